@@ -0,0 +1,80 @@
+#include "synthetic.h"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <filesystem>
+#include <fstream>
+
+namespace {
+
+// Previous read path: exists + ifstream with seek/tell + read into a fresh vector
+cv::Mat ifstream_imread(std::filesystem::path path)
+{
+  if (!std::filesystem::exists(path))
+  {
+    throw tiledwebmaps::FileNotFoundException(path);
+  }
+  std::ifstream stream(path.string(), std::ios::binary | std::ios::ate);
+  std::streamsize size = stream.tellg();
+  stream.seekg(0, std::ios::beg);
+  std::vector<uint8_t> buffer(size);
+  stream.read((char*) buffer.data(), size);
+  return cv::imdecode(cv::Mat(1, size, CV_8UC1, buffer.data()), cv::IMREAD_COLOR);
+}
+
+} // end of anonymous ns
+
+TEST_CASE("tiledwebmaps::Disk")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2i tile = tileset.get_center_tile(zoom);
+
+  tiledwebmaps::Disk disk(tileset.get_disk_path(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM);
+  std::filesystem::path tile_path = disk.get_path(tile, zoom);
+
+  // Warm the page cache
+  disk.load(tile, zoom);
+
+  BENCHMARK("ifstream_imread")
+  {
+    return ifstream_imread(tile_path);
+  };
+  BENCHMARK("safe_imread")
+  {
+    return tiledwebmaps::safe_imread(tile_path);
+  };
+  BENCHMARK("Disk::load")
+  {
+    return disk.load(tile, zoom);
+  };
+  BENCHMARK("Disk::load missing")
+  {
+    try
+    {
+      disk.load(tile - 1000, zoom);
+    }
+    catch (tiledwebmaps::LoadTileException ex)
+    {
+    }
+  };
+}
+
+TEST_CASE("tiledwebmaps::Bin")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2i tile = tileset.get_center_tile(zoom);
+
+  BENCHMARK("Bin::Bin")
+  {
+    return tiledwebmaps::Bin(tileset.get_bin_path(), tileset.get_layout());
+  };
+
+  tiledwebmaps::Bin bin(tileset.get_bin_path(), tileset.get_layout());
+  bin.load(tile, zoom);
+
+  BENCHMARK("Bin::load")
+  {
+    return bin.load(tile, zoom);
+  };
+}
@@ -0,0 +1,158 @@
+#include "synthetic.h"
+#include "tileserver.h"
+#include <tiledwebmaps/http.h>
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct LoadTestResult
+{
+  size_t tiles;
+  size_t failures;
+  double seconds;
+  double p50;
+  double p99;
+};
+
+// Loads all tiles with the given number of threads and measures the latency of each tile. If threads_num is 0, all tiles
+// are requested at once with load_async.
+LoadTestResult load_test(tiledwebmaps::TileLoader& tileloader, const std::vector<xti::vec2i>& tiles, int zoom, int threads_num)
+{
+  std::vector<double> latencies(tiles.size());
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> failures(0);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::future<cv::Mat>> futures;
+  for (size_t i = 0; threads_num == 0 && i < tiles.size(); i++)
+  {
+    auto tile_start = std::chrono::steady_clock::now();
+    auto promise = std::make_shared<std::promise<cv::Mat>>();
+    futures.push_back(promise->get_future());
+    tileloader.load_async(tiles[i], zoom, [&, i, tile_start, promise](cv::Mat image, std::exception_ptr error){
+      latencies[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+      if (error)
+      {
+        failures++;
+      }
+      promise->set_value(image);
+    });
+  }
+  for (auto& future : futures)
+  {
+    future.wait();
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threads_num; t++)
+  {
+    threads.emplace_back([&](){
+      for (size_t i = next++; i < tiles.size(); i = next++)
+      {
+        auto tile_start = std::chrono::steady_clock::now();
+        try
+        {
+          tileloader.load(tiles[i], zoom);
+        }
+        catch (tiledwebmaps::LoadTileException ex)
+        {
+          failures++;
+        }
+        latencies[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+      }
+    });
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p){
+    return latencies[std::min((size_t) (p * latencies.size()), latencies.size() - 1)];
+  };
+  return LoadTestResult{tiles.size(), failures, seconds, percentile(0.5), percentile(0.99)};
+}
+
+} // end of anonymous ns
+
+TEST_CASE("tiledwebmaps::Http")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2i center_tile = tileset.get_center_tile(zoom);
+  std::vector<xti::vec2i> tiles;
+  for (int dx = -4; dx < 4; dx++)
+  {
+    for (int dy = -4; dy < 4; dy++)
+    {
+      tiles.push_back(xti::vec2i({center_tile(0) + dx, center_tile(1) + dy}));
+    }
+  }
+
+  auto source = std::make_shared<tiledwebmaps::Disk>(tileset.get_disk_path(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM);
+
+  struct Scenario
+  {
+    std::string name;
+    tiledwebmaps::benchmark::TileServer::Options options;
+  };
+  std::vector<Scenario> scenarios;
+  scenarios.push_back(Scenario{"clean", {}});
+  scenarios.push_back(Scenario{"latency=20ms", {}});
+  scenarios.back().options.latency = 0.02;
+  scenarios.push_back(Scenario{"errors=5% 429=5%", {}});
+  scenarios.back().options.error_rate = 0.05;
+  scenarios.back().options.too_many_requests_rate = 0.05;
+  scenarios.push_back(Scenario{"bandwidth=1MB/s", {}});
+  scenarios.back().options.bandwidth = 1024 * 1024;
+
+  std::cout << std::left << std::setw(20) << "scenario" << std::setw(10) << "threads" << std::setw(12) << "tiles/s" << std::setw(12) << "p50 [ms]" << std::setw(12) << "p99 [ms]" << std::setw(10) << "failed" << std::setw(10) << "500" << std::setw(10) << "429" << std::setw(12) << "MB sent" << std::endl;
+  for (const auto& scenario : scenarios)
+  {
+    for (int threads_num : {0, 1, 4, 16})
+    {
+      tiledwebmaps::benchmark::TileServer server(source, scenario.options);
+      tiledwebmaps::Http http(server.get_url(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM, 10, 0.01, true, {}, {}, {}, true);
+
+      // Let the server encode all tiles before measuring
+      load_test(http, tiles, zoom, 16);
+      auto stats_before = server.get_stats();
+
+      LoadTestResult result = load_test(http, tiles, zoom, threads_num);
+      auto stats = server.get_stats();
+
+      std::cout << std::left << std::setw(20) << scenario.name << std::setw(10) << (threads_num == 0 ? std::string("async") : std::to_string(threads_num))
+        << std::setw(12) << std::fixed << std::setprecision(1) << result.tiles / result.seconds
+        << std::setw(12) << result.p50 * 1000 << std::setw(12) << result.p99 * 1000
+        << std::setw(10) << result.failures
+        << std::setw(10) << stats.errors - stats_before.errors
+        << std::setw(10) << stats.too_many_requests - stats_before.too_many_requests
+        << std::setw(12) << std::setprecision(2) << (stats.bytes_sent - stats_before.bytes_sent) / (1024.0 * 1024.0) << std::endl;
+
+      REQUIRE(result.failures == 0);
+      REQUIRE(stats.ok - stats_before.ok == tiles.size());
+    }
+  }
+
+}
+
+TEST_CASE("tiledwebmaps::Http missing tile")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  auto source = std::make_shared<tiledwebmaps::Disk>(tileset.get_disk_path(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM);
+
+  tiledwebmaps::benchmark::TileServer server(source, {});
+  tiledwebmaps::Http http(server.get_url(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM, 10, 0.01);
+  REQUIRE_THROWS_AS(http.load(tileset.get_center_tile(zoom) - 1000, zoom), tiledwebmaps::TileNotFoundException);
+  REQUIRE(server.get_stats().requests == 1);
+}
@@ -0,0 +1,63 @@
+#include "synthetic.h"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+TEST_CASE("tiledwebmaps::replace_placeholders")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2i tile = tileset.get_center_tile(zoom);
+
+  BENCHMARK("xyz")
+  {
+    return tiledwebmaps::replace_placeholders("https://tiles.example.com/{zoom}/{x}/{y}.jpg", tileset.get_layout(), tile, zoom);
+  };
+  BENCHMARK("quad")
+  {
+    return tiledwebmaps::replace_placeholders("https://tiles.example.com/{quad}.jpg", tileset.get_layout(), tile, zoom);
+  };
+  BENCHMARK("wms")
+  {
+    return tiledwebmaps::replace_placeholders("https://tiles.example.com/wms?bbox={bbox}&crs={crs}&width={width}&height={height}", tileset.get_layout(), tile, zoom);
+  };
+  BENCHMARK("latlon")
+  {
+    return tiledwebmaps::replace_placeholders("https://tiles.example.com/{lat_lower},{lon_lower},{lat_upper},{lon_upper}", tileset.get_layout(), tile, zoom);
+  };
+}
+
+TEST_CASE("tiledwebmaps::Layout")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  const tiledwebmaps::Layout& layout = tileset.get_layout();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2d latlon = tileset.get_latlon();
+  xti::vec2d tile = tileset.get_center_tile(zoom) + 0.5;
+  xti::vec2d crs = layout.tile_to_crs(tile, zoom);
+  xti::vec2d pixel = layout.tile_to_pixel(tile, zoom);
+
+  BENCHMARK("tile_to_crs")
+  {
+    return layout.tile_to_crs(tile, zoom);
+  };
+  BENCHMARK("crs_to_tile")
+  {
+    return layout.crs_to_tile(crs, zoom);
+  };
+  BENCHMARK("tile_to_pixel")
+  {
+    return layout.tile_to_pixel(tile, zoom);
+  };
+  BENCHMARK("epsg4326_to_pixel")
+  {
+    return layout.epsg4326_to_pixel(latlon, zoom);
+  };
+  BENCHMARK("pixel_to_epsg4326")
+  {
+    return layout.pixel_to_epsg4326(pixel, zoom);
+  };
+  BENCHMARK("pixels_per_meter_at_latlon")
+  {
+    return layout.pixels_per_meter_at_latlon(latlon, zoom);
+  };
+}
@@ -0,0 +1,49 @@
+#include "synthetic.h"
+#include <tiledwebmaps/lru.h>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+TEST_CASE("tiledwebmaps::LRU")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2i tile = tileset.get_center_tile(zoom);
+  xti::vec2i tile_shape = tileset.get_layout().get_tile_shape_px();
+  cv::Mat image(tile_shape(0), tile_shape(1), CV_8UC3, cv::Scalar(0, 0, 0));
+
+  for (int size : {16, 128, 512})
+  {
+    tiledwebmaps::LRU lru(size);
+    for (int i = 0; i < size; i++)
+    {
+      lru.save(image, xti::vec2i({tile(0) + i, tile(1)}), zoom);
+    }
+    xti::vec2i oldest({tile(0), tile(1)});
+    xti::vec2i newest({tile(0) + size - 1, tile(1)});
+
+    BENCHMARK("hit newest, size=" + std::to_string(size))
+    {
+      return lru.load(newest, zoom);
+    };
+    BENCHMARK("hit oldest, size=" + std::to_string(size))
+    {
+      // Loading moves the tile to the back, so alternate between both ends of the list
+      lru.load(oldest, zoom);
+      return lru.load(newest, zoom);
+    };
+    BENCHMARK("miss, size=" + std::to_string(size))
+    {
+      try
+      {
+        lru.load(tile - 1, zoom);
+      }
+      catch (tiledwebmaps::CacheFailure ex)
+      {
+      }
+    };
+    BENCHMARK("save, size=" + std::to_string(size))
+    {
+      lru.save(image, newest, zoom);
+    };
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <tiledwebmaps/disk.h>
+#include <tiledwebmaps/bin.h>
+#include <xtensor-io/xnpz.hpp>
+#include <opencv2/imgproc.hpp>
+#include <filesystem>
+#include <vector>
+#include <unistd.h>
+
+namespace tiledwebmaps::benchmark {
+
+// Tile set with random content written to a temporary directory, both as Disk tree and as Bin file. It covers a square of
+// 2 * radius meters around latlon at all zoom levels in [min_zoom, max_zoom] and is removed when the process exits.
+class SyntheticTileSet
+{
+public:
+  static constexpr double RADIUS = 600.0;
+  static constexpr int MIN_ZOOM = 16;
+  static constexpr int MAX_ZOOM = 18;
+
+  static const SyntheticTileSet& get()
+  {
+    static SyntheticTileSet tileset;
+    return tileset;
+  }
+
+  ~SyntheticTileSet()
+  {
+    std::error_code error;
+    std::filesystem::remove_all(m_path, error);
+  }
+
+  const Layout& get_layout() const
+  {
+    return m_layout;
+  }
+
+  xti::vec2d get_latlon() const
+  {
+    return m_latlon;
+  }
+
+  std::filesystem::path get_disk_path() const
+  {
+    return m_path / "disk";
+  }
+
+  std::filesystem::path get_bin_path() const
+  {
+    return m_path / "bin";
+  }
+
+  xti::vec2i get_center_tile(int zoom) const
+  {
+    return xt::floor(m_layout.epsg4326_to_tile(m_latlon, zoom));
+  }
+
+private:
+  std::filesystem::path m_path;
+  Layout m_layout;
+  xti::vec2d m_latlon;
+
+  SyntheticTileSet()
+    : m_path(std::filesystem::temp_directory_path() / ("tiledwebmaps-benchmark-" + std::to_string(::getpid())))
+    , m_layout(Layout::XYZ(std::make_shared<proj::Context>()))
+    , m_latlon({43.49111200344394, -1.4730902418166352})
+  {
+    Disk disk(get_disk_path(), m_layout, MIN_ZOOM, MAX_ZOOM);
+    xti::vec2i tile_shape = m_layout.get_tile_shape_px();
+
+    std::vector<int64_t> zooms, xs, ys, offsets;
+    std::vector<uint8_t> images_dat;
+    cv::RNG rng(42);
+    for (int zoom = MIN_ZOOM; zoom <= MAX_ZOOM; zoom++)
+    {
+      int radius_tiles = (int) std::ceil(RADIUS * xt::amax(m_layout.pixels_per_meter_at_latlon(m_latlon, zoom))() / xt::amin(tile_shape)()) + 1;
+      xti::vec2i center_tile = get_center_tile(zoom);
+      for (int dx = -radius_tiles; dx <= radius_tiles; dx++)
+      {
+        for (int dy = -radius_tiles; dy <= radius_tiles; dy++)
+        {
+          xti::vec2i tile({center_tile(0) + dx, center_tile(1) + dy});
+
+          cv::Mat image(tile_shape(0), tile_shape(1), CV_8UC3);
+          rng.fill(image, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(255));
+          cv::GaussianBlur(image, image, cv::Size(9, 9), 0);
+          disk.save(image, tile, zoom);
+
+          cv::Mat image_bgr;
+          cv::cvtColor(image, image_bgr, cv::COLOR_RGB2BGR);
+          std::vector<uint8_t> encoded;
+          cv::imencode(".jpg", image_bgr, encoded);
+          zooms.push_back(zoom);
+          xs.push_back(tile(0));
+          ys.push_back(tile(1));
+          offsets.push_back(images_dat.size());
+          images_dat.insert(images_dat.end(), encoded.begin(), encoded.end());
+        }
+      }
+    }
+    offsets.push_back(images_dat.size());
+
+    std::filesystem::create_directories(get_bin_path());
+    atomic_write(get_bin_path() / "images.dat", images_dat);
+    std::string npz_path = (get_bin_path() / "images-meta.npz").string();
+    xt::dump_npz(npz_path, "zoom", xt::adapt(zooms), false, false);
+    xt::dump_npz(npz_path, "x", xt::adapt(xs), false, true);
+    xt::dump_npz(npz_path, "y", xt::adapt(ys), false, true);
+    xt::dump_npz(npz_path, "offset", xt::adapt(offsets), false, true);
+  }
+};
+
+} // end of ns tiledwebmaps::benchmark
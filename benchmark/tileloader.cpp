@@ -0,0 +1,50 @@
+#include "synthetic.h"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+TEST_CASE("tiledwebmaps::load")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  int zoom = tileset.MAX_ZOOM;
+  xti::vec2i tile = tileset.get_center_tile(zoom);
+
+  tiledwebmaps::Disk disk(tileset.get_disk_path(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM);
+  tiledwebmaps::load(disk, tile - 2, tile + 2, zoom);
+
+  for (int tiles : {1, 2, 4})
+  {
+    BENCHMARK("mosaic " + std::to_string(tiles) + "x" + std::to_string(tiles))
+    {
+      return tiledwebmaps::load(disk, tile, tile + tiles, zoom);
+    };
+  }
+}
+
+TEST_CASE("tiledwebmaps::load_metric")
+{
+  const auto& tileset = tiledwebmaps::benchmark::SyntheticTileSet::get();
+  xti::vec2d latlon = tileset.get_latlon();
+  float meters_per_pixel = 0.5;
+
+  tiledwebmaps::Disk disk(tileset.get_disk_path(), tileset.get_layout(), tileset.MIN_ZOOM, tileset.MAX_ZOOM);
+  tiledwebmaps::load_metric(disk, latlon, 0.0, meters_per_pixel, xti::vec2i({1024, 1024}), tileset.MAX_ZOOM);
+
+  for (int size : {256, 512, 1024})
+  {
+    for (float bearing : {0.0f, 45.0f})
+    {
+      for (int zoom_offset : {0, -1, -2})
+      {
+        int zoom = tileset.MAX_ZOOM + zoom_offset;
+        BENCHMARK("shape=" + std::to_string(size) + " bearing=" + std::to_string((int) bearing) + " zoom=max" + std::to_string(zoom_offset))
+        {
+          return tiledwebmaps::load_metric(disk, latlon, bearing, meters_per_pixel, xti::vec2i({size, size}), zoom);
+        };
+      }
+    }
+  }
+  BENCHMARK("shape=512 bearing=0 zoom=auto")
+  {
+    return tiledwebmaps::load_metric(disk, latlon, 0.0f, meters_per_pixel, xti::vec2i({512, 512}));
+  };
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <tiledwebmaps/tileloader.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace tiledwebmaps::benchmark {
+
+// Minimal HTTP/1.1 server on localhost that serves the tiles of a TileLoader under /{zoom}/{x}/{y}.{jpg,png}. Faults of
+// real tile servers can be injected to test the behavior and throughput of Http without network access.
+class TileServer
+{
+public:
+  struct Options
+  {
+    // Delay before each response in seconds
+    float latency = 0.0;
+    // Probability of responding with 500 Internal Server Error
+    float error_rate = 0.0;
+    // Probability of responding with 429 Too Many Requests
+    float too_many_requests_rate = 0.0;
+    // Maximum bytes per second sent on each connection, or 0 for no limit
+    size_t bandwidth = 0;
+    // Number of connections that are handled concurrently
+    int threads = 16;
+  };
+
+  struct Stats
+  {
+    uint64_t requests;
+    uint64_t ok;
+    uint64_t not_found;
+    uint64_t errors;
+    uint64_t too_many_requests;
+    uint64_t bytes_sent;
+  };
+
+  TileServer(std::shared_ptr<TileLoader> source, Options options)
+    : m_source(source)
+    , m_options(options)
+    , m_stop(false)
+    , m_requests(0)
+    , m_ok(0)
+    , m_not_found(0)
+    , m_errors(0)
+    , m_too_many_requests(0)
+    , m_bytes_sent(0)
+  {
+    m_socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (m_socket < 0)
+    {
+      throw std::runtime_error(std::string("Failed to create socket. Reason: ") + std::strerror(errno));
+    }
+    int enable = 1;
+    ::setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t address_length = sizeof(address);
+    if (::bind(m_socket, (sockaddr*) &address, sizeof(address)) != 0 || ::listen(m_socket, 1024) != 0 || ::getsockname(m_socket, (sockaddr*) &address, &address_length) != 0)
+    {
+      std::string reason = std::strerror(errno);
+      ::close(m_socket);
+      throw std::runtime_error("Failed to listen on localhost. Reason: " + reason);
+    }
+    m_port = ntohs(address.sin_port);
+
+    for (int i = 0; i < m_options.threads; i++)
+    {
+      m_threads.emplace_back([this, i](){serve(i);});
+    }
+  }
+
+  ~TileServer()
+  {
+    m_stop = true;
+    ::shutdown(m_socket, SHUT_RDWR);
+    for (auto& thread : m_threads)
+    {
+      thread.join();
+    }
+    ::close(m_socket);
+  }
+
+  TileServer(const TileServer&) = delete;
+  TileServer& operator=(const TileServer&) = delete;
+
+  int get_port() const
+  {
+    return m_port;
+  }
+
+  std::string get_url(std::string extension = "jpg") const
+  {
+    return "http://127.0.0.1:" + std::to_string(m_port) + "/{zoom}/{x}/{y}." + extension;
+  }
+
+  Stats get_stats() const
+  {
+    return Stats{m_requests, m_ok, m_not_found, m_errors, m_too_many_requests, m_bytes_sent};
+  }
+
+private:
+  std::shared_ptr<TileLoader> m_source;
+  Options m_options;
+  int m_socket;
+  int m_port;
+  std::atomic<bool> m_stop;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_encoded_mutex;
+  std::map<std::tuple<int, int, int, std::string>, std::shared_ptr<const std::vector<uint8_t>>> m_encoded;
+
+  std::atomic<uint64_t> m_requests;
+  std::atomic<uint64_t> m_ok;
+  std::atomic<uint64_t> m_not_found;
+  std::atomic<uint64_t> m_errors;
+  std::atomic<uint64_t> m_too_many_requests;
+  std::atomic<uint64_t> m_bytes_sent;
+
+  void serve(int index)
+  {
+    std::mt19937 random(index);
+    std::uniform_real_distribution<float> uniform(0.0, 1.0);
+    while (!m_stop)
+    {
+      int connection = ::accept(m_socket, NULL, NULL);
+      if (connection < 0)
+      {
+        if (m_stop)
+        {
+          break;
+        }
+        continue;
+      }
+      handle(connection, uniform(random));
+      ::close(connection);
+    }
+  }
+
+  void handle(int connection, float random)
+  {
+    std::string request;
+    char buffer[4096];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 65536)
+    {
+      ssize_t n = ::recv(connection, buffer, sizeof(buffer), 0);
+      if (n <= 0)
+      {
+        return;
+      }
+      request.append(buffer, n);
+    }
+    m_requests++;
+
+    if (m_options.latency > 0)
+    {
+      std::this_thread::sleep_for(std::chrono::duration<float>(m_options.latency));
+    }
+
+    if (random < m_options.error_rate)
+    {
+      m_errors++;
+      respond(connection, "500 Internal Server Error", "text/plain", "Injected error");
+      return;
+    }
+    if (random < m_options.error_rate + m_options.too_many_requests_rate)
+    {
+      m_too_many_requests++;
+      respond(connection, "429 Too Many Requests", "text/plain", "Injected rate limit", "Retry-After: 0\r\n");
+      return;
+    }
+
+    int zoom, x, y;
+    char extension[8];
+    if (std::sscanf(request.c_str(), "GET /%d/%d/%d.%7[a-z] ", &zoom, &x, &y, extension) != 4)
+    {
+      m_not_found++;
+      respond(connection, "404 Not Found", "text/plain", "Invalid path");
+      return;
+    }
+
+    std::shared_ptr<const std::vector<uint8_t>> encoded = encode(xti::vec2i({x, y}), zoom, extension);
+    if (!encoded)
+    {
+      m_not_found++;
+      respond(connection, "404 Not Found", "text/plain", "Tile not found");
+      return;
+    }
+    m_ok++;
+    respond(connection, "200 OK", std::string("image/") + (std::string(extension) == "jpg" ? "jpeg" : extension), std::string_view((const char*) encoded->data(), encoded->size()));
+  }
+
+  std::shared_ptr<const std::vector<uint8_t>> encode(xti::vec2i tile, int zoom, std::string extension)
+  {
+    auto key = std::make_tuple(zoom, tile(0), tile(1), extension);
+    {
+      std::lock_guard<std::mutex> lock(m_encoded_mutex);
+      auto it = m_encoded.find(key);
+      if (it != m_encoded.end())
+      {
+        return it->second;
+      }
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> encoded;
+    try
+    {
+      cv::Mat image = m_source->load(tile, zoom);
+      cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+      encoded = std::make_shared<std::vector<uint8_t>>();
+      if (!cv::imencode("." + extension, image, *encoded))
+      {
+        encoded = nullptr;
+      }
+    }
+    catch (LoadTileException ex)
+    {
+    }
+
+    std::lock_guard<std::mutex> lock(m_encoded_mutex);
+    m_encoded[key] = encoded;
+    return encoded;
+  }
+
+  void respond(int connection, std::string status, std::string content_type, std::string_view body, std::string extra_header = "")
+  {
+    std::string header = "HTTP/1.1 " + status + "\r\n"
+      + "Content-Type: " + content_type + "\r\n"
+      + "Content-Length: " + std::to_string(body.size()) + "\r\n"
+      + extra_header
+      + "Connection: close\r\n\r\n";
+    if (send_all(connection, header.data(), header.size()))
+    {
+      send_all(connection, body.data(), body.size());
+    }
+  }
+
+  bool send_all(int connection, const char* data, size_t size)
+  {
+    // Without bandwidth limit send everything at once, otherwise send chunks of 10ms worth of data
+    size_t chunk_size = m_options.bandwidth > 0 ? std::max<size_t>(m_options.bandwidth / 100, 1) : size;
+    auto start = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    while (sent < size)
+    {
+      ssize_t n = ::send(connection, data + sent, std::min(chunk_size, size - sent), MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        return false;
+      }
+      sent += n;
+      m_bytes_sent += n;
+      if (m_options.bandwidth > 0)
+      {
+        std::this_thread::sleep_until(start + std::chrono::duration<double>((double) sent / m_options.bandwidth));
+      }
+    }
+    return true;
+  }
+};
+
+} // end of ns tiledwebmaps::benchmark
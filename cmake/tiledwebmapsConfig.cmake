@@ -9,6 +9,8 @@ if(NOT TARGET tiledwebmaps::tiledwebmaps)
   find_package(PROJ REQUIRED)
   find_package(CURL REQUIRED)
   find_package(curlcpp REQUIRED)
+  find_package(SQLite3 REQUIRED)
+  find_package(ZLIB REQUIRED)
 
   include("${tiledwebmaps_CMAKE_DIR}/tiledwebmapsTargets.cmake")
 endif()
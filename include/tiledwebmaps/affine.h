@@ -4,3 +4,4 @@
 #include <tiledwebmaps/affine/rigid.h>
 #include <tiledwebmaps/affine/scaled_rigid.h>
 #include <tiledwebmaps/affine/named_axes.h>
+#include <tiledwebmaps/affine/affine2.h>
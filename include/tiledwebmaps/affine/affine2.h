@@ -0,0 +1,201 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <tiledwebmaps/affine/rotation.h>
+#include <tiledwebmaps/affine/scaled_rigid.h>
+#include <cmath>
+#include <ostream>
+
+namespace tiledwebmaps {
+
+// Plain 2D point and affine types used in hot paths instead of the xtensor-based transformations. They do not allocate
+// and are trivially copyable, while xti vectors and ScaledRigid are only used at the API boundary.
+template <typename TScalar>
+struct Point2
+{
+  TScalar values[2];
+
+  constexpr Point2()
+    : values{0, 0}
+  {
+  }
+
+  constexpr Point2(TScalar x0, TScalar x1)
+    : values{x0, x1}
+  {
+  }
+
+  template <typename TVec, typename = std::enable_if_t<xti::is_xtensor_v<TVec>>>
+  explicit Point2(const TVec& vec)
+    : values{static_cast<TScalar>(vec(0)), static_cast<TScalar>(vec(1))}
+  {
+  }
+
+  constexpr TScalar& operator()(size_t i)
+  {
+    return values[i];
+  }
+
+  constexpr const TScalar& operator()(size_t i) const
+  {
+    return values[i];
+  }
+
+  constexpr TScalar& operator[](size_t i)
+  {
+    return values[i];
+  }
+
+  constexpr const TScalar& operator[](size_t i) const
+  {
+    return values[i];
+  }
+
+  template <typename TScalar2 = TScalar>
+  xti::vecXT<TScalar2, 2> to_xti() const
+  {
+    return xti::vecXT<TScalar2, 2>({static_cast<TScalar2>(values[0]), static_cast<TScalar2>(values[1])});
+  }
+};
+
+template <typename TScalar>
+class Affine2
+{
+public:
+  // Row-major linear part and translation: y = M * x + t
+  TScalar m00, m01, m10, m11;
+  TScalar t0, t1;
+
+  constexpr Affine2()
+    : m00(1), m01(0), m10(0), m11(1)
+    , t0(0), t1(0)
+  {
+  }
+
+  constexpr Affine2(TScalar m00, TScalar m01, TScalar m10, TScalar m11, TScalar t0, TScalar t1)
+    : m00(m00), m01(m01), m10(m10), m11(m11)
+    , t0(t0), t1(t1)
+  {
+  }
+
+  template <typename TScalar2, bool TSingleScale>
+  explicit Affine2(const ScaledRigid<TScalar2, 2, TSingleScale>& other)
+  {
+    TScalar s0, s1;
+    if constexpr (TSingleScale)
+    {
+      s0 = s1 = other.get_scale();
+    }
+    else
+    {
+      s0 = other.get_scale()(0);
+      s1 = other.get_scale()(1);
+    }
+    m00 = s0 * other.get_rotation()(0, 0);
+    m01 = s0 * other.get_rotation()(0, 1);
+    m10 = s1 * other.get_rotation()(1, 0);
+    m11 = s1 * other.get_rotation()(1, 1);
+    t0 = other.get_translation()(0);
+    t1 = other.get_translation()(1);
+  }
+
+  template <typename TScalar2>
+  explicit Affine2(const Rotation<TScalar2, 2>& other)
+    : m00(other.get_rotation()(0, 0)), m01(other.get_rotation()(0, 1)), m10(other.get_rotation()(1, 0)), m11(other.get_rotation()(1, 1))
+    , t0(0), t1(0)
+  {
+  }
+
+  template <typename TScalar2>
+  constexpr explicit Affine2(const Affine2<TScalar2>& other)
+    : m00(other.m00), m01(other.m01), m10(other.m10), m11(other.m11)
+    , t0(other.t0), t1(other.t1)
+  {
+  }
+
+  static constexpr Affine2 translation(TScalar t0, TScalar t1)
+  {
+    return Affine2(1, 0, 0, 1, t0, t1);
+  }
+
+  static constexpr Affine2 translation(Point2<TScalar> t)
+  {
+    return translation(t(0), t(1));
+  }
+
+  static constexpr Affine2 scale(TScalar s0, TScalar s1)
+  {
+    return Affine2(s0, 0, 0, s1, 0, 0);
+  }
+
+  static constexpr Affine2 scale(TScalar s)
+  {
+    return scale(s, s);
+  }
+
+  static Affine2 rotation(TScalar angle)
+  {
+    TScalar c = std::cos(angle);
+    TScalar s = std::sin(angle);
+    return Affine2(c, -s, s, c, 0, 0);
+  }
+
+  constexpr Point2<TScalar> transform(Point2<TScalar> point) const
+  {
+    return Point2<TScalar>(m00 * point(0) + m01 * point(1) + t0, m10 * point(0) + m11 * point(1) + t1);
+  }
+
+  constexpr Point2<TScalar> transform_inverse(Point2<TScalar> point) const
+  {
+    return inverse().transform(point);
+  }
+
+  constexpr TScalar determinant() const
+  {
+    return m00 * m11 - m01 * m10;
+  }
+
+  constexpr Affine2 inverse() const
+  {
+    TScalar d = 1 / determinant();
+    TScalar i00 = m11 * d;
+    TScalar i01 = -m01 * d;
+    TScalar i10 = -m10 * d;
+    TScalar i11 = m00 * d;
+    return Affine2(i00, i01, i10, i11, -(i00 * t0 + i01 * t1), -(i10 * t0 + i11 * t1));
+  }
+
+  constexpr Affine2& operator*=(const Affine2& right)
+  {
+    *this = *this * right;
+    return *this;
+  }
+
+  constexpr Affine2 operator*(const Affine2& right) const
+  {
+    return Affine2(
+      m00 * right.m00 + m01 * right.m10, m00 * right.m01 + m01 * right.m11,
+      m10 * right.m00 + m11 * right.m10, m10 * right.m01 + m11 * right.m11,
+      m00 * right.t0 + m01 * right.t1 + t0, m10 * right.t0 + m11 * right.t1 + t1
+    );
+  }
+
+  constexpr Affine2 operator/(const Affine2& right) const
+  {
+    return *this * right.inverse();
+  }
+};
+
+template <typename TScalar>
+std::ostream& operator<<(std::ostream& stream, const Point2<TScalar>& point)
+{
+  return stream << "{" << point(0) << ", " << point(1) << "}";
+}
+
+template <typename TScalar>
+std::ostream& operator<<(std::ostream& stream, const Affine2<TScalar>& transform)
+{
+  return stream << "Affine2(M={{" << transform.m00 << ", " << transform.m01 << "}, {" << transform.m10 << ", " << transform.m11 << "}} t={" << transform.t0 << ", " << transform.t1 << "})";
+}
+
+} // tiledwebmaps
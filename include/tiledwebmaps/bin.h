@@ -7,23 +7,34 @@
 #include <xti/util.h>
 #include <tiledwebmaps/tileloader.h>
 #include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/disk.h>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xtensor.hpp>
 #include <xtensor-io/xnpz.hpp>
 #include <filesystem>
+#include <fstream>
 #include <memory>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
 
 namespace tiledwebmaps {
 
-class Bin : public TileLoader
+// Tiles stored as encoded images in a single file "images.dat" with offsets in "images-meta.npz". The file is memory
+// mapped on first use, such that concurrent loads only copy the encoded bytes of their tile. Bin is a read-only cache.
+// All tiles must share one encoding, which is detected from the first tile. load_encoded rejects tiles with another
+// encoding, since their bytes would otherwise be passed as the wrong format to caches with the same encoding.
+class Bin : public TileLoader, public Cache, public Instrumented
 {
 public:
   Bin(std::filesystem::path path, const Layout& layout)
     : TileLoader(layout)
+    , Cache()
+    , Instrumented("bin")
     , m_path(path)
-    , m_file_pointer(NULL)
+    , m_data(NULL)
+    , m_size(0)
   {
     if (!std::filesystem::exists(path / "images.dat"))
     {
@@ -43,32 +54,51 @@ public:
 
     m_min_zoom = xt::amin(zoom)();
     m_max_zoom = xt::amax(zoom)();
+
+    // All tiles share the encoding of the first tile
+    uint8_t header[16];
+    std::ifstream file((path / "images.dat").string(), std::ios::binary);
+    file.read((char*) header, sizeof(header));
+    m_encoding = detect_encoding(header, file.gcount());
+    if (m_encoding.empty())
+    {
+      m_encoding = ".jpg";
+    }
   }
 
   Bin(const Bin& other)
     : TileLoader(other)
+    , Cache()
+    , Instrumented(other)
     , m_path(other.m_path)
-    , m_file_pointer(NULL)
+    , m_data(NULL)
+    , m_size(0)
     , m_tiles(other.m_tiles)
+    , m_min_zoom(other.m_min_zoom)
+    , m_max_zoom(other.m_max_zoom)
+    , m_encoding(other.m_encoding)
   {
   }
 
   Bin(Bin&& other)
     : TileLoader(other)
+    , Cache()
+    , Instrumented(other)
     , m_path(std::move(other.m_path))
-    , m_file_pointer(other.m_file_pointer)
+    , m_data(other.m_data)
+    , m_size(other.m_size)
     , m_tiles(std::move(other.m_tiles))
+    , m_min_zoom(other.m_min_zoom)
+    , m_max_zoom(other.m_max_zoom)
+    , m_encoding(std::move(other.m_encoding))
   {
-    other.m_file_pointer = NULL;
+    other.m_data = NULL;
+    other.m_size = 0;
   }
 
   virtual ~Bin()
   {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_file_pointer != NULL)
-    {
-      std::fclose(m_file_pointer);
-    }
+    unmap();
   }
 
   Bin& operator=(const Bin& other)
@@ -76,9 +106,12 @@ public:
     if (this != &other)
     {
       std::lock_guard<std::mutex> lock(m_mutex);
+      unmap();
       m_path = other.m_path;
-      m_file_pointer = NULL;
       m_tiles = other.m_tiles;
+      m_min_zoom = other.m_min_zoom;
+      m_max_zoom = other.m_max_zoom;
+      m_encoding = other.m_encoding;
     }
     return *this;
   }
@@ -88,24 +121,20 @@ public:
     if (this != &other)
     {
       std::lock_guard<std::mutex> lock(m_mutex);
+      unmap();
       m_path = std::move(other.m_path);
-      m_file_pointer = other.m_file_pointer;
-      other.m_file_pointer = NULL;
+      m_data = other.m_data;
+      m_size = other.m_size;
+      other.m_data = NULL;
+      other.m_size = 0;
       m_tiles = std::move(other.m_tiles);
+      m_min_zoom = other.m_min_zoom;
+      m_max_zoom = other.m_max_zoom;
+      m_encoding = std::move(other.m_encoding);
     }
     return *this;
   }
 
-  virtual void make_forksafe()
-  {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_file_pointer != NULL)
-    {
-      std::fclose(m_file_pointer);
-      m_file_pointer = NULL;
-    }
-  }
-
   int get_min_zoom() const
   {
     return m_min_zoom;
@@ -116,7 +145,91 @@ public:
     return m_max_zoom;
   }
 
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    return m_tiles.count(std::make_tuple(zoom, tile[0], tile[1])) > 0;
+  }
+
   cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    return load_ordered(tile, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    const uint8_t* data;
+    size_t size;
+    find(tile, zoom, data, size);
+    return decode(data, size, order);
+  }
+
+  ChannelOrder get_native_channel_order() const
+  {
+    return ChannelOrder::BGR;
+  }
+
+  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    throw WriteFileException(m_path / "images.dat", "Bin files are read-only");
+  }
+
+  // Bin files are created from tiles on disk by python/scripts/to_bin.py, which can re-encode them into another format
+  std::string get_encoding() const
+  {
+    return m_encoding;
+  }
+
+  std::vector<uint8_t> load_encoded(xti::vec2i tile, int zoom)
+  {
+    const uint8_t* data;
+    size_t size;
+    find(tile, zoom, data, size);
+    std::string encoding = detect_encoding(data, size);
+    if (!encoding.empty() && encoding != m_encoding)
+    {
+      m_metrics->increment("errors.encoding");
+      throw LoadTileException("Tile " + XTI_TO_STRING(tile) + " at zoom level " + std::to_string(zoom) + " has encoding " + encoding + ", but the bin file has encoding " + m_encoding + ".");
+    }
+    return std::vector<uint8_t>(data, data + size);
+  }
+
+  void save_encoded(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    throw WriteFileException(m_path / "images.dat", "Bin files are read-only");
+  }
+
+  cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    return decode(data.data(), data.size(), ChannelOrder::RGB);
+  }
+
+  // Overrides both TileLoader::make_forksafe and Cache::make_forksafe
+  virtual void make_forksafe()
+  {
+  }
+
+private:
+  std::filesystem::path m_path;
+  const uint8_t* m_data;
+  size_t m_size;
+  std::map<std::tuple<int64_t, int64_t, int64_t>, std::tuple<int64_t, int64_t>> m_tiles;
+  int m_min_zoom;
+  int m_max_zoom;
+  std::string m_encoding;
+  std::mutex m_mutex;
+
+  void unmap()
+  {
+    if (m_data != NULL)
+    {
+      ::munmap(const_cast<uint8_t*>(m_data), m_size);
+      m_data = NULL;
+      m_size = 0;
+    }
+  }
+
+  // Returns the encoded bytes of the tile in the memory mapped file. The mapping stays valid in forked processes.
+  void find(xti::vec2i tile, int zoom, const uint8_t*& data, size_t& size)
   {
     if (zoom > m_max_zoom)
     {
@@ -126,67 +239,67 @@ public:
     {
       throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
     }
+    m_metrics->increment("loads");
     auto it = m_tiles.find(std::make_tuple(zoom, tile[0], tile[1]));
     if (it == m_tiles.end())
     {
-      throw LoadTileException("Tile not found in bin file");
+      m_metrics->increment("errors.not_found");
+      throw TileNotFoundException("Tile not found in bin file");
     }
     int64_t offset = std::get<0>(it->second);
-    int64_t size = std::get<1>(it->second);
+    size = std::get<1>(it->second);
 
-    std::vector<uint8_t> buffer(size);
+    auto timer = m_metrics->time("read");
     {
       std::lock_guard<std::mutex> lock(m_mutex);
-      if (m_file_pointer == NULL)
+      if (m_data == NULL)
       {
-        m_file_pointer = std::fopen((m_path / "images.dat").string().c_str(), "rb");
-        if (m_file_pointer == NULL)
+        std::filesystem::path path = m_path / "images.dat";
+        size_t file_size;
+        int fd = open_file(path, file_size);
+        void* mapped = ::mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
         {
-          throw LoadFileException(m_path / "images.dat", "Failed to open file");
+          throw LoadFileException(path, std::string("Failed to map file. Reason: ") + std::strerror(errno));
         }
-      }
-      if (std::fseek(m_file_pointer, offset, SEEK_SET) != 0)
-      {
-        throw LoadFileException(m_path / "images.dat", "Failed to seek to offset " + std::to_string(offset));
-      }
-      if (std::fread(buffer.data(), 1, size, m_file_pointer) != size)
-      {
-        throw LoadFileException(m_path / "images.dat", "Failed to read " + std::to_string(size) + " bytes from offset " + std::to_string(offset));
+        m_data = (const uint8_t*) mapped;
+        m_size = file_size;
       }
     }
-
-    cv::Mat data_cv(1, buffer.size(), xti::opencv::pixeltype<uint8_t>::get(1), buffer.data());
-    if (data_cv.data == NULL)
+    if (offset < 0 || offset + size > m_size)
     {
-        throw ImreadException("Failed to convert data array of file " + m_path.string() + " to cv mat");
+      throw LoadFileException(m_path / "images.dat", "Failed to read " + std::to_string(size) + " bytes from offset " + std::to_string(offset));
     }
+    data = m_data + offset;
+    m_metrics->increment("bytes_in", size);
+  }
 
-    cv::Mat image = cv::imdecode(data_cv, cv::IMREAD_COLOR);
-    if (image.data == NULL)
+  cv::Mat decode(const uint8_t* data, size_t size, ChannelOrder order)
+  {
+    cv::Mat image;
+    try
     {
-        throw ImreadException("Failed to decode image from file " + m_path.string());
+      image = safe_imdecode(data, size, m_path / "images.dat", m_metrics.get(), this->get_imread_flags());
+    }
+    catch (ImreadException ex)
+    {
+      m_metrics->increment("errors.decode");
+      throw;
     }
-
-    cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
 
     try
     {
-      this->to_tile(image, true);
+      auto timer = m_metrics->time("convert");
+      this->to_tile(image, order);
     }
     catch (LoadTileException ex)
     {
+      m_metrics->increment("errors.invalid_tile");
       throw LoadFileException(m_path, std::string("Loaded invalid tile. ") + ex.what());
     }
     return image;
   }
-
-private:
-  std::filesystem::path m_path;
-  FILE* m_file_pointer;
-  std::map<std::tuple<int64_t, int64_t, int64_t>, std::tuple<int64_t, int64_t>> m_tiles;
-  int m_min_zoom;
-  int m_max_zoom;
-  std::mutex m_mutex;
 };
 
 } // end of ns tiledwebmaps
@@ -0,0 +1,569 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/disk.h>
+#include <tiledwebmaps/metrics.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+namespace tiledwebmaps {
+
+// Disk cache whose total size is limited to max_bytes. Saved tiles and accesses are appended to the journal file
+// "journal.txt" next to the tiles, from which the index of cached tiles is restored on startup without scanning the
+// directory. A background thread evicts the least recently (LRU) or least frequently (LFU) used tiles once the quota is
+// exceeded until the size is below low_watermark * max_bytes, and periodically flushes and compacts the journal.
+//
+// Only tiles saved through this object are tracked and evicted, other tiles in the directory are still loaded. A cache
+// directory must not be used by multiple objects at the same time.
+//
+// Only the process that created the object evicts tiles and writes and compacts the journal. Forked child processes
+// have to call make_forksafe, after which they append their journal lines to their own file "journal-<pid>.txt". The
+// creating process periodically adopts these lines into its index and journal and removes the files.
+class BoundedDisk : public Disk
+{
+public:
+  enum class EvictionPolicy
+  {
+    LRU,
+    LFU
+  };
+
+  BoundedDisk(std::filesystem::path path, const Layout& layout, int min_zoom, int max_zoom, uint64_t max_bytes, EvictionPolicy eviction_policy = EvictionPolicy::LRU, Sync sync = Sync::NONE, float compaction_interval = 10.0, float low_watermark = 0.9, EncodeOptions encode_options = EncodeOptions())
+    : Disk(path, layout, min_zoom, max_zoom, sync, encode_options)
+    , m_max_bytes(max_bytes)
+    , m_low_watermark_bytes(static_cast<uint64_t>(low_watermark * max_bytes))
+    , m_eviction_policy(eviction_policy)
+    , m_compaction_interval(static_cast<int64_t>(compaction_interval * 1000))
+    , m_total_bytes(0)
+    , m_clock(0)
+    , m_journal_lines(0)
+    , m_pending_lines(0)
+    , m_stop(false)
+  {
+    m_journal_path = get_base_path() / "journal.txt";
+    {
+      std::ifstream file(m_journal_path.string());
+      apply_journal(file);
+    }
+    std::filesystem::create_directories(m_journal_path.parent_path());
+    m_journal = std::make_unique<std::ofstream>(m_journal_path.string(), std::ios::app);
+    if (!*m_journal)
+    {
+      throw WriteFileException(m_journal_path, "Failed to open journal");
+    }
+    // Journals of children that were not adopted before the last process exited
+    adopt_child_journals();
+    m_thread = std::make_unique<std::thread>([this](){run();});
+  }
+
+  BoundedDisk(const BoundedDisk&) = delete;
+  BoundedDisk& operator=(const BoundedDisk&) = delete;
+
+  virtual ~BoundedDisk()
+  {
+    if (m_thread)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+      }
+      m_condition.notify_all();
+      m_thread->join();
+      m_journal->flush();
+    }
+    else
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      write_pending();
+    }
+  }
+
+  // The thread of the parent does not exist in the child and is abandoned without joining it, and the journal stream of
+  // the parent is abandoned without flushing the lines that the parent buffered at fork time. The lock might have been
+  // held by another thread of the parent at fork time and is reinitialized. Pending lines that were inherited from a
+  // parent that is a child itself are written by that parent.
+  virtual void make_forksafe()
+  {
+    m_thread.release();
+    m_journal.release();
+    new (&m_mutex) std::mutex();
+    new (&m_condition) std::condition_variable();
+    for (auto& mutex : m_file_mutexes)
+    {
+      new (&mutex) std::mutex();
+    }
+    m_pending.str("");
+    m_pending_lines = 0;
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_entries.count(Key(tile(0), tile(1), zoom)) > 0)
+      {
+        return true;
+      }
+    }
+    return Disk::contains(tile, zoom);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    cv::Mat image;
+    try
+    {
+      image = Disk::load_ordered(tile, zoom, order);
+    }
+    catch (FileNotFoundException e)
+    {
+      // Tile was removed by someone else
+      std::lock_guard<std::mutex> lock(m_mutex);
+      remove(Key(tile(0), tile(1), zoom));
+      throw;
+    }
+    touch(tile, zoom);
+    return image;
+  }
+
+  std::vector<uint8_t> load_encoded(xti::vec2i tile, int zoom)
+  {
+    std::vector<uint8_t> data = Disk::load_encoded(tile, zoom);
+    touch(tile, zoom);
+    return data;
+  }
+
+  void save_ordered(const cv::Mat& image, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    std::lock_guard<std::mutex> file_lock(get_file_mutex(Key(tile(0), tile(1), zoom)));
+    Disk::save_ordered(image, tile, zoom, order);
+    add(tile, zoom, std::filesystem::file_size(get_path(tile, zoom)));
+  }
+
+  void save_encoded(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    std::lock_guard<std::mutex> file_lock(get_file_mutex(Key(tile(0), tile(1), zoom)));
+    Disk::save_encoded(data, tile, zoom);
+    add(tile, zoom, data.size());
+  }
+
+  uint64_t get_total_bytes() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_total_bytes;
+  }
+
+  uint64_t get_max_bytes() const
+  {
+    return m_max_bytes;
+  }
+
+  size_t get_tiles_num() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+  }
+
+  // Evicts tiles until the quota is met and compacts the journal, without waiting for the background thread. In forked
+  // children, only writes the pending journal lines.
+  void compact()
+  {
+    if (!m_thread)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      write_pending();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      adopt_child_journals();
+    }
+    evict();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    compact_journal();
+  }
+
+private:
+  using Key = std::tuple<int, int, int>; // tile-x, tile-y, zoom
+
+  struct Entry
+  {
+    uint64_t size;
+    uint64_t last_access;
+    uint64_t accesses;
+  };
+
+  uint64_t m_max_bytes;
+  uint64_t m_low_watermark_bytes;
+  EvictionPolicy m_eviction_policy;
+  std::chrono::milliseconds m_compaction_interval;
+
+  std::map<Key, Entry> m_entries;
+  uint64_t m_total_bytes;
+  uint64_t m_clock;
+
+  std::filesystem::path m_journal_path;
+  // Only set in the creating process
+  std::unique_ptr<std::ofstream> m_journal;
+  size_t m_journal_lines;
+  // Journal lines of a forked child that are not yet written to its file
+  std::ostringstream m_pending;
+  size_t m_pending_lines;
+
+  mutable std::mutex m_mutex;
+  // Serialize writing and deleting the file of a tile, such that eviction never deletes a file that was just rewritten
+  std::array<std::mutex, 64> m_file_mutexes;
+  std::condition_variable m_condition;
+  bool m_stop;
+  std::unique_ptr<std::thread> m_thread;
+
+  // Maximum number of journal lines that a forked child buffers before writing them
+  static constexpr size_t MAX_PENDING_LINES = 64;
+
+  // Journal lines are "s zoom x y size" for saved, "a zoom x y" for accessed, "d zoom x y" for deleted and "e zoom x y
+  // size accesses" for compacted entries. Lines are appended to the journal if it is open, i.e. when adopting the
+  // journals of children.
+  void apply_journal(std::istream& file)
+  {
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream stream(line);
+      char op;
+      int zoom, x, y;
+      if (!(stream >> op >> zoom >> x >> y))
+      {
+        // Incomplete line from a crash
+        continue;
+      }
+      Key key(x, y, zoom);
+      if (m_journal)
+      {
+        *m_journal << line << "\n";
+      }
+      m_journal_lines++;
+      m_clock++;
+      if (op == 's' || op == 'e')
+      {
+        uint64_t size;
+        uint64_t accesses = 1;
+        if (!(stream >> size) || (op == 'e' && !(stream >> accesses)))
+        {
+          continue;
+        }
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+          m_total_bytes -= it->second.size;
+          accesses += it->second.accesses;
+        }
+        m_entries[key] = Entry{size, m_clock, accesses};
+        m_total_bytes += size;
+      }
+      else if (op == 'a')
+      {
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+          it->second.last_access = m_clock;
+          it->second.accesses++;
+        }
+      }
+      else if (op == 'd')
+      {
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+          m_total_bytes -= it->second.size;
+          m_entries.erase(it);
+        }
+      }
+    }
+  }
+
+  // Returns the stream to which journal lines are written, i.e. the journal in the creating process and the pending
+  // lines in forked children
+  std::ostream& journal()
+  {
+    if (m_journal)
+    {
+      return *m_journal;
+    }
+    m_pending_lines++;
+    return m_pending;
+  }
+
+  // Requires the lock. Appends the pending lines of a forked child to its journal file. The file is locked while
+  // writing, and reopened if the creating process removed it after adopting it.
+  void write_pending()
+  {
+    std::string data = m_pending.str();
+    if (data.empty())
+    {
+      return;
+    }
+    std::filesystem::path path = get_base_path() / ("journal-" + std::to_string(::getpid()) + ".txt");
+    while (true)
+    {
+      int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+      if (fd < 0)
+      {
+        m_metrics->increment("errors.journal");
+        break;
+      }
+      ::flock(fd, LOCK_EX);
+      struct stat status;
+      if (::fstat(fd, &status) == 0 && status.st_nlink == 0)
+      {
+        ::close(fd);
+        continue;
+      }
+      if (::write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+      {
+        m_metrics->increment("errors.journal");
+      }
+      ::close(fd);
+      break;
+    }
+    m_pending.str("");
+    m_pending_lines = 0;
+  }
+
+  // Requires the lock. Applies the journal files of forked children and appends their lines to the journal. A file is
+  // renamed before it is read, such that later lines of the child go to a new file, and removed while it is locked,
+  // such that a child that opened it before the rename writes its lines again.
+  void adopt_child_journals()
+  {
+    std::vector<std::filesystem::path> paths;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(get_base_path(), ec))
+    {
+      std::string name = entry.path().filename().string();
+      if (name.rfind("journal-", 0) == 0 && (ends_with(name, ".txt") || ends_with(name, ".txt.adopt")))
+      {
+        paths.push_back(entry.path());
+      }
+    }
+    for (std::filesystem::path path : paths)
+    {
+      if (path.extension() == ".txt")
+      {
+        std::filesystem::path adopt_path = path.string() + ".adopt";
+        if (::rename(path.c_str(), adopt_path.c_str()) != 0)
+        {
+          continue;
+        }
+        path = adopt_path;
+      }
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+      {
+        continue;
+      }
+      ::flock(fd, LOCK_EX);
+      std::string data;
+      char buffer[65536];
+      ssize_t bytes;
+      while ((bytes = ::read(fd, buffer, sizeof(buffer))) > 0)
+      {
+        data.append(buffer, bytes);
+      }
+      std::istringstream stream(data);
+      apply_journal(stream);
+      ::unlink(path.c_str());
+      ::close(fd);
+      m_metrics->increment("adopted_journals");
+    }
+    if (m_total_bytes > m_max_bytes)
+    {
+      m_condition.notify_one();
+    }
+  }
+
+  void add(xti::vec2i tile, int zoom, uint64_t size)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key key(tile(0), tile(1), zoom);
+    uint64_t accesses = 1;
+    auto it = m_entries.find(key);
+    if (it != m_entries.end())
+    {
+      m_total_bytes -= it->second.size;
+      accesses += it->second.accesses;
+    }
+    m_entries[key] = Entry{size, ++m_clock, accesses};
+    m_total_bytes += size;
+    journal() << "s " << zoom << " " << tile(0) << " " << tile(1) << " " << size << "\n";
+    m_journal_lines++;
+    if (!m_journal)
+    {
+      // Saves of children are written immediately, such that the creating process accounts for their size
+      write_pending();
+    }
+    else if (m_total_bytes > m_max_bytes)
+    {
+      m_condition.notify_one();
+    }
+  }
+
+  void touch(xti::vec2i tile, int zoom)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(Key(tile(0), tile(1), zoom));
+    if (it != m_entries.end())
+    {
+      it->second.last_access = ++m_clock;
+      it->second.accesses++;
+      journal() << "a " << zoom << " " << tile(0) << " " << tile(1) << "\n";
+      m_journal_lines++;
+      if (m_pending_lines >= MAX_PENDING_LINES)
+      {
+        write_pending();
+      }
+    }
+  }
+
+  std::mutex& get_file_mutex(const Key& key)
+  {
+    size_t hash = std::hash<int>()(std::get<0>(key));
+    hash = hash * 31 + std::hash<int>()(std::get<1>(key));
+    hash = hash * 31 + std::hash<int>()(std::get<2>(key));
+    return m_file_mutexes[hash % m_file_mutexes.size()];
+  }
+
+  // Requires the lock. Removes the entry from the index, but not the file.
+  void remove(const Key& key)
+  {
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+    {
+      return;
+    }
+    m_total_bytes -= it->second.size;
+    m_entries.erase(it);
+    journal() << "d " << std::get<2>(key) << " " << std::get<0>(key) << " " << std::get<1>(key) << "\n";
+    m_journal_lines++;
+  }
+
+  // Must not be called with the lock. Victims are chosen from a snapshot of the index and sorted without holding the
+  // lock. A victim is skipped if it was saved or accessed after the snapshot, which is detected by its last access.
+  void evict()
+  {
+    struct Victim
+    {
+      std::tuple<uint64_t, uint64_t> priority;
+      Key key;
+      uint64_t last_access;
+    };
+    std::vector<Victim> victims;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_total_bytes <= m_max_bytes)
+      {
+        return;
+      }
+      victims.reserve(m_entries.size());
+      for (const auto& pair : m_entries)
+      {
+        const Entry& entry = pair.second;
+        std::tuple<uint64_t, uint64_t> priority = m_eviction_policy == EvictionPolicy::LRU ? std::make_tuple(entry.last_access, (uint64_t) 0) : std::make_tuple(entry.accesses, entry.last_access);
+        victims.push_back(Victim{priority, pair.first, entry.last_access});
+      }
+    }
+
+    auto timer = m_metrics->time("evict");
+    std::sort(victims.begin(), victims.end(), [](const Victim& a, const Victim& b){return a.priority < b.priority;});
+    for (const Victim& victim : victims)
+    {
+      const Key& key = victim.key;
+      std::lock_guard<std::mutex> file_lock(get_file_mutex(key));
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_total_bytes <= m_low_watermark_bytes)
+        {
+          break;
+        }
+        auto it = m_entries.find(key);
+        if (it == m_entries.end() || it->second.last_access != victim.last_access)
+        {
+          continue;
+        }
+        remove(key);
+      }
+      std::error_code ec;
+      std::filesystem::remove(get_path(xti::vec2i({std::get<0>(key), std::get<1>(key)}), std::get<2>(key)), ec);
+      m_metrics->increment("evictions");
+    }
+  }
+
+  // Requires the lock. Rewrites the journal with one line per cached tile once most of its lines are obsolete.
+  void compact_journal()
+  {
+    m_journal->flush();
+    if (m_journal_lines < 2 * m_entries.size() + 1000)
+    {
+      return;
+    }
+    auto timer = m_metrics->time("compact");
+    std::vector<std::pair<uint64_t, const std::pair<const Key, Entry>*>> by_access;
+    by_access.reserve(m_entries.size());
+    for (const auto& pair : m_entries)
+    {
+      by_access.emplace_back(pair.second.last_access, &pair);
+    }
+    // Entries are written in access order, such that the order of last accesses is restored on replay
+    std::sort(by_access.begin(), by_access.end());
+    std::ostringstream stream;
+    for (const auto& access : by_access)
+    {
+      const Key& key = access.second->first;
+      stream << "e " << std::get<2>(key) << " " << std::get<0>(key) << " " << std::get<1>(key) << " " << access.second->second.size << " " << access.second->second.accesses << "\n";
+    }
+    std::string data = stream.str();
+
+    m_journal->close();
+    try
+    {
+      atomic_write(m_journal_path, std::vector<uint8_t>(data.begin(), data.end()));
+      m_journal_lines = m_entries.size();
+    }
+    catch (WriteFileException e)
+    {
+      m_metrics->increment("errors.compact");
+    }
+    m_journal->open(m_journal_path.string(), std::ios::app);
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop)
+    {
+      m_condition.wait_for(lock, m_compaction_interval, [this](){return m_stop || m_total_bytes > m_max_bytes;});
+      adopt_child_journals();
+      lock.unlock();
+      evict();
+      lock.lock();
+      compact_journal();
+    }
+  }
+};
+
+} // end of ns tiledwebmaps
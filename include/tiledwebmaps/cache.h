@@ -5,7 +5,20 @@
 #include <tiledwebmaps/tileloader.h>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xtensor.hpp>
+#include <algorithm>
 #include <memory>
+#include <optional>
+#include <filesystem>
+#include <fstream>
+#include <shared_mutex>
+#include <unordered_map>
+#include <tuple>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <string>
 
 namespace tiledwebmaps {
 
@@ -25,16 +38,232 @@ public:
 
   virtual void save(const cv::Mat& image, xti::vec2i tile, int zoom) = 0;
 
+  // Saves a tile with the given channel order. Caches that encode tiles override this to pass BGR tiles to the encoder
+  // as they are, by default the tile is swizzled to RGB and passed to save.
+  virtual void save_ordered(const cv::Mat& image, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    if (order == ChannelOrder::RGB)
+    {
+      save(image, tile, zoom);
+    }
+    else
+    {
+      cv::Mat image_rgb;
+      swizzle(image, image_rgb);
+      save(image_rgb, tile, zoom);
+    }
+  }
+
   virtual bool contains(xti::vec2i tile, int zoom) const = 0;
+
+  // Caches that store encoded tiles return the file extension of the encoding (e.g. ".jpg") and can load and save the
+  // encoded bytes directly. Tiles are then copied between caches with the same encoding without decoding and
+  // re-encoding them. Other caches return an empty string.
+  virtual std::string get_encoding() const
+  {
+    return "";
+  }
+
+  virtual std::vector<uint8_t> load_encoded(xti::vec2i tile, int zoom)
+  {
+    throw CacheFailure();
+  }
+
+  virtual void save_encoded(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    throw CacheFailure();
+  }
+
+  // Decodes bytes returned by load_encoded into the image that load would return
+  virtual cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    throw CacheFailure();
+  }
+
+  using EvictionCallback = std::function<void(const cv::Mat& image, xti::vec2i tile, int zoom)>;
+
+  // Caches with limited capacity call the callback with every tile they evict. Returns false if the cache never evicts
+  // tiles.
+  virtual bool set_eviction_callback(EvictionCallback callback)
+  {
+    return false;
+  }
+
+  // Must be called in forked child processes before the cache is used, e.g. to restart background threads
+  virtual void make_forksafe()
+  {
+  }
 };
 
-class CachedTileLoader : public TileLoader
+// Remembers tiles that the upstream tileloader reported as missing for a given time-to-live, optionally persisted in an
+// append-only sidecar file with one "zoom x y expiry-time" entry per line. The file is rewritten without expired and
+// overwritten entries when it is opened and whenever it has grown to twice the number of entries, such that its size stays
+// proportional to the number of remembered tiles.
+class NegativeCache
 {
 public:
-  CachedTileLoader(std::shared_ptr<TileLoader> loader, std::shared_ptr<Cache> cache)
-    : TileLoader(loader->get_layout())
+  using Key = std::tuple<int, int, int>; // tile-x, tile-y, zoom
+
+  NegativeCache(float ttl, std::optional<std::filesystem::path> path = std::optional<std::filesystem::path>())
+    : m_ttl(static_cast<uint64_t>(ttl * 1e6))
+    , m_path(path)
+    , m_lines(0)
+    , m_next_compaction(MIN_COMPACTION_LINES)
+  {
+    if (m_path && std::filesystem::exists(*m_path))
+    {
+      std::ifstream file(m_path->string());
+      uint64_t now = get_time();
+      int zoom, x, y;
+      uint64_t expiry_time;
+      while (file >> zoom >> x >> y >> expiry_time)
+      {
+        m_lines++;
+        if (expiry_time > now)
+        {
+          m_expiry_times[Key(x, y, zoom)] = expiry_time;
+        }
+      }
+      file.close();
+      if (m_lines > m_expiry_times.size())
+      {
+        compact();
+      }
+    }
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    auto it = m_expiry_times.find(Key(tile(0), tile(1), zoom));
+    return it != m_expiry_times.end() && it->second > get_time();
+  }
+
+  void insert(xti::vec2i tile, int zoom)
+  {
+    uint64_t expiry_time = get_time() + m_ttl;
+
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    m_expiry_times[Key(tile(0), tile(1), zoom)] = expiry_time;
+    if (m_path)
+    {
+      // Failing to persist the entry is not an error, since it is still stored in memory
+      std::error_code ec;
+      std::filesystem::create_directories(m_path->parent_path(), ec);
+      std::ofstream file(m_path->string(), std::ios::app);
+      file << zoom << " " << tile(0) << " " << tile(1) << " " << expiry_time << "\n";
+    }
+    m_lines++;
+    if (m_lines >= m_next_compaction)
+    {
+      compact();
+    }
+  }
+
+  void clear()
+  {
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    m_expiry_times.clear();
+    m_lines = 0;
+    if (m_path)
+    {
+      std::error_code ec;
+      std::filesystem::remove(*m_path, ec);
+    }
+  }
+
+  // Number of entries in memory, including expired entries that have not been compacted yet
+  size_t size() const
+  {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_expiry_times.size();
+  }
+
+  float get_ttl() const
+  {
+    return m_ttl / 1e6;
+  }
+
+  std::optional<std::filesystem::path> get_path() const
+  {
+    return m_path;
+  }
+
+private:
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const
+    {
+      size_t hash = std::hash<int>()(std::get<0>(key));
+      hash = hash * 31 + std::hash<int>()(std::get<1>(key));
+      hash = hash * 31 + std::hash<int>()(std::get<2>(key));
+      return hash;
+    }
+  };
+
+  static constexpr size_t MIN_COMPACTION_LINES = 1024;
+
+  uint64_t m_ttl;
+  std::optional<std::filesystem::path> m_path;
+  std::unordered_map<Key, uint64_t, KeyHash> m_expiry_times;
+  // Number of lines in the sidecar file, or of inserted entries if there is no file
+  size_t m_lines;
+  size_t m_next_compaction;
+  mutable std::shared_mutex m_mutex;
+
+  // Requires the lock (or the constructor). Drops expired entries and atomically replaces the sidecar file with the
+  // remaining entries. Entries appended by other processes in the meantime are lost, which only causes another request
+  // for these tiles.
+  void compact()
+  {
+    uint64_t now = get_time();
+    for (auto it = m_expiry_times.begin(); it != m_expiry_times.end();)
+    {
+      if (it->second <= now)
+      {
+        it = m_expiry_times.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    m_lines = m_expiry_times.size();
+    m_next_compaction = std::max(2 * m_lines, MIN_COMPACTION_LINES);
+
+    if (m_path)
+    {
+      // Failing to compact the file is not an error, it is compacted again when it is next opened
+      std::filesystem::path temp_path = m_path->string() + ".tmp";
+      std::error_code ec;
+      {
+        std::ofstream file(temp_path.string(), std::ios::trunc);
+        for (const auto& pair : m_expiry_times)
+        {
+          file << std::get<2>(pair.first) << " " << std::get<0>(pair.first) << " " << std::get<1>(pair.first) << " " << pair.second << "\n";
+        }
+        if (!file)
+        {
+          file.close();
+          std::filesystem::remove(temp_path, ec);
+          return;
+        }
+      }
+      std::filesystem::rename(temp_path, *m_path, ec);
+    }
+  }
+};
+
+class CachedTileLoader : public TileLoader, public Instrumented
+{
+public:
+  CachedTileLoader(std::shared_ptr<TileLoader> loader, std::shared_ptr<Cache> cache, std::shared_ptr<NegativeCache> negative_cache = nullptr)
+    : TileLoader(loader->get_layout(), loader->get_tile_format())
+    , Instrumented("cached")
     , m_cache(cache)
     , m_loader(loader)
+    , m_negative_cache(negative_cache)
+    , m_cache_loader(dynamic_cast<TileLoader*>(cache.get()))
   {
   }
 
@@ -50,20 +279,137 @@ public:
 
   cv::Mat load(xti::vec2i tile_coord, int zoom)
   {
-    if (m_cache->contains(tile_coord, zoom))
+    return load_ordered(tile_coord, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile_coord, int zoom, ChannelOrder order)
+  {
+    m_metrics->increment("loads");
+    if (m_negative_cache && m_negative_cache->contains(tile_coord, zoom))
     {
-      try
+      m_metrics->increment("negative_hits");
+      throw missing_exception(tile_coord, zoom);
+    }
+    cv::Mat image = load_from_cache(tile_coord, zoom, order);
+    if (image.data != NULL)
+    {
+      return image;
+    }
+
+    // If another thread is already loading this tile, wait for its result instead of loading it again. Workers of the
+    // thread pool load the tile again instead, since the other thread might wait for tasks that are queued behind them.
+    ChannelOrder native_order = get_native_channel_order();
+    auto promise = std::make_shared<std::promise<cv::Mat>>();
+    std::future<cv::Mat> future = promise->get_future();
+    bool started = start_flight(tile_coord, zoom, [promise](cv::Mat image, std::exception_ptr error){
+      if (error)
       {
-        return m_cache->load(tile_coord, zoom);
+        promise->set_exception(error);
       }
-      catch (CacheFailure e)
+      else
       {
+        promise->set_value(image);
       }
+    });
+    if (!started)
+    {
+      if (!ThreadPool::is_worker())
+      {
+        m_metrics->increment("coalesced");
+        return reorder(future.get(), native_order, order);
+      }
+      m_metrics->increment("uncoalesced");
+      return load_from_loader(tile_coord, zoom, order);
     }
 
-    cv::Mat image = m_loader->load(tile_coord, zoom);
-    m_cache->save(image, tile_coord, zoom);
-    return image;
+    try
+    {
+      // The tile might have been saved by a flight that finished after the cache lookup above
+      image = load_from_cache(tile_coord, zoom, native_order);
+      if (image.data == NULL)
+      {
+        image = load_from_loader(tile_coord, zoom, native_order);
+      }
+    }
+    catch (...)
+    {
+      finish_flight(tile_coord, zoom, cv::Mat(), std::current_exception());
+      throw;
+    }
+    finish_flight(tile_coord, zoom, image, nullptr);
+    return reorder(image, native_order, order);
+  }
+
+  // Cache hits are loaded in the native channel order of the cache, which is RGB for caches that are not tileloaders
+  ChannelOrder get_native_channel_order() const
+  {
+    return m_cache_loader ? m_cache_loader->get_native_channel_order() : ChannelOrder::RGB;
+  }
+
+  // Looks up the cache on the shared thread pool and only forwards misses to the asynchronous load of the loader
+  void load_ordered_async(xti::vec2i tile_coord, int zoom, ChannelOrder order, LoadCallback callback)
+  {
+    ThreadPool::get_default().post([this, tile_coord, zoom, order, callback](){
+      // Errors before the tile is passed on are reported to the callback and to all requests waiting for the flight. Once
+      // the callback was called or the load was passed to the loader, errors are left to the thread pool.
+      bool in_flight = false;
+      bool passed_on = false;
+      try
+      {
+        m_metrics->increment("loads");
+        if (m_negative_cache && m_negative_cache->contains(tile_coord, zoom))
+        {
+          m_metrics->increment("negative_hits");
+          passed_on = true;
+          callback(cv::Mat(), std::make_exception_ptr(missing_exception(tile_coord, zoom)));
+          return;
+        }
+        cv::Mat image = load_from_cache(tile_coord, zoom, order);
+        if (image.data != NULL)
+        {
+          passed_on = true;
+          callback(image, nullptr);
+          return;
+        }
+
+        // Flights pass tiles in the native channel order of this tileloader
+        ChannelOrder native_order = get_native_channel_order();
+        bool started = start_flight(tile_coord, zoom, [native_order, order, callback](cv::Mat image, std::exception_ptr error){
+          callback(error ? image : reorder(image, native_order, order), error);
+        });
+        if (!started)
+        {
+          m_metrics->increment("coalesced");
+          return;
+        }
+        in_flight = true;
+        image = load_from_cache(tile_coord, zoom, native_order);
+        if (image.data != NULL)
+        {
+          passed_on = true;
+          finish_flight(tile_coord, zoom, image, nullptr);
+          callback(reorder(image, native_order, order), nullptr);
+          return;
+        }
+        m_metrics->increment("misses");
+
+        load_miss_async(tile_coord, zoom, native_order, order, callback);
+        passed_on = true;
+      }
+      catch (...)
+      {
+        if (passed_on)
+        {
+          throw;
+        }
+        std::exception_ptr error = std::current_exception();
+        if (in_flight)
+        {
+          finish_flight(tile_coord, zoom, cv::Mat(), error);
+        }
+        callback(cv::Mat(), error);
+      }
+    });
   }
 
   std::shared_ptr<Cache> get_cache() const
@@ -71,23 +417,216 @@ public:
     return m_cache;
   }
 
+  std::shared_ptr<NegativeCache> get_negative_cache() const
+  {
+    return m_negative_cache;
+  }
+
+  // Also sets the tile format of the loader and of the cache if it is a tileloader, such that tiles are cached in the
+  // format in which they are loaded
+  virtual void set_tile_format(TileFormat tile_format)
+  {
+    TileLoader::set_tile_format(tile_format);
+    m_loader->set_tile_format(tile_format);
+    if (m_cache_loader)
+    {
+      m_cache_loader->set_tile_format(tile_format);
+    }
+  }
+
   virtual void make_forksafe()
   {
     m_loader->make_forksafe();
+    m_cache->make_forksafe();
   }
 
 private:
+  using Key = std::tuple<int, int, int>; // tile-x, tile-y, zoom
+
   std::shared_ptr<TileLoader> m_loader;
   std::shared_ptr<Cache> m_cache;
+  std::shared_ptr<NegativeCache> m_negative_cache;
+  // The cache as tileloader if it is one, e.g. Disk, such that hits are decoded directly in the requested channel order
+  TileLoader* m_cache_loader;
+
+  // Tiles that are currently loaded by some thread, with the callbacks of all other requests waiting for them
+  std::mutex m_flights_mutex;
+  std::map<Key, std::vector<LoadCallback>> m_flights;
+
+  static TileNotFoundException missing_exception(xti::vec2i tile_coord, int zoom)
+  {
+    return TileNotFoundException("Tile " + XTI_TO_STRING(tile_coord) + " at zoom level " + std::to_string(zoom) + " was recently reported as missing.");
+  }
+
+  void on_missing(xti::vec2i tile_coord, int zoom)
+  {
+    m_metrics->increment("errors.not_found");
+    if (m_negative_cache)
+    {
+      m_negative_cache->insert(tile_coord, zoom);
+    }
+  }
+
+  // Returns the image with the channel order to instead of from, without modifying the given image
+  static cv::Mat reorder(const cv::Mat& image, ChannelOrder from, ChannelOrder to)
+  {
+    if (from == to)
+    {
+      return image;
+    }
+    cv::Mat swizzled;
+    swizzle(image, swizzled);
+    return swizzled;
+  }
+
+  // Returns an empty image if the tile is not cached. Failures of the cache, e.g. corrupt tiles or tiles that were evicted
+  // after the lookup, are treated as misses.
+  cv::Mat load_from_cache(xti::vec2i tile_coord, int zoom, ChannelOrder order)
+  {
+    try
+    {
+      if (m_cache->contains(tile_coord, zoom))
+      {
+        auto timer = m_metrics->time("cache_load");
+        cv::Mat image = m_cache_loader ? m_cache_loader->load_ordered(tile_coord, zoom, order) : reorder(m_cache->load(tile_coord, zoom), ChannelOrder::RGB, order);
+        m_metrics->increment("hits");
+        return image;
+      }
+    }
+    catch (CacheFailure e)
+    {
+      m_metrics->increment("errors.cache");
+    }
+    catch (LoadTileException e)
+    {
+      m_metrics->increment("errors.cache");
+    }
+    return cv::Mat();
+  }
+
+  // Loads the tile from the loader and saves it in the cache
+  cv::Mat load_from_loader(xti::vec2i tile_coord, int zoom, ChannelOrder order)
+  {
+    m_metrics->increment("misses");
+    // The tile is passed from the loader to the cache in the native channel order of the loader, e.g. such that decoded
+    // tiles are encoded again without swizzling them twice
+    ChannelOrder loader_order = m_loader->get_native_channel_order();
+    cv::Mat image;
+    try
+    {
+      auto timer = m_metrics->time("loader_load");
+      image = m_loader->load_ordered(tile_coord, zoom, loader_order);
+    }
+    catch (TileNotFoundException e)
+    {
+      on_missing(tile_coord, zoom);
+      throw;
+    }
+    {
+      auto timer = m_metrics->time("cache_save");
+      m_cache->save_ordered(image, tile_coord, zoom, loader_order);
+    }
+    return reorder(image, loader_order, order);
+  }
+
+  // Loads a tile that is missing in the cache from the loader and finishes the flight of the tile
+  void load_miss_async(xti::vec2i tile_coord, int zoom, ChannelOrder native_order, ChannelOrder order, LoadCallback callback)
+  {
+    // The tile is passed from the loader to the cache in the native channel order of the loader, as in load_from_loader
+    ChannelOrder loader_order = m_loader->get_native_channel_order();
+    auto start = std::chrono::steady_clock::now();
+    m_loader->load_ordered_async(tile_coord, zoom, loader_order, [this, tile_coord, zoom, native_order, loader_order, order, callback, start](cv::Mat image, std::exception_ptr error){
+      m_metrics->record("loader_load", start, std::chrono::steady_clock::now());
+      if (error)
+      {
+        try
+        {
+          std::rethrow_exception(error);
+        }
+        catch (TileNotFoundException e)
+        {
+          on_missing(tile_coord, zoom);
+        }
+        catch (...)
+        {
+        }
+      }
+      else
+      {
+        try
+        {
+          auto timer = m_metrics->time("cache_save");
+          m_cache->save_ordered(image, tile_coord, zoom, loader_order);
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+          image = cv::Mat();
+        }
+      }
+      if (error)
+      {
+        finish_flight(tile_coord, zoom, image, error);
+        callback(image, error);
+        return;
+      }
+      finish_flight(tile_coord, zoom, reorder(image, loader_order, native_order), nullptr);
+      callback(reorder(image, loader_order, order), nullptr);
+    });
+  }
+
+  // Returns true if the caller has to load the tile and call finish_flight afterwards, otherwise the callback is called
+  // when the thread that is already loading the tile finishes
+  bool start_flight(xti::vec2i tile_coord, int zoom, LoadCallback callback)
+  {
+    std::lock_guard<std::mutex> lock(m_flights_mutex);
+    Key key(tile_coord(0), tile_coord(1), zoom);
+    auto it = m_flights.find(key);
+    if (it != m_flights.end())
+    {
+      it->second.push_back(callback);
+      return false;
+    }
+    m_flights[key];
+    return true;
+  }
+
+  void finish_flight(xti::vec2i tile_coord, int zoom, const cv::Mat& image, std::exception_ptr error)
+  {
+    std::vector<LoadCallback> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(m_flights_mutex);
+      auto it = m_flights.find(Key(tile_coord(0), tile_coord(1), zoom));
+      callbacks = std::move(it->second);
+      m_flights.erase(it);
+    }
+    for (const auto& callback : callbacks)
+    {
+      // Every caller gets its own copy of the image
+      callback(error ? cv::Mat() : image.clone(), error);
+    }
+  }
 };
 
-class WithDefault : public TileLoader
+class WithDefault : public TileLoader, public Instrumented
 {
 public:
+  // Default tiles have the type of the tiles of the given tileloader, i.e. float elevation with the first value of color
+  // for Terrarium and Terrain-RGB tiles and 8-bit color otherwise
   WithDefault(std::shared_ptr<TileLoader> tileloader, xti::vec3i color)
-    : TileLoader(tileloader->get_layout())
+    : WithDefault(tileloader, cv::Scalar(color(0), color(1), color(2)), get_default_type(tileloader->get_tile_format()))
+  {
+    m_type_from_format = true;
+  }
+
+  // Default tiles have the given type and are filled with the given value, e.g. a float elevation or a mask value
+  WithDefault(std::shared_ptr<TileLoader> tileloader, cv::Scalar value, int type)
+    : TileLoader(tileloader->get_layout(), tileloader->get_tile_format())
+    , Instrumented("with_default")
     , m_tileloader(tileloader)
-    , m_color(color)
+    , m_value(value)
+    , m_type(type)
+    , m_type_from_format(false)
   {
   }
 
@@ -102,6 +641,11 @@ public:
   }
 
   cv::Mat load(xti::vec2i tile_coord, int zoom)
+  {
+    return load_ordered(tile_coord, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile_coord, int zoom, ChannelOrder order)
   {
     if (zoom > get_max_zoom())
     {
@@ -111,18 +655,73 @@ public:
     {
       throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(get_min_zoom()) + ".");
     }
+    m_metrics->increment("loads");
     try
     {
-      return m_tileloader->load(tile_coord, zoom);
+      return m_tileloader->load_ordered(tile_coord, zoom, order);
     }
     catch (LoadTileException e)
     {
+      m_metrics->increment("errors.load_tile");
     }
     catch (CacheFailure e)
     {
+      m_metrics->increment("errors.cache");
     }
+    m_metrics->increment("defaults");
+
+    return get_default_tile(order);
+  }
+
+  ChannelOrder get_native_channel_order() const
+  {
+    return m_tileloader->get_native_channel_order();
+  }
+
+  void load_ordered_async(xti::vec2i tile_coord, int zoom, ChannelOrder order, LoadCallback callback)
+  {
+    if (zoom > get_max_zoom() || zoom < get_min_zoom())
+    {
+      TileLoader::load_ordered_async(tile_coord, zoom, order, callback);
+      return;
+    }
+    m_metrics->increment("loads");
+    m_tileloader->load_ordered_async(tile_coord, zoom, order, [this, order, callback](cv::Mat image, std::exception_ptr error){
+      if (error)
+      {
+        try
+        {
+          std::rethrow_exception(error);
+        }
+        catch (LoadTileException e)
+        {
+          m_metrics->increment("errors.load_tile");
+        }
+        catch (CacheFailure e)
+        {
+          m_metrics->increment("errors.cache");
+        }
+        catch (...)
+        {
+          callback(cv::Mat(), error);
+          return;
+        }
+        m_metrics->increment("defaults");
+        image = get_default_tile(order);
+      }
+      callback(image, nullptr);
+    });
+  }
 
-    return cv::Mat(m_tileloader->get_layout().get_tile_shape_px()(1), m_tileloader->get_layout().get_tile_shape_px()(0), CV_8UC3, cv::Scalar(m_color(0), m_color(1), m_color(2)));
+  // Also sets the tile format of the wrapped tileloader and the type of default tiles that follow the tile format
+  virtual void set_tile_format(TileFormat tile_format)
+  {
+    TileLoader::set_tile_format(tile_format);
+    m_tileloader->set_tile_format(tile_format);
+    if (m_type_from_format)
+    {
+      m_type = get_default_type(tile_format);
+    }
   }
 
   virtual void make_forksafe()
@@ -132,7 +731,24 @@ public:
 
 private:
   std::shared_ptr<TileLoader> m_tileloader;
-  xti::vec3i m_color;
+  cv::Scalar m_value;
+  int m_type;
+  bool m_type_from_format;
+
+  static int get_default_type(TileFormat tile_format)
+  {
+    return tile_format == TileFormat::TERRARIUM || tile_format == TileFormat::TERRAIN_RGB ? CV_32FC1 : CV_8UC3;
+  }
+
+  cv::Mat get_default_tile(ChannelOrder order = ChannelOrder::RGB) const
+  {
+    cv::Scalar value = m_value;
+    if (order != ChannelOrder::RGB && CV_MAT_CN(m_type) >= 3)
+    {
+      std::swap(value[0], value[2]);
+    }
+    return cv::Mat(m_tileloader->get_layout().get_tile_shape_px()(1), m_tileloader->get_layout().get_tile_shape_px()(0), m_type, value);
+  }
 };
 
 } // end of ns tiledwebmaps
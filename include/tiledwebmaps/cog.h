@@ -0,0 +1,1103 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/tileloader.h>
+#include <tiledwebmaps/disk.h>
+#include <tiledwebmaps/lru.h>
+#include <tiledwebmaps/layout.h>
+#include <tiledwebmaps/proj.h>
+#include <tiledwebmaps/affine.h>
+#include <tiledwebmaps/warp.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <curl/curl.h>
+#include <zlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tiledwebmaps {
+
+// Random access to the bytes of a local or remote file
+class RangeReader
+{
+public:
+  virtual ~RangeReader() = default;
+
+  // Returns fewer bytes than requested if the range exceeds the end of the file
+  virtual std::vector<uint8_t> read(uint64_t offset, uint64_t size) = 0;
+
+  virtual std::string get_name() const = 0;
+};
+
+class FileRangeReader : public RangeReader
+{
+public:
+  FileRangeReader(std::filesystem::path path)
+    : m_path(path)
+  {
+    m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+    {
+      if (errno == ENOENT)
+      {
+        throw FileNotFoundException(m_path);
+      }
+      throw LoadFileException(m_path, std::strerror(errno));
+    }
+  }
+
+  FileRangeReader(const FileRangeReader&) = delete;
+  FileRangeReader& operator=(const FileRangeReader&) = delete;
+
+  virtual ~FileRangeReader()
+  {
+    ::close(m_fd);
+  }
+
+  std::vector<uint8_t> read(uint64_t offset, uint64_t size)
+  {
+    std::vector<uint8_t> data(size);
+    uint64_t done = 0;
+    while (done < size)
+    {
+      ssize_t result = ::pread(m_fd, data.data() + done, size - done, offset + done);
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw LoadFileException(m_path, std::strerror(errno));
+      }
+      if (result == 0)
+      {
+        break;
+      }
+      done += result;
+    }
+    data.resize(done);
+    return data;
+  }
+
+  std::string get_name() const
+  {
+    return m_path.string();
+  }
+
+private:
+  std::filesystem::path m_path;
+  int m_fd;
+};
+
+// Reads byte ranges of a remote file with HTTP range requests, using the same options as Http. Curl handles are kept in
+// a pool and reused across reads, such that connections and TLS sessions to the server are reused as well. Handles
+// inherited from the parent process after fork are abandoned, since their connections are shared with the parent.
+class HttpRangeReader : public RangeReader
+{
+public:
+  HttpRangeReader(std::string url, int retries = 10, float wait_after_error = 1.5, bool verify_ssl = true, std::optional<std::filesystem::path> capath = std::optional<std::filesystem::path>(), std::optional<std::filesystem::path> cafile = std::optional<std::filesystem::path>(), std::map<std::string, std::string> header = std::map<std::string, std::string>())
+    : m_url(url)
+    , m_retries(retries)
+    , m_wait_after_error(wait_after_error)
+    , m_verify_ssl(verify_ssl)
+    , m_capath(capath)
+    , m_cafile(cafile)
+    , m_header(NULL)
+    , m_pid(::getpid())
+  {
+    for (const auto& pair : header)
+    {
+      m_header = curl_slist_append(m_header, (pair.first + ": " + pair.second).c_str());
+    }
+  }
+
+  HttpRangeReader(const HttpRangeReader&) = delete;
+  HttpRangeReader& operator=(const HttpRangeReader&) = delete;
+
+  virtual ~HttpRangeReader()
+  {
+    if (m_pid == ::getpid())
+    {
+      for (CURL* handle : m_handles)
+      {
+        curl_easy_cleanup(handle);
+      }
+    }
+    curl_slist_free_all(m_header);
+  }
+
+  std::vector<uint8_t> read(uint64_t offset, uint64_t size)
+  {
+    if (size == 0)
+    {
+      return std::vector<uint8_t>();
+    }
+    std::string range = std::to_string(offset) + "-" + std::to_string(offset + size - 1);
+
+    LoadTileException last_ex;
+    for (int tries = 0; tries < m_retries; ++tries)
+    {
+      if (tries > 0)
+      {
+        std::this_thread::sleep_for(std::chrono::duration<float>(m_wait_after_error));
+      }
+      Handle handle(*this);
+      CURL* easy = handle.get();
+      Body body{easy, std::string()};
+      char error[CURL_ERROR_SIZE];
+      error[0] = 0;
+      curl_easy_setopt(easy, CURLOPT_URL, m_url.c_str());
+      curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+      curl_easy_setopt(easy, CURLOPT_RANGE, range.c_str());
+      curl_easy_setopt(easy, CURLOPT_HTTPHEADER, m_header);
+      curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &HttpRangeReader::write_body);
+      curl_easy_setopt(easy, CURLOPT_WRITEDATA, &body);
+      curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, error);
+      curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+      if (!m_verify_ssl)
+      {
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+      }
+      if (m_capath)
+      {
+        curl_easy_setopt(easy, CURLOPT_CAPATH, m_capath->string().c_str());
+      }
+      else if (m_cafile)
+      {
+        curl_easy_setopt(easy, CURLOPT_CAINFO, m_cafile->string().c_str());
+      }
+
+      CURLcode result = curl_easy_perform(easy);
+      long response_code = 0;
+      curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response_code);
+      if (response_code == 200)
+      {
+        // Server ignored the range, the transfer was aborted instead of downloading the whole file for every read
+        throw LoadTileException("Failed to read bytes " + range + " from url " + m_url + ". The server does not support range requests.");
+      }
+      if (result != CURLE_OK)
+      {
+        last_ex = LoadTileException("Failed to read bytes " + range + " from url " + m_url + ". Reason: " + (error[0] != 0 ? std::string(error) : std::string(curl_easy_strerror(result))));
+        continue;
+      }
+
+      if (response_code == 206)
+      {
+        return std::vector<uint8_t>(body.data.begin(), body.data.begin() + std::min<uint64_t>(body.data.size(), size));
+      }
+      else if (response_code == 416)
+      {
+        // Range starts behind the end of the file
+        return std::vector<uint8_t>();
+      }
+      else if (response_code == 404)
+      {
+        throw LoadFileException(m_url, "Received response code 404");
+      }
+      last_ex = LoadTileException("Failed to read bytes " + range + " from url " + m_url + ". Received response code " + std::to_string(response_code) + ".");
+    }
+    throw last_ex;
+  }
+
+  std::string get_name() const
+  {
+    return m_url;
+  }
+
+private:
+  // Takes a handle from the pool and returns it when going out of scope
+  class Handle
+  {
+  public:
+    Handle(HttpRangeReader& reader)
+      : m_reader(reader)
+      , m_handle(reader.acquire())
+    {
+    }
+
+    ~Handle()
+    {
+      m_reader.release(m_handle);
+    }
+
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+
+    CURL* get() const
+    {
+      return m_handle;
+    }
+
+  private:
+    HttpRangeReader& m_reader;
+    CURL* m_handle;
+  };
+
+  std::string m_url;
+  int m_retries;
+  float m_wait_after_error;
+  bool m_verify_ssl;
+  std::optional<std::filesystem::path> m_capath;
+  std::optional<std::filesystem::path> m_cafile;
+  curl_slist* m_header;
+
+  std::mutex m_mutex;
+  std::vector<CURL*> m_handles;
+  pid_t m_pid;
+
+  struct Body
+  {
+    CURL* easy;
+    std::string data;
+  };
+
+  static size_t write_body(char* data, size_t size, size_t nmemb, void* user_data)
+  {
+    Body* body = static_cast<Body*>(user_data);
+    long response_code = 0;
+    curl_easy_getinfo(body->easy, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code == 200)
+    {
+      // Aborts the transfer if the server ignored the range
+      return 0;
+    }
+    body->data.append(data, size * nmemb);
+    return size * nmemb;
+  }
+
+  CURL* acquire()
+  {
+    CURL* handle = NULL;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_pid != ::getpid())
+      {
+        m_handles.clear();
+        m_pid = ::getpid();
+      }
+      if (!m_handles.empty())
+      {
+        handle = m_handles.back();
+        m_handles.pop_back();
+      }
+    }
+    if (handle == NULL)
+    {
+      handle = curl_easy_init();
+      if (handle == NULL)
+      {
+        throw LoadTileException("Failed to create curl handle");
+      }
+    }
+    else
+    {
+      // Keeps the connection and session caches, but clears all options
+      curl_easy_reset(handle);
+    }
+    return handle;
+  }
+
+  void release(CURL* handle)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pid == ::getpid())
+    {
+      m_handles.push_back(handle);
+    }
+  }
+};
+
+// Loads tiles from a Cloud-Optimized GeoTIFF without downloading or pre-tiling the whole raster. The header with the
+// directories of the full-resolution image and its overviews is read once on construction. For every tile, the raster
+// pixels of the tile are computed in the CRS of the raster, the overview with the closest resolution that is not
+// coarser than the tile is chosen, and only the internal tiles of the overview that cover the tile are read and
+// resampled. Byte ranges of neighboring internal tiles are merged into a single read, and decoded internal tiles are
+// kept in an LRU cache.
+//
+// Supports tiled 8-bit images with 1 to 4 channels (gray, gray+alpha, RGB, RGBA), uncompressed or compressed with JPEG,
+// LZW, Deflate, WebP or JPEG XL. The CRS is read from the EPSG code of the GeoTIFF keys unless it is given explicitly.
+// Tiles that do not overlap the raster throw TileNotFoundException, pixels outside of the raster are black.
+class COG : public TileLoader, public Instrumented
+{
+public:
+  // Number of bytes read at once from the start of the file, which in a COG contains all image directories
+  static constexpr uint64_t HEADER_BYTES = 16384;
+  // Byte ranges of internal tiles that are at most this many bytes apart are fetched in a single read
+  static constexpr uint64_t MAX_READ_GAP = 65536;
+
+  COG(std::shared_ptr<RangeReader> reader, const Layout& layout, int min_zoom, int max_zoom, std::optional<std::string> crs = std::optional<std::string>(), size_t cache_size = 64)
+    : TileLoader(layout)
+    , Instrumented("cog")
+    , m_reader(reader)
+    , m_min_zoom(min_zoom)
+    , m_max_zoom(max_zoom)
+    , m_cache(cache_size)
+  {
+    auto timer = m_metrics->time("open");
+    m_header = read(0, HEADER_BYTES);
+    parse(crs);
+
+    if (*m_crs != *layout.get_crs())
+    {
+      m_layout_to_crs = std::make_shared<proj::Transformer>(layout.get_crs()->get_context(), layout.get_crs(), m_crs);
+    }
+  }
+
+  COG(const COG&) = delete;
+  COG& operator=(const COG&) = delete;
+
+  int get_min_zoom() const
+  {
+    return m_min_zoom;
+  }
+
+  int get_max_zoom() const
+  {
+    return m_max_zoom;
+  }
+
+  std::shared_ptr<proj::CRS> get_crs() const
+  {
+    return m_crs;
+  }
+
+  // Returns the shape (height, width) of the full-resolution image
+  xti::vec2i get_shape() const
+  {
+    return xti::vec2i({m_levels[0].height, m_levels[0].width});
+  }
+
+  // Returns the number of resolution levels, i.e. the full-resolution image and its overviews
+  size_t get_levels_num() const
+  {
+    return m_levels.size();
+  }
+
+  cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    if (zoom > m_max_zoom)
+    {
+      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is higher than the maximum zoom level " + XTI_TO_STRING(m_max_zoom) + ".");
+    }
+    if (zoom < m_min_zoom)
+    {
+      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
+    }
+    m_metrics->increment("loads");
+    auto load_timer = m_metrics->time("load");
+    const Layout& layout = get_layout();
+    int tile_size = layout.get_tile_shape_px()(0);
+
+    // Full-resolution raster pixels at the corners of the grid cells
+    std::vector<tiledwebmaps::Point2<double>> grid;
+    {
+      auto timer = m_metrics->time("transform");
+      grid = get_warp_grid(layout, tile, zoom, m_layout_to_crs.get(), m_crs_to_pixel);
+    }
+
+    // Choose the coarsest level whose resolution is at least the resolution of the tile
+    size_t level_index = 0;
+    {
+      int center = WARP_GRID_SIZE / 2;
+      const tiledwebmaps::Point2<double>& p = grid[center * (WARP_GRID_SIZE + 1) + center];
+      const tiledwebmaps::Point2<double>& p0 = grid[(center + 1) * (WARP_GRID_SIZE + 1) + center];
+      const tiledwebmaps::Point2<double>& p1 = grid[center * (WARP_GRID_SIZE + 1) + center + 1];
+      double cell_size = (double) tile_size / WARP_GRID_SIZE;
+      double raster_pixels_per_pixel = std::min(std::hypot(p0(0) - p(0), p0(1) - p(1)), std::hypot(p1(0) - p(0), p1(1) - p(1))) / cell_size;
+      if (std::isfinite(raster_pixels_per_pixel))
+      {
+        for (size_t i = 1; i < m_levels.size(); i++)
+        {
+          if ((double) m_levels[0].width / m_levels[i].width <= raster_pixels_per_pixel * (1 + 1e-6))
+          {
+            level_index = i;
+          }
+        }
+      }
+    }
+    const Level& level = m_levels[level_index];
+    m_metrics->increment("levels." + std::to_string(level_index));
+
+    // Convert grid to pixel centers of the chosen level
+    double scale0 = (double) level.height / m_levels[0].height;
+    double scale1 = (double) level.width / m_levels[0].width;
+    double min0 = std::numeric_limits<double>::max();
+    double max0 = std::numeric_limits<double>::lowest();
+    double min1 = min0;
+    double max1 = max0;
+    for (tiledwebmaps::Point2<double>& p : grid)
+    {
+      p = tiledwebmaps::Point2<double>(p(0) * scale0 - 0.5, p(1) * scale1 - 0.5);
+      if (std::isfinite(p(0)) && std::isfinite(p(1)))
+      {
+        min0 = std::min(min0, p(0));
+        max0 = std::max(max0, p(0));
+        min1 = std::min(min1, p(1));
+        max1 = std::max(max1, p(1));
+      }
+    }
+    if (min0 > max0 || max0 < -1 || min0 > level.height || max1 < -1 || min1 > level.width)
+    {
+      m_metrics->increment("errors.not_found");
+      throw TileNotFoundException("Tile " + XTI_TO_STRING(tile) + " at zoom level " + std::to_string(zoom) + " is outside of the raster " + m_reader->get_name());
+    }
+    int row0 = std::max(0, (int) std::floor(min0));
+    int row1 = std::min(level.height, (int) std::floor(max0) + 2);
+    int col0 = std::max(0, (int) std::floor(min1));
+    int col1 = std::min(level.width, (int) std::floor(max1) + 2);
+
+    // Read internal tiles and copy the required region into a single image
+    std::vector<xti::vec2i> internal_tiles;
+    for (int t0 = row0 / level.tile_height; t0 <= (row1 - 1) / level.tile_height; t0++)
+    {
+      for (int t1 = col0 / level.tile_width; t1 <= (col1 - 1) / level.tile_width; t1++)
+      {
+        internal_tiles.push_back(xti::vec2i({t0, t1}));
+      }
+    }
+    std::vector<cv::Mat> internal_images = load_internal_tiles(level_index, internal_tiles);
+    cv::Mat src_image(row1 - row0, col1 - col0, get_tile_type(level), cv::Scalar::all(0));
+    for (size_t i = 0; i < internal_tiles.size(); i++)
+    {
+      int begin0 = std::max(row0, internal_tiles[i](0) * level.tile_height);
+      int end0 = std::min(row1, (internal_tiles[i](0) + 1) * level.tile_height);
+      int begin1 = std::max(col0, internal_tiles[i](1) * level.tile_width);
+      int end1 = std::min(col1, (internal_tiles[i](1) + 1) * level.tile_width);
+      cv::Rect src_roi(begin1 - internal_tiles[i](1) * level.tile_width, begin0 - internal_tiles[i](0) * level.tile_height, end1 - begin1, end0 - begin0);
+      cv::Rect dest_roi(begin1 - col0, begin0 - row0, end1 - begin1, end0 - begin0);
+      internal_images[i](src_roi).copyTo(src_image(dest_roi));
+    }
+
+    // Sample tile
+    auto warp_timer = m_metrics->time("warp");
+    cv::Mat map_x, map_y;
+    get_warp_maps(grid, tile_size, map_x, map_y, tiledwebmaps::Point2<double>(row0, col0));
+    cv::Mat image;
+    cv::remap(src_image, image, map_x, map_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+    return image;
+  }
+
+private:
+  struct Level
+  {
+    int width;
+    int height;
+    int tile_width;
+    int tile_height;
+    int tiles_across;
+    uint16_t compression;
+    uint16_t predictor;
+    uint16_t photometric;
+    int samples;
+    std::vector<uint64_t> tile_offsets;
+    std::vector<uint64_t> tile_byte_counts;
+    std::vector<uint8_t> jpeg_tables;
+  };
+
+  struct Entry
+  {
+    uint16_t type;
+    uint64_t count;
+    std::vector<uint8_t> data;
+  };
+
+  using Directory = std::map<uint16_t, Entry>;
+
+  std::shared_ptr<RangeReader> m_reader;
+  int m_min_zoom;
+  int m_max_zoom;
+  LRU m_cache;
+
+  std::vector<uint8_t> m_header;
+  bool m_big_endian;
+  bool m_big_tiff;
+  std::vector<Level> m_levels;
+  std::shared_ptr<proj::CRS> m_crs;
+  // Maps coordinates in the CRS of the raster to (row, col) of the full-resolution image, with pixel corners at
+  // integers
+  tiledwebmaps::Affine2<double> m_crs_to_pixel;
+  std::shared_ptr<proj::Transformer> m_layout_to_crs;
+
+  std::vector<uint8_t> read(uint64_t offset, uint64_t size)
+  {
+    m_metrics->increment("reads");
+    auto timer = m_metrics->time("read");
+    std::vector<uint8_t> data = m_reader->read(offset, size);
+    m_metrics->increment("bytes_in", data.size());
+    return data;
+  }
+
+  // Returns bytes from the header if possible, otherwise reads them
+  std::vector<uint8_t> get_bytes(uint64_t offset, uint64_t size)
+  {
+    if (offset + size <= m_header.size())
+    {
+      return std::vector<uint8_t>(m_header.begin() + offset, m_header.begin() + offset + size);
+    }
+    std::vector<uint8_t> data = read(offset, size);
+    if (data.size() != size)
+    {
+      throw LoadFileException(m_reader->get_name(), "Unexpected end of file");
+    }
+    return data;
+  }
+
+  uint64_t get_uint(const uint8_t* data, size_t bytes) const
+  {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+      value |= (uint64_t) data[m_big_endian ? bytes - 1 - i : i] << (8 * i);
+    }
+    return value;
+  }
+
+  static size_t get_type_size(uint16_t type)
+  {
+    switch (type)
+    {
+      case 1: case 2: case 6: case 7: return 1;
+      case 3: case 8: return 2;
+      case 4: case 9: case 11: return 4;
+      case 5: case 10: case 12: case 16: case 17: case 18: return 8;
+      default: return 0;
+    }
+  }
+
+  std::vector<uint64_t> get_uints(const Directory& directory, uint16_t tag) const
+  {
+    auto it = directory.find(tag);
+    if (it == directory.end())
+    {
+      return std::vector<uint64_t>();
+    }
+    const Entry& entry = it->second;
+    size_t type_size = get_type_size(entry.type);
+    if (entry.type == 2 || entry.type == 5 || entry.type == 10 || entry.type == 11 || entry.type == 12)
+    {
+      throw LoadFileException(m_reader->get_name(), "Expected integer values for TIFF tag " + std::to_string(tag));
+    }
+    std::vector<uint64_t> values(entry.count);
+    for (uint64_t i = 0; i < entry.count; i++)
+    {
+      values[i] = get_uint(entry.data.data() + i * type_size, type_size);
+    }
+    return values;
+  }
+
+  uint64_t get_uint(const Directory& directory, uint16_t tag, uint64_t default_value) const
+  {
+    std::vector<uint64_t> values = get_uints(directory, tag);
+    return values.empty() ? default_value : values[0];
+  }
+
+  std::vector<double> get_doubles(const Directory& directory, uint16_t tag) const
+  {
+    auto it = directory.find(tag);
+    if (it == directory.end())
+    {
+      return std::vector<double>();
+    }
+    const Entry& entry = it->second;
+    std::vector<double> values(entry.count);
+    for (uint64_t i = 0; i < entry.count; i++)
+    {
+      if (entry.type == 12)
+      {
+        uint64_t bits = get_uint(entry.data.data() + i * 8, 8);
+        std::memcpy(&values[i], &bits, 8);
+      }
+      else if (entry.type == 11)
+      {
+        uint32_t bits = get_uint(entry.data.data() + i * 4, 4);
+        float value;
+        std::memcpy(&value, &bits, 4);
+        values[i] = value;
+      }
+      else
+      {
+        throw LoadFileException(m_reader->get_name(), "Expected floating point values for TIFF tag " + std::to_string(tag));
+      }
+    }
+    return values;
+  }
+
+  Directory read_directory(uint64_t offset, uint64_t& next_offset)
+  {
+    size_t count_size = m_big_tiff ? 8 : 2;
+    size_t entry_size = m_big_tiff ? 20 : 12;
+    size_t offset_size = m_big_tiff ? 8 : 4;
+    uint64_t entries_num = get_uint(get_bytes(offset, count_size).data(), count_size);
+    std::vector<uint8_t> entries = get_bytes(offset + count_size, entries_num * entry_size + offset_size);
+
+    Directory directory;
+    for (uint64_t i = 0; i < entries_num; i++)
+    {
+      const uint8_t* data = entries.data() + i * entry_size;
+      uint16_t tag = get_uint(data, 2);
+      Entry entry;
+      entry.type = get_uint(data + 2, 2);
+      entry.count = get_uint(data + 4, m_big_tiff ? 8 : 4);
+      const uint8_t* value = data + 4 + offset_size;
+      size_t type_size = get_type_size(entry.type);
+      if (type_size == 0)
+      {
+        continue;
+      }
+      uint64_t size = entry.count * type_size;
+      if (entry.count > (1ULL << 32) || size > (1ULL << 32))
+      {
+        throw LoadFileException(m_reader->get_name(), "Invalid size of TIFF tag " + std::to_string(tag));
+      }
+      if (size <= offset_size)
+      {
+        entry.data.assign(value, value + size);
+      }
+      else
+      {
+        entry.data = get_bytes(get_uint(value, offset_size), size);
+      }
+      directory[tag] = std::move(entry);
+    }
+    next_offset = get_uint(entries.data() + entries_num * entry_size, offset_size);
+    return directory;
+  }
+
+  void parse(std::optional<std::string> crs)
+  {
+    std::string name = m_reader->get_name();
+    if (m_header.size() < 16 || !((m_header[0] == 'I' && m_header[1] == 'I') || (m_header[0] == 'M' && m_header[1] == 'M')))
+    {
+      throw LoadFileException(name, "Not a TIFF file");
+    }
+    m_big_endian = m_header[0] == 'M';
+    uint64_t version = get_uint(m_header.data() + 2, 2);
+    if (version != 42 && version != 43)
+    {
+      throw LoadFileException(name, "Not a TIFF file");
+    }
+    m_big_tiff = version == 43;
+    uint64_t offset = m_big_tiff ? get_uint(m_header.data() + 8, 8) : get_uint(m_header.data() + 4, 4);
+
+    std::vector<Directory> directories;
+    while (offset != 0)
+    {
+      if (directories.size() > 64)
+      {
+        throw LoadFileException(name, "Too many image directories");
+      }
+      directories.push_back(read_directory(offset, offset));
+    }
+    if (directories.empty())
+    {
+      throw LoadFileException(name, "TIFF file contains no images");
+    }
+
+    // Full-resolution image and reduced-resolution images, without masks
+    for (size_t i = 0; i < directories.size(); i++)
+    {
+      const Directory& directory = directories[i];
+      uint64_t subfile_type = get_uint(directory, 254, 0);
+      if ((subfile_type & 4) != 0 || (i > 0 && (subfile_type & 1) == 0))
+      {
+        continue;
+      }
+      m_levels.push_back(parse_level(directory));
+    }
+    if (m_levels.empty())
+    {
+      throw LoadFileException(name, "TIFF file contains no full-resolution image");
+    }
+    std::sort(m_levels.begin() + 1, m_levels.end(), [](const Level& a, const Level& b){return a.width > b.width;});
+
+    // Georeferencing
+    const Directory& directory = directories[0];
+    std::vector<double> transformation = get_doubles(directory, 34264);
+    std::vector<double> tiepoint = get_doubles(directory, 33922);
+    std::vector<double> pixel_scale = get_doubles(directory, 33550);
+    tiledwebmaps::Affine2<double> pixel_to_model; // (col, row) -> (x, y)
+    if (transformation.size() >= 16)
+    {
+      pixel_to_model = tiledwebmaps::Affine2<double>(transformation[0], transformation[1], transformation[4], transformation[5], transformation[3], transformation[7]);
+    }
+    else if (tiepoint.size() >= 6 && pixel_scale.size() >= 2)
+    {
+      pixel_to_model = tiledwebmaps::Affine2<double>(pixel_scale[0], 0, 0, -pixel_scale[1], tiepoint[3] - tiepoint[0] * pixel_scale[0], tiepoint[4] + tiepoint[1] * pixel_scale[1]);
+    }
+    else
+    {
+      throw LoadFileException(name, "GeoTIFF contains no georeferencing");
+    }
+
+    std::map<uint16_t, uint64_t> geo_keys;
+    std::vector<uint64_t> geo_key_directory = get_uints(directory, 34735);
+    for (size_t i = 4; i + 3 < geo_key_directory.size(); i += 4)
+    {
+      if (geo_key_directory[i + 1] == 0)
+      {
+        geo_keys[geo_key_directory[i]] = geo_key_directory[i + 3];
+      }
+    }
+    if (geo_keys.count(1025) > 0 && geo_keys[1025] == 2)
+    {
+      // Raster is PixelIsPoint, i.e. the georeferencing refers to pixel centers
+      pixel_to_model = pixel_to_model * tiledwebmaps::Affine2<double>::translation(-0.5, -0.5);
+    }
+    if (!crs)
+    {
+      uint64_t epsg = 0;
+      if (geo_keys.count(3072) > 0)
+      {
+        epsg = geo_keys[3072];
+      }
+      else if (geo_keys.count(2048) > 0)
+      {
+        epsg = geo_keys[2048];
+      }
+      if (epsg == 0 || epsg == 32767)
+      {
+        throw LoadFileException(name, "GeoTIFF contains no EPSG code, the CRS has to be given explicitly");
+      }
+      crs = "epsg:" + std::to_string(epsg);
+    }
+    m_crs = std::make_shared<proj::CRS>(get_layout().get_crs()->get_context(), *crs);
+
+    // The model space of GeoTIFF is (east, north), independent of the axis order of the CRS
+    m_crs_to_pixel = Georeference::from_model(m_crs, pixel_to_model).pixel_to_crs.inverse();
+  }
+
+  Level parse_level(const Directory& directory) const
+  {
+    std::string name = m_reader->get_name();
+    Level level;
+    level.width = get_uint(directory, 256, 0);
+    level.height = get_uint(directory, 257, 0);
+    level.tile_width = get_uint(directory, 322, 0);
+    level.tile_height = get_uint(directory, 323, 0);
+    level.compression = get_uint(directory, 259, 1);
+    level.predictor = get_uint(directory, 317, 1);
+    level.photometric = get_uint(directory, 262, 1);
+    level.samples = get_uint(directory, 277, 1);
+    level.tile_offsets = get_uints(directory, 324);
+    level.tile_byte_counts = get_uints(directory, 325);
+    auto jpeg_tables = directory.find(347);
+    if (jpeg_tables != directory.end())
+    {
+      level.jpeg_tables = jpeg_tables->second.data;
+    }
+
+    if (level.width <= 0 || level.height <= 0)
+    {
+      throw LoadFileException(name, "Invalid image shape");
+    }
+    if (level.tile_width <= 0 || level.tile_height <= 0)
+    {
+      throw LoadFileException(name, "Image is not tiled, which is required for cloud-optimized GeoTIFFs");
+    }
+    level.tiles_across = (level.width + level.tile_width - 1) / level.tile_width;
+    size_t tiles_num = (size_t) level.tiles_across * ((level.height + level.tile_height - 1) / level.tile_height);
+    if (level.tile_offsets.size() < tiles_num || level.tile_byte_counts.size() < tiles_num)
+    {
+      throw LoadFileException(name, "Missing offsets of internal tiles");
+    }
+    for (uint64_t bits : get_uints(directory, 258))
+    {
+      if (bits != 8)
+      {
+        throw LoadFileException(name, "Expected 8 bits per sample, got " + std::to_string(bits));
+      }
+    }
+    if (get_uint(directory, 339, 1) != 1)
+    {
+      throw LoadFileException(name, "Expected unsigned integer samples");
+    }
+    if (get_uint(directory, 284, 1) != 1)
+    {
+      throw LoadFileException(name, "Expected interleaved samples");
+    }
+    if (level.samples < 1 || level.samples > 4)
+    {
+      throw LoadFileException(name, "Expected 1 to 4 samples per pixel, got " + std::to_string(level.samples));
+    }
+    if (level.compression != 1 && level.compression != 5 && level.compression != 7 && level.compression != 8 && level.compression != 32946 && level.compression != 50001 && level.compression != 50002)
+    {
+      throw LoadFileException(name, "Unsupported compression " + std::to_string(level.compression));
+    }
+    if (level.photometric != 1 && level.photometric != 2 && !(level.photometric == 6 && level.compression == 7))
+    {
+      throw LoadFileException(name, "Unsupported photometric interpretation " + std::to_string(level.photometric));
+    }
+    if (level.predictor != 1 && level.predictor != 2)
+    {
+      throw LoadFileException(name, "Unsupported predictor " + std::to_string(level.predictor));
+    }
+    return level;
+  }
+
+  // Returns the decoded internal tiles (row, col) of the given level as RGB images
+  std::vector<cv::Mat> load_internal_tiles(size_t level_index, const std::vector<xti::vec2i>& tiles)
+  {
+    const Level& level = m_levels[level_index];
+    std::vector<cv::Mat> images(tiles.size());
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+      try
+      {
+        images[i] = m_cache.load(tiles[i], level_index);
+      }
+      catch (CacheFailure e)
+      {
+        size_t index = tiles[i](0) * level.tiles_across + tiles[i](1);
+        if (level.tile_byte_counts[index] == 0)
+        {
+          // Sparse tile
+          images[i] = cv::Mat(level.tile_height, level.tile_width, get_tile_type(level), cv::Scalar::all(0));
+        }
+        else
+        {
+          missing.push_back(i);
+        }
+      }
+    }
+
+    auto get_index = [&](size_t i){return tiles[i](0) * level.tiles_across + tiles[i](1);};
+    std::sort(missing.begin(), missing.end(), [&](size_t a, size_t b){return level.tile_offsets[get_index(a)] < level.tile_offsets[get_index(b)];});
+    size_t begin = 0;
+    while (begin < missing.size())
+    {
+      uint64_t start = level.tile_offsets[get_index(missing[begin])];
+      uint64_t end = start + level.tile_byte_counts[get_index(missing[begin])];
+      size_t next = begin + 1;
+      while (next < missing.size() && level.tile_offsets[get_index(missing[next])] <= end + MAX_READ_GAP)
+      {
+        end = std::max(end, level.tile_offsets[get_index(missing[next])] + level.tile_byte_counts[get_index(missing[next])]);
+        next++;
+      }
+      std::vector<uint8_t> data = read(start, end - start);
+      if (data.size() != end - start)
+      {
+        throw LoadFileException(m_reader->get_name(), "Unexpected end of file");
+      }
+      for (size_t j = begin; j < next; j++)
+      {
+        size_t i = missing[j];
+        size_t index = get_index(i);
+        images[i] = decode(level, data.data() + (level.tile_offsets[index] - start), level.tile_byte_counts[index]);
+        m_cache.save(images[i], tiles[i], level_index);
+      }
+      begin = next;
+    }
+    return images;
+  }
+
+  // Tiles are RGB, or keep the samples of the image if the tile format is unchanged
+  int get_tile_type(const Level& level) const
+  {
+    return get_tile_format() == TileFormat::UNCHANGED ? CV_8UC(level.samples) : CV_8UC3;
+  }
+
+  cv::Mat decode(const Level& level, const uint8_t* data, size_t size)
+  {
+    auto timer = m_metrics->time("decode");
+    std::string name = m_reader->get_name();
+    cv::Mat image;
+    if (level.compression == 7 || level.compression == 50001 || level.compression == 50002)
+    {
+      // JPEG tiles share the quantization and Huffman tables in the JPEGTables tag, which are inserted after the start
+      // marker
+      std::vector<uint8_t> stream;
+      if (level.compression == 7 && level.jpeg_tables.size() > 4 && size > 2)
+      {
+        stream.assign(level.jpeg_tables.begin(), level.jpeg_tables.end() - 2);
+        stream.insert(stream.end(), data + 2, data + size);
+      }
+      else
+      {
+        stream.assign(data, data + size);
+      }
+      image = cv::imdecode(cv::Mat(1, stream.size(), CV_8UC1, stream.data()), cv::IMREAD_UNCHANGED);
+      if (image.data == NULL)
+      {
+        m_metrics->increment("errors.decode");
+        throw LoadFileException(name, "Failed to decode internal tile");
+      }
+      if (image.channels() == 3)
+      {
+        cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+      }
+      else if (image.channels() == 4)
+      {
+        cv::cvtColor(image, image, cv::COLOR_BGRA2RGBA);
+      }
+    }
+    else
+    {
+      size_t expected_size = (size_t) level.tile_width * level.tile_height * level.samples;
+      std::vector<uint8_t> raw;
+      if (level.compression == 1)
+      {
+        raw.assign(data, data + size);
+      }
+      else if (level.compression == 5)
+      {
+        raw = lzw_decode(data, size, expected_size);
+      }
+      else
+      {
+        raw.resize(expected_size);
+        uLongf raw_size = expected_size;
+        if (::uncompress(raw.data(), &raw_size, data, size) != Z_OK)
+        {
+          m_metrics->increment("errors.decode");
+          throw LoadFileException(name, "Failed to inflate internal tile");
+        }
+        raw.resize(raw_size);
+      }
+      if (raw.size() < expected_size)
+      {
+        m_metrics->increment("errors.decode");
+        throw LoadFileException(name, "Internal tile has " + std::to_string(raw.size()) + " bytes, expected " + std::to_string(expected_size));
+      }
+      if (level.predictor == 2)
+      {
+        size_t row_size = (size_t) level.tile_width * level.samples;
+        for (int r = 0; r < level.tile_height; r++)
+        {
+          uint8_t* row = raw.data() + r * row_size;
+          for (size_t c = level.samples; c < row_size; c++)
+          {
+            row[c] += row[c - level.samples];
+          }
+        }
+      }
+      image = cv::Mat(level.tile_height, level.tile_width, CV_8UC(level.samples), raw.data()).clone();
+    }
+
+    if (image.rows != level.tile_height || image.cols != level.tile_width)
+    {
+      m_metrics->increment("errors.decode");
+      throw LoadFileException(name, "Internal tile has shape " + std::to_string(image.rows) + "x" + std::to_string(image.cols) + ", expected " + std::to_string(level.tile_height) + "x" + std::to_string(level.tile_width));
+    }
+    if (get_tile_format() == TileFormat::UNCHANGED)
+    {
+      return image;
+    }
+    switch (image.channels())
+    {
+      case 1: cv::cvtColor(image, image, cv::COLOR_GRAY2RGB); break;
+      case 2:
+      {
+        cv::Mat gray;
+        cv::extractChannel(image, gray, 0);
+        cv::cvtColor(gray, image, cv::COLOR_GRAY2RGB);
+        break;
+      }
+      case 4: cv::cvtColor(image, image, cv::COLOR_RGBA2RGB); break;
+    }
+    return image;
+  }
+
+  // Decodes TIFF LZW data, i.e. MSB-first codes of 9 to 12 bits with early change
+  std::vector<uint8_t> lzw_decode(const uint8_t* data, size_t size, size_t expected_size) const
+  {
+    static const int CLEAR = 256;
+    static const int END = 257;
+    std::vector<uint16_t> prefix(4096);
+    std::vector<uint8_t> suffix(4096);
+    std::vector<uint8_t> first(4096);
+    std::vector<uint16_t> length(4096);
+    for (int i = 0; i < 256; i++)
+    {
+      prefix[i] = 0;
+      suffix[i] = first[i] = i;
+      length[i] = 1;
+    }
+
+    std::vector<uint8_t> output;
+    output.reserve(expected_size);
+    auto append = [&](int code){
+      size_t end = output.size() + length[code];
+      output.resize(end);
+      for (size_t i = end; i > end - length[code]; i--)
+      {
+        output[i - 1] = suffix[code];
+        code = prefix[code];
+      }
+    };
+
+    uint64_t bit_pos = 0;
+    int width = 9;
+    int next_code = 258;
+    int old_code = -1;
+    while (bit_pos + width <= size * 8)
+    {
+      int code = 0;
+      for (int i = 0; i < width; i++, bit_pos++)
+      {
+        code = (code << 1) | ((data[bit_pos / 8] >> (7 - bit_pos % 8)) & 1);
+      }
+      if (code == END)
+      {
+        break;
+      }
+      if (code == CLEAR)
+      {
+        width = 9;
+        next_code = 258;
+        old_code = -1;
+        continue;
+      }
+      if (old_code == -1)
+      {
+        if (code >= 256)
+        {
+          throw LoadFileException(m_reader->get_name(), "Invalid LZW code");
+        }
+        append(code);
+      }
+      else
+      {
+        if (code > next_code || next_code >= 4096)
+        {
+          throw LoadFileException(m_reader->get_name(), "Invalid LZW code");
+        }
+        prefix[next_code] = old_code;
+        suffix[next_code] = code < next_code ? first[code] : first[old_code];
+        first[next_code] = first[old_code];
+        length[next_code] = length[old_code] + 1;
+        next_code++;
+        append(code);
+      }
+      old_code = code;
+      if (next_code + 1 >= (1 << width) && width < 12)
+      {
+        width++;
+      }
+      if (output.size() >= expected_size)
+      {
+        break;
+      }
+    }
+    return output;
+  }
+};
+
+} // end of ns tiledwebmaps
@@ -7,14 +7,20 @@
 #include <xti/util.h>
 #include <tiledwebmaps/tileloader.h>
 #include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/encoding.h>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xtensor.hpp>
 #include <filesystem>
 #include <memory>
+#include <atomic>
 #include <chrono>
-#include <thread>
-#include <fstream>
-#include <shared_mutex>
+#include <optional>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace tiledwebmaps {
 
@@ -40,55 +46,189 @@ private:
   std::string m_message;
 };
 
-cv::Mat safe_imread(std::filesystem::path path)
+class LoadFileException : public LoadTileException
 {
-  if (!std::filesystem::exists(path))
+public:
+  LoadFileException(std::filesystem::path path, std::string message)
+    : m_message(std::string("Failed to load file ") + path.string() + ". Reason: " + message)
   {
-    throw ImreadException(std::string("File does not exist: ") + path.string());
   }
-  std::ifstream file(path.string(), std::ios::binary | std::ios::ate);
-  std::streamsize size = file.tellg();
-  if (size == 0)
+
+  virtual const char* what() const throw ()
   {
-    throw ImreadException(std::string("File is empty: ") + path.string());
+    return m_message.c_str();
   }
-  file.seekg(0, std::ios::beg);
 
-  std::vector<uint8_t> buffer(size);
-  if (!file.read((char*) buffer.data(), size))
+private:
+  std::string m_message;
+};
+
+class FileNotFoundException : public LoadFileException
+{
+public:
+  FileNotFoundException(std::filesystem::path path)
+    : LoadFileException(path, "File not found")
   {
-    throw ImreadException(std::string("Failed to read bytes of file ") + path.string());
   }
+};
 
+cv::Mat safe_imdecode(const uint8_t* data, size_t size, const std::filesystem::path& path, Metrics* metrics = nullptr, int flags = cv::IMREAD_COLOR)
+{
   if (ends_with(path.string(), ".jpg") || ends_with(path.string(), ".jpeg"))
   {
     #define HEX(x) std::setw(2) << std::setfill('0') << std::hex << (int) (x)
-    if (buffer[0] != 0xFF || buffer[1] != 0xD8)
+    if (size < 4)
+    {
+      throw ImreadException(XTI_TO_STRING("Loaded jpeg with only " << size << " bytes from file " << path.string()));
+    }
+    else if (data[0] != 0xFF || data[1] != 0xD8)
     {
-      throw ImreadException(XTI_TO_STRING("Loaded jpeg with invalid start marker " << HEX(buffer[0]) << " " << HEX(buffer[1]) << " from file " << path.string()));
+      throw ImreadException(XTI_TO_STRING("Loaded jpeg with invalid start marker " << HEX(data[0]) << " " << HEX(data[1]) << " from file " << path.string()));
     }
-    else if (buffer[buffer.size() - 2] != 0xFF || buffer[buffer.size() - 1] != 0xD9)
+    else if (data[size - 2] != 0xFF || data[size - 1] != 0xD9)
     {
-     throw ImreadException(XTI_TO_STRING("Loaded jpeg with invalid end marker " << HEX(buffer[buffer.size() - 2]) << " " << HEX(buffer[buffer.size() - 1]) << " from file " << path.string()));
+     throw ImreadException(XTI_TO_STRING("Loaded jpeg with invalid end marker " << HEX(data[size - 2]) << " " << HEX(data[size - 1]) << " from file " << path.string()));
     }
     #undef HEX
   }
 
-  cv::Mat data_cv(1, buffer.size(), xti::opencv::pixeltype<uint8_t>::get(1), buffer.data());
+  cv::Mat data_cv(1, size, xti::opencv::pixeltype<uint8_t>::get(1), const_cast<uint8_t*>(data));
   if (data_cv.data == NULL)
   {
     throw ImreadException("Failed to convert data array of file " + path.string() + " to cv mat");
   }
 
-  cv::Mat image_cv = cv::imdecode(data_cv, cv::IMREAD_COLOR);
+  std::optional<Metrics::Timer> timer;
+  if (metrics)
+  {
+    timer.emplace(metrics, "decode");
+  }
+  cv::Mat image_cv = cv::imdecode(data_cv, flags);
   if (image_cv.data == NULL)
   {
+    std::string encoding = detect_encoding(data, size);
+    if (!encoding.empty() && encoding != ".jpg" && encoding != ".png")
+    {
+      throw ImreadException("Failed to decode " + encoding + " image from file " + path.string() + ". OpenCV might have been built without support for this format");
+    }
     throw ImreadException("Failed to decode image from file " + path.string());
   }
 
   return image_cv;
 }
 
+// Files at least this large are decoded directly from a memory mapping instead of being copied into the read buffer
+static const size_t IMREAD_MMAP_THRESHOLD = 4 * 1024 * 1024;
+
+// Opens a non-empty file for reading and returns its descriptor
+int open_file(const std::filesystem::path& path, size_t& size)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+    {
+      throw FileNotFoundException(path);
+    }
+    throw ImreadException("Failed to open file " + path.string() + ". Reason: " + std::strerror(errno));
+  }
+
+  struct stat stat_buffer;
+  if (::fstat(fd, &stat_buffer) != 0)
+  {
+    std::string reason = std::strerror(errno);
+    ::close(fd);
+    throw ImreadException("Failed to stat file " + path.string() + ". Reason: " + reason);
+  }
+  size = stat_buffer.st_size;
+  if (size == 0)
+  {
+    ::close(fd);
+    throw ImreadException(std::string("File is empty: ") + path.string());
+  }
+  return fd;
+}
+
+// Reads size bytes from the file descriptor and closes it
+void read_and_close(int fd, const std::filesystem::path& path, uint8_t* data, size_t size)
+{
+  size_t read = 0;
+  while (read < size)
+  {
+    ssize_t n = ::read(fd, data + read, size - read);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      ::close(fd);
+      throw ImreadException(std::string("Failed to read bytes of file ") + path.string());
+    }
+    read += n;
+  }
+  ::close(fd);
+}
+
+std::vector<uint8_t> read_file(std::filesystem::path path, Metrics* metrics = nullptr)
+{
+  auto read_start = std::chrono::steady_clock::now();
+  size_t size;
+  int fd = open_file(path, size);
+  std::vector<uint8_t> data(size);
+  read_and_close(fd, path, data.data(), size);
+  if (metrics)
+  {
+    metrics->record("read", read_start, std::chrono::steady_clock::now());
+    metrics->increment("bytes_in", size);
+  }
+  return data;
+}
+
+cv::Mat safe_imread(std::filesystem::path path, Metrics* metrics = nullptr, int flags = cv::IMREAD_COLOR)
+{
+  auto read_start = std::chrono::steady_clock::now();
+  size_t size;
+  int fd = open_file(path, size);
+  auto record_read = [&](){
+    if (metrics)
+    {
+      metrics->record("read", read_start, std::chrono::steady_clock::now());
+      metrics->increment("bytes_in", size);
+    }
+  };
+
+  if (size >= IMREAD_MMAP_THRESHOLD)
+  {
+    void* data = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+      throw ImreadException("Failed to map file " + path.string() + ". Reason: " + std::strerror(errno));
+    }
+    record_read();
+    try
+    {
+      cv::Mat image_cv = safe_imdecode((const uint8_t*) data, size, path, metrics, flags);
+      ::munmap(data, size);
+      return image_cv;
+    }
+    catch (...)
+    {
+      ::munmap(data, size);
+      throw;
+    }
+  }
+
+  // Reuse the allocation across tiles loaded by the same thread
+  thread_local std::vector<uint8_t> buffer;
+  buffer.resize(size);
+  read_and_close(fd, path, buffer.data(), size);
+  record_read();
+
+  return safe_imdecode(buffer.data(), size, path, metrics, flags);
+}
+
 class WriteFileException : public std::exception
 {
 public:
@@ -111,65 +251,90 @@ private:
   std::string m_message;
 };
 
-class LoadFileException : public LoadTileException
+// Writes the file under a temporary name and renames it to the target path afterwards, such that concurrent readers
+// either see the complete file or no file at all
+void atomic_write(std::filesystem::path path, const std::vector<uint8_t>& data, bool sync = false)
 {
-public:
-  LoadFileException(std::filesystem::path path, std::string message)
-    : m_message(std::string("Failed to load file ") + path.string() + ". Reason: " + message)
+  static std::atomic<uint64_t> counter(0);
+  std::filesystem::path temp_path = path;
+  temp_path += ".tmp" + std::to_string(::getpid()) + "_" + std::to_string(counter++);
+
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0)
   {
+    throw WriteFileException(path, std::strerror(errno));
   }
-
-  virtual const char* what() const throw ()
+  size_t written = 0;
+  while (written < data.size())
   {
-    return m_message.c_str();
+    ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      std::string reason = std::strerror(errno);
+      ::close(fd);
+      ::unlink(temp_path.c_str());
+      throw WriteFileException(path, reason);
+    }
+    written += n;
+  }
+  if (sync && ::fsync(fd) != 0)
+  {
+    std::string reason = std::strerror(errno);
+    ::close(fd);
+    ::unlink(temp_path.c_str());
+    throw WriteFileException(path, reason);
+  }
+  if (::close(fd) != 0)
+  {
+    std::string reason = std::strerror(errno);
+    ::unlink(temp_path.c_str());
+    throw WriteFileException(path, reason);
   }
 
-private:
-  std::string m_message;
-};
-
-class FileNotFoundException : public LoadFileException
-{
-public:
-  FileNotFoundException(std::filesystem::path path)
-    : LoadFileException(path, "File not found")
+  if (::rename(temp_path.c_str(), path.c_str()) != 0)
   {
+    std::string reason = std::strerror(errno);
+    ::unlink(temp_path.c_str());
+    throw WriteFileException(path, reason);
   }
-};
+}
 
-class Disk : public TileLoader, public Cache
+class Disk : public TileLoader, public Cache, public Instrumented
 {
 public:
-  struct Mutex
+  // Whether saved tiles are flushed to disk before they are moved to their final path. This is not a bool, such that
+  // arguments of the former float parameter wait_after_last_modified do not silently enable fsync.
+  enum class Sync
   {
-    std::shared_mutex mutex;
-
-    Mutex()
-    {
-    }
-
-    Mutex(const Mutex& other)
-    {
-    }
-
-    Mutex& operator=(const Mutex& other)
-    {
-      return *this;
-    }
+    NONE,
+    FSYNC
   };
 
-  Disk(std::filesystem::path path, const Layout& layout, int min_zoom, int max_zoom, float wait_after_last_modified = 1.0)
+  Disk(std::filesystem::path path, const Layout& layout, int min_zoom, int max_zoom, Sync sync = Sync::NONE, EncodeOptions encode_options = EncodeOptions())
     : TileLoader(layout)
     , Cache()
+    , Instrumented("disk")
     , m_min_zoom(min_zoom)
     , m_max_zoom(max_zoom)
-    , m_wait_after_last_modified(wait_after_last_modified)
+    , m_fsync(sync == Sync::FSYNC)
+    , m_encode_options(encode_options)
   {
     if (path.string().find("{") == std::string::npos)
     {
       path = path / "{zoom}" / "{x}" / "{y}.jpg";
     }
     m_path = path;
+    m_encode_options.validate(m_path.extension().string());
+  }
+
+  [[deprecated("Tiles are written atomically, wait_after_last_modified is ignored")]]
+  Disk(std::filesystem::path path, const Layout& layout, int min_zoom, int max_zoom, float wait_after_last_modified)
+    : Disk(path, layout, min_zoom, max_zoom, Sync::NONE)
+  {
   }
 
   int get_min_zoom() const
@@ -198,44 +363,136 @@ public:
 
   cv::Mat load(xti::vec2i tile, int zoom)
   {
-    if (zoom > m_max_zoom)
+    return load_ordered(tile, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    check_zoom(zoom);
+    m_metrics->increment("loads");
+    std::filesystem::path path = get_path(tile, zoom);
+    cv::Mat image_cv;
+    try
     {
-      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is higher than the maximum zoom level " + XTI_TO_STRING(m_max_zoom) + ".");
+      image_cv = safe_imread(path, m_metrics.get(), this->get_imread_flags());
     }
-    if (zoom < m_min_zoom)
+    catch (FileNotFoundException ex)
     {
-      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
+      m_metrics->increment("errors.not_found");
+      throw;
     }
-    std::shared_lock<std::shared_mutex> lock(m_mutex.mutex);
+    catch (ImreadException ex)
+    {
+      m_metrics->increment("errors.decode");
+      throw;
+    }
+    convert(image_cv, path, order);
+    return image_cv;
+  }
+
+  ChannelOrder get_native_channel_order() const
+  {
+    return ChannelOrder::BGR;
+  }
+
+  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    save_ordered(image, tile, zoom, ChannelOrder::RGB);
+  }
 
+  void save_ordered(const cv::Mat& image, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    check_zoom(zoom);
     std::filesystem::path path = get_path(tile, zoom);
-    if (!std::filesystem::exists(path))
+
+    m_metrics->increment("saves");
+    auto encode_timer = m_metrics->time("encode");
+    cv::Mat image_bgr = this->from_tile(image, order);
+
+    std::vector<uint8_t> buffer;
+    if (!cv::imencode(path.extension().string(), image_bgr, buffer, m_encode_options.get_params(path.extension().string())))
     {
-      throw FileNotFoundException(path);
+      m_metrics->increment("errors.encode");
+      throw WriteFileException(path, "Failed to encode image");
     }
+    encode_timer.stop();
 
-    auto last_modified_time = std::filesystem::last_write_time(path);
-    auto now_time = std::filesystem::__file_clock::now();
-    auto sleep_duration = std::chrono::duration<float>(m_wait_after_last_modified) - (now_time - last_modified_time);
-    if (sleep_duration > std::chrono::seconds(0))
+    write(path, buffer);
+  }
+
+  std::string get_encoding() const
+  {
+    return m_path.extension().string();
+  }
+
+  std::vector<uint8_t> load_encoded(xti::vec2i tile, int zoom)
+  {
+    check_zoom(zoom);
+    m_metrics->increment("loads");
+    try
+    {
+      return read_file(get_path(tile, zoom), m_metrics.get());
+    }
+    catch (FileNotFoundException ex)
     {
-      std::this_thread::sleep_for(sleep_duration);
+      m_metrics->increment("errors.not_found");
+      throw;
     }
+  }
 
-    cv::Mat image_cv = safe_imread(path);
+  void save_encoded(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    check_zoom(zoom);
+    m_metrics->increment("saves");
+    write(get_path(tile, zoom), data);
+  }
 
+  cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    std::filesystem::path path = get_path(tile, zoom);
+    cv::Mat image_cv;
     try
     {
-      this->to_tile(image_cv, true);
+      image_cv = safe_imdecode(data.data(), data.size(), path, m_metrics.get(), this->get_imread_flags());
     }
-    catch (LoadTileException ex)
+    catch (ImreadException ex)
     {
-      throw LoadFileException(path, std::string("Loaded invalid tile. ") + ex.what());
+      m_metrics->increment("errors.decode");
+      throw;
     }
+    convert(image_cv, path, ChannelOrder::RGB);
     return image_cv;
   }
 
-  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  std::filesystem::path get_path() const
+  {
+    return m_path;
+  }
+
+  const EncodeOptions& get_encode_options() const
+  {
+    return m_encode_options;
+  }
+
+  std::filesystem::path get_base_path() const
+  {
+    std::string path = m_path.string();
+    return std::filesystem::path(path.substr(0, path.find("{"))).parent_path();
+  }
+
+  // Overrides both TileLoader::make_forksafe and Cache::make_forksafe
+  virtual void make_forksafe()
+  {
+  }
+
+private:
+  std::filesystem::path m_path;
+  int m_min_zoom;
+  int m_max_zoom;
+  bool m_fsync;
+  EncodeOptions m_encode_options;
+
+  void check_zoom(int zoom) const
   {
     if (zoom > m_max_zoom)
     {
@@ -245,36 +502,34 @@ public:
     {
       throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
     }
-    std::lock_guard<std::shared_mutex> lock(m_mutex.mutex);
-
-    std::filesystem::path path = get_path(tile, zoom);
+  }
 
-    std::filesystem::path parent_path = path.parent_path();
-    if (!std::filesystem::exists(parent_path))
+  void convert(cv::Mat& image, const std::filesystem::path& path, ChannelOrder order)
+  {
+    try
     {
-      std::filesystem::create_directories(parent_path);
+      auto timer = m_metrics->time("convert");
+      this->to_tile(image, order);
     }
-
-    cv::Mat image_bgr;
-    cv::cvtColor(image, image_bgr, cv::COLOR_RGB2BGR);
-
-    if (!cv::imwrite(path.string(), image_bgr))
+    catch (LoadTileException ex)
     {
-      throw WriteFileException(path);
+      m_metrics->increment("errors.invalid_tile");
+      throw LoadFileException(path, std::string("Loaded invalid tile. ") + ex.what());
     }
   }
 
-  std::filesystem::path get_path() const
+  void write(const std::filesystem::path& path, const std::vector<uint8_t>& data)
   {
-    return m_path;
-  }
+    std::filesystem::path parent_path = path.parent_path();
+    if (!std::filesystem::exists(parent_path))
+    {
+      std::filesystem::create_directories(parent_path);
+    }
 
-private:
-  std::filesystem::path m_path;
-  int m_min_zoom;
-  int m_max_zoom;
-  float m_wait_after_last_modified;
-  Mutex m_mutex;
+    auto write_timer = m_metrics->time("write");
+    atomic_write(path, data, m_fsync);
+    m_metrics->increment("bytes_out", data.size());
+  }
 };
 
 } // end of ns tiledwebmaps
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define TILEDWEBMAPS_OPENCV_AT_LEAST(major, minor, revision) (CV_VERSION_MAJOR * 10000 + CV_VERSION_MINOR * 100 + CV_VERSION_REVISION >= (major) * 10000 + (minor) * 100 + (revision))
+
+namespace tiledwebmaps {
+
+// Parameters for encoding tiles with cv::imencode. The image format is given separately by the encoding of a cache, i.e.
+// the file extension ".jpg", ".png", ".webp", ".jxl" or ".avif". Which formats can be written and read depends on the
+// codecs that OpenCV was built with.
+struct EncodeOptions
+{
+  // Between 0 and 100, or -1 for the default of OpenCV. Ignored for png tiles.
+  int quality;
+  // Chroma subsampling of jpeg tiles, one of "444", "422", "420", or empty for the default of OpenCV
+  std::string subsampling;
+  // Whether jpeg tiles use optimized Huffman tables, which makes them smaller without loss of quality
+  bool optimize;
+  // Whether jpeg tiles are encoded progressively
+  bool progressive;
+
+  EncodeOptions(int quality = -1, std::string subsampling = "", bool optimize = false, bool progressive = false)
+    : quality(quality)
+    , subsampling(subsampling)
+    , optimize(optimize)
+    , progressive(progressive)
+  {
+    if (quality < -1 || quality > 100)
+    {
+      throw std::invalid_argument("Quality must be between 0 and 100, got " + std::to_string(quality));
+    }
+    if (!subsampling.empty() && subsampling != "444" && subsampling != "422" && subsampling != "420")
+    {
+      throw std::invalid_argument("Subsampling must be one of 444, 422, 420, got " + subsampling);
+    }
+#if !TILEDWEBMAPS_OPENCV_AT_LEAST(4, 5, 5)
+    if (!subsampling.empty())
+    {
+      throw std::invalid_argument("Chroma subsampling of jpeg tiles requires OpenCV 4.5.5 or newer");
+    }
+#endif
+  }
+
+  // Throws std::invalid_argument if the options cannot be used for the given encoding with the version of OpenCV, such
+  // that caches reject them when they are created rather than on the first save
+  void validate(const std::string& encoding) const
+  {
+    get_params(encoding);
+  }
+
+  // Returns the parameters of cv::imencode for the given encoding
+  std::vector<int> get_params(const std::string& encoding) const
+  {
+    std::vector<int> params;
+    if (encoding == ".jpg" || encoding == ".jpeg")
+    {
+      if (quality >= 0)
+      {
+        params.insert(params.end(), {cv::IMWRITE_JPEG_QUALITY, quality});
+      }
+      if (optimize)
+      {
+        params.insert(params.end(), {cv::IMWRITE_JPEG_OPTIMIZE, 1});
+      }
+      if (progressive)
+      {
+        params.insert(params.end(), {cv::IMWRITE_JPEG_PROGRESSIVE, 1});
+      }
+      if (!subsampling.empty())
+      {
+#if TILEDWEBMAPS_OPENCV_AT_LEAST(4, 5, 5)
+        int factor = subsampling == "444" ? cv::IMWRITE_JPEG_SAMPLING_FACTOR_444 : (subsampling == "422" ? cv::IMWRITE_JPEG_SAMPLING_FACTOR_422 : cv::IMWRITE_JPEG_SAMPLING_FACTOR_420);
+        params.insert(params.end(), {cv::IMWRITE_JPEG_SAMPLING_FACTOR, factor});
+#else
+        throw std::invalid_argument("Chroma subsampling of jpeg tiles requires OpenCV 4.5.5 or newer");
+#endif
+      }
+    }
+    else if (encoding == ".webp")
+    {
+      if (quality >= 0)
+      {
+        // OpenCV treats quality 100 as lossless and expects at least 1
+        params.insert(params.end(), {cv::IMWRITE_WEBP_QUALITY, std::max(quality, 1)});
+      }
+    }
+    else if (encoding == ".avif")
+    {
+      if (quality >= 0)
+      {
+#if TILEDWEBMAPS_OPENCV_AT_LEAST(4, 10, 0)
+        params.insert(params.end(), {cv::IMWRITE_AVIF_QUALITY, quality});
+#else
+        throw std::invalid_argument("Quality of avif tiles requires OpenCV 4.10 or newer");
+#endif
+      }
+    }
+    else if (encoding == ".jxl")
+    {
+      if (quality >= 0)
+      {
+#if TILEDWEBMAPS_OPENCV_AT_LEAST(4, 11, 0)
+        params.insert(params.end(), {cv::IMWRITE_JPEGXL_QUALITY, quality});
+#else
+        throw std::invalid_argument("Quality of jxl tiles requires OpenCV 4.11 or newer");
+#endif
+      }
+    }
+    return params;
+  }
+};
+
+// Returns the encoding of an encoded image from its signature, or an empty string if the format is unknown
+inline std::string detect_encoding(const uint8_t* data, size_t size)
+{
+  if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+  {
+    return ".jpg";
+  }
+  if (size >= 8 && std::memcmp(data, "\x89PNG\r\n\x1A\n", 8) == 0)
+  {
+    return ".png";
+  }
+  if (size >= 12 && std::memcmp(data, "RIFF", 4) == 0 && std::memcmp(data + 8, "WEBP", 4) == 0)
+  {
+    return ".webp";
+  }
+  if ((size >= 2 && data[0] == 0xFF && data[1] == 0x0A) || (size >= 12 && std::memcmp(data, "\x00\x00\x00\x0CJXL \x0D\x0A\x87\x0A", 12) == 0))
+  {
+    return ".jxl";
+  }
+  if (size >= 12 && std::memcmp(data + 4, "ftyp", 4) == 0 && (std::memcmp(data + 8, "avif", 4) == 0 || std::memcmp(data + 8, "avis", 4) == 0))
+  {
+    return ".avif";
+  }
+  if (size >= 4 && (std::memcmp(data, "II*\x00", 4) == 0 || std::memcmp(data, "MM\x00*", 4) == 0))
+  {
+    return ".tif";
+  }
+  return "";
+}
+
+// Returns whether OpenCV was built with an encoder for the given encoding
+inline bool can_encode(const std::string& encoding)
+{
+  return cv::haveImageWriter(encoding);
+}
+
+} // end of ns tiledwebmaps
@@ -5,15 +5,294 @@
 #include <xti/opencv.h>
 #include <opencv2/imgcodecs.hpp>
 #include <tiledwebmaps/tileloader.h>
+#include <tiledwebmaps/encoding.h>
 #include <curl_easy.h>
 #include <curl_header.h>
+#include <curl/curl.h>
+#include <cstdio>
+#include <tiledwebmaps/thread_pool.h>
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
+#include <filesystem>
+#include <functional>
+#include <vector>
 
 namespace tiledwebmaps {
 
-class Http : public TileLoader
+// Runs HTTP requests without blocking on a single background thread using the libcurl multi interface. Requests that
+// are still pending when the event loop is destroyed complete with CURLE_ABORTED_BY_CALLBACK. The state of the loop is
+// owned jointly by the event loop and its thread, such that the event loop can also be destroyed from one of its own
+// callbacks: the thread is then detached and releases the state when it finishes.
+class HttpEventLoop
+{
+public:
+  struct Request
+  {
+    std::string url;
+    std::vector<std::string> header;
+    bool verify_ssl = true;
+    std::optional<std::filesystem::path> capath;
+    std::optional<std::filesystem::path> cafile;
+    // Called on the event loop thread with the curl result, the HTTP response code, the body and an error message
+    std::function<void(CURLcode result, long response_code, std::string body, std::string error)> callback;
+  };
+
+  HttpEventLoop(size_t max_connections)
+    : m_state(std::make_shared<State>(max_connections))
+  {
+    std::shared_ptr<State> state = m_state;
+    m_thread = std::make_unique<std::thread>([state](){run(*state);});
+  }
+
+  ~HttpEventLoop()
+  {
+    if (!m_thread)
+    {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_state->mutex);
+      m_state->stop = true;
+    }
+    curl_multi_wakeup(m_state->multi);
+    if (std::this_thread::get_id() == m_thread->get_id())
+    {
+      // Destroyed from one of its own callbacks
+      m_thread->detach();
+    }
+    else
+    {
+      m_thread->join();
+    }
+  }
+
+  HttpEventLoop(const HttpEventLoop&) = delete;
+  HttpEventLoop& operator=(const HttpEventLoop&) = delete;
+
+  // Starts the request after the given delay in seconds
+  void submit(Request request, float delay = 0.0)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_state->mutex);
+      m_state->queue.emplace(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(delay)), std::move(request));
+    }
+    curl_multi_wakeup(m_state->multi);
+  }
+
+  // Must be called instead of destroying the event loop in a forked child process, in which the thread of the loop does
+  // not exist and its mutex might have been held at fork time. The thread and the state are leaked without locking,
+  // joining or cleaning them up, and the event loop can then be destroyed.
+  void abandon()
+  {
+    m_thread.release();
+    new std::shared_ptr<State>(std::move(m_state));
+  }
+
+private:
+  struct Transfer
+  {
+    Request request;
+    CURL* easy;
+    curl_slist* header;
+    std::string body;
+    char error[CURL_ERROR_SIZE];
+  };
+
+  struct State
+  {
+    State(size_t max_connections)
+      : max_connections(max_connections)
+      , stop(false)
+    {
+      multi = curl_multi_init();
+      if (multi == NULL)
+      {
+        throw std::runtime_error("Failed to create curl multi handle");
+      }
+    }
+
+    ~State()
+    {
+      curl_multi_cleanup(multi);
+    }
+
+    size_t max_connections;
+    CURLM* multi;
+    std::mutex mutex;
+    std::multimap<std::chrono::steady_clock::time_point, Request> queue;
+    bool stop;
+    std::map<CURL*, std::unique_ptr<Transfer>> transfers;
+  };
+
+  std::shared_ptr<State> m_state;
+  std::unique_ptr<std::thread> m_thread;
+
+  static size_t write_body(char* data, size_t size, size_t nmemb, void* user_data)
+  {
+    static_cast<std::string*>(user_data)->append(data, size * nmemb);
+    return size * nmemb;
+  }
+
+  static void start(State& state, Request request)
+  {
+    auto transfer = std::make_unique<Transfer>();
+    transfer->request = std::move(request);
+    transfer->easy = curl_easy_init();
+    transfer->header = NULL;
+    transfer->error[0] = 0;
+    if (transfer->easy == NULL)
+    {
+      finish(std::move(transfer), CURLE_FAILED_INIT);
+      return;
+    }
+    for (const auto& line : transfer->request.header)
+    {
+      transfer->header = curl_slist_append(transfer->header, line.c_str());
+    }
+
+    CURL* easy = transfer->easy;
+    curl_easy_setopt(easy, CURLOPT_URL, transfer->request.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->header);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &HttpEventLoop::write_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer->body);
+    curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, transfer->error);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    if (!transfer->request.verify_ssl)
+    {
+      curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+      curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+    }
+    if (transfer->request.capath)
+    {
+      curl_easy_setopt(easy, CURLOPT_CAPATH, transfer->request.capath->string().c_str());
+    }
+    else if (transfer->request.cafile)
+    {
+      curl_easy_setopt(easy, CURLOPT_CAINFO, transfer->request.cafile->string().c_str());
+    }
+
+    CURLMcode code = curl_multi_add_handle(state.multi, easy);
+    if (code != CURLM_OK)
+    {
+      std::snprintf(transfer->error, CURL_ERROR_SIZE, "%s", curl_multi_strerror(code));
+      finish(std::move(transfer), CURLE_FAILED_INIT);
+      return;
+    }
+    state.transfers[easy] = std::move(transfer);
+  }
+
+  static void finish(std::unique_ptr<Transfer> transfer, CURLcode result)
+  {
+    long response_code = 0;
+    if (transfer->easy != NULL)
+    {
+      curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &response_code);
+      curl_easy_cleanup(transfer->easy);
+    }
+    curl_slist_free_all(transfer->header);
+    std::string error = transfer->error[0] != 0 ? std::string(transfer->error) : std::string(curl_easy_strerror(result));
+    try
+    {
+      transfer->request.callback(result, response_code, std::move(transfer->body), error);
+    }
+    catch (...)
+    {
+      // Callbacks must not throw, the event loop has to keep running
+    }
+  }
+
+  // Only uses the state and no members of the event loop, which might be destroyed while the thread is running
+  static void run(State& state)
+  {
+    while (true)
+    {
+      // Start requests that are due as long as there are free connections
+      std::vector<Request> due;
+      std::optional<std::chrono::steady_clock::time_point> next_due;
+      bool stop;
+      {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        stop = state.stop;
+        auto now = std::chrono::steady_clock::now();
+        while (!stop && !state.queue.empty() && state.transfers.size() + due.size() < state.max_connections && state.queue.begin()->first <= now)
+        {
+          due.push_back(std::move(state.queue.begin()->second));
+          state.queue.erase(state.queue.begin());
+        }
+        if (!state.queue.empty())
+        {
+          next_due = state.queue.begin()->first;
+        }
+      }
+      if (stop)
+      {
+        break;
+      }
+      for (auto& request : due)
+      {
+        start(state, std::move(request));
+      }
+
+      int running;
+      curl_multi_perform(state.multi, &running);
+      int left;
+      while (CURLMsg* message = curl_multi_info_read(state.multi, &left))
+      {
+        if (message->msg == CURLMSG_DONE)
+        {
+          CURL* easy = message->easy_handle;
+          CURLcode result = message->data.result;
+          curl_multi_remove_handle(state.multi, easy);
+          auto it = state.transfers.find(easy);
+          std::unique_ptr<Transfer> transfer = std::move(it->second);
+          state.transfers.erase(it);
+          finish(std::move(transfer), result);
+        }
+      }
+
+      int timeout_ms = 1000;
+      if (next_due && state.transfers.size() < state.max_connections)
+      {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(*next_due - std::chrono::steady_clock::now()).count();
+        timeout_ms = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(timeout_ms, wait)));
+      }
+      curl_multi_poll(state.multi, NULL, 0, timeout_ms, NULL);
+    }
+
+    // Cancel all pending requests
+    for (auto& pair : state.transfers)
+    {
+      curl_multi_remove_handle(state.multi, pair.first);
+    }
+    std::map<CURL*, std::unique_ptr<Transfer>> transfers = std::move(state.transfers);
+    for (auto& pair : transfers)
+    {
+      finish(std::move(pair.second), CURLE_ABORTED_BY_CALLBACK);
+    }
+    std::multimap<std::chrono::steady_clock::time_point, Request> queue;
+    {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      queue = std::move(state.queue);
+    }
+    for (auto& pair : queue)
+    {
+      auto transfer = std::make_unique<Transfer>();
+      transfer->request = std::move(pair.second);
+      transfer->easy = NULL;
+      transfer->header = NULL;
+      transfer->error[0] = 0;
+      finish(std::move(transfer), CURLE_ABORTED_BY_CALLBACK);
+    }
+  }
+};
+
+class Http : public TileLoader, public Instrumented
 {
 public:
   struct Mutex
@@ -36,6 +315,7 @@ public:
 
   Http(std::string url, const Layout& layout, int min_zoom, int max_zoom, int retries = 10, float wait_after_error = 1.5, bool verify_ssl = true, std::optional<std::filesystem::path> capath = std::optional<std::filesystem::path>(), std::optional<std::filesystem::path> cafile = std::optional<std::filesystem::path>(), std::map<std::string, std::string> header = std::map<std::string, std::string>(), bool allow_multithreading = false)
     : TileLoader(layout)
+    , Instrumented("http")
     , m_url(url)
     , m_min_zoom(min_zoom)
     , m_max_zoom(max_zoom)
@@ -47,6 +327,7 @@ public:
     , m_header(header)
     , m_allow_multithreading(allow_multithreading)
     , m_mutex()
+    , m_event_loop_mutex()
   {
   }
 
@@ -61,6 +342,16 @@ public:
   }
 
   cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    return load_ordered(tile, zoom, ChannelOrder::RGB);
+  }
+
+  ChannelOrder get_native_channel_order() const
+  {
+    return ChannelOrder::BGR;
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
   {
     if (zoom > m_max_zoom)
     {
@@ -70,6 +361,8 @@ public:
     {
       throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
     }
+    m_metrics->increment("loads");
+    auto load_timer = m_metrics->time("load");
     auto lock = m_allow_multithreading ? std::unique_lock<std::mutex>() : std::unique_lock<std::mutex>(m_mutex.mutex);
 
     std::string url = this->get_url(tile, zoom);
@@ -79,6 +372,7 @@ public:
     {
       if (tries > 0)
       {
+        m_metrics->increment("retries");
         std::this_thread::sleep_for(std::chrono::duration<float>(m_wait_after_error));
       }
       try
@@ -116,46 +410,77 @@ public:
           request.add<CURLOPT_CAINFO>(m_cafile->string().c_str());
         }
 
-        request.perform();
-
-        // Convert data to image
-        std::string data = body_stream.str();
-        if (data.length() == 0)
-        {
-          last_ex = LoadTileException("Failed to download image from url " + url + ". Received no data.");
-          continue;
-        }
-        cv::Mat data_cv(1, data.length(), xti::opencv::pixeltype<uint8_t>::get(1), data.data());
-        if (data_cv.data == NULL)
+        m_metrics->increment("requests");
         {
-          last_ex = LoadTileException("Failed to download image from url " + url);
-          continue;
+          auto timer = m_metrics->time("fetch");
+          request.perform();
         }
-        cv::Mat image_cv = cv::imdecode(data_cv, cv::IMREAD_COLOR);
-        if (image_cv.data == NULL)
+
+        long response_code = request.get_info<CURLINFO_RESPONSE_CODE>().get();
+        m_metrics->increment("responses." + std::to_string(response_code));
+        if (response_code == 404 || response_code == 204)
         {
-          last_ex = LoadTileException("Failed to decode downloaded image from url " + url + ". Received " + XTI_TO_STRING(data.length()) + " bytes: " + data);
-          continue;
+          m_metrics->increment("errors.not_found");
+          // Tile does not exist on the server, retrying will not help
+          throw TileNotFoundException("Tile not found at url " + url + ". Received response code " + std::to_string(response_code) + ".");
         }
+
+        // Convert data to image
         try
         {
-          to_tile(image_cv, true);
+          return to_image(body_stream.str(), url, order);
         }
         catch (LoadTileException ex)
         {
-          last_ex = LoadTileException(std::string("Downloaded invalid tile. ") + ex.what());
-          continue;
+          last_ex = ex;
         }
-        return image_cv;
       }
       catch (curl::curl_easy_exception ex)
       {
+        m_metrics->increment("errors.curl");
         last_ex = LoadTileException(std::string("Failed to download image. Reason: ") + ex.what());
       }
     }
+    m_metrics->increment("failures");
     throw last_ex;
   }
 
+  // Downloads the tile on the event loop of this tileloader and decodes it on the shared thread pool. Retries are
+  // scheduled on the event loop instead of blocking a thread.
+  void load_ordered_async(xti::vec2i tile, int zoom, ChannelOrder order, LoadCallback callback)
+  {
+    auto state = std::make_shared<AsyncLoad>();
+    try
+    {
+      state->url = this->get_url(tile, zoom);
+    }
+    catch (...)
+    {
+      callback(cv::Mat(), std::current_exception());
+      return;
+    }
+    state->order = order;
+    state->tries = 0;
+    state->callback = callback;
+    state->start = std::chrono::steady_clock::now();
+    m_metrics->increment("loads");
+    submit_async(state, 0.0);
+  }
+
+  // Must be called in forked child processes (e.g. in the worker_init_fn of a DataLoader). The event loop of the parent
+  // is abandoned without stopping it, since its thread does not exist in the child, and a new event loop is started on
+  // the next asynchronous load. Mutexes that might have been held at fork time are reinitialized.
+  virtual void make_forksafe()
+  {
+    new (&m_mutex.mutex) std::mutex();
+    new (&m_event_loop_mutex.mutex) std::mutex();
+    if (m_event_loop)
+    {
+      m_event_loop->abandon();
+      m_event_loop = nullptr;
+    }
+  }
+
   std::string get_url(xti::vec2i tile, int zoom) const
   {
     if (zoom > m_max_zoom)
@@ -170,6 +495,136 @@ public:
   }
 
 private:
+  struct AsyncLoad
+  {
+    std::string url;
+    ChannelOrder order;
+    int tries;
+    LoadTileException last_ex;
+    LoadCallback callback;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  // Maximum number of concurrent connections of asynchronous loads, if allow_multithreading is true
+  static constexpr size_t MAX_ASYNC_CONNECTIONS = 16;
+
+  cv::Mat to_image(std::string data, const std::string& url, ChannelOrder order = ChannelOrder::RGB)
+  {
+    m_metrics->increment("bytes_in", data.length());
+    if (data.length() == 0)
+    {
+      m_metrics->increment("errors.empty");
+      throw LoadTileException("Failed to download image from url " + url + ". Received no data.");
+    }
+    cv::Mat data_cv(1, data.length(), xti::opencv::pixeltype<uint8_t>::get(1), data.data());
+    if (data_cv.data == NULL)
+    {
+      throw LoadTileException("Failed to download image from url " + url);
+    }
+    auto decode_timer = m_metrics->time("decode");
+    cv::Mat image_cv = cv::imdecode(data_cv, this->get_imread_flags());
+    decode_timer.stop();
+    if (image_cv.data == NULL)
+    {
+      m_metrics->increment("errors.decode");
+      std::string encoding = detect_encoding((const uint8_t*) data.data(), data.length());
+      if (!encoding.empty() && encoding != ".jpg" && encoding != ".png")
+      {
+        throw LoadTileException("Failed to decode downloaded " + encoding + " image from url " + url + ". OpenCV might have been built without support for this format");
+      }
+      throw LoadTileException("Failed to decode downloaded image from url " + url + ". Received " + XTI_TO_STRING(data.length()) + " bytes: " + data);
+    }
+    try
+    {
+      auto timer = m_metrics->time("convert");
+      to_tile(image_cv, order);
+    }
+    catch (LoadTileException ex)
+    {
+      m_metrics->increment("errors.invalid_tile");
+      throw LoadTileException(std::string("Downloaded invalid tile. ") + ex.what());
+    }
+    return image_cv;
+  }
+
+  std::shared_ptr<HttpEventLoop> get_event_loop()
+  {
+    std::lock_guard<std::mutex> lock(m_event_loop_mutex.mutex);
+    if (!m_event_loop)
+    {
+      m_event_loop = std::make_shared<HttpEventLoop>(m_allow_multithreading ? MAX_ASYNC_CONNECTIONS : 1);
+    }
+    return m_event_loop;
+  }
+
+  void submit_async(std::shared_ptr<AsyncLoad> state, float delay)
+  {
+    HttpEventLoop::Request request;
+    request.url = state->url;
+    for (const auto& pair : m_header)
+    {
+      request.header.push_back(pair.first + ": " + pair.second);
+    }
+    request.verify_ssl = m_verify_ssl;
+    request.capath = m_capath;
+    request.cafile = m_cafile;
+    request.callback = [this, state](CURLcode result, long response_code, std::string body, std::string error){
+      if (result == CURLE_ABORTED_BY_CALLBACK)
+      {
+        // The event loop was stopped, the tileloader might already be destroyed
+        state->callback(cv::Mat(), std::make_exception_ptr(LoadTileException("Download of url " + state->url + " was cancelled.")));
+        return;
+      }
+      m_metrics->increment("requests");
+      if (result != CURLE_OK)
+      {
+        m_metrics->increment("errors.curl");
+        state->last_ex = LoadTileException("Failed to download image. Reason: " + error);
+        retry_async(state);
+        return;
+      }
+      m_metrics->increment("responses." + std::to_string(response_code));
+      if (response_code == 404 || response_code == 204)
+      {
+        m_metrics->increment("errors.not_found");
+        state->callback(cv::Mat(), std::make_exception_ptr(TileNotFoundException("Tile not found at url " + state->url + ". Received response code " + std::to_string(response_code) + ".")));
+        return;
+      }
+
+      ThreadPool::get_default().post([this, state, body = std::move(body)](){
+        cv::Mat image;
+        try
+        {
+          image = to_image(body, state->url, state->order);
+        }
+        catch (LoadTileException ex)
+        {
+          state->last_ex = ex;
+          retry_async(state);
+          return;
+        }
+        m_metrics->record("load", state->start, std::chrono::steady_clock::now());
+        state->callback(image, nullptr);
+      });
+    };
+    get_event_loop()->submit(std::move(request), delay);
+  }
+
+  void retry_async(std::shared_ptr<AsyncLoad> state)
+  {
+    state->tries++;
+    if (state->tries < m_retries)
+    {
+      m_metrics->increment("retries");
+      submit_async(state, m_wait_after_error);
+    }
+    else
+    {
+      m_metrics->increment("failures");
+      state->callback(cv::Mat(), std::make_exception_ptr(state->last_ex));
+    }
+  }
+
   std::string m_url;
   int m_min_zoom;
   int m_max_zoom;
@@ -181,6 +636,8 @@ private:
   std::map<std::string, std::string> m_header;
   bool m_allow_multithreading;
   Mutex m_mutex;
+  Mutex m_event_loop_mutex;
+  std::shared_ptr<HttpEventLoop> m_event_loop;
 };
 
 } // end of ns tiledwebmaps
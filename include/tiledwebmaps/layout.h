@@ -7,6 +7,7 @@
 #include <xtensor/xmath.hpp>
 #include <xtensor/xindex_view.hpp>
 #include <utility>
+#include <array>
 
 namespace tiledwebmaps {
 
@@ -70,21 +71,22 @@ public:
     tiledwebmaps::NamedAxesTransformation<double, 2> crs_to_tile_axes(crs->get_axes(), m_tile_axes);
     tiledwebmaps::NamedAxesTransformation<double, 2> tile_to_pixel_axes(m_tile_axes, pixel_axes);
 
-    m_tile_to_crs = tiledwebmaps::ScaledRigid<double, 2>(
-      crs_to_tile_axes.inverse().get_rotation(),
-      m_origin_crs,
-      1.0
-    );
+    m_tile_to_crs = tiledwebmaps::Affine2<double>(crs_to_tile_axes.inverse());
+    m_tile_to_crs.t0 = m_origin_crs(0);
+    m_tile_to_crs.t1 = m_origin_crs(1);
     if (xt::any(crs_to_tile_axes.get_rotation() < 0))
     {
-      m_tile_to_crs.get_translation() += xt::maximum(-crs_to_tile_axes.transform(size_crs.value()), 0.0);
+      xti::vec2d offset = xt::maximum(-crs_to_tile_axes.transform(size_crs.value()), 0.0);
+      m_tile_to_crs.t0 += offset(0);
+      m_tile_to_crs.t1 += offset(1);
     }
 
-    m_tile_to_pixel = tiledwebmaps::ScaledRigid<double, 2>(
-      tile_to_pixel_axes.get_rotation(),
-      xti::vec2d({0.0, 0.0}),// xt::maximum(-(scale * tile_to_pixel_axes.transform(xt::abs(crs_to_tile_axes.transform(m_size_crs))) - 1), 0.0),
-      tile_shape_px(0)
-    );
+    m_tile_to_pixel = tiledwebmaps::Affine2<double>(tile_to_pixel_axes) * tiledwebmaps::Affine2<double>::scale(tile_shape_px(0));
+
+    for (int zoom = MIN_CACHED_ZOOM; zoom <= MAX_CACHED_ZOOM; zoom++)
+    {
+      m_zoom_transforms[zoom - MIN_CACHED_ZOOM] = make_zoom_transforms(zoom_to_scale(zoom));
+    }
   }
 
   const std::shared_ptr<tiledwebmaps::proj::Transformer>& get_epsg4326_to_crs() const
@@ -102,66 +104,102 @@ public:
     return m_epsg4326_to_crs->transform_inverse(coords_crs);
   }
 
+  tiledwebmaps::Point2<double> crs_to_tile(tiledwebmaps::Point2<double> coords_crs, double scale) const
+  {
+    return tile_to_crs_affine(scale).transform_inverse(coords_crs);
+  }
+
+  tiledwebmaps::Point2<double> crs_to_tile(tiledwebmaps::Point2<double> coords_crs, int zoom) const
+  {
+    return get_zoom_transforms(zoom).crs_to_tile.transform(coords_crs);
+  }
+
   xti::vec2d crs_to_tile(xti::vec2d coords_crs, double scale) const
   {
-    return tile_to_crs(scale).transform_inverse(coords_crs);
+    return crs_to_tile(tiledwebmaps::Point2<double>(coords_crs), scale).to_xti();
   }
- 
+
   xti::vec2d crs_to_tile(xti::vec2d coords_crs, int zoom) const
   {
-    double scale = (double) std::pow(2.0, zoom) / m_tile_shape_crs(0);
-    return crs_to_tile(coords_crs, scale);
+    return crs_to_tile(tiledwebmaps::Point2<double>(coords_crs), zoom).to_xti();
   }
 
   tiledwebmaps::ScaledRigid<double, 2> tile_to_crs(double scale) const
   {
     return tiledwebmaps::ScaledRigid<double, 2>(
-      m_tile_to_crs.get_rotation(),
-      m_tile_to_crs.get_translation(),
+      m_crs_to_tile_axes.inverse().get_rotation(),
+      xti::vec2d({m_tile_to_crs.t0, m_tile_to_crs.t1}),
       1.0 / scale
     );
   }
 
+  tiledwebmaps::Point2<double> tile_to_crs(tiledwebmaps::Point2<double> coords_tile, double scale) const
+  {
+    return tile_to_crs_affine(scale).transform(coords_tile);
+  }
+
+  tiledwebmaps::Point2<double> tile_to_crs(tiledwebmaps::Point2<double> coords_tile, int zoom) const
+  {
+    return get_zoom_transforms(zoom).tile_to_crs.transform(coords_tile);
+  }
+
   xti::vec2d tile_to_crs(xti::vec2d coords_tile, double scale) const
   {
-    return tile_to_crs(scale).transform(coords_tile);
+    return tile_to_crs(tiledwebmaps::Point2<double>(coords_tile), scale).to_xti();
   }
 
   xti::vec2d tile_to_crs(xti::vec2d coords_tile, int zoom) const
   {
-    double scale = (double) std::pow(2.0, zoom) / m_tile_shape_crs(0);
-    return tile_to_crs(coords_tile, scale);
+    return tile_to_crs(tiledwebmaps::Point2<double>(coords_tile), zoom).to_xti();
   }
 
   tiledwebmaps::ScaledRigid<double, 2> tile_to_pixel(double scale) const
   {
     return tiledwebmaps::ScaledRigid<double, 2>(
-      m_tile_to_pixel.get_rotation(),
-      m_tile_to_pixel.get_translation(), // xt::maximum(-(scale * m_tile_to_pixel_axes.transform(xt::abs(m_crs_to_tile_axes.transform(m_size_crs))) - 1), 0.0),
+      m_tile_to_pixel_axes.get_rotation(),
+      xti::vec2d({m_tile_to_pixel.t0, m_tile_to_pixel.t1}), // xt::maximum(-(scale * m_tile_to_pixel_axes.transform(xt::abs(m_crs_to_tile_axes.transform(m_size_crs))) - 1), 0.0),
       m_tile_shape_px(0)
     );
   }
 
+  tiledwebmaps::Point2<double> tile_to_pixel(tiledwebmaps::Point2<double> coords_tile, double scale) const
+  {
+    return m_tile_to_pixel.transform(coords_tile);
+  }
+
+  tiledwebmaps::Point2<double> tile_to_pixel(tiledwebmaps::Point2<double> coords_tile, int zoom) const
+  {
+    return tile_to_pixel(coords_tile, zoom_to_scale(zoom));
+  }
+
   xti::vec2d tile_to_pixel(xti::vec2d coords_tile, double scale) const
   {
-    return tile_to_pixel(scale).transform(coords_tile);
+    return tile_to_pixel(tiledwebmaps::Point2<double>(coords_tile), scale).to_xti();
   }
 
   xti::vec2d tile_to_pixel(xti::vec2d coords_tile, int zoom) const
   {
-    double scale = (double) std::pow(2.0, zoom) / m_tile_shape_crs(0);
-    return tile_to_pixel(coords_tile, scale);
+    return tile_to_pixel(coords_tile, zoom_to_scale(zoom));
+  }
+
+  tiledwebmaps::Point2<double> pixel_to_tile(tiledwebmaps::Point2<double> coords_pixel, double scale) const
+  {
+    return m_tile_to_pixel.transform_inverse(coords_pixel);
+  }
+
+  tiledwebmaps::Point2<double> pixel_to_tile(tiledwebmaps::Point2<double> coords_pixel, int zoom) const
+  {
+    return pixel_to_tile(coords_pixel, zoom_to_scale(zoom));
   }
 
   xti::vec2d pixel_to_tile(xti::vec2d coords_pixel, double scale) const
   {
-    return tile_to_pixel(scale).transform_inverse(coords_pixel);
+    return pixel_to_tile(tiledwebmaps::Point2<double>(coords_pixel), scale).to_xti();
   }
 
   xti::vec2d pixel_to_tile(xti::vec2d coords_pixel, int zoom) const
   {
-    double scale = (double) std::pow(2.0, zoom) / m_tile_shape_crs(0);
-    return pixel_to_tile(coords_pixel, scale);
+    return pixel_to_tile(coords_pixel, zoom_to_scale(zoom));
   }
 
   template <typename T>
@@ -176,6 +214,26 @@ public:
     return crs_to_epsg4326(tile_to_crs(coords_tile, zoom_or_scale));
   }
 
+  tiledwebmaps::Point2<double> crs_to_pixel(tiledwebmaps::Point2<double> coords_crs, int zoom) const
+  {
+    return get_zoom_transforms(zoom).crs_to_pixel.transform(coords_crs);
+  }
+
+  tiledwebmaps::Point2<double> pixel_to_crs(tiledwebmaps::Point2<double> coords_pixel, int zoom) const
+  {
+    return get_zoom_transforms(zoom).pixel_to_crs.transform(coords_pixel);
+  }
+
+  xti::vec2d epsg4326_to_pixel(xti::vec2d coords_epsg4326, int zoom) const
+  {
+    return crs_to_pixel(tiledwebmaps::Point2<double>(epsg4326_to_crs(coords_epsg4326)), zoom).to_xti();
+  }
+
+  xti::vec2d pixel_to_epsg4326(xti::vec2d coords_pixel, int zoom) const
+  {
+    return crs_to_epsg4326(pixel_to_crs(tiledwebmaps::Point2<double>(coords_pixel), zoom).to_xti());
+  }
+
   template <typename T>
   xti::vec2d epsg4326_to_pixel(xti::vec2d coords_epsg4326, T zoom_or_scale) const
   {
@@ -261,8 +319,55 @@ private:
   tiledwebmaps::NamedAxesTransformation<double, 2> m_crs_to_tile_axes;
   tiledwebmaps::NamedAxesTransformation<double, 2> m_tile_to_pixel_axes;
 
-  tiledwebmaps::ScaledRigid<double, 2> m_tile_to_crs;
-  tiledwebmaps::ScaledRigid<double, 2> m_tile_to_pixel;
+  tiledwebmaps::Affine2<double> m_tile_to_crs;
+  tiledwebmaps::Affine2<double> m_tile_to_pixel;
+
+  // Fully composed transforms for the zoom levels MIN_CACHED_ZOOM..MAX_CACHED_ZOOM, such that per-point conversions do not
+  // have to recompute the scale of the zoom level or compose transforms. Negative zoom levels are used by layouts whose
+  // highest resolution is at zoom 0 (see util.add_zooms).
+  static const int MIN_CACHED_ZOOM = -20;
+  static const int MAX_CACHED_ZOOM = 30;
+
+  struct ZoomTransforms
+  {
+    tiledwebmaps::Affine2<double> tile_to_crs;
+    tiledwebmaps::Affine2<double> crs_to_tile;
+    tiledwebmaps::Affine2<double> crs_to_pixel;
+    tiledwebmaps::Affine2<double> pixel_to_crs;
+  };
+  std::array<ZoomTransforms, MAX_CACHED_ZOOM - MIN_CACHED_ZOOM + 1> m_zoom_transforms;
+
+  double zoom_to_scale(int zoom) const
+  {
+    return std::pow(2.0, zoom) / m_tile_shape_crs(0);
+  }
+
+  tiledwebmaps::Affine2<double> tile_to_crs_affine(double scale) const
+  {
+    return m_tile_to_crs * tiledwebmaps::Affine2<double>::scale(1.0 / scale);
+  }
+
+  ZoomTransforms make_zoom_transforms(double scale) const
+  {
+    ZoomTransforms result;
+    result.tile_to_crs = tile_to_crs_affine(scale);
+    result.crs_to_tile = result.tile_to_crs.inverse();
+    result.crs_to_pixel = m_tile_to_pixel * result.crs_to_tile;
+    result.pixel_to_crs = result.crs_to_pixel.inverse();
+    return result;
+  }
+
+  ZoomTransforms get_zoom_transforms(int zoom) const
+  {
+    if (zoom >= MIN_CACHED_ZOOM && zoom <= MAX_CACHED_ZOOM)
+    {
+      return m_zoom_transforms[zoom - MIN_CACHED_ZOOM];
+    }
+    else
+    {
+      return make_zoom_transforms(zoom_to_scale(zoom));
+    }
+  }
 };
 
 } // end of ns tiledwebmaps
@@ -13,19 +13,21 @@
 
 namespace tiledwebmaps {
 
-class LRU : public Cache
+class LRU : public Cache, public Instrumented
 {
 public:
   using Key = std::tuple<int, int, int>; // tile-x, tile-y, zoom
 
   LRU(int size)
     : Cache()
+    , Instrumented("lru")
     , m_size(size)
   {
   }
 
   bool contains(xti::vec2i tile, int zoom) const
   {
+    std::lock_guard<std::mutex> guard(m_mutex);
     return m_key_to_tile.count(Key(tile(0), tile(1), zoom)) > 0;
   }
 
@@ -37,8 +39,10 @@ public:
     auto key_it = std::find(m_keys.begin(), m_keys.end(), key);
     if (key_it == m_keys.end())
     {
+      m_metrics->increment("misses");
       throw CacheFailure();
     }
+    m_metrics->increment("hits");
     m_keys.erase(key_it);
     m_keys.push_back(key);
     return m_key_to_tile[key].clone();
@@ -46,33 +50,58 @@ public:
 
   void save(const cv::Mat& image, xti::vec2i tile, int zoom)
   {
-    std::lock_guard<std::mutex> guard(m_mutex);
-
-    Key key(tile(0), tile(1), zoom);
-    auto key_it = std::find(m_keys.begin(), m_keys.end(), key);
-    if (key_it != m_keys.end())
-    {
-      m_keys.erase(key_it);
-    }
-    m_keys.push_back(key);
-    m_key_to_tile[key] = image.clone();
-    if (m_keys.size() > m_size)
+    Key evicted_key;
+    cv::Mat evicted_image;
+    EvictionCallback eviction_callback;
     {
-      m_key_to_tile.erase(m_key_to_tile.find(m_keys.front()));
-      m_keys.pop_front();
+      std::lock_guard<std::mutex> guard(m_mutex);
+
+      Key key(tile(0), tile(1), zoom);
+      auto key_it = std::find(m_keys.begin(), m_keys.end(), key);
+      if (key_it != m_keys.end())
+      {
+        m_keys.erase(key_it);
+      }
+      m_keys.push_back(key);
+      m_key_to_tile[key] = image.clone();
+      m_metrics->increment("saves");
+      if (m_keys.size() > m_size)
+      {
+        m_metrics->increment("evictions");
+        auto evicted_it = m_key_to_tile.find(m_keys.front());
+        evicted_key = evicted_it->first;
+        evicted_image = evicted_it->second;
+        eviction_callback = m_eviction_callback;
+        m_key_to_tile.erase(evicted_it);
+        m_keys.pop_front();
+      }
+      if (m_keys.size() > m_size || m_key_to_tile.size() > m_size)
+      {
+        std::cout << "Assertion failure in tiledwebmaps::LRU" << std::endl;
+        exit(-1);
+      }
     }
-    if (m_keys.size() > m_size || m_key_to_tile.size() > m_size)
+
+    // Called without holding the lock, since the callback might write the tile to a slower cache
+    if (eviction_callback && evicted_image.data != NULL)
     {
-      std::cout << "Assertion failure in tiledwebmaps::LRU" << std::endl;
-      exit(-1);
+      eviction_callback(evicted_image, xti::vec2i({std::get<0>(evicted_key), std::get<1>(evicted_key)}), std::get<2>(evicted_key));
     }
   }
 
+  bool set_eviction_callback(EvictionCallback callback)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_eviction_callback = callback;
+    return true;
+  }
+
 private:
   int m_size;
   std::map<Key, cv::Mat> m_key_to_tile;
   std::list<Key> m_keys;
-  std::mutex m_mutex;
+  mutable std::mutex m_mutex;
+  EvictionCallback m_eviction_callback;
 };
 
 } // end of ns tiledwebmaps
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/tileloader.h>
+#include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/disk.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <sqlite3.h>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <unistd.h>
+
+namespace tiledwebmaps {
+
+// Stores encoded tiles in a single MBTiles file, i.e. an SQLite database with a "tiles" table. The database is opened
+// in WAL mode, such that readers are not blocked by writers. Connections with their prepared statements are taken from
+// a pool, which keeps at most one idle connection per hardware thread open. Saved tiles are buffered and inserted in a
+// single transaction once batch_size tiles are pending or, on the next save or load, the oldest pending tile is older
+// than max_delay seconds. Pending tiles are visible to this object, and to other processes after flush().
+//
+// If read_only is true, the database must exist and is neither created nor modified, and saving tiles fails.
+//
+// MBTiles uses the TMS tile scheme, where the y coordinate points north. If flip_y is true, y coordinates of the layout
+// are flipped when accessing the database, which is correct for Layout::XYZ.
+class MBTiles : public TileLoader, public Cache, public Instrumented
+{
+public:
+  MBTiles(std::filesystem::path path, const Layout& layout, int min_zoom, int max_zoom, std::string encoding = ".jpg", bool flip_y = true, size_t batch_size = 64, float max_delay = 1.0, bool read_only = false)
+    : TileLoader(layout)
+    , Cache()
+    , Instrumented("mbtiles")
+    , m_path(path)
+    , m_min_zoom(min_zoom)
+    , m_max_zoom(max_zoom)
+    , m_encoding(encoding)
+    , m_flip_y(flip_y)
+    , m_read_only(read_only)
+    , m_max_idle_connections(std::max<size_t>(std::thread::hardware_concurrency(), 1))
+    , m_batch_size(std::max<size_t>(batch_size, 1))
+    , m_max_delay(static_cast<int64_t>(max_delay * 1e6))
+  {
+    if (m_read_only)
+    {
+      // Fails if the database or its tiles table does not exist
+      std::unique_ptr<Connection> connection = open_connection();
+      prepare_statements(*connection);
+      release_connection(std::move(connection));
+      return;
+    }
+    if (m_path.has_parent_path())
+    {
+      std::filesystem::create_directories(m_path.parent_path());
+    }
+    std::unique_ptr<Connection> connection = open_connection();
+    exec(*connection, "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT)");
+    exec(*connection, "CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)");
+    exec(*connection, "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row)");
+
+    sqlite3_stmt* statement;
+    if (sqlite3_prepare_v2(connection->db, "INSERT INTO metadata (name, value) SELECT 'format', ? WHERE NOT EXISTS (SELECT 1 FROM metadata WHERE name = 'format')", -1, &statement, NULL) != SQLITE_OK)
+    {
+      throw WriteFileException(m_path, sqlite3_errmsg(connection->db));
+    }
+    std::string format = m_encoding.substr(m_encoding.find_first_not_of('.'));
+    sqlite3_bind_text(statement, 1, format.c_str(), -1, SQLITE_TRANSIENT);
+    int result = sqlite3_step(statement);
+    sqlite3_finalize(statement);
+    if (result != SQLITE_DONE)
+    {
+      throw WriteFileException(m_path, sqlite3_errmsg(connection->db));
+    }
+    prepare_statements(*connection);
+    release_connection(std::move(connection));
+  }
+
+  MBTiles(const MBTiles&) = delete;
+  MBTiles& operator=(const MBTiles&) = delete;
+
+  virtual ~MBTiles()
+  {
+    try
+    {
+      flush();
+    }
+    catch (...)
+    {
+    }
+  }
+
+  int get_min_zoom() const
+  {
+    return m_min_zoom;
+  }
+
+  int get_max_zoom() const
+  {
+    return m_max_zoom;
+  }
+
+  // SQLite connections must not be used in forked processes. They are abandoned without closing them, since closing
+  // would release file locks that are still held by the parent process. The lock of the pool might have been held by
+  // another thread of the parent at fork time and is reinitialized.
+  virtual void make_forksafe()
+  {
+    new (&m_connections_mutex) std::mutex();
+    m_connections.clear();
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    if (zoom < m_min_zoom || zoom > m_max_zoom)
+    {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_pending_mutex);
+      if (m_pending.count(Key(tile(0), tile(1), zoom)) > 0)
+      {
+        return true;
+      }
+    }
+    try
+    {
+      PooledConnection connection = get_connection();
+      Statement statement(connection->exists);
+      bind_tile(statement.get(), tile, zoom);
+      int result = sqlite3_step(statement.get());
+      if (result != SQLITE_ROW && result != SQLITE_DONE)
+      {
+        throw LoadFileException(m_path, sqlite3_errmsg(connection->db));
+      }
+      return result == SQLITE_ROW;
+    }
+    catch (LoadFileException ex)
+    {
+      // Database errors such as a busy or locked database are reported as missing, loading the tile reports the error
+      m_metrics->increment("errors.contains");
+      return false;
+    }
+  }
+
+  cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    return load_ordered(tile, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    std::vector<uint8_t> data = load_encoded(tile, zoom);
+    return decode(data, tile, zoom, order);
+  }
+
+  ChannelOrder get_native_channel_order() const
+  {
+    return ChannelOrder::BGR;
+  }
+
+  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    save_ordered(image, tile, zoom, ChannelOrder::RGB);
+  }
+
+  void save_ordered(const cv::Mat& image, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    check_zoom(zoom);
+    auto encode_timer = m_metrics->time("encode");
+    cv::Mat image_bgr = this->from_tile(image, order);
+    std::vector<uint8_t> data;
+    if (!cv::imencode(m_encoding, image_bgr, data))
+    {
+      m_metrics->increment("errors.encode");
+      throw WriteFileException(m_path, "Failed to encode image");
+    }
+    encode_timer.stop();
+
+    save_encoded(data, tile, zoom);
+  }
+
+  std::string get_encoding() const
+  {
+    return m_encoding;
+  }
+
+  std::vector<uint8_t> load_encoded(xti::vec2i tile, int zoom)
+  {
+    check_zoom(zoom);
+    m_metrics->increment("loads");
+    if (is_flush_due())
+    {
+      try
+      {
+        flush();
+      }
+      catch (...)
+      {
+        // Pending tiles are inserted again on the next flush, which reports the error to the caller that saves tiles
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_pending_mutex);
+      auto it = m_pending.find(Key(tile(0), tile(1), zoom));
+      if (it != m_pending.end())
+      {
+        m_metrics->increment("pending_hits");
+        return *it->second;
+      }
+    }
+
+    auto timer = m_metrics->time("read");
+    PooledConnection connection = get_connection();
+    Statement statement(connection->select);
+    bind_tile(statement.get(), tile, zoom);
+    int result = sqlite3_step(statement.get());
+    if (result == SQLITE_DONE)
+    {
+      m_metrics->increment("errors.not_found");
+      throw TileNotFoundException("Tile " + XTI_TO_STRING(tile) + " at zoom level " + std::to_string(zoom) + " not found in " + m_path.string());
+    }
+    else if (result != SQLITE_ROW)
+    {
+      throw LoadFileException(m_path, sqlite3_errmsg(connection->db));
+    }
+    const uint8_t* blob = (const uint8_t*) sqlite3_column_blob(statement.get(), 0);
+    int size = sqlite3_column_bytes(statement.get(), 0);
+    m_metrics->increment("bytes_in", size);
+    return std::vector<uint8_t>(blob, blob + size);
+  }
+
+  void save_encoded(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    check_zoom(zoom);
+    if (m_read_only)
+    {
+      throw WriteFileException(m_path, "MBTiles is opened read-only");
+    }
+    m_metrics->increment("saves");
+    bool flush_now;
+    {
+      std::lock_guard<std::mutex> lock(m_pending_mutex);
+      if (m_pending.empty())
+      {
+        m_oldest_pending = std::chrono::steady_clock::now();
+      }
+      m_pending[Key(tile(0), tile(1), zoom)] = std::make_shared<std::vector<uint8_t>>(data);
+      flush_now = m_pending.size() >= m_batch_size;
+    }
+    if (flush_now || is_flush_due())
+    {
+      flush();
+    }
+  }
+
+  cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    return decode(data, tile, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    cv::Mat image;
+    try
+    {
+      image = safe_imdecode(data.data(), data.size(), m_path.string() + m_encoding, m_metrics.get(), this->get_imread_flags());
+    }
+    catch (ImreadException ex)
+    {
+      m_metrics->increment("errors.decode");
+      throw;
+    }
+
+    try
+    {
+      auto timer = m_metrics->time("convert");
+      this->to_tile(image, order);
+    }
+    catch (LoadTileException ex)
+    {
+      m_metrics->increment("errors.invalid_tile");
+      throw LoadFileException(m_path, std::string("Loaded invalid tile. ") + ex.what());
+    }
+    return image;
+  }
+
+  // Inserts all pending tiles in a single transaction
+  void flush()
+  {
+    std::vector<std::pair<Key, std::shared_ptr<std::vector<uint8_t>>>> batch;
+    {
+      std::lock_guard<std::mutex> lock(m_pending_mutex);
+      batch.assign(m_pending.begin(), m_pending.end());
+    }
+    if (batch.empty())
+    {
+      return;
+    }
+
+    auto timer = m_metrics->time("flush");
+    PooledConnection connection = get_connection();
+    exec(*connection, "BEGIN IMMEDIATE");
+    try
+    {
+      for (const auto& pair : batch)
+      {
+        Statement statement(connection->insert);
+        bind_tile(statement.get(), xti::vec2i({std::get<0>(pair.first), std::get<1>(pair.first)}), std::get<2>(pair.first));
+        sqlite3_bind_blob(statement.get(), 4, pair.second->data(), pair.second->size(), SQLITE_STATIC);
+        if (sqlite3_step(statement.get()) != SQLITE_DONE)
+        {
+          throw WriteFileException(m_path, sqlite3_errmsg(connection->db));
+        }
+        m_metrics->increment("bytes_out", pair.second->size());
+      }
+      exec(*connection, "COMMIT");
+    }
+    catch (...)
+    {
+      sqlite3_exec(connection->db, "ROLLBACK", NULL, NULL, NULL);
+      m_metrics->increment("errors.flush");
+      throw;
+    }
+    m_metrics->increment("transactions");
+
+    // Tiles that were saved again during the transaction stay pending
+    std::lock_guard<std::mutex> lock(m_pending_mutex);
+    for (const auto& pair : batch)
+    {
+      auto it = m_pending.find(pair.first);
+      if (it != m_pending.end() && it->second == pair.second)
+      {
+        m_pending.erase(it);
+      }
+    }
+    m_oldest_pending = std::chrono::steady_clock::now();
+  }
+
+  std::filesystem::path get_path() const
+  {
+    return m_path;
+  }
+
+  bool is_read_only() const
+  {
+    return m_read_only;
+  }
+
+private:
+  using Key = std::tuple<int, int, int>; // tile-x, tile-y, zoom
+
+  struct Connection
+  {
+    sqlite3* db;
+    sqlite3_stmt* select;
+    sqlite3_stmt* exists;
+    sqlite3_stmt* insert;
+    pid_t pid;
+
+    Connection()
+      : db(NULL)
+      , select(NULL)
+      , exists(NULL)
+      , insert(NULL)
+      , pid(::getpid())
+    {
+    }
+
+    ~Connection()
+    {
+      if (pid == ::getpid())
+      {
+        sqlite3_finalize(select);
+        sqlite3_finalize(exists);
+        sqlite3_finalize(insert);
+        sqlite3_close(db);
+      }
+    }
+  };
+
+  // Returns the connection to the pool when going out of scope
+  class PooledConnection
+  {
+  public:
+    PooledConnection(const MBTiles& mbtiles, std::unique_ptr<Connection> connection)
+      : m_mbtiles(mbtiles)
+      , m_connection(std::move(connection))
+    {
+    }
+
+    ~PooledConnection()
+    {
+      m_mbtiles.release_connection(std::move(m_connection));
+    }
+
+    PooledConnection(const PooledConnection&) = delete;
+    PooledConnection& operator=(const PooledConnection&) = delete;
+
+    Connection& operator*() const
+    {
+      return *m_connection;
+    }
+
+    Connection* operator->() const
+    {
+      return m_connection.get();
+    }
+
+  private:
+    const MBTiles& m_mbtiles;
+    std::unique_ptr<Connection> m_connection;
+  };
+
+  // Resets the prepared statement when going out of scope
+  class Statement
+  {
+  public:
+    Statement(sqlite3_stmt* statement)
+      : m_statement(statement)
+    {
+    }
+
+    ~Statement()
+    {
+      sqlite3_reset(m_statement);
+      sqlite3_clear_bindings(m_statement);
+    }
+
+    sqlite3_stmt* get() const
+    {
+      return m_statement;
+    }
+
+  private:
+    sqlite3_stmt* m_statement;
+  };
+
+  std::filesystem::path m_path;
+  int m_min_zoom;
+  int m_max_zoom;
+  std::string m_encoding;
+  bool m_flip_y;
+  bool m_read_only;
+
+  // Idle connections
+  size_t m_max_idle_connections;
+  mutable std::mutex m_connections_mutex;
+  mutable std::vector<std::unique_ptr<Connection>> m_connections;
+
+  size_t m_batch_size;
+  std::chrono::microseconds m_max_delay;
+  mutable std::mutex m_pending_mutex;
+  std::map<Key, std::shared_ptr<std::vector<uint8_t>>> m_pending;
+  std::chrono::steady_clock::time_point m_oldest_pending;
+
+  bool is_flush_due() const
+  {
+    std::lock_guard<std::mutex> lock(m_pending_mutex);
+    return !m_pending.empty() && std::chrono::steady_clock::now() - m_oldest_pending >= m_max_delay;
+  }
+
+  void check_zoom(int zoom) const
+  {
+    if (zoom > m_max_zoom)
+    {
+      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is higher than the maximum zoom level " + XTI_TO_STRING(m_max_zoom) + ".");
+    }
+    if (zoom < m_min_zoom)
+    {
+      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
+    }
+  }
+
+  void bind_tile(sqlite3_stmt* statement, xti::vec2i tile, int zoom) const
+  {
+    int64_t row = m_flip_y ? ((int64_t) 1 << zoom) - 1 - tile(1) : tile(1);
+    sqlite3_bind_int(statement, 1, zoom);
+    sqlite3_bind_int64(statement, 2, tile(0));
+    sqlite3_bind_int64(statement, 3, row);
+  }
+
+  void exec(Connection& connection, std::string sql) const
+  {
+    char* error = NULL;
+    if (sqlite3_exec(connection.db, sql.c_str(), NULL, NULL, &error) != SQLITE_OK)
+    {
+      std::string message = error ? error : "Unknown error";
+      sqlite3_free(error);
+      throw WriteFileException(m_path, message);
+    }
+  }
+
+  std::unique_ptr<Connection> open_connection() const
+  {
+    std::unique_ptr<Connection> connection = std::make_unique<Connection>();
+    int flags = m_read_only ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if (sqlite3_open_v2(m_path.c_str(), &connection->db, flags | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+    {
+      std::string message = connection->db ? sqlite3_errmsg(connection->db) : "Failed to allocate connection";
+      throw LoadFileException(m_path, "Failed to open database. Reason: " + message);
+    }
+    sqlite3_busy_timeout(connection->db, 60000);
+    if (!m_read_only)
+    {
+      exec(*connection, "PRAGMA journal_mode=WAL");
+      exec(*connection, "PRAGMA synchronous=NORMAL");
+    }
+    m_metrics->increment("connections");
+    return connection;
+  }
+
+  void release_connection(std::unique_ptr<Connection> connection) const
+  {
+    std::lock_guard<std::mutex> lock(m_connections_mutex);
+    if (m_connections.size() < m_max_idle_connections)
+    {
+      m_connections.push_back(std::move(connection));
+    }
+  }
+
+  PooledConnection get_connection() const
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_connections_mutex);
+      if (!m_connections.empty())
+      {
+        std::unique_ptr<Connection> connection = std::move(m_connections.back());
+        m_connections.pop_back();
+        return PooledConnection(*this, std::move(connection));
+      }
+    }
+
+    std::unique_ptr<Connection> connection = open_connection();
+    prepare_statements(*connection);
+    return PooledConnection(*this, std::move(connection));
+  }
+
+  // Requires the tiles table
+  void prepare_statements(Connection& connection) const
+  {
+    auto prepare = [&](const char* sql, sqlite3_stmt** statement){
+      if (sqlite3_prepare_v3(connection.db, sql, -1, SQLITE_PREPARE_PERSISTENT, statement, NULL) != SQLITE_OK)
+      {
+        throw LoadFileException(m_path, std::string("Failed to prepare statement. Reason: ") + sqlite3_errmsg(connection.db));
+      }
+    };
+    prepare("SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", &connection.select);
+    prepare("SELECT 1 FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", &connection.exists);
+    if (!m_read_only)
+    {
+      prepare("INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)", &connection.insert);
+    }
+  }
+};
+
+} // end of ns tiledwebmaps
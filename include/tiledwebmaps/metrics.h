@@ -0,0 +1,490 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// Defining TILEDWEBMAPS_DISABLE_METRICS turns incrementing counters, recording latencies and timing into no-ops at compile
+// time, e.g. for builds in which even the lookup of metrics by name on per-tile paths is too expensive
+#ifdef TILEDWEBMAPS_DISABLE_METRICS
+#define TILEDWEBMAPS_METRICS_ENABLED false
+#else
+#define TILEDWEBMAPS_METRICS_ENABLED true
+#endif
+
+namespace tiledwebmaps {
+
+// Latency histogram with fixed logarithmic buckets from 10us to ~5min. Recording is lock-free.
+class Histogram
+{
+public:
+  static constexpr size_t BUCKETS_NUM = 16;
+
+  struct Snapshot
+  {
+    // Upper bounds of the buckets in seconds, the last bucket counts all larger values
+    std::vector<double> bounds;
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    double sum;
+
+    // Approximate quantile given as upper bound of the bucket that contains it
+    double quantile(double q) const
+    {
+      uint64_t rank = static_cast<uint64_t>(std::ceil(q * count));
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < bounds.size(); i++)
+      {
+        cumulative += counts[i];
+        if (cumulative >= rank)
+        {
+          return bounds[i];
+        }
+      }
+      return std::numeric_limits<double>::infinity();
+    }
+  };
+
+  static const std::array<double, BUCKETS_NUM>& get_bounds()
+  {
+    static const std::array<double, BUCKETS_NUM> bounds = [](){
+      std::array<double, BUCKETS_NUM> bounds;
+      for (size_t i = 0; i < BUCKETS_NUM; i++)
+      {
+        bounds[i] = 1e-5 * std::pow(10.0, i / 2.0);
+      }
+      return bounds;
+    }();
+    return bounds;
+  }
+
+  Histogram()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    for (auto& count : m_counts)
+    {
+      count = 0;
+    }
+    m_count = 0;
+    m_sum_ns = 0;
+  }
+
+  void record(double seconds)
+  {
+    const auto& bounds = get_bounds();
+    size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+    m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(static_cast<uint64_t>(seconds * 1e9), std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const
+  {
+    Snapshot result;
+    result.bounds = std::vector<double>(get_bounds().begin(), get_bounds().end());
+    for (const auto& count : m_counts)
+    {
+      result.counts.push_back(count.load(std::memory_order_relaxed));
+    }
+    result.count = m_count.load(std::memory_order_relaxed);
+    result.sum = m_sum_ns.load(std::memory_order_relaxed) / 1e9;
+    return result;
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, BUCKETS_NUM + 1> m_counts;
+  std::atomic<uint64_t> m_count;
+  std::atomic<uint64_t> m_sum_ns;
+};
+
+// Counters, latency histograms and optional trace events of a single component. Metrics are identified by name, errors
+// are counted as "errors.<type>". Names passed to time() must outlive the returned timer, e.g. string literals. Latencies
+// are measured with the monotonic steady_clock.
+//
+// Metrics can be disabled at runtime with set_enabled(false), after which increment, record and time only check a flag.
+// Hot paths that cannot afford the lookup by name can instead hold the references returned by get_counter and
+// get_histogram, which stay valid for the lifetime of the metrics object.
+class Metrics
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Snapshot
+  {
+    std::string name;
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, Histogram::Snapshot> histograms;
+  };
+
+  struct TraceEvent
+  {
+    std::string name;
+    uint64_t start; // Microseconds since an unspecified point in time that is the same for all events of the process
+    uint64_t duration; // Microseconds
+    uint64_t thread;
+  };
+
+  // Records the time from construction until stop() or destruction in a histogram, and as trace event if enabled
+  class Timer
+  {
+  public:
+    Timer(Metrics* metrics, std::string_view name)
+      : m_metrics(metrics->is_enabled() ? metrics : nullptr)
+      , m_name(name)
+      , m_start(m_metrics ? Clock::now() : Clock::time_point())
+    {
+    }
+
+    Timer(Timer&& other)
+      : m_metrics(other.m_metrics)
+      , m_name(other.m_name)
+      , m_start(other.m_start)
+    {
+      other.m_metrics = nullptr;
+    }
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    ~Timer()
+    {
+      stop();
+    }
+
+    void stop()
+    {
+      if (m_metrics != nullptr)
+      {
+        m_metrics->record(m_name, m_start, Clock::now());
+        m_metrics = nullptr;
+      }
+    }
+
+  private:
+    Metrics* m_metrics;
+    std::string_view m_name;
+    Clock::time_point m_start;
+  };
+
+  Metrics(std::string name = "")
+    : m_name(name)
+    , m_enabled(true)
+    , m_tracing(false)
+    , m_max_trace_events(0)
+  {
+  }
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  const std::string& get_name() const
+  {
+    return m_name;
+  }
+
+  bool is_enabled() const
+  {
+    return TILEDWEBMAPS_METRICS_ENABLED && m_enabled.load(std::memory_order_relaxed);
+  }
+
+  void set_enabled(bool enabled)
+  {
+    m_enabled = enabled;
+  }
+
+  void increment(std::string_view name, uint64_t value = 1)
+  {
+    if (!is_enabled())
+    {
+      return;
+    }
+    get_counter(name).fetch_add(value, std::memory_order_relaxed);
+  }
+
+  void record(std::string_view name, double seconds)
+  {
+    if (!is_enabled())
+    {
+      return;
+    }
+    get_histogram(name).record(seconds);
+  }
+
+  void record(std::string_view name, Clock::time_point start, Clock::time_point end)
+  {
+    if (!is_enabled())
+    {
+      return;
+    }
+    get_histogram(name).record(std::chrono::duration<double>(end - start).count());
+    if (m_tracing.load(std::memory_order_relaxed))
+    {
+      TraceEvent event;
+      event.name = std::string(name);
+      event.start = std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count();
+      event.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+      event.thread = get_thread_index();
+
+      std::lock_guard<std::mutex> lock(m_trace_mutex);
+      if (m_trace_events.size() < m_max_trace_events)
+      {
+        m_trace_events.push_back(std::move(event));
+      }
+    }
+  }
+
+  Timer time(std::string_view name)
+  {
+    return Timer(this, name);
+  }
+
+  // Returns the counter with the given name and creates it if necessary. The reference stays valid for the lifetime of
+  // this object and is not affected by set_enabled.
+  std::atomic<uint64_t>& get_counter(std::string_view name)
+  {
+    {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      auto it = m_counters.find(name);
+      if (it != m_counters.end())
+      {
+        return *it->second;
+      }
+    }
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    auto& counter = m_counters[std::string(name)];
+    if (!counter)
+    {
+      counter = std::make_unique<std::atomic<uint64_t>>(0);
+    }
+    return *counter;
+  }
+
+  // Returns the histogram with the given name and creates it if necessary. The reference stays valid for the lifetime of
+  // this object and is not affected by set_enabled.
+  Histogram& get_histogram(std::string_view name)
+  {
+    {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      auto it = m_histograms.find(name);
+      if (it != m_histograms.end())
+      {
+        return *it->second;
+      }
+    }
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    auto& histogram = m_histograms[std::string(name)];
+    if (!histogram)
+    {
+      histogram = std::make_unique<Histogram>();
+    }
+    return *histogram;
+  }
+
+  // Trace events are only recorded while tracing is enabled, at most max_events are kept
+  void set_tracing(bool tracing, size_t max_events = 1000000)
+  {
+    std::lock_guard<std::mutex> lock(m_trace_mutex);
+    m_max_trace_events = max_events;
+    m_tracing = tracing;
+  }
+
+  bool is_tracing() const
+  {
+    return m_tracing;
+  }
+
+  std::vector<TraceEvent> get_trace_events() const
+  {
+    std::lock_guard<std::mutex> lock(m_trace_mutex);
+    return m_trace_events;
+  }
+
+  Snapshot snapshot() const
+  {
+    Snapshot result;
+    result.name = m_name;
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    for (const auto& pair : m_counters)
+    {
+      result.counters[pair.first] = pair.second->load(std::memory_order_relaxed);
+    }
+    for (const auto& pair : m_histograms)
+    {
+      result.histograms[pair.first] = pair.second->snapshot();
+    }
+    return result;
+  }
+
+  void reset()
+  {
+    {
+      // Values are zeroed instead of removed, since other threads may still hold references to them
+      std::lock_guard<std::shared_mutex> lock(m_mutex);
+      for (auto& pair : m_counters)
+      {
+        *pair.second = 0;
+      }
+      for (auto& pair : m_histograms)
+      {
+        pair.second->reset();
+      }
+    }
+    std::lock_guard<std::mutex> lock(m_trace_mutex);
+    m_trace_events.clear();
+  }
+
+  // Metrics in the Prometheus text exposition format. The name of this object is added as "component" label.
+  std::string to_prometheus(std::string prefix = "tiledwebmaps") const
+  {
+    Snapshot snapshot = this->snapshot();
+    std::string labels = m_name.empty() ? "" : ("component=\"" + m_name + "\"");
+    auto with_labels = [&](std::string extra){
+      std::string all = labels.empty() ? extra : (extra.empty() ? labels : labels + "," + extra);
+      return all.empty() ? std::string() : ("{" + all + "}");
+    };
+
+    std::ostringstream stream;
+    stream << std::setprecision(9);
+    for (const auto& pair : snapshot.counters)
+    {
+      std::string name = prefix + "_" + to_prometheus_name(pair.first) + "_total";
+      stream << "# TYPE " << name << " counter\n";
+      stream << name << with_labels("") << " " << pair.second << "\n";
+    }
+    for (const auto& pair : snapshot.histograms)
+    {
+      std::string name = prefix + "_" + to_prometheus_name(pair.first) + "_seconds";
+      stream << "# TYPE " << name << " histogram\n";
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < pair.second.bounds.size(); i++)
+      {
+        cumulative += pair.second.counts[i];
+        std::ostringstream bound;
+        bound << pair.second.bounds[i];
+        stream << name << "_bucket" << with_labels("le=\"" + bound.str() + "\"") << " " << cumulative << "\n";
+      }
+      stream << name << "_bucket" << with_labels("le=\"+Inf\"") << " " << pair.second.count << "\n";
+      stream << name << "_sum" << with_labels("") << " " << pair.second.sum << "\n";
+      stream << name << "_count" << with_labels("") << " " << pair.second.count << "\n";
+    }
+    return stream.str();
+  }
+
+  // Recorded trace events in the Chrome trace event format that can be opened in chrome://tracing or Perfetto
+  std::string to_chrome_trace() const
+  {
+    std::vector<TraceEvent> events = get_trace_events();
+    std::ostringstream stream;
+    stream << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++)
+    {
+      if (i > 0)
+      {
+        stream << ",";
+      }
+      stream << "{\"name\":\"" << escape_json(events[i].name) << "\",\"cat\":\"" << escape_json(m_name) << "\",\"ph\":\"X\",\"ts\":" << events[i].start << ",\"dur\":" << events[i].duration << ",\"pid\":" << ::getpid() << ",\"tid\":" << events[i].thread << "}";
+    }
+    stream << "]}";
+    return stream.str();
+  }
+
+private:
+  std::string m_name;
+  std::atomic<bool> m_enabled;
+
+  mutable std::shared_mutex m_mutex;
+  std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>, std::less<>> m_counters;
+  std::map<std::string, std::unique_ptr<Histogram>, std::less<>> m_histograms;
+
+  std::atomic<bool> m_tracing;
+  size_t m_max_trace_events;
+  mutable std::mutex m_trace_mutex;
+  std::vector<TraceEvent> m_trace_events;
+
+  static uint64_t get_thread_index()
+  {
+    static std::atomic<uint64_t> next_index(0);
+    thread_local uint64_t index = next_index++;
+    return index;
+  }
+
+  static std::string to_prometheus_name(std::string name)
+  {
+    for (char& c : name)
+    {
+      if (!std::isalnum(c) && c != '_')
+      {
+        c = '_';
+      }
+    }
+    return name;
+  }
+
+  // Escapes a string for use inside a JSON string literal
+  static std::string escape_json(const std::string& input)
+  {
+    std::ostringstream stream;
+    for (char c : input)
+    {
+      if (c == '"' || c == '\\')
+      {
+        stream << '\\' << c;
+      }
+      else if (static_cast<unsigned char>(c) < 0x20)
+      {
+        stream << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+      }
+      else
+      {
+        stream << c;
+      }
+    }
+    return stream.str();
+  }
+};
+
+// Base class of components that expose metrics. Copies share the metrics object with the original.
+class Instrumented
+{
+public:
+  Instrumented(std::string name)
+    : m_metrics(std::make_shared<Metrics>(name))
+  {
+  }
+
+  virtual ~Instrumented() = default;
+
+  std::shared_ptr<Metrics> get_metrics() const
+  {
+    return m_metrics;
+  }
+
+  void set_metrics(std::shared_ptr<Metrics> metrics)
+  {
+    m_metrics = metrics;
+  }
+
+protected:
+  std::shared_ptr<Metrics> m_metrics;
+};
+
+} // end of ns tiledwebmaps
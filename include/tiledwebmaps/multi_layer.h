@@ -0,0 +1,141 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/layout.h>
+#include <tiledwebmaps/metrics.h>
+#include <tiledwebmaps/tileloader.h>
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace tiledwebmaps {
+
+// Samples several layers at the same pose in one call, e.g. aerial imagery, rendered semantic labels and elevation. The
+// pose geometry (the tiles covering the footprint and the sampling maps) is computed once and shared by all layers with
+// the same layout and zoom level. Every layer is sampled with its own interpolation, e.g. nearest for labels such that no
+// mixed classes appear at their borders. Layers are loaded at the zoom level of the first layer clamped to their own zoom
+// range, such that e.g. a coarser elevation layer is sampled from its highest zoom level.
+class MultiLayer : public Instrumented
+{
+public:
+  struct Layer
+  {
+    std::shared_ptr<TileLoader> tileloader;
+    Interpolation interpolation;
+  };
+
+  MultiLayer(std::vector<Layer> layers)
+    : Instrumented("multi_layer")
+    , m_layers(layers)
+  {
+    if (m_layers.empty())
+    {
+      throw std::invalid_argument("MultiLayer requires at least one layer");
+    }
+    for (size_t i = 0; i < m_layers.size(); i++)
+    {
+      if (!m_layers[i].tileloader)
+      {
+        throw std::invalid_argument(XTI_TO_STRING("Layer " << i << " has no tileloader"));
+      }
+    }
+  }
+
+  // Writes the image of every layer into the corresponding element of dests, which is only reallocated if it does not have
+  // the given shape and the type of the tiles of the layer. zoom is the zoom level of the first layer. The mosaics of tiles
+  // and the geometries are kept per thread and reused across calls, as in load_metric.
+  void load(xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, int zoom, std::vector<cv::Mat>& dests, ChannelOrder order = ChannelOrder::RGB)
+  {
+    thread_local std::vector<MetricGeometry> geometries;
+    thread_local std::vector<cv::Mat> src_images;
+    // Index of the geometry of every layer
+    thread_local std::vector<size_t> layer_geometries;
+
+    dests.resize(m_layers.size());
+    src_images.resize(m_layers.size());
+    layer_geometries.resize(m_layers.size());
+    if (geometries.size() < m_layers.size())
+    {
+      geometries.resize(m_layers.size());
+    }
+
+    {
+      auto timer = m_metrics->time("geometry");
+      size_t geometries_num = 0;
+      for (size_t i = 0; i < m_layers.size(); i++)
+      {
+        const TileLoader& tileloader = *m_layers[i].tileloader;
+        int layer_zoom = std::clamp(zoom, tileloader.get_min_zoom(), tileloader.get_max_zoom());
+        size_t j = 0;
+        while (j < i && (geometries[layer_geometries[j]].zoom != layer_zoom || !(m_layers[j].tileloader->get_layout() == tileloader.get_layout())))
+        {
+          j++;
+        }
+        if (j < i)
+        {
+          layer_geometries[i] = layer_geometries[j];
+        }
+        else
+        {
+          layer_geometries[i] = geometries_num++;
+          get_metric_geometry(tileloader.get_layout(), latlon, bearing, meters_per_pixel, shape, layer_zoom, geometries[layer_geometries[i]]);
+        }
+      }
+      m_metrics->increment("geometries", geometries_num);
+    }
+
+    // All layers are fetched before any is warped, such that no layer is warped in vain if a later layer fails to load
+    {
+      auto timer = m_metrics->time("fetch");
+      for (size_t i = 0; i < m_layers.size(); i++)
+      {
+        TileLoader& tileloader = *m_layers[i].tileloader;
+        const MetricGeometry& geometry = geometries[layer_geometries[i]];
+        tiledwebmaps::load(tileloader, geometry.min_tile, geometry.max_tile, geometry.zoom, src_images[i], tileloader.get_native_channel_order());
+      }
+    }
+
+    {
+      auto timer = m_metrics->time("warp");
+      for (size_t i = 0; i < m_layers.size(); i++)
+      {
+        sample_metric(src_images[i], geometries[layer_geometries[i]], dests[i], m_layers[i].interpolation);
+        if (m_layers[i].tileloader->get_native_channel_order() != order)
+        {
+          swizzle(dests[i], dests[i]);
+        }
+      }
+    }
+  }
+
+  std::vector<cv::Mat> load(xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, int zoom, ChannelOrder order = ChannelOrder::RGB)
+  {
+    std::vector<cv::Mat> dests;
+    load(latlon, bearing, meters_per_pixel, shape, zoom, dests, order);
+    return dests;
+  }
+
+  // Chooses the zoom level of the first layer for the given resolution, as in load_metric
+  void load(xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, std::vector<cv::Mat>& dests, ChannelOrder order = ChannelOrder::RGB)
+  {
+    load(latlon, bearing, meters_per_pixel, shape, m_layers[0].tileloader->get_zoom(latlon, meters_per_pixel), dests, order);
+  }
+
+  std::vector<cv::Mat> load(xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, ChannelOrder order = ChannelOrder::RGB)
+  {
+    return load(latlon, bearing, meters_per_pixel, shape, m_layers[0].tileloader->get_zoom(latlon, meters_per_pixel), order);
+  }
+
+  const std::vector<Layer>& get_layers() const
+  {
+    return m_layers;
+  }
+
+private:
+  std::vector<Layer> m_layers;
+};
+
+} // end of ns tiledwebmaps
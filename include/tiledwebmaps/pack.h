@@ -0,0 +1,516 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/tileloader.h>
+#include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/disk.h>
+#include <opencv2/imgcodecs.hpp>
+#include <atomic>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+namespace tiledwebmaps {
+
+// Stores encoded tiles in packfiles "{zoom}/{x}/{y}.pack" that each hold a metatile of metatile_size x metatile_size
+// tiles, which reduces the number of files and directory entries by metatile_size^2 compared to Disk. A packfile
+// starts with a header and an index of (offset, size) per tile, followed by the encoded tiles. Tiles are appended to
+// the end of the file before their index entry is updated, such that readers never see partially written tiles.
+// Overwritten tiles leave unused bytes in the packfile. Writers from multiple processes are serialized with flock.
+// Packfiles are opened read-only until a tile is saved to them, such that read-only packs can be loaded.
+class Pack : public TileLoader, public Cache, public Instrumented
+{
+public:
+  static constexpr uint64_t MAGIC = 0x314b4341504d5754; // "TWMPACK1"
+
+  Pack(std::filesystem::path path, const Layout& layout, int min_zoom, int max_zoom, std::string encoding = ".jpg", int metatile_size = 16, Disk::Sync sync = Disk::Sync::NONE, size_t max_open_files = 256)
+    : TileLoader(layout)
+    , Cache()
+    , Instrumented("pack")
+    , m_path(path)
+    , m_min_zoom(min_zoom)
+    , m_max_zoom(max_zoom)
+    , m_encoding(encoding)
+    , m_metatile_size(metatile_size)
+    , m_fsync(sync == Disk::Sync::FSYNC)
+    , m_max_open_files(max_open_files)
+  {
+    if (m_metatile_size <= 0)
+    {
+      throw std::invalid_argument("Metatile size must be positive");
+    }
+  }
+
+  Pack(const Pack&) = delete;
+  Pack& operator=(const Pack&) = delete;
+
+  int get_min_zoom() const
+  {
+    return m_min_zoom;
+  }
+
+  int get_max_zoom() const
+  {
+    return m_max_zoom;
+  }
+
+  // Open file descriptors are shared with forked processes, which would break the locking between writers
+  virtual void make_forksafe()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_files.clear();
+    m_files_order.clear();
+  }
+
+  std::filesystem::path get_pack_path(xti::vec2i tile, int zoom) const
+  {
+    xti::vec2i metatile = get_metatile(tile);
+    return m_path / std::to_string(zoom) / std::to_string(metatile(0)) / (std::to_string(metatile(1)) + ".pack");
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    if (zoom < m_min_zoom || zoom > m_max_zoom)
+    {
+      return false;
+    }
+    try
+    {
+      std::shared_ptr<File> file = open(tile, zoom, false);
+      return file && has_header(*file) && read_index_entry(*file, tile).size > 0;
+    }
+    catch (LoadFileException ex)
+    {
+      // Unreadable packfiles and packfiles with an invalid header are reported as missing, loading reports the error
+      m_metrics->increment("errors.contains");
+      return false;
+    }
+  }
+
+  cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    return load_ordered(tile, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    std::vector<uint8_t> data = load_encoded(tile, zoom);
+    return decode(data, tile, zoom, order);
+  }
+
+  ChannelOrder get_native_channel_order() const
+  {
+    return ChannelOrder::BGR;
+  }
+
+  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    save_ordered(image, tile, zoom, ChannelOrder::RGB);
+  }
+
+  void save_ordered(const cv::Mat& image, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    check_zoom(zoom);
+    auto encode_timer = m_metrics->time("encode");
+    cv::Mat image_bgr = this->from_tile(image, order);
+    std::vector<uint8_t> data;
+    if (!cv::imencode(m_encoding, image_bgr, data))
+    {
+      m_metrics->increment("errors.encode");
+      throw WriteFileException(get_pack_path(tile, zoom), "Failed to encode image");
+    }
+    encode_timer.stop();
+
+    save_encoded(data, tile, zoom);
+  }
+
+  std::string get_encoding() const
+  {
+    return m_encoding;
+  }
+
+  std::vector<uint8_t> load_encoded(xti::vec2i tile, int zoom)
+  {
+    check_zoom(zoom);
+    m_metrics->increment("loads");
+    auto timer = m_metrics->time("read");
+    std::shared_ptr<File> file = open(tile, zoom, false);
+    IndexEntry entry{0, 0, 0};
+    if (file && has_header(*file))
+    {
+      entry = read_index_entry(*file, tile);
+    }
+    if (entry.size == 0)
+    {
+      m_metrics->increment("errors.not_found");
+      throw FileNotFoundException(get_tile_path(tile, zoom));
+    }
+    struct stat stat_buffer;
+    if (::fstat(file->fd, &stat_buffer) != 0)
+    {
+      throw LoadFileException(file->path, std::strerror(errno));
+    }
+    uint64_t file_size = stat_buffer.st_size;
+    if (entry.offset < get_header_size() || entry.offset > file_size || entry.size > file_size - entry.offset)
+    {
+      m_metrics->increment("errors.invalid_index");
+      throw LoadFileException(file->path, "Index entry of tile " + XTI_TO_STRING(tile) + " points to " + std::to_string(entry.size) + " bytes at offset " + std::to_string(entry.offset) + " outside of the packfile with " + std::to_string(stat_buffer.st_size) + " bytes");
+    }
+
+    std::vector<uint8_t> data(entry.size);
+    if (!pread_all(file->fd, data.data(), entry.size, entry.offset))
+    {
+      throw LoadFileException(file->path, "Failed to read " + std::to_string(entry.size) + " bytes from offset " + std::to_string(entry.offset));
+    }
+    m_metrics->increment("bytes_in", entry.size);
+    return data;
+  }
+
+  void save_encoded(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    check_zoom(zoom);
+    m_metrics->increment("saves");
+    auto timer = m_metrics->time("write");
+    std::shared_ptr<File> file = open(tile, zoom, true);
+
+    // Serializes writers of this process and of other processes
+    std::lock_guard<std::mutex> file_lock(file->mutex);
+    if (::flock(file->fd, LOCK_EX) != 0)
+    {
+      throw WriteFileException(file->path, std::string("Failed to lock file. Reason: ") + std::strerror(errno));
+    }
+    try
+    {
+      struct stat stat_buffer;
+      if (::fstat(file->fd, &stat_buffer) != 0)
+      {
+        throw WriteFileException(file->path, std::strerror(errno));
+      }
+      uint64_t offset = stat_buffer.st_size;
+      if (offset == 0)
+      {
+        // New packfile, write header with an empty index
+        std::vector<uint8_t> header(get_header_size(), 0);
+        std::memcpy(header.data(), &MAGIC, sizeof(MAGIC));
+        uint32_t metatile_size = m_metatile_size;
+        std::memcpy(header.data() + sizeof(MAGIC), &metatile_size, sizeof(metatile_size));
+        if (!pwrite_all(file->fd, header.data(), header.size(), 0))
+        {
+          throw WriteFileException(file->path, std::strerror(errno));
+        }
+        offset = header.size();
+      }
+      else
+      {
+        check_header(*file);
+      }
+
+      IndexEntry entry{offset, static_cast<uint32_t>(data.size()), 0};
+      if (!pwrite_all(file->fd, data.data(), data.size(), offset))
+      {
+        throw WriteFileException(file->path, std::strerror(errno));
+      }
+      if (m_fsync && ::fdatasync(file->fd) != 0)
+      {
+        throw WriteFileException(file->path, std::strerror(errno));
+      }
+      if (!pwrite_all(file->fd, (const uint8_t*) &entry, sizeof(entry), get_index_offset(tile)))
+      {
+        throw WriteFileException(file->path, std::strerror(errno));
+      }
+    }
+    catch (...)
+    {
+      ::flock(file->fd, LOCK_UN);
+      throw;
+    }
+    ::flock(file->fd, LOCK_UN);
+    m_metrics->increment("bytes_out", data.size());
+  }
+
+  cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom)
+  {
+    return decode(data, tile, zoom, ChannelOrder::RGB);
+  }
+
+  cv::Mat decode(const std::vector<uint8_t>& data, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    std::filesystem::path path = get_tile_path(tile, zoom);
+    cv::Mat image;
+    try
+    {
+      image = safe_imdecode(data.data(), data.size(), path, m_metrics.get(), this->get_imread_flags());
+    }
+    catch (ImreadException ex)
+    {
+      m_metrics->increment("errors.decode");
+      throw;
+    }
+
+    try
+    {
+      auto timer = m_metrics->time("convert");
+      this->to_tile(image, order);
+    }
+    catch (LoadTileException ex)
+    {
+      m_metrics->increment("errors.invalid_tile");
+      throw LoadFileException(path, std::string("Loaded invalid tile. ") + ex.what());
+    }
+    return image;
+  }
+
+  std::filesystem::path get_path() const
+  {
+    return m_path;
+  }
+
+  int get_metatile_size() const
+  {
+    return m_metatile_size;
+  }
+
+private:
+  struct IndexEntry
+  {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+  };
+  static_assert(sizeof(IndexEntry) == 16, "Index entries must be 16 bytes");
+
+  struct File
+  {
+    int fd;
+    std::filesystem::path path;
+    bool writable;
+    std::atomic<bool> header_checked;
+    std::mutex mutex;
+
+    File(int fd, std::filesystem::path path, bool writable)
+      : fd(fd)
+      , path(path)
+      , writable(writable)
+      , header_checked(false)
+    {
+    }
+
+    ~File()
+    {
+      ::close(fd);
+    }
+  };
+
+  using Key = std::tuple<int, int, int>; // metatile-x, metatile-y, zoom
+
+  std::filesystem::path m_path;
+  int m_min_zoom;
+  int m_max_zoom;
+  std::string m_encoding;
+  int m_metatile_size;
+  bool m_fsync;
+
+  // Recently used packfiles are kept open
+  size_t m_max_open_files;
+  mutable std::mutex m_mutex;
+  mutable std::map<Key, std::pair<std::shared_ptr<File>, std::list<Key>::iterator>> m_files;
+  mutable std::list<Key> m_files_order;
+
+  void check_zoom(int zoom) const
+  {
+    if (zoom > m_max_zoom)
+    {
+      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is higher than the maximum zoom level " + XTI_TO_STRING(m_max_zoom) + ".");
+    }
+    if (zoom < m_min_zoom)
+    {
+      throw LoadTileException("Zoom level " + XTI_TO_STRING(zoom) + " is lower than the minimum zoom level " + XTI_TO_STRING(m_min_zoom) + ".");
+    }
+  }
+
+  static int floor_div(int a, int b)
+  {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+  }
+
+  xti::vec2i get_metatile(xti::vec2i tile) const
+  {
+    return xti::vec2i({floor_div(tile(0), m_metatile_size), floor_div(tile(1), m_metatile_size)});
+  }
+
+  // Virtual path of the tile used in error messages, and whose extension determines whether jpeg markers are checked
+  std::filesystem::path get_tile_path(xti::vec2i tile, int zoom) const
+  {
+    return get_pack_path(tile, zoom) / (std::to_string(tile(0)) + "_" + std::to_string(tile(1)) + m_encoding);
+  }
+
+  size_t get_header_size() const
+  {
+    return 16 + m_metatile_size * m_metatile_size * sizeof(IndexEntry);
+  }
+
+  size_t get_index_offset(xti::vec2i tile) const
+  {
+    xti::vec2i metatile = get_metatile(tile);
+    int i0 = tile(0) - metatile(0) * m_metatile_size;
+    int i1 = tile(1) - metatile(1) * m_metatile_size;
+    return 16 + (i0 * m_metatile_size + i1) * sizeof(IndexEntry);
+  }
+
+  void check_header(const File& file) const
+  {
+    uint64_t magic;
+    uint32_t metatile_size;
+    if (!pread_all(file.fd, (uint8_t*) &magic, sizeof(magic), 0) || !pread_all(file.fd, (uint8_t*) &metatile_size, sizeof(metatile_size), sizeof(magic)))
+    {
+      throw LoadFileException(file.path, "Failed to read header");
+    }
+    if (magic != MAGIC)
+    {
+      throw LoadFileException(file.path, "Invalid packfile header");
+    }
+    if (metatile_size != static_cast<uint32_t>(m_metatile_size))
+    {
+      throw LoadFileException(file.path, "Packfile has metatile size " + std::to_string(metatile_size) + ", but expected " + std::to_string(m_metatile_size));
+    }
+  }
+
+  // Checks the header once per opened packfile. Returns false if the packfile is still being created by another writer.
+  bool has_header(File& file) const
+  {
+    if (file.header_checked)
+    {
+      return true;
+    }
+    struct stat stat_buffer;
+    if (::fstat(file.fd, &stat_buffer) != 0)
+    {
+      throw LoadFileException(file.path, std::strerror(errno));
+    }
+    if (static_cast<uint64_t>(stat_buffer.st_size) < get_header_size())
+    {
+      return false;
+    }
+    check_header(file);
+    file.header_checked = true;
+    return true;
+  }
+
+  IndexEntry read_index_entry(const File& file, xti::vec2i tile) const
+  {
+    IndexEntry entry{0, 0, 0};
+    if (!pread_all(file.fd, (uint8_t*) &entry, sizeof(entry), get_index_offset(tile)))
+    {
+      // Packfile is still being created by another writer
+      return IndexEntry{0, 0, 0};
+    }
+    return entry;
+  }
+
+  // Returns nullptr if the packfile does not exist and create is false. Packfiles are opened for writing only if create
+  // is true, a packfile that is already open read-only is then opened again.
+  std::shared_ptr<File> open(xti::vec2i tile, int zoom, bool create) const
+  {
+    xti::vec2i metatile = get_metatile(tile);
+    Key key(metatile(0), metatile(1), zoom);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_files.find(key);
+      if (it != m_files.end() && (!create || it->second.first->writable))
+      {
+        m_files_order.splice(m_files_order.end(), m_files_order, it->second.second);
+        return it->second.first;
+      }
+    }
+
+    std::filesystem::path path = get_pack_path(tile, zoom);
+    if (create)
+    {
+      std::filesystem::create_directories(path.parent_path());
+    }
+    int fd = ::open(path.c_str(), create ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+    if (fd < 0)
+    {
+      if (errno == ENOENT && !create)
+      {
+        return nullptr;
+      }
+      throw LoadFileException(path, std::string("Failed to open file. Reason: ") + std::strerror(errno));
+    }
+    m_metrics->increment("opens");
+    std::shared_ptr<File> file = std::make_shared<File>(fd, path, create);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_files.find(key);
+    if (it != m_files.end())
+    {
+      m_files_order.splice(m_files_order.end(), m_files_order, it->second.second);
+      if (!create || it->second.first->writable)
+      {
+        // Opened concurrently by another thread
+        return it->second.first;
+      }
+      // Replaces the read-only packfile, which is closed once no other thread uses it anymore
+      it->second.first = file;
+      return file;
+    }
+    m_files_order.push_back(key);
+    m_files[key] = std::make_pair(file, std::prev(m_files_order.end()));
+    if (m_files.size() > m_max_open_files)
+    {
+      m_files.erase(m_files_order.front());
+      m_files_order.pop_front();
+    }
+    return file;
+  }
+
+  static bool pread_all(int fd, uint8_t* data, size_t size, uint64_t offset)
+  {
+    size_t done = 0;
+    while (done < size)
+    {
+      ssize_t n = ::pread(fd, data + done, size - done, offset + done);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  static bool pwrite_all(int fd, const uint8_t* data, size_t size, uint64_t offset)
+  {
+    size_t done = 0;
+    while (done < size)
+    {
+      ssize_t n = ::pwrite(fd, data + done, size - done, offset + done);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+};
+
+} // end of ns tiledwebmaps
@@ -0,0 +1,1040 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/disk.h>
+#include <tiledwebmaps/encoding.h>
+#include <tiledwebmaps/layout.h>
+#include <tiledwebmaps/metrics.h>
+#include <tiledwebmaps/retiler.h>
+#include <tiledwebmaps/warp.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <curl_easy.h>
+#include <curl_header.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace tiledwebmaps {
+
+// Thread-safe FIFO queue that holds at most max_size items. push blocks while the queue is full, such that a slow
+// consumer throttles its producers. After close, push fails and pop returns the remaining items and then nothing.
+template <typename T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(size_t max_size)
+    : m_max_size(std::max<size_t>(max_size, 1))
+    , m_closed(false)
+  {
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Returns false if the queue was closed
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_full.wait(lock, [this](){return m_closed || m_items.size() < m_max_size;});
+    if (m_closed)
+    {
+      return false;
+    }
+    m_items.push_back(std::move(item));
+    lock.unlock();
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  // Returns nothing once the queue is closed and empty
+  std::optional<T> pop()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_empty.wait(lock, [this](){return m_closed || !m_items.empty();});
+    if (m_items.empty())
+    {
+      return std::optional<T>();
+    }
+    std::optional<T> item(std::move(m_items.front()));
+    m_items.pop_front();
+    lock.unlock();
+    m_not_full.notify_one();
+    return item;
+  }
+
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_not_empty.notify_all();
+    m_not_full.notify_all();
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_items.size();
+  }
+
+private:
+  size_t m_max_size;
+  std::deque<T> m_items;
+  bool m_closed;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+};
+
+// Threads that pop items from a queue and process them until the queue is closed and empty
+template <typename T>
+class WorkerPool
+{
+public:
+  WorkerPool(size_t threads_num, BoundedQueue<T>& queue, std::function<void(T&)> process)
+  {
+    threads_num = std::max<size_t>(threads_num, 1);
+    for (size_t i = 0; i < threads_num; i++)
+    {
+      m_threads.emplace_back([&queue, process](){
+        while (std::optional<T> item = queue.pop())
+        {
+          process(*item);
+        }
+      });
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  ~WorkerPool()
+  {
+    join();
+  }
+
+  void join()
+  {
+    for (auto& thread : m_threads)
+    {
+      if (thread.joinable())
+      {
+        thread.join();
+      }
+    }
+  }
+
+private:
+  std::vector<std::thread> m_threads;
+};
+
+// Append-only file with one key per line that records completed work, e.g. the inputs of a pipeline that were processed
+// before it was interrupted
+class Journal
+{
+public:
+  Journal(std::filesystem::path path)
+    : m_path(path)
+  {
+    bool complete_line = true;
+    {
+      std::ifstream file(m_path.string());
+      std::string line;
+      while (std::getline(file, line))
+      {
+        if (!line.empty())
+        {
+          m_keys.insert(line);
+        }
+        complete_line = !file.eof();
+      }
+    }
+    if (m_path.has_parent_path())
+    {
+      std::filesystem::create_directories(m_path.parent_path());
+    }
+    m_file.open(m_path.string(), std::ios::app);
+    if (!m_file)
+    {
+      throw WriteFileException(m_path, "Failed to open journal");
+    }
+    if (!complete_line)
+    {
+      // Terminate the incomplete last line from a crash
+      m_file << "\n";
+    }
+  }
+
+  bool contains(const std::string& key) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_keys.count(key) > 0;
+  }
+
+  void add(const std::vector<std::string>& keys)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const std::string& key : keys)
+    {
+      m_file << key << "\n";
+      m_keys.insert(key);
+    }
+    m_file.flush();
+    if (!m_file)
+    {
+      throw WriteFileException(m_path, "Failed to append to journal");
+    }
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_keys.size();
+  }
+
+  std::filesystem::path get_path() const
+  {
+    return m_path;
+  }
+
+private:
+  std::filesystem::path m_path;
+  std::set<std::string> m_keys;
+  std::ofstream m_file;
+  mutable std::mutex m_mutex;
+};
+
+// Reads the georeference of a raster from its world file, e.g. "image.jgw" or "image.jpgw" for "image.jpg", or
+// "image.wld"
+Georeference read_world_file(const std::filesystem::path& path, std::shared_ptr<proj::CRS> crs)
+{
+  std::string extension = path.extension().string();
+  std::vector<std::filesystem::path> candidates;
+  if (extension.size() >= 3)
+  {
+    candidates.push_back(std::filesystem::path(path).replace_extension(extension.substr(0, 2) + extension.substr(extension.size() - 1) + "w"));
+  }
+  candidates.push_back(std::filesystem::path(path).replace_extension(extension + "w"));
+  candidates.push_back(std::filesystem::path(path).replace_extension(".wld"));
+  for (const std::filesystem::path& candidate : candidates)
+  {
+    std::ifstream file(candidate.string());
+    if (!file)
+    {
+      continue;
+    }
+    // Lines are A, D, B, E, C, F where (C, F) is the center of the top-left pixel
+    double a, d, b, e, c, f;
+    if (!(file >> a >> d >> b >> e >> c >> f))
+    {
+      throw LoadFileException(candidate, "Invalid world file");
+    }
+    return Georeference::from_geotransform(crs, {c - 0.5 * a - 0.5 * b, a, b, f - 0.5 * d - 0.5 * e, d, e});
+  }
+  throw FileNotFoundException(candidates[0]);
+}
+
+// Downloads rasters, extracts archives, decodes the rasters and cuts them into the tiles of a layout at a single zoom
+// level, which are encoded and saved to a cache. Every step has its own pool of threads, and the steps are connected by
+// bounded queues such that a slow step throttles the steps before it. A decoded raster is held in memory while it is
+// cut, i.e. at most about decode_workers + queue_size / (rows / strip_rows) + cut_workers rasters are decoded at a time.
+//
+// Inputs are urls, or paths of local files that are not downloaded. Every input gets its own directory under work_path
+// that is removed once the input is processed. If an extract command is given (e.g. "unzip -o -q {file} -d {dir}"), it
+// is run on the downloaded file and all extracted files with one of the given extensions are decoded, otherwise the
+// downloaded file itself is decoded. The georeference of a raster is returned by the georeference function, e.g. from a
+// world file with read_world_file. Rasters are passed to a Retiler in strips of strip_rows rows.
+//
+// With a journal, processed inputs are recorded at checkpoints and skipped when the pipeline is run again. At a
+// checkpoint, partially covered tiles are saved and all tiles are written before the inputs are recorded, such that no
+// work of a recorded input is lost if the pipeline is interrupted later. Inputs that fail are not recorded.
+class DownloadPipeline : public Instrumented
+{
+public:
+  struct Options
+  {
+    size_t download_workers;
+    size_t extract_workers;
+    size_t decode_workers;
+    size_t cut_workers;
+    size_t encode_workers;
+    size_t write_workers;
+    // Maximum number of files or strips that wait for the next step
+    size_t queue_size;
+    // Maximum number of tiles that wait to be encoded or written
+    size_t tile_queue_size;
+    std::optional<std::string> extract_command;
+    std::vector<std::string> extensions;
+    int strip_rows;
+    size_t max_pending_tiles;
+    cv::Vec3b background;
+    // Used when the sink stores encoded tiles
+    EncodeOptions encode_options;
+    std::optional<std::filesystem::path> journal_path;
+    // Seconds between two checkpoints
+    float checkpoint_interval;
+    int retries;
+    float wait_after_error;
+    bool verify_ssl;
+    std::optional<std::filesystem::path> capath;
+    std::optional<std::filesystem::path> cafile;
+    std::map<std::string, std::string> header;
+
+    Options()
+      : download_workers(8)
+      , extract_workers(2)
+      , decode_workers(2)
+      , cut_workers(4)
+      , encode_workers(4)
+      , write_workers(2)
+      , queue_size(4)
+      , tile_queue_size(256)
+      , extensions({".jpg", ".jpeg", ".jp2", ".tif", ".tiff", ".png"})
+      , strip_rows(1024)
+      , max_pending_tiles(256)
+      , background(255, 255, 255)
+      , encode_options(95)
+      , checkpoint_interval(60.0)
+      , retries(10)
+      , wait_after_error(1.5)
+      , verify_ssl(true)
+    {
+    }
+  };
+
+  using GeoreferenceFunction = std::function<Georeference(const std::filesystem::path& path)>;
+  // Called after every processed input with the number of processed and of all inputs
+  using ProgressCallback = std::function<void(size_t done, size_t total)>;
+
+  DownloadPipeline(std::shared_ptr<Cache> sink, const Layout& layout, int zoom, std::filesystem::path work_path, GeoreferenceFunction georeference, Options options)
+    : Instrumented("pipeline")
+    , m_sink(sink)
+    , m_work_path(work_path)
+    , m_georeference(georeference)
+    , m_options(options)
+    , m_encoding(sink->get_encoding())
+    , m_channel_order(m_encoding.empty() ? ChannelOrder::RGB : ChannelOrder::BGR)
+    , m_sequence(0)
+    , m_write_failed(false)
+    , m_checkpointing(false)
+    , m_failed_num(0)
+    , m_done_num(0)
+    , m_total_num(0)
+  {
+    if (m_options.strip_rows <= 0)
+    {
+      throw std::invalid_argument("strip_rows must be positive");
+    }
+    m_options.encode_options.validate(m_encoding);
+    for (std::string& extension : m_options.extensions)
+    {
+      std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c){return std::tolower(c);});
+    }
+    if (m_options.journal_path)
+    {
+      m_journal = std::make_shared<Journal>(*m_options.journal_path);
+    }
+    cv::Vec3b background = m_options.background;
+    if (m_channel_order == ChannelOrder::BGR)
+    {
+      std::swap(background[0], background[2]);
+    }
+    m_retiler = std::make_shared<Retiler>(std::make_shared<TileSink>(*this), layout, zoom, m_options.max_pending_tiles, background);
+  }
+
+  DownloadPipeline(const DownloadPipeline&) = delete;
+  DownloadPipeline& operator=(const DownloadPipeline&) = delete;
+
+  virtual ~DownloadPipeline()
+  {
+    // The retiler saves remaining tiles through this object, i.e. before its members are destroyed
+    try
+    {
+      m_retiler->flush();
+    }
+    catch (...)
+    {
+    }
+  }
+
+  // Processes all inputs that are not recorded in the journal and blocks until they are done. Throws after all inputs
+  // were processed if any of them failed.
+  void run(const std::vector<std::string>& inputs, ProgressCallback progress = ProgressCallback())
+  {
+    std::lock_guard<std::mutex> run_lock(m_run_mutex);
+    auto timer = m_metrics->time("run");
+    m_progress = progress;
+    m_failed_num = 0;
+    m_done_num = 0;
+    m_first_error = "";
+    m_write_failed = false;
+    {
+      std::lock_guard<std::mutex> lock(m_checkpoint_mutex);
+      m_last_checkpoint = std::chrono::steady_clock::now();
+    }
+
+    std::vector<std::string> todo;
+    for (const std::string& input : inputs)
+    {
+      if (m_journal && m_journal->contains(input))
+      {
+        m_metrics->increment("skipped");
+      }
+      else
+      {
+        todo.push_back(input);
+      }
+    }
+    m_total_num = todo.size();
+
+    BoundedQueue<File> downloaded(m_options.queue_size);
+    BoundedQueue<File> files(m_options.queue_size);
+    BoundedQueue<Strip> strips(m_options.queue_size);
+    BoundedQueue<Tile> tiles(m_options.tile_queue_size);
+    BoundedQueue<Tile> encoded(m_options.tile_queue_size);
+    BoundedQueue<File> inputs_queue(m_options.download_workers);
+    m_tiles = &tiles;
+
+    WorkerPool<File> download_pool(m_options.download_workers, inputs_queue, [&](File& file){download(file, downloaded);});
+    WorkerPool<File> extract_pool(m_options.extract_workers, downloaded, [&](File& file){extract(file, files);});
+    WorkerPool<File> decode_pool(m_options.decode_workers, files, [&](File& file){decode(file, strips);});
+    WorkerPool<Strip> cut_pool(m_options.cut_workers, strips, [&](Strip& strip){cut(strip);});
+    WorkerPool<Tile> encode_pool(m_options.encode_workers, tiles, [&](Tile& tile){encode(tile, encoded);});
+    WorkerPool<Tile> write_pool(m_options.write_workers, encoded, [&](Tile& tile){write(tile);});
+
+    for (size_t i = 0; i < todo.size(); i++)
+    {
+      std::filesystem::path directory = m_work_path / std::to_string(i);
+      std::shared_ptr<Input> input(new Input{todo[i], directory, false, ""}, [this](Input* input){
+        finish(*input);
+        delete input;
+      });
+      inputs_queue.push(File{input, std::filesystem::path()});
+    }
+
+    // Close the queues in the order of the steps, such that every step finishes after the steps before it
+    inputs_queue.close();
+    download_pool.join();
+    downloaded.close();
+    extract_pool.join();
+    files.close();
+    decode_pool.join();
+    strips.close();
+    cut_pool.join();
+    m_retiler->flush();
+    tiles.close();
+    encode_pool.join();
+    encoded.close();
+    write_pool.join();
+    m_tiles = NULL;
+    checkpoint();
+
+    if (m_failed_num > 0)
+    {
+      throw std::runtime_error("Failed to process " + std::to_string(m_failed_num) + " of " + std::to_string(m_total_num) + " inputs. First error: " + m_first_error);
+    }
+    if (m_write_failed)
+    {
+      throw std::runtime_error("Failed to write tiles. First error: " + m_first_error);
+    }
+  }
+
+  std::shared_ptr<Journal> get_journal() const
+  {
+    return m_journal;
+  }
+
+  const Options& get_options() const
+  {
+    return m_options;
+  }
+
+private:
+  struct Input
+  {
+    std::string key;
+    std::filesystem::path directory;
+    std::atomic<bool> failed;
+    std::string error;
+  };
+
+  struct File
+  {
+    std::shared_ptr<Input> input;
+    std::filesystem::path path;
+  };
+
+  struct Strip
+  {
+    std::shared_ptr<Input> input;
+    cv::Mat image;
+    Georeference georeference;
+    xti::vec2i offset;
+  };
+
+  struct Tile
+  {
+    cv::Mat image;
+    std::vector<uint8_t> data;
+    xti::vec2i tile;
+    int zoom;
+    uint64_t sequence;
+  };
+
+  using Key = std::tuple<int, int, int>; // tile-x, tile-y, zoom
+
+  // Tile that was saved by the retiler but is not written to the sink yet
+  struct InFlight
+  {
+    uint64_t sequence;
+    cv::Mat image;
+    bool writing;
+    // Earlier saves of the tile whose image is written together with this one
+    std::vector<uint64_t> superseded;
+  };
+
+  // Cache that passes tiles saved by the retiler to the encode step. Tiles that are not written yet are returned from
+  // memory, such that the retiler does not read outdated tiles from the sink.
+  class TileSink : public Cache
+  {
+  public:
+    TileSink(DownloadPipeline& pipeline)
+      : m_pipeline(pipeline)
+    {
+    }
+
+    cv::Mat load(xti::vec2i tile, int zoom)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_pipeline.m_in_flight_mutex);
+        auto it = m_pipeline.m_in_flight.find(Key(tile(0), tile(1), zoom));
+        if (it != m_pipeline.m_in_flight.end())
+        {
+          return it->second.image.clone();
+        }
+      }
+      if (TileLoader* loader = dynamic_cast<TileLoader*>(m_pipeline.m_sink.get()))
+      {
+        return loader->load_ordered(tile, zoom, m_pipeline.m_channel_order);
+      }
+      cv::Mat image = m_pipeline.m_sink->load(tile, zoom);
+      if (m_pipeline.m_channel_order == ChannelOrder::BGR)
+      {
+        cv::Mat image_bgr;
+        cv::cvtColor(image, image_bgr, cv::COLOR_RGB2BGR);
+        image = image_bgr;
+      }
+      return image;
+    }
+
+    void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+    {
+      m_pipeline.push(image, tile, zoom);
+    }
+
+    bool contains(xti::vec2i tile, int zoom) const
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_pipeline.m_in_flight_mutex);
+        if (m_pipeline.m_in_flight.count(Key(tile(0), tile(1), zoom)) > 0)
+        {
+          return true;
+        }
+      }
+      return m_pipeline.m_sink->contains(tile, zoom);
+    }
+
+  private:
+    DownloadPipeline& m_pipeline;
+  };
+
+  std::shared_ptr<Cache> m_sink;
+  std::filesystem::path m_work_path;
+  GeoreferenceFunction m_georeference;
+  Options m_options;
+  std::string m_encoding;
+  // Channel order of rasters and tiles inside the pipeline. Tiles of sinks with an encoding stay in the BGR order of
+  // OpenCV's decoder and encoder, such that they are never swizzled.
+  ChannelOrder m_channel_order;
+  std::shared_ptr<Retiler> m_retiler;
+  std::shared_ptr<Journal> m_journal;
+  std::mutex m_run_mutex;
+
+  BoundedQueue<Tile>* m_tiles;
+  std::map<Key, InFlight> m_in_flight;
+  std::set<uint64_t> m_in_flight_sequences;
+  uint64_t m_sequence;
+  mutable std::mutex m_in_flight_mutex;
+  std::condition_variable m_in_flight_condition;
+  std::atomic<bool> m_write_failed;
+
+  // Inputs that were cut completely since the last checkpoint
+  std::vector<std::string> m_cut_keys;
+  std::mutex m_checkpoint_mutex;
+  std::chrono::steady_clock::time_point m_last_checkpoint;
+  std::atomic<bool> m_checkpointing;
+
+  std::mutex m_status_mutex;
+  size_t m_failed_num;
+  size_t m_done_num;
+  size_t m_total_num;
+  std::string m_first_error;
+  ProgressCallback m_progress;
+
+  void fail(Input& input, std::string error, std::string step)
+  {
+    m_metrics->increment("errors." + step);
+    input.failed = true;
+    std::lock_guard<std::mutex> lock(m_status_mutex);
+    if (input.error.empty())
+    {
+      input.error = error;
+    }
+  }
+
+  // Called once all files and strips of the input are processed
+  void finish(Input& input)
+  {
+    std::error_code ec;
+    std::filesystem::remove_all(input.directory, ec);
+
+    size_t done, total;
+    {
+      std::lock_guard<std::mutex> lock(m_status_mutex);
+      if (input.failed)
+      {
+        m_failed_num++;
+        if (m_first_error.empty())
+        {
+          m_first_error = input.key + ": " + input.error;
+        }
+      }
+      else
+      {
+        std::lock_guard<std::mutex> lock(m_checkpoint_mutex);
+        m_cut_keys.push_back(input.key);
+      }
+      done = ++m_done_num;
+      total = m_total_num;
+    }
+    m_metrics->increment(input.failed ? "inputs.failed" : "inputs.done");
+    if (m_progress)
+    {
+      m_progress(done, total);
+    }
+  }
+
+  void download(File& file, BoundedQueue<File>& output)
+  {
+    const std::string& url = file.input->key;
+    std::error_code ec;
+    std::filesystem::create_directories(file.input->directory, ec);
+    if (ec)
+    {
+      fail(*file.input, "Failed to create directory " + file.input->directory.string() + ". Reason: " + ec.message(), "download");
+      return;
+    }
+    if (url.rfind("http://", 0) != 0 && url.rfind("https://", 0) != 0)
+    {
+      file.path = url;
+      output.push(std::move(file));
+      return;
+    }
+
+    auto timer = m_metrics->time("download");
+    std::string name = url.substr(0, url.find_first_of("?#"));
+    name = name.substr(name.find_last_of('/') + 1);
+    file.path = file.input->directory / (name.empty() ? std::string("download") : name);
+    std::string error;
+    for (int tries = 0; tries < m_options.retries; ++tries)
+    {
+      if (tries > 0)
+      {
+        m_metrics->increment("retries");
+        std::this_thread::sleep_for(std::chrono::duration<float>(m_options.wait_after_error));
+      }
+      try
+      {
+        std::ofstream stream(file.path.string(), std::ios::binary | std::ios::trunc);
+        if (!stream)
+        {
+          error = "Failed to open " + file.path.string();
+          break;
+        }
+        curl::curl_easy request;
+        request.add<CURLOPT_URL>(url.c_str());
+        request.add<CURLOPT_FOLLOWLOCATION>(1L);
+
+        curl::curl_header curl_header;
+        for (const auto& pair : m_options.header)
+        {
+          curl_header.add(pair.first + ": " + pair.second);
+        }
+        request.add<CURLOPT_HTTPHEADER>(curl_header.get());
+
+        curl::curl_ios<std::ofstream> curl_file_stream(stream);
+        request.add<CURLOPT_WRITEFUNCTION>(curl_file_stream.get_function());
+        request.add<CURLOPT_WRITEDATA>(curl_file_stream.get_stream());
+        if (!m_options.verify_ssl)
+        {
+          request.add<CURLOPT_SSL_VERIFYHOST>(0);
+          request.add<CURLOPT_SSL_VERIFYPEER>(0);
+        }
+        if (m_options.capath)
+        {
+          request.add<CURLOPT_CAPATH>(m_options.capath->string().c_str());
+        }
+        else if (m_options.cafile)
+        {
+          request.add<CURLOPT_CAINFO>(m_options.cafile->string().c_str());
+        }
+
+        request.perform();
+        stream.close();
+
+        long response_code = request.get_info<CURLINFO_RESPONSE_CODE>().get();
+        if (response_code == 200 && stream)
+        {
+          m_metrics->increment("bytes_in", std::filesystem::file_size(file.path, ec));
+          output.push(std::move(file));
+          return;
+        }
+        error = "Received response code " + std::to_string(response_code);
+        if (response_code == 404)
+        {
+          break;
+        }
+      }
+      catch (curl::curl_easy_exception ex)
+      {
+        error = ex.what();
+      }
+    }
+    fail(*file.input, "Failed to download " + url + ". Reason: " + error, "download");
+  }
+
+  void extract(File& file, BoundedQueue<File>& output)
+  {
+    if (!m_options.extract_command)
+    {
+      output.push(std::move(file));
+      return;
+    }
+
+    auto timer = m_metrics->time("extract");
+    std::string command = *m_options.extract_command;
+    auto replace = [&](std::string placeholder, std::string value){
+      std::string quoted = "'";
+      for (char c : value)
+      {
+        quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+      }
+      quoted += "'";
+      for (size_t pos = command.find(placeholder); pos != std::string::npos; pos = command.find(placeholder, pos + quoted.size()))
+      {
+        command.replace(pos, placeholder.size(), quoted);
+      }
+    };
+    replace("{file}", file.path.string());
+    replace("{dir}", file.input->directory.string());
+    int returncode = std::system(command.c_str());
+    if (returncode != 0)
+    {
+      fail(*file.input, "Failed to run " + command + ". Got return code " + std::to_string(returncode), "extract");
+      return;
+    }
+
+    // Decode extracted files in a fixed order
+    std::vector<std::filesystem::path> paths;
+    try
+    {
+      for (const auto& entry : std::filesystem::recursive_directory_iterator(file.input->directory))
+      {
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c){return std::tolower(c);});
+        if (entry.is_regular_file() && entry.path() != file.path && std::find(m_options.extensions.begin(), m_options.extensions.end(), extension) != m_options.extensions.end())
+        {
+          paths.push_back(entry.path());
+        }
+      }
+    }
+    catch (std::filesystem::filesystem_error& e)
+    {
+      fail(*file.input, e.what(), "extract");
+      return;
+    }
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty())
+    {
+      fail(*file.input, "Archive " + file.path.string() + " contains no rasters", "extract");
+      return;
+    }
+    for (const std::filesystem::path& path : paths)
+    {
+      output.push(File{file.input, path});
+    }
+  }
+
+  void decode(File& file, BoundedQueue<Strip>& output)
+  {
+    if (file.input->failed)
+    {
+      return;
+    }
+    cv::Mat image;
+    Georeference georeference;
+    try
+    {
+      auto timer = m_metrics->time("decode");
+      image = cv::imread(file.path.string(), cv::IMREAD_COLOR);
+      if (image.empty())
+      {
+        throw LoadFileException(file.path, "Failed to decode raster");
+      }
+      if (m_channel_order == ChannelOrder::RGB)
+      {
+        cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+      }
+      georeference = m_georeference(file.path);
+    }
+    catch (std::exception& e)
+    {
+      fail(*file.input, e.what(), "decode");
+      return;
+    }
+    m_metrics->increment("rasters");
+
+    for (int row = 0; row < image.rows; row += m_options.strip_rows)
+    {
+      cv::Mat strip = image.rowRange(row, std::min(image.rows, row + m_options.strip_rows));
+      output.push(Strip{file.input, strip, georeference, xti::vec2i({row, 0})});
+    }
+  }
+
+  void cut(Strip& strip)
+  {
+    if (!strip.input->failed)
+    {
+      try
+      {
+        auto timer = m_metrics->time("cut");
+        m_retiler->add(strip.image, strip.georeference, strip.offset);
+      }
+      catch (std::exception& e)
+      {
+        fail(*strip.input, e.what(), "cut");
+      }
+    }
+    // Release the input before the checkpoint, such that it can be recorded if this was its last strip
+    strip = Strip();
+
+    bool due;
+    {
+      std::lock_guard<std::mutex> lock(m_checkpoint_mutex);
+      due = std::chrono::steady_clock::now() - m_last_checkpoint > std::chrono::duration<float>(m_options.checkpoint_interval);
+    }
+    if (due)
+    {
+      try
+      {
+        checkpoint();
+      }
+      catch (std::exception& e)
+      {
+        m_metrics->increment("errors.checkpoint");
+        m_write_failed = true;
+        std::lock_guard<std::mutex> lock(m_status_mutex);
+        if (m_first_error.empty())
+        {
+          m_first_error = e.what();
+        }
+      }
+    }
+  }
+
+  // Called by the retiler
+  void push(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    uint64_t sequence;
+    {
+      std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+      sequence = ++m_sequence;
+      Key key(tile(0), tile(1), zoom);
+      auto it = m_in_flight.find(key);
+      if (it == m_in_flight.end())
+      {
+        m_in_flight.emplace(key, InFlight{sequence, image, false, std::vector<uint64_t>()});
+      }
+      else
+      {
+        it->second.superseded.push_back(it->second.sequence);
+        it->second.sequence = sequence;
+        it->second.image = image;
+      }
+      m_in_flight_sequences.insert(sequence);
+    }
+    if (!m_tiles || !m_tiles->push(Tile{image, std::vector<uint8_t>(), tile, zoom, sequence}))
+    {
+      // Pipeline is not running, save the tile directly
+      Tile item{image, std::vector<uint8_t>(), tile, zoom, sequence};
+      write(item);
+    }
+  }
+
+  void encode(Tile& tile, BoundedQueue<Tile>& output)
+  {
+    if (!m_encoding.empty())
+    {
+      auto timer = m_metrics->time("encode");
+      if (!cv::imencode(m_encoding, tile.image, tile.data, m_options.encode_options.get_params(m_encoding)))
+      {
+        m_metrics->increment("errors.encode");
+        done(tile, "Failed to encode tile " + XTI_TO_STRING(tile.tile) + " with encoding " + m_encoding, false);
+        return;
+      }
+      tile.image = cv::Mat();
+    }
+    output.push(std::move(tile));
+  }
+
+  void write(Tile& tile)
+  {
+    Key key(tile.tile(0), tile.tile(1), tile.zoom);
+    {
+      // Tiles that were saved again in the meantime are only written once with the latest image, which also completes
+      // the earlier saves
+      std::unique_lock<std::mutex> lock(m_in_flight_mutex);
+      auto it = m_in_flight.end();
+      m_in_flight_condition.wait(lock, [&](){
+        it = m_in_flight.find(key);
+        return it == m_in_flight.end() || !it->second.writing;
+      });
+      if (it == m_in_flight.end() || it->second.sequence != tile.sequence)
+      {
+        m_metrics->increment("superseded");
+        return;
+      }
+      it->second.writing = true;
+    }
+
+    std::string error;
+    try
+    {
+      auto timer = m_metrics->time("write");
+      if (tile.image.empty())
+      {
+        m_sink->save_encoded(tile.data, tile.tile, tile.zoom);
+      }
+      else
+      {
+        m_sink->save_ordered(tile.image, tile.tile, tile.zoom, m_channel_order);
+      }
+      m_metrics->increment("tiles");
+    }
+    catch (std::exception& e)
+    {
+      m_metrics->increment("errors.write");
+      error = e.what();
+    }
+    done(tile, error, true);
+  }
+
+  // Marks the tile as written and wakes up waiting writers and checkpoints
+  void done(const Tile& tile, std::string error, bool writing)
+  {
+    if (!error.empty())
+    {
+      m_write_failed = true;
+      std::lock_guard<std::mutex> lock(m_status_mutex);
+      if (m_first_error.empty())
+      {
+        m_first_error = error;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+      auto it = m_in_flight.find(Key(tile.tile(0), tile.tile(1), tile.zoom));
+      if (it != m_in_flight.end() && it->second.sequence == tile.sequence)
+      {
+        for (uint64_t sequence : it->second.superseded)
+        {
+          m_in_flight_sequences.erase(sequence);
+        }
+        m_in_flight.erase(it);
+      }
+      else if (it != m_in_flight.end() && writing)
+      {
+        // The tile was saved again while this image was written
+        it->second.writing = false;
+      }
+      m_in_flight_sequences.erase(tile.sequence);
+    }
+    m_in_flight_condition.notify_all();
+  }
+
+  // Saves all partially covered tiles, waits until all saved tiles are written and records the inputs that were cut
+  // completely before. Only one thread runs a checkpoint at a time, other threads skip it.
+  void checkpoint()
+  {
+    bool expected = false;
+    if (!m_checkpointing.compare_exchange_strong(expected, true))
+    {
+      return;
+    }
+    std::vector<std::string> keys;
+    {
+      std::lock_guard<std::mutex> lock(m_checkpoint_mutex);
+      m_last_checkpoint = std::chrono::steady_clock::now();
+      std::swap(keys, m_cut_keys);
+    }
+    try
+    {
+      if (m_journal && !keys.empty())
+      {
+        auto timer = m_metrics->time("checkpoint");
+        m_retiler->flush();
+        {
+          std::unique_lock<std::mutex> lock(m_in_flight_mutex);
+          uint64_t sequence = m_sequence;
+          m_in_flight_condition.wait(lock, [&](){return m_in_flight_sequences.empty() || *m_in_flight_sequences.begin() > sequence;});
+        }
+        // If a tile failed, tiles of these inputs may be missing and the inputs are processed again in the next run
+        if (!m_write_failed)
+        {
+          m_journal->add(keys);
+          m_metrics->increment("checkpoints");
+        }
+      }
+    }
+    catch (...)
+    {
+      m_checkpointing = false;
+      throw;
+    }
+    m_checkpointing = false;
+  }
+};
+
+} // end of ns tiledwebmaps
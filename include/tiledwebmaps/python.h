@@ -2,13 +2,131 @@
 
 #include <xtensor-python/pytensor.hpp>
 #include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <opencv2/core.hpp>
 
 #include <tiledwebmaps/affine.h>
 
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 namespace py = pybind11;
 
+namespace tiledwebmaps {
+
+inline py::dtype depth_to_dtype(int depth)
+{
+  switch (depth)
+  {
+    case CV_8U: return py::dtype::of<uint8_t>();
+    case CV_8S: return py::dtype::of<int8_t>();
+    case CV_16U: return py::dtype::of<uint16_t>();
+    case CV_16S: return py::dtype::of<int16_t>();
+    case CV_32S: return py::dtype::of<int32_t>();
+    case CV_32F: return py::dtype::of<float>();
+    case CV_64F: return py::dtype::of<double>();
+    default: throw std::invalid_argument("Unsupported depth of image " + std::to_string(depth));
+  }
+}
+
+// Returns -1 if the dtype has no corresponding depth
+inline int dtype_to_depth(const py::dtype& dtype)
+{
+  for (int depth : {CV_8U, CV_8S, CV_16U, CV_16S, CV_32S, CV_32F, CV_64F})
+  {
+    if (dtype.equal(depth_to_dtype(depth)))
+    {
+      return depth;
+    }
+  }
+  return -1;
+}
+
+// Returns a matrix that refers to the buffer of an array with shape (rows, cols) or (rows, cols, channels), or an empty
+// matrix if the array cannot be referred to without copying, i.e. if pixels or channels are not contiguous. The array must
+// outlive the matrix.
+inline cv::Mat numpy_to_mat(py::array array)
+{
+  int depth = dtype_to_depth(array.dtype());
+  if (depth < 0 || (array.ndim() != 2 && array.ndim() != 3))
+  {
+    return cv::Mat();
+  }
+  int channels = array.ndim() == 3 ? array.shape(2) : 1;
+  if (channels < 1 || channels > CV_CN_MAX)
+  {
+    return cv::Mat();
+  }
+  if ((array.ndim() == 3 && array.strides(2) != (ssize_t) array.itemsize()) || array.strides(1) != (ssize_t) (array.itemsize() * channels) || array.strides(0) < array.strides(1) * array.shape(1))
+  {
+    return cv::Mat();
+  }
+  return cv::Mat(array.shape(0), array.shape(1), CV_MAKETYPE(depth, channels), const_cast<void*>(array.data()), array.strides(0));
+}
+
+// Returns an array with shape (rows, cols, channels) that adopts the buffer of the matrix. The array holds a reference
+// of the matrix in a capsule, such that the buffer is released when both are destroyed.
+inline py::array mat_to_numpy(const cv::Mat& image)
+{
+  if (image.empty())
+  {
+    return py::array(depth_to_dtype(image.depth()), std::vector<ssize_t>{0, 0, image.channels()});
+  }
+  std::vector<ssize_t> shape = {image.rows, image.cols, image.channels()};
+  std::vector<ssize_t> strides = {(ssize_t) image.step[0], (ssize_t) image.elemSize(), (ssize_t) image.elemSize1()};
+  cv::Mat* owner = new cv::Mat(image);
+  py::capsule capsule(owner, [](void* mat){delete reinterpret_cast<cv::Mat*>(mat);});
+  return py::array(depth_to_dtype(image.depth()), shape, strides, owner->data, capsule);
+}
+
+} // end of ns tiledwebmaps
+
 namespace pybind11::detail {
 
+// Images are passed as numpy arrays without copying the pixels where possible
+template <>
+struct type_caster<cv::Mat>
+{
+public:
+  PYBIND11_TYPE_CASTER(cv::Mat, const_name("numpy.ndarray"));
+
+  bool load(py::handle src, bool convert)
+  {
+    if (!py::isinstance<py::array>(src) && !convert)
+    {
+      return false;
+    }
+    py::array array = py::array::ensure(src);
+    if (!array)
+    {
+      PyErr_Clear();
+      return false;
+    }
+    value = tiledwebmaps::numpy_to_mat(array);
+    if (value.empty() && convert)
+    {
+      array = py::array::ensure(array, py::array::c_style);
+      value = tiledwebmaps::numpy_to_mat(array);
+    }
+    if (value.empty() && array.size() > 0)
+    {
+      return false;
+    }
+    m_array = array;
+    return true;
+  }
+
+  static py::handle cast(const cv::Mat& src, py::return_value_policy /* policy */, py::handle /* parent */)
+  {
+    return tiledwebmaps::mat_to_numpy(src).release();
+  }
+
+private:
+  // Keeps the buffer of the loaded matrix alive
+  py::array m_array;
+};
+
 template <typename TElementType, size_t TRank>
 struct type_caster<tiledwebmaps::Rigid<TElementType, TRank>>
 {
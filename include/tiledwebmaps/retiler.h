@@ -0,0 +1,316 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/layout.h>
+#include <tiledwebmaps/metrics.h>
+#include <tiledwebmaps/proj.h>
+#include <tiledwebmaps/warp.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace tiledwebmaps {
+
+// Cuts georeferenced rasters that are too large to be held in memory into the tiles of a layout at a single zoom level
+// and saves the tiles to a cache. Rasters are passed in blocks, e.g. strips of rows from a decoder, which are warped into
+// all tiles they overlap. A tile is saved once it is completely covered, possibly by blocks of several adjacent rasters.
+// At most max_pending_tiles incomplete tiles are kept in memory: when exceeded, the least recently updated tile is saved
+// as is and is loaded from the cache again if a later block overlaps it. flush saves all remaining tiles, pixels that
+// are not covered by any block have the background color.
+//
+// Pixels are interpolated bilinearly, the zoom level should therefore not be coarser than the resolution of the rasters.
+// Lower zoom levels can be built from the saved tiles afterwards, e.g. with tiledwebmaps.util.add_zooms.
+class Retiler : public Instrumented
+{
+public:
+  Retiler(std::shared_ptr<Cache> sink, const Layout& layout, int zoom, size_t max_pending_tiles = 256, cv::Vec3b background = cv::Vec3b(0, 0, 0))
+    : Instrumented("retiler")
+    , m_sink(sink)
+    , m_layout(layout)
+    , m_zoom(zoom)
+    , m_max_pending_tiles(max_pending_tiles)
+    , m_background(background)
+  {
+    if (m_layout.get_tile_shape_px()(0) != m_layout.get_tile_shape_px()(1))
+    {
+      throw std::invalid_argument("Retiler requires square tiles");
+    }
+    if (m_max_pending_tiles == 0)
+    {
+      throw std::invalid_argument("Retiler must keep at least one pending tile");
+    }
+  }
+
+  Retiler(const Retiler&) = delete;
+  Retiler& operator=(const Retiler&) = delete;
+
+  virtual ~Retiler()
+  {
+    try
+    {
+      flush();
+    }
+    catch (...)
+    {
+    }
+  }
+
+  // Warps an RGB block of a raster into all tiles it overlaps. offset is the pixel (row, col) of the raster at the
+  // top-left corner of the block, while the georeference refers to the whole raster.
+  void add(const cv::Mat& block, const Georeference& georeference, xti::vec2i offset = xti::vec2i({0, 0}))
+  {
+    if (block.empty())
+    {
+      return;
+    }
+    if (block.type() != CV_8UC3)
+    {
+      throw std::invalid_argument("Retiler expects blocks with 3 channels of type uint8");
+    }
+    m_metrics->increment("blocks");
+    auto timer = m_metrics->time("add");
+
+    // Blocks are warped concurrently, the lock is only held while merging them into the pending tiles
+    const proj::Transformer* layout_to_crs;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      layout_to_crs = get_transformer(georeference.crs);
+    }
+    tiledwebmaps::Affine2<double> crs_to_pixel = georeference.pixel_to_crs.inverse();
+    int tile_size = m_layout.get_tile_shape_px()(0);
+
+    // Tiles overlapped by the block, found from points along its border
+    double min0 = std::numeric_limits<double>::max();
+    double max0 = std::numeric_limits<double>::lowest();
+    double min1 = min0;
+    double max1 = max0;
+    for (int i = 0; i < 4 * WARP_GRID_SIZE; i++)
+    {
+      int side = i / WARP_GRID_SIZE;
+      double f = (double) (i % WARP_GRID_SIZE) / WARP_GRID_SIZE;
+      tiledwebmaps::Point2<double> pixel;
+      switch (side)
+      {
+        case 0: pixel = tiledwebmaps::Point2<double>(0, f * block.cols); break;
+        case 1: pixel = tiledwebmaps::Point2<double>(f * block.rows, block.cols); break;
+        case 2: pixel = tiledwebmaps::Point2<double>(block.rows, (1 - f) * block.cols); break;
+        default: pixel = tiledwebmaps::Point2<double>((1 - f) * block.rows, 0); break;
+      }
+      pixel = tiledwebmaps::Point2<double>(pixel(0) + offset(0), pixel(1) + offset(1));
+      tiledwebmaps::Point2<double> coords_crs = georeference.pixel_to_crs.transform(pixel);
+      if (layout_to_crs)
+      {
+        coords_crs = tiledwebmaps::Point2<double>(layout_to_crs->transform_inverse(coords_crs.to_xti()));
+      }
+      tiledwebmaps::Point2<double> coords_tile = m_layout.crs_to_tile(coords_crs, m_zoom);
+      if (std::isfinite(coords_tile(0)) && std::isfinite(coords_tile(1)))
+      {
+        min0 = std::min(min0, coords_tile(0));
+        max0 = std::max(max0, coords_tile(0));
+        min1 = std::min(min1, coords_tile(1));
+        max1 = std::max(max1, coords_tile(1));
+      }
+    }
+    if (min0 > max0)
+    {
+      m_metrics->increment("errors.not_transformable");
+      return;
+    }
+
+    cv::Mat map_x, map_y, warped;
+    cv::Mat mask(tile_size, tile_size, CV_8UC1);
+    for (int t0 = (int) std::floor(min0); t0 <= (int) std::floor(max0); t0++)
+    {
+      for (int t1 = (int) std::floor(min1); t1 <= (int) std::floor(max1); t1++)
+      {
+        xti::vec2i tile({t0, t1});
+
+        // A pixel of the tile belongs to the block if its source point lies within the block, such that adjacent blocks
+        // fill adjacent pixels without gaps or overlaps
+        std::vector<tiledwebmaps::Point2<double>> grid = get_warp_grid(m_layout, tile, m_zoom, layout_to_crs, crs_to_pixel);
+        get_warp_maps(grid, tile_size, map_x, map_y, tiledwebmaps::Point2<double>(offset(0) + 0.5, offset(1) + 0.5));
+        int covered = 0;
+        for (int r = 0; r < tile_size; r++)
+        {
+          const float* map_y_row = map_y.ptr<float>(r);
+          const float* map_x_row = map_x.ptr<float>(r);
+          uint8_t* mask_row = mask.ptr<uint8_t>(r);
+          for (int c = 0; c < tile_size; c++)
+          {
+            bool inside = map_y_row[c] >= -0.5f && map_y_row[c] < block.rows - 0.5f && map_x_row[c] >= -0.5f && map_x_row[c] < block.cols - 0.5f;
+            mask_row[c] = inside ? 255 : 0;
+            covered += inside;
+          }
+        }
+        if (covered == 0)
+        {
+          continue;
+        }
+
+        {
+          auto warp_timer = m_metrics->time("warp");
+          cv::remap(block, warped, map_x, map_y, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Pending& pending = get_pending(tile);
+        warped.copyTo(pending.image, mask);
+        cv::bitwise_or(pending.coverage, mask, pending.coverage);
+        if (cv::countNonZero(pending.coverage) == tile_size * tile_size)
+        {
+          save(tile);
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_pending.size() > m_max_pending_tiles)
+    {
+      m_metrics->increment("spills");
+      const Key& key = m_order.back();
+      save(xti::vec2i({key.first, key.second}));
+    }
+  }
+
+  // Saves all pending tiles, including incomplete ones
+  void flush()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (!m_order.empty())
+    {
+      const Key& key = m_order.back();
+      save(xti::vec2i({key.first, key.second}));
+    }
+  }
+
+  size_t get_pending_tiles_num() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending.size();
+  }
+
+  size_t get_max_pending_tiles() const
+  {
+    return m_max_pending_tiles;
+  }
+
+  const Layout& get_layout() const
+  {
+    return m_layout;
+  }
+
+  int get_zoom() const
+  {
+    return m_zoom;
+  }
+
+private:
+  using Key = std::pair<int, int>;
+
+  struct Pending
+  {
+    cv::Mat image;
+    // Non-zero for pixels that were written by a block since the tile was created or loaded
+    cv::Mat coverage;
+    std::list<Key>::iterator order;
+  };
+
+  std::shared_ptr<Cache> m_sink;
+  Layout m_layout;
+  int m_zoom;
+  size_t m_max_pending_tiles;
+  cv::Vec3b m_background;
+
+  std::map<Key, Pending> m_pending;
+  // Most recently updated tile first
+  std::list<Key> m_order;
+  std::map<std::string, std::shared_ptr<proj::Transformer>> m_transformers;
+  mutable std::mutex m_mutex;
+
+  // Requires the lock. Returns NULL if the CRS equals the CRS of the layout. Transformers are never removed and can be
+  // used after releasing the lock.
+  const proj::Transformer* get_transformer(std::shared_ptr<proj::CRS> crs)
+  {
+    if (*crs == *m_layout.get_crs())
+    {
+      return NULL;
+    }
+    std::string description = crs->get_description();
+    auto it = m_transformers.find(description);
+    if (it == m_transformers.end())
+    {
+      it = m_transformers.emplace(description, std::make_shared<proj::Transformer>(m_layout.get_crs()->get_context(), m_layout.get_crs(), crs)).first;
+    }
+    return it->second.get();
+  }
+
+  // Requires the lock. Returns the pending tile and marks it as most recently updated, tiles that are not pending are
+  // loaded from the sink if it contains them.
+  Pending& get_pending(xti::vec2i tile)
+  {
+    Key key(tile(0), tile(1));
+    auto it = m_pending.find(key);
+    if (it != m_pending.end())
+    {
+      m_order.splice(m_order.begin(), m_order, it->second.order);
+      return it->second;
+    }
+
+    int tile_size = m_layout.get_tile_shape_px()(0);
+    cv::Mat image;
+    if (m_sink->contains(tile, m_zoom))
+    {
+      try
+      {
+        image = m_sink->load(tile, m_zoom);
+        m_metrics->increment("reloads");
+      }
+      catch (LoadTileException e)
+      {
+        m_metrics->increment("errors.reload");
+      }
+      catch (CacheFailure e)
+      {
+        m_metrics->increment("errors.reload");
+      }
+    }
+    if (image.rows != tile_size || image.cols != tile_size || image.type() != CV_8UC3)
+    {
+      image = cv::Mat(tile_size, tile_size, CV_8UC3, cv::Scalar(m_background[0], m_background[1], m_background[2]));
+    }
+
+    m_order.push_front(key);
+    Pending& pending = m_pending[key];
+    pending.image = image;
+    pending.coverage = cv::Mat::zeros(tile_size, tile_size, CV_8UC1);
+    pending.order = m_order.begin();
+    return pending;
+  }
+
+  // Requires the lock. Saves the pending tile to the sink and removes it from memory.
+  void save(xti::vec2i tile)
+  {
+    Key key(tile(0), tile(1));
+    auto it = m_pending.find(key);
+    {
+      auto timer = m_metrics->time("save");
+      m_sink->save(it->second.image, tile, m_zoom);
+    }
+    m_metrics->increment("tiles");
+    m_order.erase(it->second.order);
+    m_pending.erase(it);
+  }
+};
+
+} // end of ns tiledwebmaps
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/metrics.h>
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace tiledwebmaps {
+
+// Cache of decoded tiles in shared memory that is used by multiple processes, e.g. forked data loader workers. The
+// memory consists of a fixed number of slots that each hold one tile of at most slot_bytes bytes. A tile can be stored
+// in one of PROBES_NUM slots following the hash of its coordinates, when all are occupied the least recently used one
+// is replaced. Slots are protected by sequence locks: readers never block and retry if a slot was modified while it was
+// copied, writers skip a slot that is being written by another process. A slot that is locked by a process that no longer
+// exists (e.g. a worker that was killed while writing) is taken over by the next writer.
+//
+// Without a name, the memory is anonymous and shared with processes forked after construction. With a name, it is a
+// POSIX shared memory object (/dev/shm/<name>) that unrelated processes can open with create = false. Creating a cache
+// fails if the name already exists.
+//
+// Tiles of different layers (e.g. imagery and elevation) can share the memory: every cache has a layer id that is part of
+// the key of its tiles, and with_layer returns a cache for another layer in the same memory.
+class SharedMemoryCache : public Cache, public Instrumented
+{
+public:
+  static constexpr size_t PROBES_NUM = 8;
+  static constexpr uint64_t MAGIC = 0x74776d73686d3032; // "twmshm02"
+
+  SharedMemoryCache(size_t slots_num, size_t slot_bytes = 256 * 256 * 3, std::string name = "", bool create = true, uint32_t layer = 0)
+    : Cache()
+    , Instrumented("shared_memory")
+    , m_mapping(std::make_shared<Mapping>())
+    , m_layer(layer)
+  {
+    m_mapping->name = name;
+    size_t size = 0;
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory cache requires lock-free 64-bit atomics");
+    if (create)
+    {
+      if (slots_num == 0)
+      {
+        throw std::invalid_argument("Shared memory cache must have at least one slot");
+      }
+      m_slot_stride = get_slot_stride(slot_bytes);
+      size = sizeof(Header) + slots_num * m_slot_stride;
+    }
+
+    int fd = -1;
+    if (!name.empty())
+    {
+      std::string shm_name = "/" + name;
+      if (create)
+      {
+        // Never replaces an existing object that other processes might still use
+        fd = ::shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST)
+        {
+          throw std::runtime_error("Shared memory " + shm_name + " already exists. Open it with create = false, or remove /dev/shm" + shm_name + " if it is left over from a crashed process");
+        }
+      }
+      else
+      {
+        fd = ::shm_open(shm_name.c_str(), O_RDWR, 0600);
+      }
+      if (fd < 0)
+      {
+        throw std::runtime_error("Failed to open shared memory " + shm_name + ". Reason: " + std::strerror(errno));
+      }
+      if (create)
+      {
+        m_mapping->owner_pid = ::getpid();
+        if (::ftruncate(fd, size) != 0)
+        {
+          std::string reason = std::strerror(errno);
+          ::close(fd);
+          throw std::runtime_error("Failed to resize shared memory " + shm_name + ". Reason: " + reason);
+        }
+      }
+      else
+      {
+        Header header;
+        if (::pread(fd, &header, sizeof(Header), 0) != sizeof(Header) || header.magic != MAGIC)
+        {
+          ::close(fd);
+          throw std::runtime_error("Shared memory " + shm_name + " is not a tile cache");
+        }
+        m_slot_stride = get_slot_stride(header.slot_bytes);
+        size = sizeof(Header) + header.slots_num * m_slot_stride;
+      }
+    }
+
+    void* memory = ::mmap(NULL, size, PROT_READ | PROT_WRITE, name.empty() ? (MAP_SHARED | MAP_ANONYMOUS) : MAP_SHARED, fd, 0);
+    if (fd >= 0)
+    {
+      ::close(fd);
+    }
+    if (memory == MAP_FAILED)
+    {
+      throw std::runtime_error(std::string("Failed to map shared memory. Reason: ") + std::strerror(errno));
+    }
+    m_mapping->memory = (uint8_t*) memory;
+    m_mapping->size = size;
+
+    // The memory is zero-initialized, i.e. all slots are empty and unlocked
+    if (create)
+    {
+      Header* header = get_header();
+      header->slots_num = slots_num;
+      header->slot_bytes = slot_bytes;
+      header->clock = 0;
+      header->magic = MAGIC;
+    }
+  }
+
+  SharedMemoryCache(const SharedMemoryCache&) = delete;
+  SharedMemoryCache& operator=(const SharedMemoryCache&) = delete;
+
+  // Returns a cache for the tiles of another layer in the same memory
+  std::shared_ptr<SharedMemoryCache> with_layer(uint32_t layer) const
+  {
+    return std::shared_ptr<SharedMemoryCache>(new SharedMemoryCache(m_mapping, m_slot_stride, layer));
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    uint64_t key = get_key(tile, zoom);
+    if (key == 0)
+    {
+      return false;
+    }
+    size_t first = get_first_slot(key);
+    for (size_t i = 0; i < PROBES_NUM; i++)
+    {
+      const Slot* slot = get_slot((first + i) % get_header()->slots_num);
+      if (slot->key.load(std::memory_order_acquire) == key && slot->layer.load(std::memory_order_relaxed) == m_layer)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    uint64_t key = get_key(tile, zoom);
+    if (key != 0)
+    {
+      size_t first = get_first_slot(key);
+      for (size_t i = 0; i < PROBES_NUM; i++)
+      {
+        Slot* slot = get_slot((first + i) % get_header()->slots_num);
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if ((sequence & 1) != 0 || slot->key.load(std::memory_order_relaxed) != key || slot->layer.load(std::memory_order_relaxed) != m_layer)
+        {
+          continue;
+        }
+        int rows = slot->rows;
+        int cols = slot->cols;
+        int type = slot->type;
+        uint64_t size = slot->size;
+        if (rows <= 0 || cols <= 0 || size > get_header()->slot_bytes || (uint64_t) rows * cols * CV_ELEM_SIZE(type) != size)
+        {
+          // Slot is being modified by another process
+          m_metrics->increment("conflicts");
+          continue;
+        }
+        cv::Mat image(rows, cols, type);
+        std::memcpy(image.data, slot->get_data(), size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) != sequence)
+        {
+          m_metrics->increment("conflicts");
+          continue;
+        }
+        slot->last_access.store(get_header()->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+        m_metrics->increment("hits");
+        return image;
+      }
+    }
+    m_metrics->increment("misses");
+    throw CacheFailure();
+  }
+
+  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    uint64_t key = get_key(tile, zoom);
+    size_t size = image.total() * image.elemSize();
+    if (key == 0 || size > get_header()->slot_bytes)
+    {
+      m_metrics->increment("errors.too_large");
+      return;
+    }
+    cv::Mat continuous = image.isContinuous() ? image : image.clone();
+
+    // Prefer the slot that already holds the tile, then an empty slot, then the least recently used slot
+    size_t first = get_first_slot(key);
+    Slot* victim = NULL;
+    int victim_rank = 3;
+    uint64_t victim_access = 0;
+    for (size_t i = 0; i < PROBES_NUM; i++)
+    {
+      Slot* slot = get_slot((first + i) % get_header()->slots_num);
+      uint64_t slot_key = slot->key.load(std::memory_order_relaxed);
+      int rank = slot_key == key && slot->layer.load(std::memory_order_relaxed) == m_layer ? 0 : (slot_key == 0 ? 1 : 2);
+      uint64_t access = slot->last_access.load(std::memory_order_relaxed);
+      if (rank < victim_rank || (rank == victim_rank && access < victim_access))
+      {
+        victim = slot;
+        victim_rank = rank;
+        victim_access = access;
+      }
+    }
+
+    if (!lock(victim))
+    {
+      // Another process is writing to this slot, the tile is not cached
+      m_metrics->increment("conflicts");
+      return;
+    }
+    // The sequence is odd if the slot is taken over from a process that died while writing it
+    uint64_t sequence = victim->sequence.load(std::memory_order_relaxed) | 1;
+    victim->sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (victim_rank == 2)
+    {
+      m_metrics->increment("evictions");
+    }
+    victim->key.store(key, std::memory_order_relaxed);
+    victim->layer.store(m_layer, std::memory_order_relaxed);
+    victim->rows = continuous.rows;
+    victim->cols = continuous.cols;
+    victim->type = continuous.type();
+    victim->size = size;
+    std::memcpy(victim->get_data(), continuous.data, size);
+    victim->last_access.store(get_header()->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+    victim->sequence.store(sequence + 1, std::memory_order_release);
+    victim->writer.store(0, std::memory_order_release);
+    m_metrics->increment("saves");
+  }
+
+  size_t get_slots_num() const
+  {
+    return get_header()->slots_num;
+  }
+
+  size_t get_slot_bytes() const
+  {
+    return get_header()->slot_bytes;
+  }
+
+  std::string get_name() const
+  {
+    return m_mapping->name;
+  }
+
+  uint32_t get_layer() const
+  {
+    return m_layer;
+  }
+
+private:
+  struct Header
+  {
+    uint64_t magic;
+    uint64_t slots_num;
+    uint64_t slot_bytes;
+    std::atomic<uint64_t> clock;
+    uint8_t padding[32];
+  };
+  static_assert(sizeof(Header) == 64, "Header must fill one cache line");
+
+  struct Slot
+  {
+    // Odd while the slot is being written
+    std::atomic<uint64_t> sequence;
+    // Process id of the writer that holds the slot, 0 if none
+    std::atomic<uint64_t> writer;
+    // Packed tile coordinates, 0 if the slot is empty
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> layer;
+    std::atomic<uint64_t> last_access;
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+    uint64_t size;
+
+    uint8_t* get_data()
+    {
+      return reinterpret_cast<uint8_t*>(this) + get_slot_header_size();
+    }
+  };
+
+  // Shared by the caches of all layers in the same memory
+  struct Mapping
+  {
+    std::string name;
+    pid_t owner_pid = 0;
+    uint8_t* memory = NULL;
+    size_t size = 0;
+
+    ~Mapping()
+    {
+      if (memory != NULL)
+      {
+        ::munmap(memory, size);
+      }
+      // Forked processes inherit this object, but only the creating process removes the shared memory object
+      if (!name.empty() && owner_pid == ::getpid())
+      {
+        ::shm_unlink(("/" + name).c_str());
+      }
+    }
+  };
+
+  std::shared_ptr<Mapping> m_mapping;
+  size_t m_slot_stride;
+  uint32_t m_layer;
+
+  SharedMemoryCache(std::shared_ptr<Mapping> mapping, size_t slot_stride, uint32_t layer)
+    : Cache()
+    , Instrumented("shared_memory")
+    , m_mapping(mapping)
+    , m_slot_stride(slot_stride)
+    , m_layer(layer)
+  {
+  }
+
+  // Acquires the slot for writing. Fails if another process that is still alive holds the slot.
+  static bool lock(Slot* slot)
+  {
+    uint64_t writer = 0;
+    uint64_t pid = ::getpid();
+    if (slot->writer.compare_exchange_strong(writer, pid, std::memory_order_acquire))
+    {
+      return true;
+    }
+    if (writer == pid || ::kill((pid_t) writer, 0) == 0 || errno != ESRCH)
+    {
+      // Held by another thread of this process or by a living process
+      return false;
+    }
+    return slot->writer.compare_exchange_strong(writer, pid, std::memory_order_acquire);
+  }
+
+  static constexpr size_t get_slot_header_size()
+  {
+    return (sizeof(Slot) + 63) / 64 * 64;
+  }
+
+  static size_t get_slot_stride(size_t slot_bytes)
+  {
+    return get_slot_header_size() + (slot_bytes + 63) / 64 * 64;
+  }
+
+  Header* get_header() const
+  {
+    return reinterpret_cast<Header*>(m_mapping->memory);
+  }
+
+  Slot* get_slot(size_t index) const
+  {
+    return reinterpret_cast<Slot*>(m_mapping->memory + sizeof(Header) + index * m_slot_stride);
+  }
+
+  // Returns 0 for tiles that cannot be packed into the key and are therefore not cached
+  static uint64_t get_key(xti::vec2i tile, int zoom)
+  {
+    if (zoom < 0 || zoom >= 255 || tile(0) < 0 || tile(0) >= (1 << 28) || tile(1) < 0 || tile(1) >= (1 << 28))
+    {
+      return 0;
+    }
+    return ((uint64_t) (zoom + 1) << 56) | ((uint64_t) tile(0) << 28) | (uint64_t) tile(1);
+  }
+
+  size_t get_first_slot(uint64_t key) const
+  {
+    key ^= (uint64_t) m_layer * 0x9e3779b97f4a7c15ULL;
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key % get_header()->slots_num;
+  }
+};
+
+} // end of ns tiledwebmaps
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <pthread.h>
+#include <vector>
+
+namespace tiledwebmaps {
+
+// Fixed number of worker threads that run posted tasks in FIFO order. Remaining tasks are run before the pool is
+// destroyed.
+class ThreadPool
+{
+public:
+  ThreadPool(size_t threads_num = std::thread::hardware_concurrency())
+    : m_stop(false)
+  {
+    threads_num = std::max<size_t>(threads_num, 1);
+    for (size_t i = 0; i < threads_num; i++)
+    {
+      m_threads.emplace_back([this](){run();});
+    }
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    for (auto& thread : m_threads)
+    {
+      thread.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void post(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(std::move(task));
+    }
+    m_condition.notify_one();
+  }
+
+  size_t get_threads_num() const
+  {
+    return m_threads.size();
+  }
+
+  // Returns true if called from a worker thread of any pool. Tasks must not block on other tasks of the pool, since all
+  // workers might be blocked then.
+  static bool is_worker()
+  {
+    return get_is_worker();
+  }
+
+  // Pool that is shared by all tileloaders for asynchronous loading and decoding. It is never destroyed, such that tasks
+  // can still be posted during static destruction. The worker threads do not exist in forked child processes, so a new
+  // pool is created in the child on the first call after fork, and the pool of the parent is leaked.
+  static ThreadPool& get_default()
+  {
+    DefaultState& state = get_default_state();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.pool == nullptr)
+    {
+      state.pool = new ThreadPool();
+    }
+    return *state.pool;
+  }
+
+private:
+  struct DefaultState
+  {
+    std::mutex mutex;
+    ThreadPool* pool = nullptr;
+  };
+
+  static bool& get_is_worker()
+  {
+    thread_local bool is_worker = false;
+    return is_worker;
+  }
+
+  static DefaultState& get_default_state()
+  {
+    static DefaultState* state = [](){
+      pthread_atfork(NULL, NULL, [](){
+        // Runs in the child after fork, the mutex might have been held by another thread of the parent
+        new (&get_default_state().mutex) std::mutex();
+        get_default_state().pool = nullptr;
+      });
+      return new DefaultState();
+    }();
+    return *state;
+  }
+
+  std::vector<std::thread> m_threads;
+  std::deque<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  bool m_stop;
+
+  void run()
+  {
+    get_is_worker() = true;
+    while (true)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this](){return m_stop || !m_tasks.empty();});
+        if (m_tasks.empty())
+        {
+          return;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+      }
+      // Tasks report errors through their callbacks. An exception that escapes a task anyway must not terminate the
+      // process.
+      try
+      {
+        task();
+      }
+      catch (...)
+      {
+      }
+    }
+  }
+};
+
+} // end of ns tiledwebmaps
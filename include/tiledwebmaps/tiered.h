@@ -0,0 +1,221 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <xti/util.h>
+#include <tiledwebmaps/cache.h>
+#include <tiledwebmaps/metrics.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <exception>
+
+namespace tiledwebmaps {
+
+// Cache that combines multiple caches ordered from fastest to slowest, e.g. LRU -> Bin -> Disk, and is itself used as
+// cache of a CachedTileLoader. Tiles are loaded from the first tier that contains them and promoted to all faster
+// write-through tiers. Tiers with the same encoding exchange encoded bytes, such that e.g. a tile found in a Bin file
+// is copied to a Disk cache without re-encoding.
+class TieredCache : public Cache, public Instrumented
+{
+public:
+  enum class Policy
+  {
+    // Saved and promoted tiles are written to the tier immediately
+    WRITE_THROUGH,
+    // Tiles are written to the tier only when they are evicted from the previous tier
+    WRITE_BACK,
+    // Tiles are only loaded from the tier
+    READ_ONLY
+  };
+
+  struct Tier
+  {
+    std::shared_ptr<Cache> cache;
+    Policy policy;
+    // Name used in the metrics, defaults to the index and metrics name of the cache, e.g. "0_lru"
+    std::string name;
+  };
+
+  TieredCache(std::vector<Tier> tiers)
+    : Cache()
+    , Instrumented("tiered")
+    , m_tiers(tiers)
+  {
+    for (size_t i = 0; i < m_tiers.size(); i++)
+    {
+      Tier& tier = m_tiers[i];
+      if (!tier.cache)
+      {
+        throw std::invalid_argument(XTI_TO_STRING("Tier " << i << " has no cache"));
+      }
+      if (tier.name.empty())
+      {
+        Instrumented* instrumented = dynamic_cast<Instrumented*>(tier.cache.get());
+        tier.name = std::to_string(i) + (instrumented ? "_" + instrumented->get_metrics()->get_name() : "");
+      }
+      if (tier.policy == Policy::WRITE_BACK)
+      {
+        std::shared_ptr<Cache> cache = tier.cache;
+        std::shared_ptr<Metrics> metrics = m_metrics;
+        std::string name = tier.name;
+        auto callback = [cache, metrics, name](const cv::Mat& image, xti::vec2i tile, int zoom){
+          try
+          {
+            if (!cache->contains(tile, zoom))
+            {
+              cache->save(image, tile, zoom);
+              metrics->increment("write_backs." + name);
+            }
+          }
+          catch (std::exception& e)
+          {
+            metrics->increment("errors.write_back");
+          }
+        };
+        if (i == 0 || !m_tiers[i - 1].cache->set_eviction_callback(callback))
+        {
+          throw std::invalid_argument(XTI_TO_STRING("Write-back tier " << i << " requires a previous tier that evicts tiles"));
+        }
+      }
+    }
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    for (const Tier& tier : m_tiers)
+    {
+      if (tier.cache->contains(tile, zoom))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    for (size_t i = 0; i < m_tiers.size(); i++)
+    {
+      Tier& tier = m_tiers[i];
+      if (!tier.cache->contains(tile, zoom))
+      {
+        continue;
+      }
+
+      // Encoded bytes are only needed if a faster tier stores the same encoding
+      std::string encoding = tier.cache->get_encoding();
+      bool copy_encoded = false;
+      for (size_t j = 0; j < i; j++)
+      {
+        copy_encoded = copy_encoded || (m_tiers[j].policy == Policy::WRITE_THROUGH && !encoding.empty() && m_tiers[j].cache->get_encoding() == encoding);
+      }
+
+      cv::Mat image;
+      std::vector<uint8_t> data;
+      try
+      {
+        if (copy_encoded)
+        {
+          data = tier.cache->load_encoded(tile, zoom);
+          image = tier.cache->decode(data, tile, zoom);
+        }
+        else
+        {
+          image = tier.cache->load(tile, zoom);
+        }
+      }
+      catch (CacheFailure e)
+      {
+        m_metrics->increment("errors.load");
+        continue;
+      }
+      catch (LoadTileException e)
+      {
+        m_metrics->increment("errors.load");
+        continue;
+      }
+      m_metrics->increment("hits." + tier.name);
+
+      for (size_t j = 0; j < i; j++)
+      {
+        Tier& faster_tier = m_tiers[j];
+        if (faster_tier.policy != Policy::WRITE_THROUGH)
+        {
+          continue;
+        }
+        try
+        {
+          if (copy_encoded && faster_tier.cache->get_encoding() == encoding)
+          {
+            faster_tier.cache->save_encoded(data, tile, zoom);
+          }
+          else
+          {
+            faster_tier.cache->save(image, tile, zoom);
+          }
+          m_metrics->increment("promotions." + faster_tier.name);
+        }
+        catch (std::exception& e)
+        {
+          m_metrics->increment("errors.promote");
+        }
+      }
+      return image;
+    }
+    m_metrics->increment("misses");
+    throw CacheFailure();
+  }
+
+  void save(const cv::Mat& image, xti::vec2i tile, int zoom)
+  {
+    save_ordered(image, tile, zoom, ChannelOrder::RGB);
+  }
+
+  // Failing to save the tile in some tiers is only an error if it could not be saved in any tier
+  void save_ordered(const cv::Mat& image, xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    bool saved = false;
+    std::exception_ptr error;
+    for (Tier& tier : m_tiers)
+    {
+      if (tier.policy != Policy::WRITE_THROUGH)
+      {
+        continue;
+      }
+      try
+      {
+        tier.cache->save_ordered(image, tile, zoom, order);
+        m_metrics->increment("saves." + tier.name);
+        saved = true;
+      }
+      catch (std::exception& e)
+      {
+        m_metrics->increment("errors.save");
+        error = std::current_exception();
+      }
+    }
+    if (!saved && error)
+    {
+      std::rethrow_exception(error);
+    }
+  }
+
+  const std::vector<Tier>& get_tiers() const
+  {
+    return m_tiers;
+  }
+
+  virtual void make_forksafe()
+  {
+    for (auto& tier : m_tiers)
+    {
+      tier.cache->make_forksafe();
+    }
+  }
+
+private:
+  std::vector<Tier> m_tiers;
+};
+
+} // end of ns tiledwebmaps
@@ -1,8 +1,20 @@
 #include <tiledwebmaps/affine.h>
 #include <tiledwebmaps/layout.h>
+#include <tiledwebmaps/metrics.h>
 #include <tiledwebmaps/tileloader.h>
+#include <tiledwebmaps/encoding.h>
 #include <tiledwebmaps/disk.h>
+#include <tiledwebmaps/bounded_disk.h>
+#include <tiledwebmaps/pack.h>
+#include <tiledwebmaps/mbtiles.h>
 #include <tiledwebmaps/lru.h>
 #include <tiledwebmaps/http.h>
+#include <tiledwebmaps/cog.h>
+#include <tiledwebmaps/warp.h>
+#include <tiledwebmaps/retiler.h>
+#include <tiledwebmaps/pipeline.h>
 #include <tiledwebmaps/proj.h>
 #include <tiledwebmaps/bin.h>
+#include <tiledwebmaps/tiered.h>
+#include <tiledwebmaps/shared_memory.h>
+#include <tiledwebmaps/multi_layer.h>
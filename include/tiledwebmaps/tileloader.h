@@ -5,10 +5,23 @@
 #include <xtensor/xtensor.hpp>
 #include <xtensor/xview.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cmath>
 #include <exception>
+#include <stdexcept>
 #include <string>
 #include <tiledwebmaps/layout.h>
-#include <regex>
+#include <tiledwebmaps/metrics.h>
+#include <tiledwebmaps/thread_pool.h>
+#include <optional>
+#include <string_view>
+#include <functional>
+#include <future>
+#include <memory>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#endif
 
 namespace tiledwebmaps {
 
@@ -33,11 +46,111 @@ private:
   std::string m_message;
 };
 
+class TileNotFoundException : public LoadTileException
+{
+public:
+  TileNotFoundException(std::string message)
+    : LoadTileException(message)
+  {
+  }
+};
+
+// Order of the color channels of tiles and images
+enum class ChannelOrder
+{
+  RGB,
+  BGR
+};
+
+// Swaps the red and blue channels of images with 3 or 4 channels, other images are passed through
+inline void swizzle(const cv::Mat& input, cv::Mat& output)
+{
+  if (input.channels() == 3)
+  {
+    cv::cvtColor(input, output, cv::COLOR_RGB2BGR);
+  }
+  else if (input.channels() == 4)
+  {
+    cv::cvtColor(input, output, cv::COLOR_RGBA2BGRA);
+  }
+  else
+  {
+    output = input;
+  }
+}
+
+// Interpolation with which images are sampled from the mosaic of tiles
+enum class Interpolation
+{
+  // Keeps the values of the tiles, e.g. class labels of semantic layers
+  NEAREST,
+  // Bilinear, the mosaic is blurred beforehand if it is finer than the sampled image
+  LINEAR
+};
+
+// Format of the tiles that are returned by tileloaders that decode tiles
+enum class TileFormat
+{
+  // 8-bit tiles with 3 color channels, alpha channels are dropped and gray tiles are expanded
+  COLOR,
+  // Tiles keep the channels and depth of the encoded images, e.g. gray masks, RGBA or NIR bands, or 16-bit and float
+  // elevation
+  UNCHANGED,
+  // Float elevation in meters of Terrarium tiles, encoded as R * 256 + G + B / 256 - 32768
+  TERRARIUM,
+  // Float elevation in meters of Mapbox Terrain-RGB tiles, encoded as (R * 65536 + G * 256 + B) / 10 - 10000
+  TERRAIN_RGB
+};
+
+// Decodes the elevation of a BGR or BGRA tile into a float tile with a single channel
+inline void decode_elevation(const cv::Mat& input, cv::Mat& output, TileFormat format)
+{
+  int channels = input.channels();
+  output.create(input.rows, input.cols, CV_32FC1);
+  for (int r = 0; r < input.rows; r++)
+  {
+    const uint8_t* input_row = input.ptr<uint8_t>(r);
+    float* output_row = output.ptr<float>(r);
+    for (int c = 0; c < input.cols; c++)
+    {
+      const uint8_t* pixel = input_row + c * channels;
+      if (format == TileFormat::TERRARIUM)
+      {
+        output_row[c] = pixel[2] * 256.0f + pixel[1] + pixel[0] / 256.0f - 32768.0f;
+      }
+      else
+      {
+        output_row[c] = (float) ((pixel[2] * 65536 + pixel[1] * 256 + pixel[0]) / 10.0 - 10000.0);
+      }
+    }
+  }
+}
+
+// Encodes a float tile with a single channel into the elevation of a BGR tile, inverse of decode_elevation
+inline void encode_elevation(const cv::Mat& input, cv::Mat& output, TileFormat format)
+{
+  output.create(input.rows, input.cols, CV_8UC3);
+  for (int r = 0; r < input.rows; r++)
+  {
+    const float* input_row = input.ptr<float>(r);
+    uint8_t* output_row = output.ptr<uint8_t>(r);
+    for (int c = 0; c < input.cols; c++)
+    {
+      double value = format == TileFormat::TERRARIUM ? (input_row[c] + 32768.0) * 256.0 : (input_row[c] + 10000.0) * 10.0;
+      int64_t encoded = std::clamp<int64_t>(std::llround(std::isfinite(value) ? value : 0.0), 0, (1 << 24) - 1);
+      output_row[3 * c + 0] = encoded & 0xFF;
+      output_row[3 * c + 1] = (encoded >> 8) & 0xFF;
+      output_row[3 * c + 2] = (encoded >> 16) & 0xFF;
+    }
+  }
+}
+
 class TileLoader
 {
 public:
-  TileLoader(const Layout& layout)
+  TileLoader(const Layout& layout, TileFormat tile_format = TileFormat::COLOR)
     : m_layout(layout)
+    , m_tile_format(tile_format)
   {
   }
 
@@ -45,11 +158,89 @@ public:
 
   virtual cv::Mat load(xti::vec2i tile, int zoom) = 0;
 
+  // Loads the tile with the given channel order. Tileloaders that decode tiles override this to decode them directly into
+  // the requested order, by default the RGB tile returned by load is swizzled.
+  virtual cv::Mat load_ordered(xti::vec2i tile, int zoom, ChannelOrder order)
+  {
+    cv::Mat image = load(tile, zoom);
+    if (order == ChannelOrder::RGB)
+    {
+      return image;
+    }
+    // The tile might be shared with a cache and is not swizzled in place
+    cv::Mat swizzled;
+    swizzle(image, swizzled);
+    return swizzled;
+  }
+
+  // Channel order in which load_ordered returns tiles without swizzling them, e.g. the BGR order of OpenCV's decoders
+  virtual ChannelOrder get_native_channel_order() const
+  {
+    return ChannelOrder::RGB;
+  }
+
+  using LoadCallback = std::function<void(cv::Mat image, std::exception_ptr error)>;
+
+  // Loads the tile without blocking and calls the callback with either the image or the error, possibly from another
+  // thread. The tileloader must outlive all pending loads.
+  virtual void load_async(xti::vec2i tile, int zoom, LoadCallback callback)
+  {
+    load_ordered_async(tile, zoom, ChannelOrder::RGB, callback);
+  }
+
+  // Loads the tile with the given channel order without blocking, as in load_async. By default, load_ordered is run on
+  // the shared thread pool.
+  virtual void load_ordered_async(xti::vec2i tile, int zoom, ChannelOrder order, LoadCallback callback)
+  {
+    ThreadPool::get_default().post([this, tile, zoom, order, callback](){
+      cv::Mat image;
+      try
+      {
+        image = this->load_ordered(tile, zoom, order);
+      }
+      catch (...)
+      {
+        callback(cv::Mat(), std::current_exception());
+        return;
+      }
+      callback(image, nullptr);
+    });
+  }
+
+  std::future<cv::Mat> load_async(xti::vec2i tile, int zoom)
+  {
+    auto promise = std::make_shared<std::promise<cv::Mat>>();
+    std::future<cv::Mat> future = promise->get_future();
+    load_async(tile, zoom, [promise](cv::Mat image, std::exception_ptr error){
+      if (error)
+      {
+        promise->set_exception(error);
+      }
+      else
+      {
+        promise->set_value(image);
+      }
+    });
+    return future;
+  }
+
   const Layout& get_layout() const
   {
     return m_layout;
   }
 
+  TileFormat get_tile_format() const
+  {
+    return m_tile_format;
+  }
+
+  // Tileloaders that decode tiles convert them to this format, and caches that encode tiles expect tiles in this format.
+  // Should be set before tiles are loaded.
+  virtual void set_tile_format(TileFormat tile_format)
+  {
+    m_tile_format = tile_format;
+  }
+
   virtual void make_forksafe()
   {
   }
@@ -69,7 +260,15 @@ public:
   }
 
 protected:
-  void to_tile(cv::Mat& input, bool bgr_to_rgb = true) const
+  // Flags of cv::imdecode that keep everything of the encoded images that the tile format requires
+  int get_imread_flags() const
+  {
+    return m_tile_format == TileFormat::COLOR ? cv::IMREAD_COLOR : cv::IMREAD_UNCHANGED;
+  }
+
+  // Checks the shape of a decoded tile and converts it to the tile format. Decoded color channels are in BGR or BGRA order
+  // and are converted to the given channel order.
+  void to_tile(cv::Mat& input, ChannelOrder order = ChannelOrder::RGB) const
   {
     xti::vec2i got_tile_shape({(int) input.rows, (int) input.cols});
     if (got_tile_shape != m_layout.get_tile_shape_px())
@@ -77,16 +276,33 @@ protected:
       throw LoadTileException("Expected tile shape " + XTI_TO_STRING(m_layout.get_tile_shape_px()) + ", got tile shape " + XTI_TO_STRING(got_tile_shape));
     }
 
-    if (input.channels() == 3)
+    if (m_tile_format == TileFormat::UNCHANGED)
+    {
+      if (order == ChannelOrder::RGB)
+      {
+        swizzle(input, input);
+      }
+    }
+    else if (m_tile_format == TileFormat::TERRARIUM || m_tile_format == TileFormat::TERRAIN_RGB)
+    {
+      if (input.depth() != CV_8U || (input.channels() != 3 && input.channels() != 4))
+      {
+        throw LoadTileException("Expected elevation encoded in 3 or 4 channels of type uint8, got " + std::to_string(input.channels()) + " channels of depth " + std::to_string(input.depth()));
+      }
+      cv::Mat elevation;
+      decode_elevation(input, elevation, m_tile_format);
+      input = elevation;
+    }
+    else if (input.channels() == 3)
     {
-      if (bgr_to_rgb)
+      if (order == ChannelOrder::RGB)
       {
         cv::cvtColor(input, input, cv::COLOR_BGR2RGB);
       }
     }
     else if (input.channels() == 4)
     {
-      if (bgr_to_rgb)
+      if (order == ChannelOrder::RGB)
       {
         cv::cvtColor(input, input, cv::COLOR_BGRA2RGB);
       }
@@ -101,8 +317,33 @@ protected:
     }
   }
 
+  // Converts a tile in the tile format with the given channel order into an image that can be encoded by cv::imencode,
+  // inverse of to_tile
+  cv::Mat from_tile(const cv::Mat& image, ChannelOrder order = ChannelOrder::RGB) const
+  {
+    cv::Mat output;
+    if (m_tile_format == TileFormat::TERRARIUM || m_tile_format == TileFormat::TERRAIN_RGB)
+    {
+      if (image.type() != CV_32FC1)
+      {
+        throw std::invalid_argument("Expected elevation tile with a single channel of type float32");
+      }
+      encode_elevation(image, output, m_tile_format);
+    }
+    else if (order == ChannelOrder::RGB)
+    {
+      swizzle(image, output);
+    }
+    else
+    {
+      output = image;
+    }
+    return output;
+  }
+
 private:
   Layout m_layout;
+  TileFormat m_tile_format;
 };
 
 uint64_t get_time()
@@ -110,8 +351,13 @@ uint64_t get_time()
   return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
-cv::Mat load(TileLoader& tileloader, xti::vec2i min_tile, xti::vec2i max_tile, int zoom)
+// Writes the mosaic of the tiles into image, which is only reallocated if it does not have the size and type of the mosaic.
+// The mosaic has the type of the tiles, e.g. gray, RGBA, 16-bit or float. Tiles are loaded and composed in the native
+// channel order of the tileloader and the mosaic is swizzled once at the end if the requested order differs.
+void load(TileLoader& tileloader, xti::vec2i min_tile, xti::vec2i max_tile, int zoom, cv::Mat& image, ChannelOrder order = ChannelOrder::RGB)
 {
+  ChannelOrder native_order = tileloader.get_native_channel_order();
+
   xti::vec2i tiles_num = max_tile - min_tile;
   xti::vec2i pixels_num = xt::abs(tileloader.get_layout().tile_to_pixel(tiles_num, zoom));
 
@@ -120,13 +366,23 @@ cv::Mat load(TileLoader& tileloader, xti::vec2i min_tile, xti::vec2i max_tile, i
   xti::vec2i image_min_pixel = xt::minimum(corner1, corner2);
   xti::vec2i image_max_pixel = xt::maximum(corner1, corner2);
 
-  cv::Mat image(pixels_num(0), pixels_num(1), CV_8UC3, cv::Scalar(0, 0, 0));
+  bool created = false;
   for (int t0 = min_tile(0); t0 < max_tile(0); t0++)
   {
     for (int t1 = min_tile(1); t1 < max_tile(1); t1++)
     {
       xti::vec2i tile({t0, t1});
-      cv::Mat tile_image = tileloader.load(tile, zoom);
+      cv::Mat tile_image = tileloader.load_ordered(tile, zoom, native_order);
+      if (!created)
+      {
+        // Tiles cover the whole mosaic, such that the image is not cleared
+        image.create(pixels_num(0), pixels_num(1), tile_image.type());
+        created = true;
+      }
+      else if (tile_image.type() != image.type())
+      {
+        throw LoadTileException("Expected tiles of type " + std::to_string(image.type()) + ", got tile of type " + std::to_string(tile_image.type()));
+      }
 
       xti::vec2i corner1 = tileloader.get_layout().tile_to_pixel(tile, zoom);
       xti::vec2i corner2 = tileloader.get_layout().tile_to_pixel(tile + 1, zoom);
@@ -138,25 +394,99 @@ cv::Mat load(TileLoader& tileloader, xti::vec2i min_tile, xti::vec2i max_tile, i
       tile_image.copyTo(image_roi);
     }
   }
+  if (!created)
+  {
+    image.create(pixels_num(0), pixels_num(1), CV_8UC3);
+  }
+  if (native_order != order)
+  {
+    swizzle(image, image);
+  }
+}
 
+cv::Mat load(TileLoader& tileloader, xti::vec2i min_tile, xti::vec2i max_tile, int zoom, ChannelOrder order = ChannelOrder::RGB)
+{
+  cv::Mat image;
+  load(tileloader, min_tile, max_tile, zoom, image, order);
   return image;
 }
 
-cv::Mat load(TileLoader& tileloader, xti::vec2i tile, int zoom)
+cv::Mat load(TileLoader& tileloader, xti::vec2i tile, int zoom, ChannelOrder order = ChannelOrder::RGB)
+{
+  return tileloader.load_ordered(tile, zoom, order);
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// Awaitable for loading a tile in a C++20 coroutine: cv::Mat image = co_await load_awaitable(tileloader, tile, zoom);
+// The coroutine is resumed on the thread that completes the load.
+class LoadAwaitable
+{
+public:
+  LoadAwaitable(TileLoader& tileloader, xti::vec2i tile, int zoom)
+    : m_tileloader(tileloader)
+    , m_tile(tile)
+    , m_zoom(zoom)
+  {
+  }
+
+  bool await_ready() const noexcept
+  {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    m_tileloader.load_async(m_tile, m_zoom, [this, handle](cv::Mat image, std::exception_ptr error){
+      m_image = image;
+      m_error = error;
+      handle.resume();
+    });
+  }
+
+  cv::Mat await_resume()
+  {
+    if (m_error)
+    {
+      std::rethrow_exception(m_error);
+    }
+    return m_image;
+  }
+
+private:
+  TileLoader& m_tileloader;
+  xti::vec2i m_tile;
+  int m_zoom;
+  cv::Mat m_image;
+  std::exception_ptr m_error;
+};
+
+LoadAwaitable load_awaitable(TileLoader& tileloader, xti::vec2i tile, int zoom)
 {
-  return tileloader.load(tile, zoom);
+  return LoadAwaitable(tileloader, tile, zoom);
 }
+#endif
 
-cv::Mat load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, int zoom)
+// Pose geometry of an image that is sampled from tiles: the tiles covering the footprint of the image and the maps with
+// which the image is sampled from the mosaic of these tiles. The geometry depends only on the layout and zoom level, such
+// that it is shared by all tileloaders with the same layout.
+struct MetricGeometry
 {
-  // Load source image
-  xti::vec2f dest_pixels = shape;
-  xti::vec2f dest_meters = dest_pixels * meters_per_pixel;
-  xti::vec2f src_meters = dest_meters;
-  xti::vec2f src_pixels_per_meter = tileloader.get_layout().pixels_per_meter_at_latlon(latlon, zoom);
-  float src_pixels_per_meter1 = 0.5 * (src_pixels_per_meter(0) + src_pixels_per_meter(1));
-  src_pixels_per_meter = xti::vec2f({src_pixels_per_meter1, src_pixels_per_meter1}); // TODO: why is this necessary?
-  xti::vec2f src_pixels = src_meters * src_pixels_per_meter;
+  int zoom;
+  xti::vec2i min_tile;
+  xti::vec2i max_tile;
+  // Standard deviation in pixels of the mosaic of the gaussian that removes aliasing before bilinear sampling, 0 if the
+  // mosaic is not finer than the image
+  double blur_sigma;
+  cv::Mat map_x;
+  cv::Mat map_y;
+};
+
+// Computes the geometry of an image with the given location, bearing and resolution. The maps of the geometry are only
+// reallocated if they do not have the given shape.
+void get_metric_geometry(const Layout& layout, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, int zoom, MetricGeometry& geometry)
+{
+  xti::vec2d src_pixels_per_meter2 = layout.pixels_per_meter_at_latlon(latlon, zoom);
+  float src_pixels_per_meter = 0.5 * (src_pixels_per_meter2(0) + src_pixels_per_meter2(1)); // TODO: why is this necessary?
 
   float rotation_factor = std::fmod(tiledwebmaps::radians(bearing), xt::numeric_constants<float>::PI / 2);
   if (rotation_factor < 0)
@@ -164,190 +494,276 @@ cv::Mat load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, fl
     rotation_factor += xt::numeric_constants<float>::PI / 2;
   }
   rotation_factor = std::sqrt(2.0f) * std::sin(rotation_factor + xt::numeric_constants<float>::PI / 4);
-  src_pixels = src_pixels * rotation_factor;
-
-  xti::vec2d global_center_pixel = tileloader.get_layout().epsg4326_to_pixel(latlon, zoom);
-  xti::vec2d global_min_pixel = global_center_pixel - src_pixels / 2;
-  xti::vec2d global_max_pixel = global_center_pixel + src_pixels / 2;
-
-  xti::vec2i global_tile_corner1 = tileloader.get_layout().pixel_to_tile(global_min_pixel, zoom);
-  xti::vec2i global_tile_corner2 = tileloader.get_layout().pixel_to_tile(global_max_pixel, zoom);
-  xti::vec2i global_min_tile = xt::minimum(global_tile_corner1, global_tile_corner2);
-  xti::vec2i global_max_tile = xt::maximum(global_tile_corner1, global_tile_corner2) + 1;
-
-  cv::Mat src_image = load(tileloader, global_min_tile, global_max_tile, zoom);
-
-  if (xt::amin(src_pixels_per_meter)() > 1.0 / meters_per_pixel)
-  {
-    double sigma = (xt::amin(src_pixels_per_meter)() * meters_per_pixel - 1) / 2;
-    size_t kernel_size = static_cast<size_t>(std::ceil(sigma) * 4) + 1;
-    cv::GaussianBlur(src_image, src_image, cv::Size(kernel_size, kernel_size), sigma, sigma);
-  }
-
-  // Sample dest image
-  xti::vec2d global_srcimagemin_pixel = xt::minimum(tileloader.get_layout().tile_to_pixel(global_min_tile, zoom), tileloader.get_layout().tile_to_pixel(global_max_tile, zoom));
-  xti::vec2d destim_center_pixel = xt::cast<float>(shape) / 2;
-  xti::vec2d srcim_center_pixel = global_center_pixel - global_srcimagemin_pixel;
-  float angle_dest_to_src = -tiledwebmaps::radians(bearing) + tileloader.get_layout().get_meridian_convergence(latlon);
-  tiledwebmaps::ScaledRigid<float, 2, false> dest_to_center;
-  dest_to_center.get_translation() = -destim_center_pixel;
-  tiledwebmaps::ScaledRigid<float, 2, false> dest_pixels_to_meters;
-  dest_pixels_to_meters.get_scale() = xti::vec2f({meters_per_pixel, meters_per_pixel});
-  tiledwebmaps::ScaledRigid<float, 2, false> rotate_dest_to_src;
-  rotate_dest_to_src.get_rotation() = tiledwebmaps::angle_to_rotation_matrix(angle_dest_to_src); // TODO: epsg4326_to_epsg....transform_angle()?
-  tiledwebmaps::ScaledRigid<float, 2, false> src_meters_to_pixels;
-  src_meters_to_pixels.get_scale() = src_pixels_per_meter;
-  tiledwebmaps::ScaledRigid<float, 2, false> src_from_center;
-  src_from_center.get_translation() = srcim_center_pixel;
-
-  tiledwebmaps::ScaledRigid<float, 2, false> transform = src_from_center * src_meters_to_pixels * rotate_dest_to_src * dest_pixels_to_meters * dest_to_center;
-  xti::mat2f sR = transform.get_rotation();
-  for (int r = 0; r < 2; r++)
-  {
-    for (int c = 0; c < 2; c++)
-    {
-      sR(r, c) *= transform.get_scale()(r);
-    }
+
+  tiledwebmaps::Point2<float> src_pixels;
+  for (int i = 0; i < 2; i++)
+  {
+    float dest_meters = shape(i) * meters_per_pixel;
+    src_pixels(i) = dest_meters * src_pixels_per_meter * rotation_factor;
+  }
+
+  tiledwebmaps::Point2<double> global_center_pixel(layout.epsg4326_to_pixel(latlon, zoom));
+  tiledwebmaps::Point2<double> global_tile_corner1 = layout.pixel_to_tile(tiledwebmaps::Point2<double>(global_center_pixel(0) - src_pixels(0) / 2, global_center_pixel(1) - src_pixels(1) / 2), zoom);
+  tiledwebmaps::Point2<double> global_tile_corner2 = layout.pixel_to_tile(tiledwebmaps::Point2<double>(global_center_pixel(0) + src_pixels(0) / 2, global_center_pixel(1) + src_pixels(1) / 2), zoom);
+  geometry.zoom = zoom;
+  for (int i = 0; i < 2; i++)
+  {
+    int corner1 = static_cast<int>(global_tile_corner1(i));
+    int corner2 = static_cast<int>(global_tile_corner2(i));
+    geometry.min_tile(i) = std::min(corner1, corner2);
+    geometry.max_tile(i) = std::max(corner1, corner2) + 1;
+  }
+
+  geometry.blur_sigma = 0;
+  if (src_pixels_per_meter > 1.0 / meters_per_pixel)
+  {
+    geometry.blur_sigma = (src_pixels_per_meter * meters_per_pixel - 1) / 2;
+  }
+
+  tiledwebmaps::Point2<double> global_srcimage_corner1 = layout.tile_to_pixel(tiledwebmaps::Point2<double>(geometry.min_tile(0), geometry.min_tile(1)), zoom);
+  tiledwebmaps::Point2<double> global_srcimage_corner2 = layout.tile_to_pixel(tiledwebmaps::Point2<double>(geometry.max_tile(0), geometry.max_tile(1)), zoom);
+  tiledwebmaps::Point2<float> destim_center_pixel(shape(0) / 2.0f, shape(1) / 2.0f);
+  tiledwebmaps::Point2<float> srcim_center_pixel;
+  for (int i = 0; i < 2; i++)
+  {
+    srcim_center_pixel(i) = global_center_pixel(i) - std::min(global_srcimage_corner1(i), global_srcimage_corner2(i));
   }
-  xti::vec2f t = transform.get_translation();
+  float angle_dest_to_src = -tiledwebmaps::radians(bearing) + layout.get_meridian_convergence(latlon);
+  tiledwebmaps::Affine2<float> transform = tiledwebmaps::Affine2<float>::translation(srcim_center_pixel) // src_from_center
+    * tiledwebmaps::Affine2<float>::scale(src_pixels_per_meter) // src_meters_to_pixels
+    * tiledwebmaps::Affine2<float>::rotation(angle_dest_to_src) // rotate_dest_to_src, TODO: epsg4326_to_epsg....transform_angle()?
+    * tiledwebmaps::Affine2<float>::scale(meters_per_pixel) // dest_pixels_to_meters
+    * tiledwebmaps::Affine2<float>::translation(-destim_center_pixel(0), -destim_center_pixel(1)); // dest_to_center
 
   cv::Size newsize((size_t) shape(1), (size_t) shape(0));
-  cv::Mat map_x(newsize, CV_32FC1);
-  cv::Mat map_y(newsize, CV_32FC1);
+  geometry.map_x.create(newsize, CV_32FC1);
+  geometry.map_y.create(newsize, CV_32FC1);
   for (int r = 0; r < shape(0); r++)
   {
     float point0 = r;
-    float sR00t0 = sR(0, 0) * point0 + t(0);
-    float sR10t0 = sR(1, 0) * point0 + t(1);
+    float sR00t0 = transform.m00 * point0 + transform.t0;
+    float sR10t0 = transform.m10 * point0 + transform.t1;
+    float* map_y_row = geometry.map_y.ptr<float>(r);
+    float* map_x_row = geometry.map_x.ptr<float>(r);
     for (int c = 0; c < shape(1); c++)
     {
       float point1 = c;
-      map_y.at<float>(r, c) = sR00t0 + sR(0, 1) * point1;
-      map_x.at<float>(r, c) = sR10t0 + sR(1, 1) * point1;
+      map_y_row[c] = sR00t0 + transform.m01 * point1;
+      map_x_row[c] = sR10t0 + transform.m11 * point1;
     }
   }
-  cv::Mat dest_image;
-  cv::remap(src_image, dest_image, map_x, map_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0)); // BORDER_REPLICATE
-
-  return dest_image;
 }
 
-cv::Mat load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape)
+// Samples dest from the mosaic of the tiles of the geometry. dest is only reallocated if it does not have the shape of the
+// geometry and the type of the mosaic. Bilinear sampling blurs the mosaic in place.
+void sample_metric(cv::Mat& src_image, const MetricGeometry& geometry, cv::Mat& dest, Interpolation interpolation = Interpolation::LINEAR)
 {
-  return load_metric(tileloader, latlon, bearing, meters_per_pixel, shape, tileloader.get_zoom(latlon, meters_per_pixel));
+  if (interpolation == Interpolation::LINEAR && geometry.blur_sigma > 0)
+  {
+    size_t kernel_size = static_cast<size_t>(std::ceil(geometry.blur_sigma) * 4) + 1;
+    cv::GaussianBlur(src_image, src_image, cv::Size(kernel_size, kernel_size), geometry.blur_sigma, geometry.blur_sigma);
+  }
+  dest.create(geometry.map_x.size(), src_image.type());
+  int flags = interpolation == Interpolation::NEAREST ? cv::INTER_NEAREST : cv::INTER_LINEAR;
+  cv::remap(src_image, dest, geometry.map_x, geometry.map_y, flags, cv::BORDER_CONSTANT, cv::Scalar::all(0)); // BORDER_REPLICATE
 }
 
-std::string replace_placeholders(std::string url, const Layout& layout, xti::vec2i tile, int zoom)
+// Writes the image into dest, which is only reallocated if it does not have the given shape and the type of the tiles,
+// e.g. such that images are sampled directly into the slots of a batch. The mosaic of tiles and the sampling maps are
+// kept per thread and reused across calls, such that no memory is allocated once their size is reached (apart from
+// loading the tiles). The mosaic is composed and sampled in the native channel order of the tileloader, only dest is
+// swizzled if needed. Tiles of any type are interpolated bilinearly, e.g. float elevation is not quantized.
+void load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, int zoom, cv::Mat& dest, ChannelOrder order = ChannelOrder::RGB)
 {
-  xti::vec2d crs_lower = layout.tile_to_crs(tile, zoom);
-  xti::vec2d crs_upper = layout.tile_to_crs(tile + 1, zoom);
-  if (crs_lower(0) > crs_upper(0))
+  thread_local cv::Mat src_image;
+  thread_local MetricGeometry geometry;
+
+  std::shared_ptr<Metrics> metrics;
+  if (Instrumented* instrumented = dynamic_cast<Instrumented*>(&tileloader))
   {
-    std::swap(crs_lower(0), crs_upper(0));
+    metrics = instrumented->get_metrics();
   }
-  if (crs_lower(1) > crs_upper(1))
+
+  get_metric_geometry(tileloader.get_layout(), latlon, bearing, meters_per_pixel, shape, zoom, geometry);
+
+  auto fetch_start = std::chrono::steady_clock::now();
+  ChannelOrder native_order = tileloader.get_native_channel_order();
+  load(tileloader, geometry.min_tile, geometry.max_tile, zoom, src_image, native_order);
+  auto warp_start = std::chrono::steady_clock::now();
+  if (metrics)
   {
-    std::swap(crs_lower(1), crs_upper(1));
+    metrics->record("load_metric.fetch", fetch_start, warp_start);
   }
-  xti::vec2d crs_center = layout.tile_to_crs(tile + 0.5, zoom);
-  xti::vec2d crs_size = crs_upper - crs_lower;
 
-  xti::vec2d px_lower = layout.tile_to_pixel(tile, zoom);
-  xti::vec2d px_upper = layout.tile_to_pixel(tile + 1, zoom);
-  if (px_lower(0) > px_upper(0))
+  sample_metric(src_image, geometry, dest);
+  if (native_order != order)
   {
-    std::swap(px_lower(0), px_upper(0));
+    swizzle(dest, dest);
   }
-  if (px_lower(1) > px_upper(1))
+  if (metrics)
   {
-    std::swap(px_lower(1), px_upper(1));
+    metrics->record("load_metric.warp", warp_start, std::chrono::steady_clock::now());
   }
-  xti::vec2d px_center = layout.tile_to_pixel(tile + 0.5, zoom);
-  xti::vec2i px_size = layout.get_tile_shape_px();
+}
 
-  xti::vec2i tile_lower = tile;
-  xti::vec2d tile_center = tile + 0.5;
-  xti::vec2i tile_upper = tile + 1;
+cv::Mat load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, int zoom, ChannelOrder order = ChannelOrder::RGB)
+{
+  cv::Mat dest;
+  load_metric(tileloader, latlon, bearing, meters_per_pixel, shape, zoom, dest, order);
+  return dest;
+}
 
-  xti::vec2d latlon_lower = layout.tile_to_epsg4326(tile, zoom);
-  xti::vec2d latlon_upper = layout.tile_to_epsg4326(tile + 1, zoom);
-  if (latlon_lower(0) > latlon_upper(0))
-  {
-    std::swap(latlon_lower(0), latlon_upper(0));
-  }
-  if (latlon_lower(1) > latlon_upper(1))
+cv::Mat load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, ChannelOrder order = ChannelOrder::RGB)
+{
+  return load_metric(tileloader, latlon, bearing, meters_per_pixel, shape, tileloader.get_zoom(latlon, meters_per_pixel), order);
+}
+
+void load_metric(TileLoader& tileloader, xti::vec2d latlon, float bearing, float meters_per_pixel, xti::vec2i shape, cv::Mat& dest, ChannelOrder order = ChannelOrder::RGB)
+{
+  load_metric(tileloader, latlon, bearing, meters_per_pixel, shape, tileloader.get_zoom(latlon, meters_per_pixel), dest, order);
+}
+
+std::string replace_placeholders(std::string url, const Layout& layout, xti::vec2i tile, int zoom)
+{
+  // Corners and center of the tile in some coordinate system, computed only if a placeholder requires them
+  struct Bounds
   {
-    std::swap(latlon_lower(1), latlon_upper(1));
-  }
-  xti::vec2d latlon_center = layout.tile_to_epsg4326(tile + 0.5, zoom);
-  xti::vec2d latlon_size = latlon_upper - latlon_lower;
+    tiledwebmaps::Point2<double> lower;
+    tiledwebmaps::Point2<double> upper;
+    tiledwebmaps::Point2<double> center;
+  };
+  auto make_bounds = [&](auto transform){
+    Bounds bounds;
+    bounds.lower = transform(tiledwebmaps::Point2<double>(tile(0), tile(1)));
+    bounds.upper = transform(tiledwebmaps::Point2<double>(tile(0) + 1, tile(1) + 1));
+    bounds.center = transform(tiledwebmaps::Point2<double>(tile(0) + 0.5, tile(1) + 0.5));
+    for (int i = 0; i < 2; i++)
+    {
+      if (bounds.lower(i) > bounds.upper(i))
+      {
+        std::swap(bounds.lower(i), bounds.upper(i));
+      }
+    }
+    return bounds;
+  };
+  std::optional<Bounds> crs_bounds, px_bounds, latlon_bounds;
+  auto crs = [&]() -> const Bounds& {
+    if (!crs_bounds)
+    {
+      crs_bounds = make_bounds([&](tiledwebmaps::Point2<double> coords_tile){return layout.tile_to_crs(coords_tile, zoom);});
+    }
+    return *crs_bounds;
+  };
+  auto px = [&]() -> const Bounds& {
+    if (!px_bounds)
+    {
+      px_bounds = make_bounds([&](tiledwebmaps::Point2<double> coords_tile){return layout.tile_to_pixel(coords_tile, zoom);});
+    }
+    return *px_bounds;
+  };
+  auto latlon = [&]() -> const Bounds& {
+    if (!latlon_bounds)
+    {
+      latlon_bounds = make_bounds([&](tiledwebmaps::Point2<double> coords_tile){return tiledwebmaps::Point2<double>(layout.crs_to_epsg4326(layout.tile_to_crs(coords_tile, zoom).to_xti()));});
+    }
+    return *latlon_bounds;
+  };
+  xti::vec2i px_size = layout.get_tile_shape_px();
 
-  std::string quad = "";
-  for (int32_t bit = zoom; bit > 0; bit--)
+  auto quad = [&](){
+    std::string quad = "";
+    for (int32_t bit = zoom; bit > 0; bit--)
+    {
+      char digit = '0';
+      auto mask = 1 << (bit - 1);
+      if ((tile(0) & mask) != 0)
+      {
+        digit += 1;
+      }
+      if ((tile(1) & mask) != 0)
+      {
+        digit += 2;
+      }
+      quad += digit;
+    }
+    return quad;
+  };
+
+  auto bbox = [&](){
+    const Bounds& bounds = crs();
+    return std::to_string(bounds.lower(0)) + "," + std::to_string(bounds.lower(1)) + "," + std::to_string(bounds.upper(0)) + "," + std::to_string(bounds.upper(1));
+  };
+
+  auto value = [&](std::string_view name) -> std::optional<std::string> {
+    if (name == "crs_lower_x") return std::to_string(crs().lower(0));
+    if (name == "crs_lower_y") return std::to_string(crs().lower(1));
+    if (name == "crs_upper_x") return std::to_string(crs().upper(0));
+    if (name == "crs_upper_y") return std::to_string(crs().upper(1));
+    if (name == "crs_center_x") return std::to_string(crs().center(0));
+    if (name == "crs_center_y") return std::to_string(crs().center(1));
+    if (name == "crs_size_x") return std::to_string(crs().upper(0) - crs().lower(0));
+    if (name == "crs_size_y") return std::to_string(crs().upper(1) - crs().lower(1));
+
+    if (name == "px_lower_x") return std::to_string(px().lower(0));
+    if (name == "px_lower_y") return std::to_string(px().lower(1));
+    if (name == "px_upper_x") return std::to_string(px().upper(0));
+    if (name == "px_upper_y") return std::to_string(px().upper(1));
+    if (name == "px_center_x") return std::to_string(px().center(0));
+    if (name == "px_center_y") return std::to_string(px().center(1));
+    if (name == "px_size_x" || name == "width") return std::to_string(px_size(0));
+    if (name == "px_size_y" || name == "height") return std::to_string(px_size(1));
+
+    if (name == "tile_lower_x" || name == "x") return std::to_string(tile(0));
+    if (name == "tile_lower_y" || name == "y") return std::to_string(tile(1));
+    if (name == "tile_upper_x") return std::to_string(tile(0) + 1);
+    if (name == "tile_upper_y") return std::to_string(tile(1) + 1);
+    if (name == "tile_center_x") return std::to_string(tile(0) + 0.5);
+    if (name == "tile_center_y") return std::to_string(tile(1) + 0.5);
+
+    if (name == "lat_lower") return std::to_string(latlon().lower(0));
+    if (name == "lon_lower") return std::to_string(latlon().lower(1));
+    if (name == "lat_upper") return std::to_string(latlon().upper(0));
+    if (name == "lon_upper") return std::to_string(latlon().upper(1));
+    if (name == "lat_center") return std::to_string(latlon().center(0));
+    if (name == "lon_center") return std::to_string(latlon().center(1));
+    if (name == "lat_size") return std::to_string(latlon().upper(0) - latlon().lower(0));
+    if (name == "lon_size") return std::to_string(latlon().upper(1) - latlon().lower(1));
+
+    if (name == "zoom" || name == "z") return std::to_string(zoom);
+    if (name == "quad") return quad();
+    if (name == "bbox") return bbox();
+    if (name == "proj" || name == "crs") return layout.get_crs()->get_description();
+
+    return std::optional<std::string>();
+  };
+
+  // Replace all placeholders in a single pass, unknown placeholders are kept as they are
+  std::string result;
+  result.reserve(url.size() + 32);
+  size_t pos = 0;
+  while (true)
   {
-    char digit = '0';
-    auto mask = 1 << (bit - 1);
-    if ((tile(0) & mask) != 0)
+    size_t begin = url.find('{', pos);
+    size_t end = begin == std::string::npos ? std::string::npos : url.find('}', begin);
+    if (end == std::string::npos)
+    {
+      result.append(url, pos, std::string::npos);
+      break;
+    }
+    result.append(url, pos, begin - pos);
+    std::optional<std::string> replacement = value(std::string_view(url).substr(begin + 1, end - begin - 1));
+    if (replacement)
     {
-      digit += 1;
+      result += *replacement;
     }
-    if ((tile(1) & mask) != 0)
+    else
     {
-      digit += 2;
+      result.append(url, begin, end + 1 - begin);
     }
-    quad += digit;
-  }
-
-  std::string crs = layout.get_crs()->get_description();
-  std::string bbox = std::to_string(crs_lower(0)) + "," + std::to_string(crs_lower(1)) + "," + std::to_string(crs_upper(0)) + "," + std::to_string(crs_upper(1));
-
-  url = std::regex_replace(url, std::regex("\\{crs_lower_x\\}"), std::to_string(crs_lower(0)));
-  url = std::regex_replace(url, std::regex("\\{crs_lower_y\\}"), std::to_string(crs_lower(1)));
-  url = std::regex_replace(url, std::regex("\\{crs_upper_x\\}"), std::to_string(crs_upper(0)));
-  url = std::regex_replace(url, std::regex("\\{crs_upper_y\\}"), std::to_string(crs_upper(1)));
-  url = std::regex_replace(url, std::regex("\\{crs_center_x\\}"), std::to_string(crs_center(0)));
-  url = std::regex_replace(url, std::regex("\\{crs_center_y\\}"), std::to_string(crs_center(1)));
-  url = std::regex_replace(url, std::regex("\\{crs_size_x\\}"), std::to_string(crs_size(0)));
-  url = std::regex_replace(url, std::regex("\\{crs_size_y\\}"), std::to_string(crs_size(1)));
-
-  url = std::regex_replace(url, std::regex("\\{px_lower_x\\}"), std::to_string(px_lower(0)));
-  url = std::regex_replace(url, std::regex("\\{px_lower_y\\}"), std::to_string(px_lower(1)));
-  url = std::regex_replace(url, std::regex("\\{px_upper_x\\}"), std::to_string(px_upper(0)));
-  url = std::regex_replace(url, std::regex("\\{px_upper_y\\}"), std::to_string(px_upper(1)));
-  url = std::regex_replace(url, std::regex("\\{px_center_x\\}"), std::to_string(px_center(0)));
-  url = std::regex_replace(url, std::regex("\\{px_center_y\\}"), std::to_string(px_center(1)));
-  url = std::regex_replace(url, std::regex("\\{px_size_x\\}"), std::to_string(px_size(0)));
-  url = std::regex_replace(url, std::regex("\\{px_size_y\\}"), std::to_string(px_size(1)));
-
-  url = std::regex_replace(url, std::regex("\\{tile_lower_x\\}"), std::to_string(tile_lower(0)));
-  url = std::regex_replace(url, std::regex("\\{tile_lower_y\\}"), std::to_string(tile_lower(1)));
-  url = std::regex_replace(url, std::regex("\\{tile_upper_x\\}"), std::to_string(tile_upper(0)));
-  url = std::regex_replace(url, std::regex("\\{tile_upper_y\\}"), std::to_string(tile_upper(1)));
-  url = std::regex_replace(url, std::regex("\\{tile_center_x\\}"), std::to_string(tile_center(0)));
-  url = std::regex_replace(url, std::regex("\\{tile_center_y\\}"), std::to_string(tile_center(1)));
-
-  url = std::regex_replace(url, std::regex("\\{lat_lower\\}"), std::to_string(latlon_lower(0)));
-  url = std::regex_replace(url, std::regex("\\{lon_lower\\}"), std::to_string(latlon_lower(1)));
-  url = std::regex_replace(url, std::regex("\\{lat_upper\\}"), std::to_string(latlon_upper(0)));
-  url = std::regex_replace(url, std::regex("\\{lon_upper\\}"), std::to_string(latlon_upper(1)));
-  url = std::regex_replace(url, std::regex("\\{lat_center\\}"), std::to_string(latlon_center(0)));
-  url = std::regex_replace(url, std::regex("\\{lon_center\\}"), std::to_string(latlon_center(1)));
-  url = std::regex_replace(url, std::regex("\\{lat_size\\}"), std::to_string(latlon_size(0)));
-  url = std::regex_replace(url, std::regex("\\{lon_size\\}"), std::to_string(latlon_size(1)));
-
-  url = std::regex_replace(url, std::regex("\\{zoom\\}"), std::to_string(zoom));
-  url = std::regex_replace(url, std::regex("\\{quad\\}"), quad);
-
-  url = std::regex_replace(url, std::regex("\\{x\\}"), std::to_string(tile_lower(0)));
-  url = std::regex_replace(url, std::regex("\\{y\\}"), std::to_string(tile_lower(1)));
-  url = std::regex_replace(url, std::regex("\\{z\\}"), std::to_string(zoom));
-  url = std::regex_replace(url, std::regex("\\{width\\}"), std::to_string(px_size(0)));
-  url = std::regex_replace(url, std::regex("\\{height\\}"), std::to_string(px_size(1)));
-  url = std::regex_replace(url, std::regex("\\{bbox\\}"), bbox);
-  url = std::regex_replace(url, std::regex("\\{proj\\}"), crs);
-  url = std::regex_replace(url, std::regex("\\{crs\\}"), crs);
-
-  return url;
+    pos = end + 1;
+  }
+
+  return result;
 }
 
 } // end of ns tiledwebmaps
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <xti/typedefs.h>
+#include <tiledwebmaps/layout.h>
+#include <tiledwebmaps/proj.h>
+#include <tiledwebmaps/affine.h>
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace tiledwebmaps {
+
+// Number of cells per axis of the grid on which pixels of a tile are transformed exactly into raster pixels, pixels
+// inside the cells are interpolated bilinearly
+static const int WARP_GRID_SIZE = 16;
+
+// Placement of a raster in a CRS
+struct Georeference
+{
+  std::shared_ptr<proj::CRS> crs;
+  // Maps (row, col) of the raster to coordinates in the CRS, with pixel corners at integers
+  tiledwebmaps::Affine2<double> pixel_to_crs;
+
+  // pixel_to_model maps (col, row) of the raster to (east, north) coordinates in the CRS, as in GeoTIFF and world files
+  static Georeference from_model(std::shared_ptr<proj::CRS> crs, tiledwebmaps::Affine2<double> pixel_to_model)
+  {
+    xti::vec2d east = crs->get_vector("east");
+    xti::vec2d north = crs->get_vector("north");
+    tiledwebmaps::Affine2<double> model_to_crs(east(0), north(0), east(1), north(1), 0, 0);
+    tiledwebmaps::Affine2<double> pixel_to_col_row(0, 1, 1, 0, 0, 0);
+    return Georeference{crs, model_to_crs * pixel_to_model * pixel_to_col_row};
+  }
+
+  // Uses the GDAL convention (x0, dx/dcol, dx/drow, y0, dy/dcol, dy/drow) with (x, y) = (east, north)
+  static Georeference from_geotransform(std::shared_ptr<proj::CRS> crs, std::array<double, 6> geotransform)
+  {
+    return from_model(crs, tiledwebmaps::Affine2<double>(geotransform[1], geotransform[2], geotransform[4], geotransform[5], geotransform[0], geotransform[3]));
+  }
+};
+
+// Returns the raster pixels (row, col) at the corners of the WARP_GRID_SIZE x WARP_GRID_SIZE cells covering the tile.
+// layout_to_crs transforms from the CRS of the layout to the CRS of the raster and is NULL if both are equal. Points that
+// cannot be transformed are not finite.
+inline std::vector<tiledwebmaps::Point2<double>> get_warp_grid(const Layout& layout, xti::vec2i tile, int zoom, const proj::Transformer* layout_to_crs, const tiledwebmaps::Affine2<double>& crs_to_pixel)
+{
+  int tile_size = layout.get_tile_shape_px()(0);
+  tiledwebmaps::Point2<double> corner1 = layout.tile_to_pixel(tiledwebmaps::Point2<double>(tile(0), tile(1)), zoom);
+  tiledwebmaps::Point2<double> corner2 = layout.tile_to_pixel(tiledwebmaps::Point2<double>(tile(0) + 1, tile(1) + 1), zoom);
+  tiledwebmaps::Point2<double> min_pixel(std::min(corner1(0), corner2(0)), std::min(corner1(1), corner2(1)));
+  std::vector<tiledwebmaps::Point2<double>> grid((WARP_GRID_SIZE + 1) * (WARP_GRID_SIZE + 1));
+  for (int g0 = 0; g0 <= WARP_GRID_SIZE; g0++)
+  {
+    for (int g1 = 0; g1 <= WARP_GRID_SIZE; g1++)
+    {
+      tiledwebmaps::Point2<double> pixel(min_pixel(0) + g0 * (double) tile_size / WARP_GRID_SIZE, min_pixel(1) + g1 * (double) tile_size / WARP_GRID_SIZE);
+      tiledwebmaps::Point2<double> coords_crs = layout.pixel_to_crs(pixel, zoom);
+      if (layout_to_crs)
+      {
+        coords_crs = tiledwebmaps::Point2<double>(layout_to_crs->transform(coords_crs.to_xti()));
+      }
+      grid[g0 * (WARP_GRID_SIZE + 1) + g1] = crs_to_pixel.transform(coords_crs);
+    }
+  }
+  return grid;
+}
+
+// Interpolates the grid at the centers of all pixels of the tile and writes the maps for cv::remap, after subtracting
+// offset (row, col) from the interpolated points. Pixels without a finite point are mapped to (-2, -2).
+inline void get_warp_maps(const std::vector<tiledwebmaps::Point2<double>>& grid, int tile_size, cv::Mat& map_x, cv::Mat& map_y, tiledwebmaps::Point2<double> offset = tiledwebmaps::Point2<double>())
+{
+  map_x.create(tile_size, tile_size, CV_32FC1);
+  map_y.create(tile_size, tile_size, CV_32FC1);
+  for (int r = 0; r < tile_size; r++)
+  {
+    double u0 = (r + 0.5) * WARP_GRID_SIZE / tile_size;
+    int g0 = std::min((int) u0, WARP_GRID_SIZE - 1);
+    double f0 = u0 - g0;
+    float* map_y_row = map_y.ptr<float>(r);
+    float* map_x_row = map_x.ptr<float>(r);
+    for (int c = 0; c < tile_size; c++)
+    {
+      double u1 = (c + 0.5) * WARP_GRID_SIZE / tile_size;
+      int g1 = std::min((int) u1, WARP_GRID_SIZE - 1);
+      double f1 = u1 - g1;
+      const tiledwebmaps::Point2<double>& p00 = grid[g0 * (WARP_GRID_SIZE + 1) + g1];
+      const tiledwebmaps::Point2<double>& p01 = grid[g0 * (WARP_GRID_SIZE + 1) + g1 + 1];
+      const tiledwebmaps::Point2<double>& p10 = grid[(g0 + 1) * (WARP_GRID_SIZE + 1) + g1];
+      const tiledwebmaps::Point2<double>& p11 = grid[(g0 + 1) * (WARP_GRID_SIZE + 1) + g1 + 1];
+      double v0 = (1 - f0) * ((1 - f1) * p00(0) + f1 * p01(0)) + f0 * ((1 - f1) * p10(0) + f1 * p11(0));
+      double v1 = (1 - f0) * ((1 - f1) * p00(1) + f1 * p01(1)) + f0 * ((1 - f1) * p10(1) + f1 * p11(1));
+      if (std::isfinite(v0) && std::isfinite(v1))
+      {
+        map_y_row[c] = v0 - offset(0);
+        map_x_row[c] = v1 - offset(1);
+      }
+      else
+      {
+        map_y_row[c] = -2;
+        map_x_row[c] = -2;
+      }
+    }
+  }
+}
+
+} // end of ns tiledwebmaps
@@ -15,6 +15,251 @@ thread_local std::shared_ptr<tiledwebmaps::proj::Transformer> epsg4326_to_epsg38
 );
 thread_local std::shared_ptr<tiledwebmaps::proj::Transformer> epsg3857_to_epsg4326 = epsg4326_to_epsg3857->inverse();
 
+// Asyncio future that is resolved from a thread of the tileloader. All Python objects are only touched while holding the GIL.
+struct AsyncioFuture
+{
+  py::object loop;
+  py::object future;
+
+  AsyncioFuture(py::object loop)
+    : loop(loop)
+    , future(loop.attr("create_future")())
+  {
+  }
+
+  ~AsyncioFuture()
+  {
+    py::gil_scoped_acquire gil;
+    future = py::object();
+    loop = py::object();
+  }
+
+  void set_result(cv::Mat image)
+  {
+    py::gil_scoped_acquire gil;
+    call_soon("set_result", py::cast(image));
+  }
+
+  void set_exception(std::exception_ptr error)
+  {
+    py::gil_scoped_acquire gil;
+    py::object exception;
+    try
+    {
+      // Let pybind11 translate the C++ exception into the registered Python exception
+      py::cpp_function([error](){std::rethrow_exception(error);})();
+    }
+    catch (py::error_already_set& e)
+    {
+      exception = e.value();
+    }
+    call_soon("set_exception", exception);
+  }
+
+  void call_soon(std::string method, py::object value)
+  {
+    py::cpp_function set([method](py::object future, py::object value){
+      if (!future.attr("done")().cast<bool>())
+      {
+        future.attr(method.c_str())(value);
+      }
+    });
+    try
+    {
+      loop.attr("call_soon_threadsafe")(set, future, value);
+    }
+    catch (py::error_already_set& e)
+    {
+      // The event loop was closed in the meantime
+    }
+  }
+};
+
+// Uses the default certificate paths of python's ssl module for curl requests, if no paths are given
+void find_default_ssl_paths(std::optional<std::string>& capath, std::optional<std::string>& cafile)
+{
+  if (!capath && !cafile)
+  {
+    auto ssl = py::module::import("ssl");
+    auto default_verify_paths = ssl.attr("get_default_verify_paths")();
+    std::vector<std::string> capaths;
+    auto capath_py = default_verify_paths.attr("capath");
+    if (!capath_py.is_none())
+    {
+      capaths.push_back(capath_py.cast<std::string>());
+    }
+    auto openssl_capath_py = default_verify_paths.attr("openssl_capath");
+    if (!openssl_capath_py.is_none())
+    {
+      capaths.push_back(openssl_capath_py.cast<std::string>());
+    }
+    for (auto& capath2 : capaths)
+    {
+      if (std::filesystem::exists(capath2))
+      {
+        capath = capath2;
+        break;
+      }
+    }
+  }
+  if (!capath && !cafile)
+  {
+    auto ssl = py::module::import("ssl");
+    auto default_verify_paths = ssl.attr("get_default_verify_paths")();
+    std::vector<std::string> cafiles;
+    auto cafile_py = default_verify_paths.attr("cafile");
+    if (!cafile_py.is_none())
+    {
+      cafiles.push_back(cafile_py.cast<std::string>());
+    }
+    auto openssl_cafile_py = default_verify_paths.attr("openssl_cafile");
+    if (!openssl_cafile_py.is_none())
+    {
+      cafiles.push_back(openssl_cafile_py.cast<std::string>());
+    }
+    for (auto& cafile2 : cafiles)
+    {
+      if (std::filesystem::exists(cafile2))
+      {
+        cafile = cafile2;
+        break;
+      }
+    }
+  }
+}
+
+tiledwebmaps::BoundedDisk::EvictionPolicy parse_eviction_policy(std::string eviction)
+{
+  if (eviction == "lru")
+  {
+    return tiledwebmaps::BoundedDisk::EvictionPolicy::LRU;
+  }
+  else if (eviction == "lfu")
+  {
+    return tiledwebmaps::BoundedDisk::EvictionPolicy::LFU;
+  }
+  else
+  {
+    throw std::invalid_argument("Invalid eviction policy " + eviction);
+  }
+}
+
+tiledwebmaps::Disk::Sync parse_sync(bool fsync)
+{
+  return fsync ? tiledwebmaps::Disk::Sync::FSYNC : tiledwebmaps::Disk::Sync::NONE;
+}
+
+tiledwebmaps::ChannelOrder parse_channel_order(std::string channel_order)
+{
+  if (channel_order == "rgb")
+  {
+    return tiledwebmaps::ChannelOrder::RGB;
+  }
+  else if (channel_order == "bgr")
+  {
+    return tiledwebmaps::ChannelOrder::BGR;
+  }
+  else
+  {
+    throw std::invalid_argument("Invalid channel order " + channel_order);
+  }
+}
+
+tiledwebmaps::Interpolation parse_interpolation(std::string interpolation)
+{
+  if (interpolation == "nearest")
+  {
+    return tiledwebmaps::Interpolation::NEAREST;
+  }
+  else if (interpolation == "linear")
+  {
+    return tiledwebmaps::Interpolation::LINEAR;
+  }
+  else
+  {
+    throw std::invalid_argument("Invalid interpolation " + interpolation);
+  }
+}
+
+tiledwebmaps::TileFormat parse_tile_format(std::string tile_format)
+{
+  if (tile_format == "color")
+  {
+    return tiledwebmaps::TileFormat::COLOR;
+  }
+  else if (tile_format == "unchanged")
+  {
+    return tiledwebmaps::TileFormat::UNCHANGED;
+  }
+  else if (tile_format == "terrarium")
+  {
+    return tiledwebmaps::TileFormat::TERRARIUM;
+  }
+  else if (tile_format == "terrain-rgb")
+  {
+    return tiledwebmaps::TileFormat::TERRAIN_RGB;
+  }
+  else
+  {
+    throw std::invalid_argument("Invalid tile format " + tile_format);
+  }
+}
+
+std::string tile_format_to_string(tiledwebmaps::TileFormat tile_format)
+{
+  switch (tile_format)
+  {
+    case tiledwebmaps::TileFormat::COLOR: return "color";
+    case tiledwebmaps::TileFormat::UNCHANGED: return "unchanged";
+    case tiledwebmaps::TileFormat::TERRARIUM: return "terrarium";
+    default: return "terrain-rgb";
+  }
+}
+
+tiledwebmaps::EncodeOptions make_encode_options(std::optional<int> quality, std::optional<std::string> subsampling, bool optimize, bool progressive)
+{
+  return tiledwebmaps::EncodeOptions(quality ? *quality : -1, subsampling ? *subsampling : "", optimize, progressive);
+}
+
+// The deprecated argument is still accepted at its former position, such that it is not taken for a later parameter
+void warn_wait_after_last_modified(std::optional<float> wait_after_last_modified)
+{
+  if (wait_after_last_modified && PyErr_WarnEx(PyExc_DeprecationWarning, "wait_after_last_modified is deprecated and ignored, tiles are written atomically", 1) != 0)
+  {
+    throw py::error_already_set();
+  }
+}
+
+// Returns a matrix that refers to the buffer of out, which must be writeable and have the given size and type
+cv::Mat to_destination(py::array out, int rows, int cols, int type)
+{
+  cv::Mat dest = tiledwebmaps::numpy_to_mat(out);
+  if (!out.writeable() || dest.data == NULL)
+  {
+    throw std::invalid_argument("out must be a writeable array whose pixels and channels are contiguous");
+  }
+  if (dest.rows != rows || dest.cols != cols || dest.type() != type || (out.ndim() == 2 && CV_MAT_CN(type) != 1))
+  {
+    throw std::invalid_argument("out has shape " + py::str(out.attr("shape")).cast<std::string>() + " and dtype " + py::str(out.dtype()).cast<std::string>() + ", but the image has shape (" + std::to_string(rows) + ", " + std::to_string(cols) + ", " + std::to_string(CV_MAT_CN(type)) + ") and dtype " + py::str(tiledwebmaps::depth_to_dtype(CV_MAT_DEPTH(type))).cast<std::string>());
+  }
+  return dest;
+}
+
+// Returns the image as numpy array without copying, or copies it into out if given and returns out
+py::object to_numpy(const cv::Mat& image, std::optional<py::array> out)
+{
+  if (!out)
+  {
+    return tiledwebmaps::mat_to_numpy(image);
+  }
+  cv::Mat dest = to_destination(*out, image.rows, image.cols, image.type());
+  {
+    py::gil_scoped_release gil;
+    image.copyTo(dest);
+  }
+  return *out;
+}
+
 PYBIND11_MODULE(backend, m)
 {
   // **********************************************************************************************
@@ -357,57 +602,189 @@ PYBIND11_MODULE(backend, m)
     )
   ;
 
+  py::class_<tiledwebmaps::Metrics, std::shared_ptr<tiledwebmaps::Metrics>>(m, "Metrics")
+    .def(py::init<std::string>(),
+      py::arg("name") = "",
+      "Returns a new empty set of metrics.\n"
+      "\n"
+      "Parameters:\n"
+      "    name: Name of the component that records the metrics. Defaults to \"\".\n"
+      "\n"
+      "Returns:\n"
+      "    A new empty set of metrics.\n"
+    )
+    .def("snapshot", [](const tiledwebmaps::Metrics& metrics){
+        tiledwebmaps::Metrics::Snapshot snapshot = metrics.snapshot();
+        py::dict histograms;
+        for (const auto& pair : snapshot.histograms)
+        {
+          py::dict histogram;
+          histogram["bounds"] = pair.second.bounds;
+          histogram["counts"] = pair.second.counts;
+          histogram["count"] = pair.second.count;
+          histogram["sum"] = pair.second.sum;
+          histogram["p50"] = pair.second.quantile(0.5);
+          histogram["p99"] = pair.second.quantile(0.99);
+          histograms[py::str(pair.first)] = histogram;
+        }
+        py::dict result;
+        result["name"] = snapshot.name;
+        result["counters"] = snapshot.counters;
+        result["histograms"] = histograms;
+        return result;
+      },
+      "Returns the current values of all counters and histograms.\n"
+      "\n"
+      "Returns:\n"
+      "    A dictionary with keys \"name\", \"counters\" (name to count) and \"histograms\" (name to dictionary with keys \"bounds\", \"counts\", \"count\", \"sum\", \"p50\" and \"p99\" in seconds).\n"
+    )
+    .def("reset", &tiledwebmaps::Metrics::reset)
+    .def_property("tracing", &tiledwebmaps::Metrics::is_tracing, [](tiledwebmaps::Metrics& metrics, bool tracing){metrics.set_tracing(tracing);})
+    .def_property("enabled", &tiledwebmaps::Metrics::is_enabled, &tiledwebmaps::Metrics::set_enabled)
+    .def("to_prometheus", &tiledwebmaps::Metrics::to_prometheus,
+      py::arg("prefix") = "tiledwebmaps",
+      "Returns the metrics in the Prometheus text exposition format.\n"
+      "\n"
+      "Parameters:\n"
+      "    prefix: Prefix of all metric names. Defaults to \"tiledwebmaps\".\n"
+      "\n"
+      "Returns:\n"
+      "    The metrics as Prometheus text.\n"
+    )
+    .def("to_chrome_trace", &tiledwebmaps::Metrics::to_chrome_trace,
+      "Returns the events recorded while tracing was enabled in the Chrome trace event JSON format.\n"
+      "\n"
+      "Returns:\n"
+      "    The trace as JSON string.\n"
+    )
+    .def_property_readonly("name", &tiledwebmaps::Metrics::get_name)
+  ;
+  py::class_<tiledwebmaps::Instrumented, std::shared_ptr<tiledwebmaps::Instrumented>>(m, "Instrumented")
+    .def_property("metrics", &tiledwebmaps::Instrumented::get_metrics, &tiledwebmaps::Instrumented::set_metrics)
+  ;
+
   py::class_<tiledwebmaps::TileLoader, std::shared_ptr<tiledwebmaps::TileLoader>>(m, "TileLoader", py::dynamic_attr())
-    .def("load", [](tiledwebmaps::TileLoader& tile_loader, xti::vec2s tile, int zoom){
-        py::gil_scoped_release gil;
-        cv::Mat image = tile_loader.load(tile, zoom);
-        xt::xtensor<uint8_t, 3> image2 = xti::from_opencv<uint8_t>(image);
-        return image2;
+    .def("load", [](tiledwebmaps::TileLoader& tile_loader, xti::vec2s tile, int zoom, std::optional<py::array> out, std::string channel_order){
+        tiledwebmaps::ChannelOrder order = parse_channel_order(channel_order);
+        cv::Mat image;
+        {
+          py::gil_scoped_release gil;
+          image = tile_loader.load_ordered(tile, zoom, order);
+        }
+        return to_numpy(image, out);
       },
       py::arg("tile"),
-      py::arg("zoom")
+      py::arg("zoom"),
+      py::arg("out") = std::optional<py::array>(),
+      py::arg("channel_order") = "rgb"
     )
-    .def("load", [](tiledwebmaps::TileLoader& tile_loader, xti::vec2s min_tile, xti::vec2s max_tile, int zoom){
-        py::gil_scoped_release gil;
-        cv::Mat image = tiledwebmaps::load(tile_loader, min_tile, max_tile, zoom);
-        xt::xtensor<uint8_t, 3> image2 = xti::from_opencv<uint8_t>(image);
-        return image2;
+    .def("load", [](tiledwebmaps::TileLoader& tile_loader, xti::vec2s min_tile, xti::vec2s max_tile, int zoom, std::optional<py::array> out, std::string channel_order){
+        tiledwebmaps::ChannelOrder order = parse_channel_order(channel_order);
+        cv::Mat image;
+        {
+          py::gil_scoped_release gil;
+          image = tiledwebmaps::load(tile_loader, min_tile, max_tile, zoom, order);
+        }
+        return to_numpy(image, out);
       },
       py::arg("min_tile"),
       py::arg("max_tile"),
-      py::arg("zoom")
+      py::arg("zoom"),
+      py::arg("out") = std::optional<py::array>(),
+      py::arg("channel_order") = "rgb"
     )
-    .def("load", [](tiledwebmaps::TileLoader& tile_loader, xti::vec2d latlon, double bearing, double meters_per_pixel, xti::vec2s shape, std::optional<int> zoom){
-        py::gil_scoped_release gil;
-        cv::Mat image;
-        if (zoom)
+    .def("load", [](tiledwebmaps::TileLoader& tile_loader, xti::vec2d latlon, double bearing, double meters_per_pixel, xti::vec2s shape, std::optional<int> zoom, std::optional<py::array> out, std::string channel_order){
+        tiledwebmaps::ChannelOrder order = parse_channel_order(channel_order);
+        // The image is sampled directly into out. The type of the tiles is only known after loading them, such that out is
+        // checked against the type of the image afterwards.
+        cv::Mat image, dest;
+        if (out)
         {
-          image = tiledwebmaps::load_metric(tile_loader, latlon, bearing, meters_per_pixel, shape, *zoom);
+          dest = to_destination(*out, shape(0), shape(1), tiledwebmaps::numpy_to_mat(*out).type());
+          image = dest;
         }
-        else
         {
-          image = tiledwebmaps::load_metric(tile_loader, latlon, bearing, meters_per_pixel, shape);
+          py::gil_scoped_release gil;
+          if (zoom)
+          {
+            tiledwebmaps::load_metric(tile_loader, latlon, bearing, meters_per_pixel, shape, *zoom, image, order);
+          }
+          else
+          {
+            tiledwebmaps::load_metric(tile_loader, latlon, bearing, meters_per_pixel, shape, image, order);
+          }
+        }
+        if (out && image.data != dest.data)
+        {
+          to_destination(*out, image.rows, image.cols, image.type());
         }
-        xt::xtensor<uint8_t, 3> image2 = xti::from_opencv<uint8_t>(image);
-        return image2;
+        return out ? py::object(*out) : py::object(tiledwebmaps::mat_to_numpy(image));
       },
       py::arg("latlon"),
       py::arg("bearing"),
       py::arg("meters_per_pixel"),
       py::arg("shape"),
       py::arg("zoom") = std::optional<int>(),
+      py::arg("out") = std::optional<py::array>(),
+      py::arg("channel_order") = "rgb",
       "Load an image with the given location, bearing and resolution.\n"
       "\n"
+      "The returned array adopts the buffer of the loaded image without copying it. Tiles are composed and sampled in the\n"
+      "channel order of their decoder and only the returned image is converted to the requested channel order.\n"
+      "\n"
       "Parameters:\n"
       "    latlon: Latitude and longitude, center of the returned image\n"
       "    bearing: Orientation of the returned image, in degrees from north clockwise\n"
       "    meters_per_pixel: Pixel resolution in meters per pixel\n"
       "    shape: Shape of the returned image\n"
       "    zoom: Zoom level at which images are retrieved from the tileloader. If None, chooses the next zoom level above 2 * meters_per_pixel. Defaults to None.\n"
+      "    out: Preallocated array with the shape and dtype of the result into which the image is written, e.g. a slice of a batch. Defaults to None.\n"
+      "    channel_order: Channel order of the returned image, \"rgb\" or \"bgr\" (e.g. for OpenCV). Defaults to \"rgb\".\n"
+      "Returns:\n"
+      "    The loaded image, or out if given.\n"
+    )
+    .def("load_async", [](std::shared_ptr<tiledwebmaps::TileLoader> tile_loader, xti::vec2s tile, int zoom){
+        py::object loop = py::module_::import("asyncio").attr("get_running_loop")();
+        std::shared_ptr<AsyncioFuture> future = std::make_shared<AsyncioFuture>(loop);
+        py::object result = future->future;
+        {
+          py::gil_scoped_release gil;
+          tile_loader->load_async(tile, zoom, [tile_loader, future](cv::Mat image, std::exception_ptr error){
+            if (error)
+            {
+              future->set_exception(error);
+            }
+            else
+            {
+              future->set_result(image);
+            }
+          });
+        }
+        return result;
+      },
+      py::arg("tile"),
+      py::arg("zoom"),
+      "Load a tile without blocking the running asyncio event loop.\n"
+      "\n"
+      "Parameters:\n"
+      "    tile: Coordinates of the tile.\n"
+      "    zoom: Zoom level of the tile.\n"
+      "\n"
       "Returns:\n"
-      "    The loaded image.\n"
+      "    An asyncio future that resolves to the loaded tile.\n"
     )
     .def_property_readonly("layout", &tiledwebmaps::TileLoader::get_layout)
+    .def_property("tile_format",
+      [](const tiledwebmaps::TileLoader& tile_loader){
+        return tile_format_to_string(tile_loader.get_tile_format());
+      },
+      [](tiledwebmaps::TileLoader& tile_loader, std::string tile_format){
+        tile_loader.set_tile_format(parse_tile_format(tile_format));
+      },
+      "Format of the tiles returned by tileloaders that decode tiles, and expected by caches that encode tiles. One of\n"
+      "\"color\" (uint8 RGB), \"unchanged\" (channels and dtype of the encoded images, e.g. gray masks, RGBA, NIR or 16-bit\n"
+      "and float elevation), \"terrarium\" or \"terrain-rgb\" (float32 elevation in meters decoded from color tiles).\n"
+    )
     .def("make_forksafe", &tiledwebmaps::TileLoader::make_forksafe)
     .def("get_zoom", &tiledwebmaps::TileLoader::get_zoom,
       py::arg("latlon"),
@@ -417,56 +794,9 @@ PYBIND11_MODULE(backend, m)
     .def_property_readonly("min_zoom", &tiledwebmaps::TileLoader::get_min_zoom)
   ;
 
-  py::class_<tiledwebmaps::Http, std::shared_ptr<tiledwebmaps::Http>, tiledwebmaps::TileLoader>(m, "Http")
+  py::class_<tiledwebmaps::Http, std::shared_ptr<tiledwebmaps::Http>, tiledwebmaps::TileLoader, tiledwebmaps::Instrumented>(m, "Http")
     .def(py::init([](std::string url, tiledwebmaps::Layout layout, int min_zoom, int max_zoom, int retries, float wait_after_error, bool verify_ssl, std::optional<std::string> capath, std::optional<std::string> cafile, std::map<std::string, std::string> header, bool allow_multithreading){
-        if (!capath && !cafile)
-        {
-          auto ssl = py::module::import("ssl");
-          auto default_verify_paths = ssl.attr("get_default_verify_paths")();
-          std::vector<std::string> capaths;
-          auto capath_py = default_verify_paths.attr("capath");
-          if (!capath_py.is_none())
-          {
-            capaths.push_back(capath_py.cast<std::string>());
-          }
-          auto openssl_capath_py = default_verify_paths.attr("openssl_capath");
-          if (!openssl_capath_py.is_none())
-          {
-            capaths.push_back(openssl_capath_py.cast<std::string>());
-          }
-          for (auto& capath2 : capaths)
-          {
-            if (std::filesystem::exists(capath2))
-            {
-              capath = capath2;
-              break;
-            }
-          }
-        }
-        if (!capath && !cafile)
-        {
-          auto ssl = py::module::import("ssl");
-          auto default_verify_paths = ssl.attr("get_default_verify_paths")();
-          std::vector<std::string> cafiles;
-          auto cafile_py = default_verify_paths.attr("cafile");
-          if (!cafile_py.is_none())
-          {
-            cafiles.push_back(cafile_py.cast<std::string>());
-          }
-          auto openssl_cafile_py = default_verify_paths.attr("openssl_cafile");
-          if (!openssl_cafile_py.is_none())
-          {
-            cafiles.push_back(openssl_cafile_py.cast<std::string>());
-          }
-          for (auto& cafile2 : cafiles)
-          {
-            if (std::filesystem::exists(cafile2))
-            {
-              cafile = cafile2;
-              break;
-            }
-          }
-        }
+        find_default_ssl_paths(capath, cafile);
         return tiledwebmaps::Http(url, layout, min_zoom, max_zoom, retries, wait_after_error, verify_ssl, capath, cafile, header, allow_multithreading);
       }),
       py::arg("url"),
@@ -526,8 +856,367 @@ PYBIND11_MODULE(backend, m)
       "    The created Http tileloader.\n"
     )
   ;
+  py::class_<tiledwebmaps::COG, std::shared_ptr<tiledwebmaps::COG>, tiledwebmaps::TileLoader, tiledwebmaps::Instrumented>(m, "COG", py::dynamic_attr())
+    .def(py::init([](std::string path, tiledwebmaps::Layout layout, int min_zoom, int max_zoom, std::optional<std::string> crs, size_t cache_size, int retries, float wait_after_error, bool verify_ssl, std::optional<std::string> capath, std::optional<std::string> cafile, std::map<std::string, std::string> header){
+        std::shared_ptr<tiledwebmaps::RangeReader> reader;
+        if (path.rfind("http://", 0) == 0 || path.rfind("https://", 0) == 0)
+        {
+          find_default_ssl_paths(capath, cafile);
+          reader = std::make_shared<tiledwebmaps::HttpRangeReader>(path, retries, wait_after_error, verify_ssl, capath, cafile, header);
+        }
+        else
+        {
+          reader = std::make_shared<tiledwebmaps::FileRangeReader>(path);
+        }
+        return std::make_shared<tiledwebmaps::COG>(reader, layout, min_zoom, max_zoom, crs, cache_size);
+      }),
+      py::arg("path"),
+      py::arg("layout"),
+      py::arg("min_zoom"),
+      py::arg("max_zoom"),
+      py::arg("crs") = std::optional<std::string>(),
+      py::arg("cache_size") = 64,
+      py::arg("retries") = 10,
+      py::arg("wait_after_error") = 1.5,
+      py::arg("verify_ssl") = true,
+      py::arg("capath") = std::optional<std::string>(),
+      py::arg("cafile") = std::optional<std::string>(),
+      py::arg("header") = std::map<std::string, std::string>(),
+      "Returns a new tileloader that loads tiles from a Cloud-Optimized GeoTIFF (COG) on disk or on a server.\n"
+      "\n"
+      "Only the internal tiles of the image or of the overview matching the zoom level are read with byte-range requests, and are reprojected into the given layout.\n"
+      "\n"
+      "Parameters:\n"
+      "    path: Path of the file, or url starting with http:// or https://.\n"
+      "    layout: The layout of the tiles loaded by this tileloader.\n"
+      "    min_zoom: The minimum zoom level that the tileloader will load.\n"
+      "    max_zoom: The maximum zoom level that the tileloader will load.\n"
+      "    crs: The crs of the image. Defaults to the EPSG code stored in the GeoTIFF.\n"
+      "    cache_size: The number of decoded internal tiles of the image that are kept in memory. Defaults to 64.\n"
+      "    retries: Number of times that a http request will be retried before throwing an error. Defaults to 10.\n"
+      "    wait_after_error: Seconds to wait before retrying a http request. Defaults to 1.5.\n"
+      "    verify_ssl: Whether to verify the ssl host/peer. Defaults to True.\n"
+      "    capath: Set the capath of the curl request if given. Defaults to None.\n"
+      "    cafile: Set the cafile of the curl request if given. Defaults to None.\n"
+      "    header: Header of the curl request. Defaults to {}.\n"
+      "\n"
+      "Returns:\n"
+      "    A new tileloader that loads tiles from a COG.\n"
+    )
+    .def_property_readonly("crs", &tiledwebmaps::COG::get_crs)
+    .def_property_readonly("shape", &tiledwebmaps::COG::get_shape)
+    .def_property_readonly("levels_num", &tiledwebmaps::COG::get_levels_num)
+  ;
 
-  py::class_<tiledwebmaps::Bin, std::shared_ptr<tiledwebmaps::Bin>, tiledwebmaps::TileLoader>(m, "Bin")
+  py::class_<tiledwebmaps::MultiLayer, std::shared_ptr<tiledwebmaps::MultiLayer>, tiledwebmaps::Instrumented>(m, "MultiLayer", py::dynamic_attr())
+    .def(py::init([](std::vector<std::tuple<std::shared_ptr<tiledwebmaps::TileLoader>, std::string>> layers){
+        std::vector<tiledwebmaps::MultiLayer::Layer> layers2;
+        for (const auto& layer : layers)
+        {
+          layers2.push_back(tiledwebmaps::MultiLayer::Layer{std::get<0>(layer), parse_interpolation(std::get<1>(layer))});
+        }
+        return std::make_shared<tiledwebmaps::MultiLayer>(layers2);
+      }),
+      py::arg("layers"),
+      "Returns a new loader that samples several layers at the same pose in one call, e.g. aerial imagery, rendered semantic labels and elevation.\n"
+      "\n"
+      "The pose geometry (tiles covering the footprint and sampling maps) is computed once and shared by all layers with the same layout and zoom level. Layers are loaded at the zoom level of the first layer clamped to their own zoom range.\n"
+      "\n"
+      "Parameters:\n"
+      "    layers: List of (tileloader, interpolation) tuples. The interpolation is \"linear\" (e.g. for imagery and elevation) or \"nearest\" (e.g. for class labels, which are then not mixed at their borders).\n"
+      "\n"
+      "Returns:\n"
+      "    A new multi-layer loader.\n"
+    )
+    .def("load", [](tiledwebmaps::MultiLayer& multi_layer, xti::vec2d latlon, double bearing, double meters_per_pixel, xti::vec2s shape, std::optional<int> zoom, std::optional<std::vector<py::array>> out, std::string channel_order){
+        tiledwebmaps::ChannelOrder order = parse_channel_order(channel_order);
+        size_t layers_num = multi_layer.get_layers().size();
+        if (out && out->size() != layers_num)
+        {
+          throw std::invalid_argument("out must contain one array per layer, got " + std::to_string(out->size()) + " arrays for " + std::to_string(layers_num) + " layers");
+        }
+        // As in TileLoader.load, the images are sampled directly into out and out is checked against their types afterwards
+        std::vector<cv::Mat> images(layers_num), dests(layers_num);
+        if (out)
+        {
+          for (size_t i = 0; i < layers_num; i++)
+          {
+            dests[i] = to_destination((*out)[i], shape(0), shape(1), tiledwebmaps::numpy_to_mat((*out)[i]).type());
+            images[i] = dests[i];
+          }
+        }
+        {
+          py::gil_scoped_release gil;
+          if (zoom)
+          {
+            multi_layer.load(latlon, bearing, meters_per_pixel, shape, *zoom, images, order);
+          }
+          else
+          {
+            multi_layer.load(latlon, bearing, meters_per_pixel, shape, images, order);
+          }
+        }
+        py::list result;
+        for (size_t i = 0; i < layers_num; i++)
+        {
+          if (out && images[i].data != dests[i].data)
+          {
+            to_destination((*out)[i], images[i].rows, images[i].cols, images[i].type());
+          }
+          result.append(out ? py::object((*out)[i]) : py::object(tiledwebmaps::mat_to_numpy(images[i])));
+        }
+        return result;
+      },
+      py::arg("latlon"),
+      py::arg("bearing"),
+      py::arg("meters_per_pixel"),
+      py::arg("shape"),
+      py::arg("zoom") = std::optional<int>(),
+      py::arg("out") = std::optional<std::vector<py::array>>(),
+      py::arg("channel_order") = "rgb",
+      "Load the images of all layers with the given location, bearing and resolution.\n"
+      "\n"
+      "Parameters:\n"
+      "    latlon: Latitude and longitude, center of the returned images\n"
+      "    bearing: Orientation of the returned images, in degrees from north clockwise\n"
+      "    meters_per_pixel: Pixel resolution in meters per pixel\n"
+      "    shape: Shape of the returned images\n"
+      "    zoom: Zoom level of the first layer. If None, chooses the next zoom level of the first layer above 2 * meters_per_pixel. Defaults to None.\n"
+      "    out: List with one preallocated array per layer with the shape and dtype of its result, e.g. slices of batches. Defaults to None.\n"
+      "    channel_order: Channel order of the returned color images, \"rgb\" or \"bgr\" (e.g. for OpenCV). Defaults to \"rgb\".\n"
+      "Returns:\n"
+      "    List with the loaded image of every layer, or out if given.\n"
+    )
+    .def_property_readonly("layers", [](const tiledwebmaps::MultiLayer& multi_layer){
+        std::vector<std::shared_ptr<tiledwebmaps::TileLoader>> layers;
+        for (const auto& layer : multi_layer.get_layers())
+        {
+          layers.push_back(layer.tileloader);
+        }
+        return layers;
+      })
+  ;
+
+  py::class_<tiledwebmaps::Retiler, std::shared_ptr<tiledwebmaps::Retiler>, tiledwebmaps::Instrumented>(m, "Retiler", py::dynamic_attr())
+    .def(py::init([](std::shared_ptr<tiledwebmaps::Cache> sink, tiledwebmaps::Layout layout, int zoom, size_t max_pending_tiles, std::tuple<uint8_t, uint8_t, uint8_t> background){
+        return std::make_shared<tiledwebmaps::Retiler>(sink, layout, zoom, max_pending_tiles, cv::Vec3b(std::get<0>(background), std::get<1>(background), std::get<2>(background)));
+      }),
+      py::arg("sink"),
+      py::arg("layout"),
+      py::arg("zoom"),
+      py::arg("max_pending_tiles") = 256,
+      py::arg("background") = std::tuple<uint8_t, uint8_t, uint8_t>(0, 0, 0),
+      "Returns a new retiler that cuts large georeferenced rasters into the tiles of a layout at a single zoom level.\n"
+      "\n"
+      "Rasters are added in blocks (e.g. strips of rows) that are warped into all tiles they overlap. Complete tiles are saved to the sink, incomplete tiles are kept until adjacent blocks or rasters complete them.\n"
+      "\n"
+      "Parameters:\n"
+      "    sink: The cache that the tiles are saved to.\n"
+      "    layout: The layout of the saved tiles.\n"
+      "    zoom: The zoom level of the saved tiles.\n"
+      "    max_pending_tiles: The maximum number of incomplete tiles kept in memory, further tiles are saved incomplete and loaded again from the sink when needed. Defaults to 256.\n"
+      "    background: The RGB color of pixels that are not covered by any raster. Defaults to (0, 0, 0).\n"
+      "\n"
+      "Returns:\n"
+      "    A new retiler.\n"
+    )
+    .def("add", [](tiledwebmaps::Retiler& retiler, cv::Mat block, std::shared_ptr<tiledwebmaps::proj::CRS> crs, std::array<double, 6> geotransform, xti::vec2i offset){
+        py::gil_scoped_release gil;
+        retiler.add(block, tiledwebmaps::Georeference::from_geotransform(crs, geotransform), offset);
+      },
+      py::arg("block"),
+      py::arg("crs"),
+      py::arg("geotransform"),
+      py::arg("offset") = xti::vec2i({0, 0}),
+      "Warps a block of a raster into all tiles it overlaps.\n"
+      "\n"
+      "Parameters:\n"
+      "    block: RGB image with shape (rows, cols, 3).\n"
+      "    crs: The crs of the raster.\n"
+      "    geotransform: The GDAL geotransform (x0, dx/dcol, dx/drow, y0, dy/dcol, dy/drow) of the whole raster, where (x, y) are (east, north) coordinates.\n"
+      "    offset: The pixel (row, col) of the raster at the top-left corner of the block. Defaults to (0, 0).\n"
+    )
+    .def("flush", &tiledwebmaps::Retiler::flush, py::call_guard<py::gil_scoped_release>(),
+      "Saves all pending tiles, including incomplete ones."
+    )
+    .def_property_readonly("pending_tiles_num", &tiledwebmaps::Retiler::get_pending_tiles_num)
+    .def_property_readonly("max_pending_tiles", &tiledwebmaps::Retiler::get_max_pending_tiles)
+    .def_property_readonly("layout", &tiledwebmaps::Retiler::get_layout)
+    .def_property_readonly("zoom", &tiledwebmaps::Retiler::get_zoom)
+  ;
+
+  py::class_<tiledwebmaps::DownloadPipeline, std::shared_ptr<tiledwebmaps::DownloadPipeline>, tiledwebmaps::Instrumented>(m, "DownloadPipeline", py::dynamic_attr())
+    .def(py::init([](std::shared_ptr<tiledwebmaps::Cache> sink, tiledwebmaps::Layout layout, int zoom, std::string work_path, std::optional<py::function> georeference, std::shared_ptr<tiledwebmaps::proj::CRS> crs, std::optional<std::string> extract_command, std::optional<std::vector<std::string>> extensions, std::optional<std::string> journal, std::map<std::string, size_t> workers, size_t queue_size, size_t tile_queue_size, int strip_rows, size_t max_pending_tiles, std::tuple<uint8_t, uint8_t, uint8_t> background, int quality, std::optional<std::string> subsampling, bool optimize, bool progressive, float checkpoint_interval, int retries, float wait_after_error, bool verify_ssl, std::optional<std::string> capath, std::optional<std::string> cafile, std::map<std::string, std::string> header){
+        tiledwebmaps::DownloadPipeline::Options options;
+        for (const auto& pair : workers)
+        {
+          if (pair.first == "download") options.download_workers = pair.second;
+          else if (pair.first == "extract") options.extract_workers = pair.second;
+          else if (pair.first == "decode") options.decode_workers = pair.second;
+          else if (pair.first == "cut") options.cut_workers = pair.second;
+          else if (pair.first == "encode") options.encode_workers = pair.second;
+          else if (pair.first == "write") options.write_workers = pair.second;
+          else throw std::invalid_argument("Unknown pipeline step " + pair.first);
+        }
+        options.queue_size = queue_size;
+        options.tile_queue_size = tile_queue_size;
+        options.extract_command = extract_command;
+        if (extensions)
+        {
+          options.extensions = *extensions;
+        }
+        options.strip_rows = strip_rows;
+        options.max_pending_tiles = max_pending_tiles;
+        options.background = cv::Vec3b(std::get<0>(background), std::get<1>(background), std::get<2>(background));
+        options.encode_options = make_encode_options(quality, subsampling, optimize, progressive);
+        if (journal)
+        {
+          options.journal_path = *journal;
+        }
+        options.checkpoint_interval = checkpoint_interval;
+        options.retries = retries;
+        options.wait_after_error = wait_after_error;
+        options.verify_ssl = verify_ssl;
+        find_default_ssl_paths(capath, cafile);
+        if (capath)
+        {
+          options.capath = *capath;
+        }
+        if (cafile)
+        {
+          options.cafile = *cafile;
+        }
+        options.header = header;
+
+        tiledwebmaps::DownloadPipeline::GeoreferenceFunction georeference_function;
+        if (georeference)
+        {
+          // The function is called from worker threads, and is only copied and destroyed while holding the GIL
+          std::shared_ptr<py::function> function(new py::function(*georeference), [](py::function* function){
+            py::gil_scoped_acquire gil;
+            delete function;
+          });
+          georeference_function = [function](const std::filesystem::path& path){
+            py::gil_scoped_acquire gil;
+            try
+            {
+              py::tuple result = (*function)(path.string());
+              return tiledwebmaps::Georeference::from_geotransform(result[0].cast<std::shared_ptr<tiledwebmaps::proj::CRS>>(), result[1].cast<std::array<double, 6>>());
+            }
+            catch (py::error_already_set& e)
+            {
+              throw std::runtime_error(std::string("Georeference function failed for ") + path.string() + ". Reason: " + e.what());
+            }
+          };
+        }
+        else if (crs)
+        {
+          georeference_function = [crs](const std::filesystem::path& path){
+            return tiledwebmaps::read_world_file(path, crs);
+          };
+        }
+        else
+        {
+          throw std::invalid_argument("Either georeference or crs must be given");
+        }
+
+        return std::make_shared<tiledwebmaps::DownloadPipeline>(sink, layout, zoom, work_path, georeference_function, options);
+      }),
+      py::arg("sink"),
+      py::arg("layout"),
+      py::arg("zoom"),
+      py::arg("work_path"),
+      py::arg("georeference") = std::optional<py::function>(),
+      py::arg("crs") = std::shared_ptr<tiledwebmaps::proj::CRS>(),
+      py::arg("extract_command") = std::optional<std::string>(),
+      py::arg("extensions") = std::optional<std::vector<std::string>>(),
+      py::arg("journal") = std::optional<std::string>(),
+      py::arg("workers") = std::map<std::string, size_t>(),
+      py::arg("queue_size") = 4,
+      py::arg("tile_queue_size") = 256,
+      py::arg("strip_rows") = 1024,
+      py::arg("max_pending_tiles") = 256,
+      py::arg("background") = std::tuple<uint8_t, uint8_t, uint8_t>(255, 255, 255),
+      py::arg("quality") = 95,
+      py::arg("subsampling") = std::optional<std::string>(),
+      py::arg("optimize") = false,
+      py::arg("progressive") = false,
+      py::arg("checkpoint_interval") = 60.0,
+      py::arg("retries") = 10,
+      py::arg("wait_after_error") = 1.5,
+      py::arg("verify_ssl") = true,
+      py::arg("capath") = std::optional<std::string>(),
+      py::arg("cafile") = std::optional<std::string>(),
+      py::arg("header") = std::map<std::string, std::string>(),
+      "Returns a new pipeline that downloads rasters, extracts and decodes them, cuts them into tiles and saves the tiles to a cache.\n"
+      "\n"
+      "Every step runs natively in its own pool of threads, and the steps are connected by bounded queues such that slow steps throttle the steps before them.\n"
+      "\n"
+      "Parameters:\n"
+      "    sink: The cache that the tiles are saved to, e.g. tiledwebmaps.Disk.\n"
+      "    layout: The layout of the saved tiles.\n"
+      "    zoom: The zoom level of the saved tiles.\n"
+      "    work_path: Directory for downloaded and extracted files, every input uses a subdirectory that is removed once the input is processed.\n"
+      "    georeference: Function that is called with the path of a raster and returns its crs and GDAL geotransform (x0, dx/dcol, dx/drow, y0, dy/dcol, dy/drow). Defaults to None.\n"
+      "    crs: If no georeference function is given, the georeference is read from the world file of the raster (e.g. \".jgw\", \".j2w\", \".tfw\") in this crs. Defaults to None.\n"
+      "    extract_command: Command that extracts a downloaded archive, with placeholders {file} and {dir}, e.g. \"unzip -o -q {file} -d {dir}\". Defaults to None.\n"
+      "    extensions: Extensions of extracted files that are decoded as rasters. Defaults to [\".jpg\", \".jpeg\", \".jp2\", \".tif\", \".tiff\", \".png\"].\n"
+      "    journal: Path of a journal file that records processed inputs, which are skipped when the pipeline is run again. Defaults to None.\n"
+      "    workers: Number of threads per step, i.e. download, extract, decode, cut, encode and write. Defaults to {\"download\": 8, \"extract\": 2, \"decode\": 2, \"cut\": 4, \"encode\": 4, \"write\": 2}.\n"
+      "    queue_size: Maximum number of files or raster strips that wait for the next step. Defaults to 4.\n"
+      "    tile_queue_size: Maximum number of tiles that wait to be encoded or written. Defaults to 256.\n"
+      "    strip_rows: Number of rows of the strips in which rasters are cut. Defaults to 1024.\n"
+      "    max_pending_tiles: The maximum number of partially covered tiles kept in memory. Defaults to 256.\n"
+      "    background: The RGB color of pixels that are not covered by any raster. Defaults to (255, 255, 255).\n"
+      "    quality: Quality of jpeg, webp, jxl and avif tiles between 0 and 100, if the sink stores encoded tiles. Defaults to 95.\n"
+      "    subsampling: Chroma subsampling of jpeg tiles, one of \"444\", \"422\", \"420\". Defaults to None, i.e. the default of OpenCV.\n"
+      "    optimize: Whether jpeg tiles use optimized Huffman tables. Defaults to False.\n"
+      "    progressive: Whether jpeg tiles are encoded progressively. Defaults to False.\n"
+      "    checkpoint_interval: Seconds between two checkpoints at which processed inputs are recorded in the journal. Defaults to 60.\n"
+      "    retries: Number of times that a download will be retried before the input fails. Defaults to 10.\n"
+      "    wait_after_error: Seconds to wait before retrying a download. Defaults to 1.5.\n"
+      "    verify_ssl: Whether to verify the ssl host/peer. Defaults to True.\n"
+      "    capath: Set the capath of the curl request if given. Defaults to None.\n"
+      "    cafile: Set the cafile of the curl request if given. Defaults to None.\n"
+      "    header: Header of the curl request. Defaults to {}.\n"
+      "\n"
+      "Returns:\n"
+      "    A new pipeline.\n"
+    )
+    .def("run", [](tiledwebmaps::DownloadPipeline& pipeline, std::vector<std::string> inputs, std::optional<py::function> progress){
+        tiledwebmaps::DownloadPipeline::ProgressCallback progress_callback;
+        if (progress)
+        {
+          std::shared_ptr<py::function> function(new py::function(*progress), [](py::function* function){
+            py::gil_scoped_acquire gil;
+            delete function;
+          });
+          progress_callback = [function](size_t done, size_t total){
+            py::gil_scoped_acquire gil;
+            try
+            {
+              (*function)(done, total);
+            }
+            catch (py::error_already_set& e)
+            {
+              // Errors in the progress callback do not stop the pipeline
+            }
+          };
+        }
+        py::gil_scoped_release gil;
+        pipeline.run(inputs, progress_callback);
+      },
+      py::arg("inputs"),
+      py::arg("progress") = std::optional<py::function>(),
+      "Processes all inputs that are not recorded in the journal and returns once they are done.\n"
+      "\n"
+      "Parameters:\n"
+      "    inputs: Urls or paths of local files.\n"
+      "    progress: Function that is called with the number of processed inputs and the number of all inputs after every input. Defaults to None.\n"
+    )
+  ;
+
+  py::class_<tiledwebmaps::Bin, std::shared_ptr<tiledwebmaps::Bin>, tiledwebmaps::TileLoader, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "Bin")
     .def(py::init([](std::string path, tiledwebmaps::Layout layout){
         return tiledwebmaps::Bin(path, layout);
       }),
@@ -550,50 +1239,266 @@ PYBIND11_MODULE(backend, m)
       py::arg("tile"),
       py::arg("zoom")
     )
+    .def("make_forksafe", &tiledwebmaps::Cache::make_forksafe)
+    .def_property_readonly("encoding", &tiledwebmaps::Cache::get_encoding)
   ;
-  py::class_<tiledwebmaps::CachedTileLoader, std::shared_ptr<tiledwebmaps::CachedTileLoader>, tiledwebmaps::TileLoader>(m, "CachedTileLoader", py::dynamic_attr())
-    .def(py::init<std::shared_ptr<tiledwebmaps::TileLoader>, std::shared_ptr<tiledwebmaps::Cache>>())
+  m.def("can_encode", &tiledwebmaps::can_encode,
+    py::arg("encoding"),
+    "Returns whether OpenCV was built with an encoder for the given image format.\n"
+    "\n"
+    "Parameters:\n"
+    "    encoding: The file extension of the image format, e.g. \".webp\", \".jxl\" or \".avif\".\n"
+    "\n"
+    "Returns:\n"
+    "    True if tiles can be saved in this format, otherwise False.\n"
+  );
+  m.def("encode_params", [](std::string encoding, std::optional<int> quality, std::optional<std::string> subsampling, bool optimize, bool progressive){
+      return make_encode_options(quality, subsampling, optimize, progressive).get_params(encoding);
+    },
+    py::arg("encoding"),
+    py::arg("quality") = py::none(),
+    py::arg("subsampling") = py::none(),
+    py::arg("optimize") = false,
+    py::arg("progressive") = false,
+    "Returns the parameters of cv2.imwrite and cv2.imencode for the encoding options of Disk.\n"
+    "\n"
+    "Parameters:\n"
+    "    encoding: The file extension of the image format, e.g. \".jpg\" or \".webp\".\n"
+    "    quality: Quality between 0 and 100, or None for the default of OpenCV.\n"
+    "    subsampling: Chroma subsampling of jpeg images, one of \"444\", \"422\", \"420\", or None for the default of OpenCV.\n"
+    "    optimize: Whether jpeg images use optimized Huffman tables.\n"
+    "    progressive: Whether jpeg images are encoded progressively.\n"
+    "\n"
+    "Returns:\n"
+    "    The list of parameters.\n"
+  );
+  py::class_<tiledwebmaps::NegativeCache, std::shared_ptr<tiledwebmaps::NegativeCache>>(m, "NegativeCache", py::dynamic_attr())
+    .def(py::init([](float ttl, std::optional<std::string> path){
+        return std::make_shared<tiledwebmaps::NegativeCache>(ttl, path ? std::optional<std::filesystem::path>(*path) : std::optional<std::filesystem::path>());
+      }),
+      py::arg("ttl"),
+      py::arg("path") = std::optional<std::string>(),
+      "Returns a new cache of tiles that are known to be missing in a tileloader.\n"
+      "\n"
+      "Parameters:\n"
+      "    ttl: Number of seconds for which a missing tile is remembered.\n"
+      "    path: File in which missing tiles are persisted across runs. If None, missing tiles are only stored in memory. Defaults to None.\n"
+      "\n"
+      "Returns:\n"
+      "    A new cache of missing tiles.\n"
+    )
+    .def("contains", &tiledwebmaps::NegativeCache::contains,
+      py::arg("tile"),
+      py::arg("zoom")
+    )
+    .def("insert", &tiledwebmaps::NegativeCache::insert,
+      py::arg("tile"),
+      py::arg("zoom")
+    )
+    .def("clear", &tiledwebmaps::NegativeCache::clear)
+    .def_property_readonly("ttl", &tiledwebmaps::NegativeCache::get_ttl)
+  ;
+  py::class_<tiledwebmaps::CachedTileLoader, std::shared_ptr<tiledwebmaps::CachedTileLoader>, tiledwebmaps::TileLoader, tiledwebmaps::Instrumented>(m, "CachedTileLoader", py::dynamic_attr())
+    .def(py::init<std::shared_ptr<tiledwebmaps::TileLoader>, std::shared_ptr<tiledwebmaps::Cache>, std::shared_ptr<tiledwebmaps::NegativeCache>>(),
+      py::arg("loader"),
+      py::arg("cache"),
+      py::arg("negative_cache") = std::shared_ptr<tiledwebmaps::NegativeCache>()
+    )
     .def_property_readonly("cache", &tiledwebmaps::CachedTileLoader::get_cache)
+    .def_property_readonly("negative_cache", &tiledwebmaps::CachedTileLoader::get_negative_cache)
   ;
 
-  py::class_<tiledwebmaps::Disk, std::shared_ptr<tiledwebmaps::Disk>, tiledwebmaps::TileLoader, tiledwebmaps::Cache>(m, "Disk", py::dynamic_attr())
-    .def(py::init<std::string, tiledwebmaps::Layout, int, int, float>(),
+  py::class_<tiledwebmaps::Disk, std::shared_ptr<tiledwebmaps::Disk>, tiledwebmaps::TileLoader, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "Disk", py::dynamic_attr())
+    .def(py::init([](std::string path, tiledwebmaps::Layout layout, int min_zoom, int max_zoom, std::optional<float> wait_after_last_modified, bool fsync, std::optional<int> quality, std::optional<std::string> subsampling, bool optimize, bool progressive){
+        warn_wait_after_last_modified(wait_after_last_modified);
+        return std::make_shared<tiledwebmaps::Disk>(path, layout, min_zoom, max_zoom, parse_sync(fsync), make_encode_options(quality, subsampling, optimize, progressive));
+      }),
       py::arg("path"),
       py::arg("layout"),
       py::arg("min_zoom"),
       py::arg("max_zoom"),
-      py::arg("wait_after_last_modified") = 1.0,
+      py::arg("wait_after_last_modified") = std::optional<float>(),
+      py::kw_only(),
+      py::arg("fsync") = false,
+      py::arg("quality") = std::optional<int>(),
+      py::arg("subsampling") = std::optional<std::string>(),
+      py::arg("optimize") = false,
+      py::arg("progressive") = false,
       "Returns a new tileloader that loads tiles from disk.\n"
       "\n"
+      "The image format of saved tiles is given by the file extension of the path, e.g. \".jpg\", \".png\", \".webp\", \".jxl\" or \".avif\", depending on the codecs that OpenCV was built with.\n"
+      "\n"
       "Parameters:\n"
       "    path: The path to the saved tiles, including placeholders. If it does not include placeholders, appends \"/zoom/x/y.jpg\".\n"
       "    layout: The layout of the tiles loaded by this tileloader. Defaults to tiledwebmaps.Layout.XYZ().\n"
       "    min_zoom: The minimum zoom level that the tileloader will load.\n"
       "    max_zoom: The maximum zoom level that the tileloader will load.\n"
-      "    wait_after_last_modified: Waits this many seconds after the last modification of a tile before loading it. Defaults to 1.0.\n"
+      "    wait_after_last_modified: Deprecated and ignored, since tiles are written atomically.\n"
+      "    fsync: Whether saved tiles are flushed to disk before they are moved to their final path. Keyword-only, as are the following parameters. Defaults to False.\n"
+      "    quality: Quality of saved jpeg, webp, jxl and avif tiles between 0 and 100. Defaults to None, i.e. the default of OpenCV.\n"
+      "    subsampling: Chroma subsampling of saved jpeg tiles, one of \"444\", \"422\", \"420\". Defaults to None, i.e. the default of OpenCV.\n"
+      "    optimize: Whether saved jpeg tiles use optimized Huffman tables. Defaults to False.\n"
+      "    progressive: Whether saved jpeg tiles are encoded progressively. Defaults to False.\n"
       "\n"
       "Returns:\n"
       "    A new tileloader that loads tiles from disk.\n"
     )
     .def_property_readonly("path", [](const tiledwebmaps::Disk& disk){return disk.get_path().string();})
   ;
-  m.def("DiskCached", [](std::shared_ptr<tiledwebmaps::TileLoader> loader, std::string path, float wait_after_last_modified){
-      return std::make_shared<tiledwebmaps::CachedTileLoader>(loader, std::make_shared<tiledwebmaps::Disk>(path, loader->get_layout(), loader->get_min_zoom(), loader->get_max_zoom(), wait_after_last_modified));
+  py::class_<tiledwebmaps::Pack, std::shared_ptr<tiledwebmaps::Pack>, tiledwebmaps::TileLoader, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "Pack", py::dynamic_attr())
+    .def(py::init([](std::string path, tiledwebmaps::Layout layout, int min_zoom, int max_zoom, std::string encoding, int metatile_size, bool fsync){
+        return std::make_shared<tiledwebmaps::Pack>(path, layout, min_zoom, max_zoom, encoding, metatile_size, parse_sync(fsync));
+      }),
+      py::arg("path"),
+      py::arg("layout"),
+      py::arg("min_zoom"),
+      py::arg("max_zoom"),
+      py::arg("encoding") = ".jpg",
+      py::arg("metatile_size") = 16,
+      py::arg("fsync") = false,
+      "Returns a new tileloader that stores tiles in packfiles on disk, with one file per metatile of metatile_size x metatile_size tiles.\n"
+      "\n"
+      "Parameters:\n"
+      "    path: The directory of the packfiles \"zoom/x/y.pack\".\n"
+      "    layout: The layout of the tiles loaded by this tileloader.\n"
+      "    min_zoom: The minimum zoom level that the tileloader will load.\n"
+      "    max_zoom: The maximum zoom level that the tileloader will load.\n"
+      "    encoding: The file extension of the image format of saved tiles. Defaults to \".jpg\".\n"
+      "    metatile_size: The number of tiles per packfile along each axis. Defaults to 16.\n"
+      "    fsync: Whether saved tiles are flushed to disk before they are added to the index of the packfile. Defaults to False.\n"
+      "\n"
+      "Returns:\n"
+      "    A new tileloader that stores tiles in packfiles.\n"
+    )
+    .def_property_readonly("path", [](const tiledwebmaps::Pack& pack){return pack.get_path().string();})
+    .def_property_readonly("metatile_size", &tiledwebmaps::Pack::get_metatile_size)
+  ;
+  py::class_<tiledwebmaps::MBTiles, std::shared_ptr<tiledwebmaps::MBTiles>, tiledwebmaps::TileLoader, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "MBTiles", py::dynamic_attr())
+    .def(py::init<std::string, tiledwebmaps::Layout, int, int, std::string, bool, size_t, float, bool>(),
+      py::arg("path"),
+      py::arg("layout"),
+      py::arg("min_zoom"),
+      py::arg("max_zoom"),
+      py::arg("encoding") = ".jpg",
+      py::arg("flip_y") = true,
+      py::arg("batch_size") = 64,
+      py::arg("max_delay") = 1.0,
+      py::arg("read_only") = false,
+      "Returns a new tileloader that stores tiles in an MBTiles file, i.e. an SQLite database.\n"
+      "\n"
+      "The database is opened in WAL mode with a pool of connections that are shared by all threads. Saved tiles are inserted in batches in a single transaction.\n"
+      "\n"
+      "Parameters:\n"
+      "    path: The path of the MBTiles file. It is created if it does not exist.\n"
+      "    layout: The layout of the tiles loaded by this tileloader.\n"
+      "    min_zoom: The minimum zoom level that the tileloader will load.\n"
+      "    max_zoom: The maximum zoom level that the tileloader will load.\n"
+      "    encoding: The file extension of the image format of saved tiles. Defaults to \".jpg\".\n"
+      "    flip_y: Whether y coordinates are flipped between the layout and the TMS scheme of the database. Defaults to True, which is correct for the XYZ layout.\n"
+      "    batch_size: The number of pending saved tiles after which they are inserted into the database. Defaults to 64.\n"
+      "    max_delay: The number of seconds after which pending saved tiles are inserted into the database on the next save or load. Defaults to 1.\n"
+      "    read_only: Whether to open an existing database without creating or modifying it. Defaults to False.\n"
+      "\n"
+      "Returns:\n"
+      "    A new tileloader that stores tiles in an MBTiles file.\n"
+    )
+    .def("flush", &tiledwebmaps::MBTiles::flush, py::call_guard<py::gil_scoped_release>())
+    .def_property_readonly("path", [](const tiledwebmaps::MBTiles& mbtiles){return mbtiles.get_path().string();})
+    .def_property_readonly("read_only", &tiledwebmaps::MBTiles::is_read_only)
+  ;
+  py::class_<tiledwebmaps::BoundedDisk, std::shared_ptr<tiledwebmaps::BoundedDisk>, tiledwebmaps::Disk>(m, "BoundedDisk", py::dynamic_attr())
+    .def(py::init([](std::string path, tiledwebmaps::Layout layout, int min_zoom, int max_zoom, uint64_t max_bytes, std::string eviction, bool fsync, float compaction_interval, std::optional<int> quality, std::optional<std::string> subsampling, bool optimize, bool progressive){
+        return std::make_shared<tiledwebmaps::BoundedDisk>(path, layout, min_zoom, max_zoom, max_bytes, parse_eviction_policy(eviction), parse_sync(fsync), compaction_interval, 0.9, make_encode_options(quality, subsampling, optimize, progressive));
+      }),
+      py::arg("path"),
+      py::arg("layout"),
+      py::arg("min_zoom"),
+      py::arg("max_zoom"),
+      py::arg("max_bytes"),
+      py::arg("eviction") = "lru",
+      py::arg("fsync") = false,
+      py::arg("compaction_interval") = 10.0,
+      py::arg("quality") = std::optional<int>(),
+      py::arg("subsampling") = std::optional<std::string>(),
+      py::arg("optimize") = false,
+      py::arg("progressive") = false,
+      "Returns a new disk cache whose total size is limited to the given number of bytes.\n"
+      "\n"
+      "Saved and accessed tiles are recorded in the file \"journal.txt\" next to the tiles. A background thread evicts tiles once the quota is exceeded and compacts the journal.\n"
+      "\n"
+      "Parameters:\n"
+      "    path: The path to the saved tiles, including placeholders. If it does not include placeholders, appends \"/zoom/x/y.jpg\".\n"
+      "    layout: The layout of the tiles loaded by this tileloader.\n"
+      "    min_zoom: The minimum zoom level that the tileloader will load.\n"
+      "    max_zoom: The maximum zoom level that the tileloader will load.\n"
+      "    max_bytes: The maximum total size of the saved tiles in bytes.\n"
+      "    eviction: Either \"lru\" to evict least recently used tiles, or \"lfu\" to evict least frequently used tiles. Defaults to \"lru\".\n"
+      "    fsync: Whether saved tiles are flushed to disk before they are moved to their final path. Defaults to False.\n"
+      "    compaction_interval: Number of seconds between flushes and compactions of the journal. Defaults to 10.\n"
+      "    quality: Quality of saved jpeg, webp, jxl and avif tiles between 0 and 100. Defaults to None, i.e. the default of OpenCV.\n"
+      "    subsampling: Chroma subsampling of saved jpeg tiles, one of \"444\", \"422\", \"420\". Defaults to None, i.e. the default of OpenCV.\n"
+      "    optimize: Whether saved jpeg tiles use optimized Huffman tables. Defaults to False.\n"
+      "    progressive: Whether saved jpeg tiles are encoded progressively. Defaults to False.\n"
+      "\n"
+      "Returns:\n"
+      "    A new size-bounded disk cache.\n"
+    )
+    .def_property_readonly("total_bytes", &tiledwebmaps::BoundedDisk::get_total_bytes)
+    .def_property_readonly("max_bytes", &tiledwebmaps::BoundedDisk::get_max_bytes)
+    .def("compact", &tiledwebmaps::BoundedDisk::compact, py::call_guard<py::gil_scoped_release>())
+  ;
+  m.def("DiskCached", [](std::shared_ptr<tiledwebmaps::TileLoader> loader, std::string path, std::optional<float> wait_after_last_modified, std::optional<float> missing_ttl, bool fsync, std::optional<uint64_t> max_bytes, std::string eviction, std::optional<int> quality, std::optional<std::string> subsampling, bool optimize, bool progressive){
+      warn_wait_after_last_modified(wait_after_last_modified);
+      tiledwebmaps::EncodeOptions encode_options = make_encode_options(quality, subsampling, optimize, progressive);
+      std::shared_ptr<tiledwebmaps::Disk> disk;
+      if (max_bytes)
+      {
+        disk = std::make_shared<tiledwebmaps::BoundedDisk>(path, loader->get_layout(), loader->get_min_zoom(), loader->get_max_zoom(), *max_bytes, parse_eviction_policy(eviction), parse_sync(fsync), 10.0, 0.9, encode_options);
+      }
+      else
+      {
+        disk = std::make_shared<tiledwebmaps::Disk>(path, loader->get_layout(), loader->get_min_zoom(), loader->get_max_zoom(), parse_sync(fsync), encode_options);
+      }
+      // Tiles are cached in the format in which the loader returns them, e.g. float elevation of Terrarium tiles
+      disk->set_tile_format(loader->get_tile_format());
+      std::shared_ptr<tiledwebmaps::NegativeCache> negative_cache;
+      if (missing_ttl)
+      {
+        negative_cache = std::make_shared<tiledwebmaps::NegativeCache>(*missing_ttl, disk->get_base_path() / "missing.txt");
+      }
+      return std::make_shared<tiledwebmaps::CachedTileLoader>(loader, disk, negative_cache);
     },
     py::arg("loader"),
     py::arg("path"),
-    py::arg("wait_after_last_modified") = 1.0,
+    py::arg("wait_after_last_modified") = std::optional<float>(),
+    py::kw_only(),
+    py::arg("missing_ttl") = std::optional<float>(),
+    py::arg("fsync") = false,
+    py::arg("max_bytes") = std::optional<uint64_t>(),
+    py::arg("eviction") = "lru",
+    py::arg("quality") = std::optional<int>(),
+    py::arg("subsampling") = std::optional<std::string>(),
+    py::arg("optimize") = false,
+    py::arg("progressive") = false,
     "Returns a new tileloader that caches tiles from the given tileloader on disk.\n"
     "\n"
     "Parameters:\n"
     "    loader: The tileloader whose tiles will be cached.\n"
     "    path: The path to where the cached tiles will be saved, including placeholders. If it does not include placeholders, appends \"/zoom/x/y.jpg\".\n"
-    "    wait_after_last_modified: Waits this many seconds after the last modification of a tile before loading it. Defaults to 1.0.\n"
+    "    wait_after_last_modified: Deprecated and ignored, since tiles are written atomically.\n"
+    "    missing_ttl: If given, tiles that are missing in the given tileloader are remembered for this many seconds in the file \"missing.txt\" next to the cached tiles and are not requested again during that time. Keyword-only, as are the following parameters. Defaults to None.\n"
+    "    fsync: Whether saved tiles are flushed to disk before they are moved to their final path. Defaults to False.\n"
+    "    max_bytes: If given, the total size of the cached tiles is limited to this many bytes (see BoundedDisk). Defaults to None.\n"
+    "    eviction: Either \"lru\" or \"lfu\", only used if max_bytes is given. Defaults to \"lru\".\n"
+    "    quality: Quality of saved jpeg, webp, jxl and avif tiles between 0 and 100. Defaults to None, i.e. the default of OpenCV.\n"
+    "    subsampling: Chroma subsampling of saved jpeg tiles, one of \"444\", \"422\", \"420\". Defaults to None, i.e. the default of OpenCV.\n"
+    "    optimize: Whether saved jpeg tiles use optimized Huffman tables. Defaults to False.\n"
+    "    progressive: Whether saved jpeg tiles are encoded progressively. Defaults to False.\n"
     "\n"
     "Returns:\n"
     "    A new tileloader that caches tiles from the given tileloader on disk.\n"
   );
-  py::class_<tiledwebmaps::LRU, std::shared_ptr<tiledwebmaps::LRU>, tiledwebmaps::Cache>(m, "LRU", py::dynamic_attr())
+  py::class_<tiledwebmaps::LRU, std::shared_ptr<tiledwebmaps::LRU>, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "LRU", py::dynamic_attr())
     .def(py::init<int>(),
       py::arg("size")
     )
@@ -612,15 +1517,103 @@ PYBIND11_MODULE(backend, m)
     "Returns:\n"
     "    A new tileloader that caches tiles from the given tileloader in a LRU cache.\n"
   );
-  py::class_<tiledwebmaps::WithDefault, std::shared_ptr<tiledwebmaps::WithDefault>, tiledwebmaps::TileLoader>(m, "WithDefault", py::dynamic_attr())
-    .def(py::init<std::shared_ptr<tiledwebmaps::TileLoader>, xti::vec3i>(),
+  py::class_<tiledwebmaps::SharedMemoryCache, std::shared_ptr<tiledwebmaps::SharedMemoryCache>, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "SharedMemoryCache", py::dynamic_attr())
+    .def(py::init([](size_t slots, size_t slot_bytes, std::optional<std::string> name, bool create, uint32_t layer){
+        return std::make_shared<tiledwebmaps::SharedMemoryCache>(slots, slot_bytes, name ? *name : "", create, layer);
+      }),
+      py::arg("slots"),
+      py::arg("slot_bytes") = 256 * 256 * 3,
+      py::arg("name") = std::optional<std::string>(),
+      py::arg("create") = true,
+      py::arg("layer") = 0,
+      "Returns a new cache of decoded tiles in shared memory that is shared between processes, e.g. the workers of a PyTorch DataLoader.\n"
+      "\n"
+      "Parameters:\n"
+      "    slots: The maximum number of tiles that will be cached.\n"
+      "    slot_bytes: The maximum number of bytes of a decoded tile. Larger tiles are not cached. Defaults to 256 * 256 * 3.\n"
+      "    name: If None, the memory is shared with processes that are forked after creating the cache. Otherwise, the name of the POSIX shared memory object that other processes can open. Defaults to None.\n"
+      "    create: Whether to create a new shared memory object, or to open the existing object with the given name. Creating fails if the object already exists. Defaults to True.\n"
+      "    layer: The id of the layer whose tiles are stored by this cache, such that several layers can share the memory. Defaults to 0.\n"
+      "\n"
+      "Returns:\n"
+      "    A new shared memory cache.\n"
+    )
+    .def("with_layer", &tiledwebmaps::SharedMemoryCache::with_layer,
+      py::arg("layer"),
+      "Returns a cache for the tiles of another layer in the same shared memory.\n"
+      "\n"
+      "Parameters:\n"
+      "    layer: The id of the layer.\n"
+      "\n"
+      "Returns:\n"
+      "    A cache that shares the memory with this cache.\n"
+    )
+    .def_property_readonly("slots", &tiledwebmaps::SharedMemoryCache::get_slots_num)
+    .def_property_readonly("slot_bytes", &tiledwebmaps::SharedMemoryCache::get_slot_bytes)
+    .def_property_readonly("layer", &tiledwebmaps::SharedMemoryCache::get_layer)
+  ;
+  py::class_<tiledwebmaps::TieredCache, std::shared_ptr<tiledwebmaps::TieredCache>, tiledwebmaps::Cache, tiledwebmaps::Instrumented>(m, "TieredCache", py::dynamic_attr())
+    .def(py::init([](std::vector<std::tuple<std::shared_ptr<tiledwebmaps::Cache>, std::string>> tiers){
+        std::vector<tiledwebmaps::TieredCache::Tier> tiers2;
+        for (const auto& tier : tiers)
+        {
+          std::string policy = std::get<1>(tier);
+          tiledwebmaps::TieredCache::Policy policy2;
+          if (policy == "write_through")
+          {
+            policy2 = tiledwebmaps::TieredCache::Policy::WRITE_THROUGH;
+          }
+          else if (policy == "write_back")
+          {
+            policy2 = tiledwebmaps::TieredCache::Policy::WRITE_BACK;
+          }
+          else if (policy == "read_only")
+          {
+            policy2 = tiledwebmaps::TieredCache::Policy::READ_ONLY;
+          }
+          else
+          {
+            throw std::invalid_argument("Invalid tier policy " + policy);
+          }
+          tiers2.push_back(tiledwebmaps::TieredCache::Tier{std::get<0>(tier), policy2, ""});
+        }
+        return std::make_shared<tiledwebmaps::TieredCache>(tiers2);
+      }),
+      py::arg("tiers"),
+      "Returns a new cache that combines the given caches ordered from fastest to slowest.\n"
+      "\n"
+      "Tiles are loaded from the first tier that contains them and copied to all faster write-through tiers. Tiers with the same encoding (e.g. Bin and Disk with jpeg tiles) exchange encoded bytes without decoding and re-encoding the tiles. Hits, promotions and saves are counted per tier in the metrics.\n"
+      "\n"
+      "Parameters:\n"
+      "    tiers: List of (cache, policy) tuples. The policy is one of \"write_through\" (tiles are saved in the tier immediately), \"write_back\" (tiles are saved in the tier when they are evicted from the previous tier, e.g. an LRU) or \"read_only\".\n"
+      "\n"
+      "Returns:\n"
+      "    A new tiered cache.\n"
+    )
+  ;
+  py::class_<tiledwebmaps::WithDefault, std::shared_ptr<tiledwebmaps::WithDefault>, tiledwebmaps::TileLoader, tiledwebmaps::Instrumented>(m, "WithDefault", py::dynamic_attr())
+    .def(py::init([](std::shared_ptr<tiledwebmaps::TileLoader> loader, std::vector<double> color, py::dtype dtype){
+        int depth = tiledwebmaps::dtype_to_depth(dtype);
+        if (depth < 0 || color.size() < 1 || color.size() > 4)
+        {
+          throw std::invalid_argument("Default tiles must have 1 to 4 channels and a dtype that is supported by OpenCV");
+        }
+        cv::Scalar value;
+        for (size_t i = 0; i < color.size(); i++)
+        {
+          value[i] = color[i];
+        }
+        return std::make_shared<tiledwebmaps::WithDefault>(loader, value, CV_MAKETYPE(depth, (int) color.size()));
+      }),
       py::arg("loader"),
-      py::arg("color") = xti::vec3i({255, 255, 255}),
+      py::arg("color") = std::vector<double>{255, 255, 255},
+      py::arg("dtype") = py::dtype::of<uint8_t>(),
       "Returns a new tileloader that returns default tiles with the given color if the given tileloader does not contain a tile.\n"
       "\n"
       "Parameters:\n"
       "    loader: The tileloader whose tiles will be returned if they exist.\n"
-      "    color: Color that the default tile will be filled with. Defaults to [255, 255, 255].\n"
+      "    color: Color that the default tile will be filled with, with one value per channel, e.g. [0] for elevation. Defaults to [255, 255, 255].\n"
+      "    dtype: Dtype of the default tile, e.g. \"float32\" for elevation. Defaults to uint8.\n"
       "\n"
       "Returns:\n"
       "    A new tileloader that returns default tiles if the given tileloader does not contain a tile.\n"
@@ -628,7 +1621,8 @@ PYBIND11_MODULE(backend, m)
   ;
 
 
-  py::register_exception<tiledwebmaps::LoadTileException>(m, "LoadTileException");
+  auto& load_tile_exception = py::register_exception<tiledwebmaps::LoadTileException>(m, "LoadTileException");
+  py::register_exception<tiledwebmaps::TileNotFoundException>(m, "TileNotFoundException", load_tile_exception.ptr());
   py::register_exception<tiledwebmaps::WriteFileException>(m, "WriteFileException");
   py::register_exception<tiledwebmaps::LoadFileException>(m, "LoadFileException");
   py::register_exception<tiledwebmaps::FileNotFoundException>(m, "FileNotFoundException");
@@ -3,7 +3,7 @@ set -e -u -x
 
 $BUILD_PYTHON_ROOT_PATH/bin/python -m pip install cython numpy
 
-yum install -y openssl-devel libtiff-devel blas-devel lapack-devel
+yum install -y openssl-devel libtiff-devel blas-devel lapack-devel sqlite-devel zlib-devel
 
 git clone https://github.com/opencv/opencv && cd opencv && mkdir build && cd build && cmake -DCMAKE_BUILD_TYPE=Release -DCMAKE_POSITION_INDEPENDENT_CODE=ON -DBUILD_SHARED_LIBS=OFF -DBUILD_opencv_python=OFF -DBUILD_opencv_dnn=OFF -DBUILD_opencv_video=OFF -DBUILD_opencv_highgui=OFF -DBUILD_opencv_ml=OFF -DBUILD_opencv_flann=OFF -DBUILD_opencv_video=OFF -DBUILD_opencv_videoio=OFF -DBUILD_opencv_features2d=OFF -DBUILD_opencv_gapi=OFF -DBUILD_opencv_photo=OFF -DCMAKE_CXX_STANDARD=14 -DWITH_CUDA=OFF -DCUDA_FAST_MATH=ON -DBUILD_EXAMPLES=OFF -DBUILD_TESTS=OFF -DBUILD_opencv_apps=OFF -DBUILD_PERF_TESTS=OFF -DBUILD_PROTOBUF=OFF -DWITH_PROTOBUF=OFF -DWITH_VTK=OFF -DWITH_GTK=OFF -DBUILD_JAVA=OFF -DWITH_QUIRC=OFF -DWITH_ADE=OFF .. && make -j32 && make install -j32 && cd ../.. && rm -rf opencv
 git clone https://github.com/curl/curl && cd curl && cmake -DCMAKE_BUILD_TYPE=Release -DCMAKE_POSITION_INDEPENDENT_CODE=ON -DBUILD_SHARED_LIBS=OFF -DCURL_CA_BUNDLE=none -DCURL_CA_PATH=none . && make -j32 && make install -j32 && cd .. && rm -rf curl
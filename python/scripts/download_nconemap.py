@@ -1,7 +1,6 @@
 #!/usr/bin/env python3
 
 import argparse, os, requests, tqdm, shutil, sys, multiprocessing, cv2
-import imageio.v2 as imageio
 import tiledwebmaps as twm
 from datetime import datetime
 import tinypl as pl
@@ -11,6 +10,8 @@ parser = argparse.ArgumentParser()
 parser.add_argument("--path", type=str, required=True)
 parser.add_argument("--shape", type=int, default=None)
 parser.add_argument("--workers", type=int, default=32)
+parser.add_argument("--format", type=str, default="jpg")
+parser.add_argument("--quality", type=int, default=95)
 args = parser.parse_args()
 
 if shutil.which("gdal_retile.py") is None:
@@ -160,7 +161,7 @@ layout_yaml = {
     "tile_shape_px": [shape[0], shape[1]],
     "tile_shape_crs": tile_shape_crs,
     "tile_axes": ["east", "north"],
-    "path": "{zoom}/{x}/{y}.jpg",
+    "path": "{zoom}/{x}/{y}." + args.format,
     "min_zoom": 0,
     "max_zoom": 0,
 }
@@ -252,7 +253,7 @@ def process(area):
                     with lock2:
                         if not os.path.isdir(path):
                             os.makedirs(path)
-                imageio.imwrite(os.path.join(path, f"{tile[1]}.jpg"), image, quality=100)
+                cv2.imwrite(os.path.join(path, f"{tile[1]}.{args.format}"), cv2.cvtColor(image, cv2.COLOR_RGB2BGR), twm.encode_params("." + args.format, quality=args.quality, optimize=True))
 
         os.remove(file)
 pipe = pl.process.map(pipe, process, workers=args.workers)
@@ -264,4 +265,4 @@ for _ in tqdm.tqdm(pipe, desc="Downloading areas", total=len(areas)):
 
 shutil.rmtree(download_path)
 
-twm.util.add_zooms(args.path, workers=args.workers)
\ No newline at end of file
+twm.util.add_zooms(args.path, workers=args.workers, quality=args.quality, optimize=True)
\ No newline at end of file
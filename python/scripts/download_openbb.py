@@ -1,19 +1,18 @@
 #!/usr/bin/env python3
 
-import argparse, os, requests, tqdm, pyunpack, shutil, sys, multiprocessing
+import argparse, os, requests, tqdm, shutil, sys
 
 parser = argparse.ArgumentParser()
 parser.add_argument("--path", type=str, required=True)
 parser.add_argument("--shape", type=int, default=None)
 parser.add_argument("--workers", type=int, default=32)
+parser.add_argument("--format", type=str, default="jpg")
+parser.add_argument("--quality", type=int, default=95)
 args = parser.parse_args()
 
 import tiledwebmaps as twm
 import numpy as np
 from PIL import Image
-Image.MAX_IMAGE_PIXELS = None
-import tinypl as pl
-import imageio.v2 as imageio
 
 download_path = os.path.join(args.path, "download")
 if not os.path.exists(download_path):
@@ -53,7 +52,7 @@ layout_yaml = {
     "tile_shape_px": [shape[0], shape[1]],
     "tile_shape_crs": tile_shape_crs,
     "tile_axes": ["east", "north"],
-    "path": "{zoom}/{x}/{y}.jpg",
+    "path": "{zoom}/{x}/{y}." + args.format,
     "min_zoom": 0,
     "max_zoom": 0,
 }
@@ -63,44 +62,35 @@ with open(os.path.join(args.path, "layout.yaml"), "w") as f:
 print(f"Partitioning into {partition} tiles per side")
 
 
-utm_to_epsg4326 = twm.proj.Transformer("epsg:25833", "epsg:4326")
-
-pipe = urls
-pipe = pl.thread.mutex(pipe)
-
-lock = multiprocessing.Lock()
-lock2 = multiprocessing.Lock()
-def process(url):
-    file = os.path.join(download_path, url.split("/")[-1])
+crs = twm.proj.CRS("epsg:25833")
+def georeference(file):
+    # Rasters are named after their lower-left corner in kilometers, e.g. dop_33250-5886.jpg
     line = os.path.basename(file).split("_33")[1].split(".")[0].split("-")
-
-    with lock:
-        twm.util.download(url, file)
-    twm.util.extract(file, download_path)
-    file = file.replace(".zip", ".jpg")
-    image = imageio.imread(file)[:, :, :3]
-
     lower_utm = np.asarray([float(line[0]), float(line[1])]) * 1000
-    upper_utm = lower_utm + 1000
-
-    lower_latlon = utm_to_epsg4326(lower_utm)
-    upper_latlon = utm_to_epsg4326(upper_utm)
-    latlon = 0.5 * (lower_latlon + upper_latlon)
-
-    for image, tile in twm.util.to_tiles(image, latlon, layout, partition):
-        path = os.path.join(args.path, "0", f"{tile[0]}")
-        if not os.path.isdir(path):
-            with lock2:
-                if not os.path.isdir(path):
-                    os.makedirs(path)
-        imageio.imwrite(os.path.join(path, f"{tile[1]}.jpg"), image, quality=100)
-
-    os.remove(file)
-pipe = pl.process.map(pipe, process, workers=args.workers)
-
-for _ in tqdm.tqdm(pipe, total=len(urls)):
-    pass
+    # Rasters cover 1km x 1km, the resolution is derived from the raster size that is read from the image header
+    with Image.open(file) as image:
+        width, height = image.size
+    if width != height:
+        raise ValueError(f"Expected a square raster covering 1km x 1km, but {file} has shape {height}x{width}")
+    meters_per_pixel = 1000.0 / width
+    return crs, (lower_utm[0], meters_per_pixel, 0.0, lower_utm[1] + 1000.0, 0.0, -meters_per_pixel)
+
+pipeline = twm.DownloadPipeline(
+    sink=twm.Disk(os.path.join(args.path, "{zoom}/{x}/{y}." + args.format), layout, 0, 0),
+    layout=layout,
+    zoom=0,
+    work_path=download_path,
+    georeference=georeference,
+    extract_command="unzip -o -q {file} -d {dir}",
+    extensions=[".jpg"],
+    journal=os.path.join(args.path, "journal.txt"),
+    workers={"download": args.workers, "cut": max(args.workers // 4, 1), "encode": max(args.workers // 2, 1)},
+    quality=args.quality,
+    optimize=True,
+)
+with tqdm.tqdm(total=len(urls)) as progress:
+    pipeline.run(urls, progress=lambda done, total: progress.update(1))
 
 shutil.rmtree(download_path)
 
-twm.util.add_zooms(args.path, workers=args.workers)
\ No newline at end of file
+twm.util.add_zooms(args.path, workers=args.workers, quality=args.quality, optimize=True)
\ No newline at end of file
@@ -6,9 +6,12 @@ parser = argparse.ArgumentParser()
 parser.add_argument("--path", type=str, required=True)
 parser.add_argument("--shape", type=int, default=None)
 parser.add_argument("--workers", type=int, default=32)
+parser.add_argument("--format", type=str, default="jpg")
+parser.add_argument("--quality", type=int, default=95)
 args = parser.parse_args()
 
 import tiledwebmaps as twm
+import cv2
 import numpy as np
 from PIL import Image
 Image.MAX_IMAGE_PIXELS = None
@@ -59,7 +62,7 @@ layout_yaml = {
     "tile_shape_px": tile_shape_px,
     "tile_shape_crs": tile_shape_crs,
     "tile_axes": ["east", "north"],
-    "path": "{zoom}/{x}/{y}.jpg",
+    "path": "{zoom}/{x}/{y}." + args.format,
     "min_zoom": 0,
     "max_zoom": 0,
 }
@@ -110,7 +113,7 @@ def process(url):
                 with lock2:
                     if not os.path.isdir(path):
                         os.makedirs(path)
-            imageio.imwrite(os.path.join(path, f"{tile[1]}.jpg"), image, quality=100)
+            cv2.imwrite(os.path.join(path, f"{tile[1]}.{args.format}"), cv2.cvtColor(image, cv2.COLOR_RGB2BGR), twm.encode_params("." + args.format, quality=args.quality, optimize=True))
 
         os.remove(imagefile)
 pipe = pl.process.map(pipe, process, workers=args.workers)
@@ -118,4 +121,4 @@ pipe = pl.process.map(pipe, process, workers=args.workers)
 for _ in tqdm.tqdm(pipe, total=len(urls)):
     pass
 
-twm.util.add_zooms(args.path, workers=args.workers)
\ No newline at end of file
+twm.util.add_zooms(args.path, workers=args.workers, quality=args.quality, optimize=True)
\ No newline at end of file
@@ -8,8 +8,14 @@ parser = argparse.ArgumentParser()
 parser.add_argument("--input", type=str, required=True)
 parser.add_argument("--output", type=str, required=True)
 parser.add_argument("--workers", type=int, default=8)
+parser.add_argument("--format", type=str, default=None, help="Re-encode tiles into this format, e.g. webp, jxl or avif. By default, tiles are copied without re-encoding")
+parser.add_argument("--quality", type=int, default=None)
+parser.add_argument("--subsampling", type=str, default=None, choices=["444", "422", "420"])
+parser.add_argument("--optimize", action="store_true", help="Use optimized Huffman tables for jpeg tiles")
 args = parser.parse_args()
 
+import tiledwebmaps as twm
+
 print("Finding tiles...")
 tiles = []
 for zoom in os.listdir(args.input):
@@ -22,42 +28,60 @@ for zoom in os.listdir(args.input):
             continue
         for y in os.listdir(x_path):
             file = os.path.join(x_path, y)
-            if os.path.isfile(file) and file.endswith(".jpg"):
-                size = os.path.getsize(file)
-                tiles.append((int(zoom), int(x), int(y[:-4]), size))
+            name, extension = os.path.splitext(y)
+            if os.path.isfile(file) and extension in [".jpg", ".jpeg", ".png", ".webp", ".jxl", ".avif"]:
+                tiles.append((int(zoom), int(x), int(name), file))
 
 print("Sorting tiles...")
 tiles = sorted(tiles)
+if len(tiles) == 0:
+    raise ValueError(f"Found no tiles in {args.input}")
+extensions = set(os.path.splitext(tile[3])[1] for tile in tiles)
+if args.format is None and len(extensions) > 1:
+    raise ValueError(f"Found tiles with different formats {sorted(extensions)}, use --format to re-encode them into a single format")
+# Bin files store all tiles in a single format
+reencode = args.format is not None or args.quality is not None or args.subsampling is not None or args.optimize
+encoding = "." + args.format if args.format is not None else extensions.pop()
+if reencode and not twm.can_encode(encoding):
+    raise ValueError(f"OpenCV was built without an encoder for {encoding}")
 
-print("Computing tile offsets...")
-sizes = np.asarray([tile[3] for tile in tiles])
-tile_starts = np.concatenate(([0], np.cumsum(sizes)))
-tiles = [(zoom, x, y, size, offset) for (zoom, x, y, size), offset in zip(tiles, tile_starts)]
-total_size = tile_starts[-1]
-
-print(f"Allocating {total_size / 1024 ** 3:.2f} GB of memory...")
 if not os.path.exists(args.output):
     os.makedirs(args.output)
 shutil.copy(os.path.join(args.input, "layout.yaml"), os.path.join(args.output, "layout.yaml"))
-images_bin = np.memmap(os.path.join(args.output, "images.dat"), dtype="uint8", mode="w+", shape=(total_size,))
-
-np.savez(
-    os.path.join(args.output, "images-meta.npz"),
-    zoom=np.asarray([tile[0] for tile in tiles]).astype("int64"),
-    x=np.asarray([tile[1] for tile in tiles]).astype("int64"),
-    y=np.asarray([tile[2] for tile in tiles]).astype("int64"), 
-    offset=tile_starts.astype("int64"),
-)
 
 pipe = tiles
 pipe = pl.thread.mutex(pipe)
 
 @pl.unpack
-def process(zoom, x, y, size, offset):
-    file = os.path.join(args.input, str(zoom), str(x), str(y) + ".jpg")
-    data = np.fromfile(file, dtype="uint8")
-    return data, offset
+def process(zoom, x, y, file):
+    if not reencode:
+        data = np.fromfile(file, dtype="uint8")
+    else:
+        import cv2
+        image = cv2.imread(file, cv2.IMREAD_COLOR)
+        if image is None:
+            raise ValueError(f"Failed to decode tile {file}")
+        success, data = cv2.imencode(encoding, image, twm.encode_params(encoding, quality=args.quality, subsampling=args.subsampling, optimize=args.optimize))
+        if not success:
+            raise ValueError(f"Failed to encode tile {file}")
+        data = data.reshape(-1)
+    return zoom, x, y, data
 pipe = pl.process.map(pipe, process, workers=args.workers)
 
-for data, offset in tqdm.tqdm(pipe, total=len(tiles), desc="Copying to binary..."):
-    images_bin[offset:offset + len(data)] = data
\ No newline at end of file
+# Tiles are appended in the order in which they are processed, every tile ends at the offset of the next tile
+written = []
+offset = 0
+with open(os.path.join(args.output, "images.dat"), "wb") as f:
+    for zoom, x, y, data in tqdm.tqdm(pipe, total=len(tiles), desc="Writing to binary..."):
+        f.write(data.tobytes())
+        written.append((zoom, x, y, offset))
+        offset += len(data)
+print(f"Wrote {offset / 1024 ** 3:.2f} GB")
+
+np.savez(
+    os.path.join(args.output, "images-meta.npz"),
+    zoom=np.asarray([tile[0] for tile in written]).astype("int64"),
+    x=np.asarray([tile[1] for tile in written]).astype("int64"),
+    y=np.asarray([tile[2] for tile in written]).astype("int64"),
+    offset=np.asarray([tile[3] for tile in written] + [offset]).astype("int64"),
+)
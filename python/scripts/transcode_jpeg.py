@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+
+import argparse, os, tqdm, shutil, subprocess, tempfile, sys
+import numpy as np
+import tinypl as pl
+
+parser = argparse.ArgumentParser(description="Losslessly transcodes the jpeg tiles of a folder of tiles or a bin file. "
+    "optimize recomputes the Huffman tables, progressive additionally converts the tiles to progressive jpegs (both via jpegtran), "
+    "and jxl recompresses the tiles into JPEG XL from which the original jpeg files can be reconstructed (via cjxl). "
+    "Every transcoded tile is verified to decode to exactly the same pixels, otherwise the original tile is kept. "
+    "Since the output of mode jxl may only contain JPEG XL tiles, it is aborted instead if a tile cannot be transcoded.")
+parser.add_argument("--input", type=str, required=True)
+parser.add_argument("--output", type=str, default=None, help="Defaults to transcoding the tiles in place, which is only supported for folders with modes optimize and progressive")
+parser.add_argument("--mode", type=str, default="optimize", choices=["optimize", "progressive", "jxl"])
+parser.add_argument("--workers", type=int, default=8)
+args = parser.parse_args()
+
+tools = ["cjxl", "djxl"] if args.mode == "jxl" else ["jpegtran"]
+for tool in tools:
+    if shutil.which(tool) is None:
+        print(f"{tool} not found, please install " + ("libjxl" if args.mode == "jxl" else "libjpeg-turbo"))
+        sys.exit(-1)
+
+is_bin = os.path.isfile(os.path.join(args.input, "images.dat"))
+if args.output is None and (is_bin or args.mode == "jxl"):
+    print("--output is required for bin files and mode jxl")
+    sys.exit(-1)
+output_extension = ".jxl" if args.mode == "jxl" else None
+
+def transcode(data):
+    # Returns the transcoded tile, or None if the tile could not be transcoded losslessly
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "src.jpg")
+        dest = os.path.join(tmp, "dest.jxl" if args.mode == "jxl" else "dest.jpg")
+        with open(src, "wb") as f:
+            f.write(data)
+        if args.mode == "jxl":
+            command = ["cjxl", src, dest, "--lossless_jpeg=1"]
+        else:
+            command = ["jpegtran", "-copy", "none", "-optimize"] + (["-progressive"] if args.mode == "progressive" else []) + ["-outfile", dest, src]
+        if subprocess.run(command, capture_output=True).returncode != 0:
+            return None
+        with open(dest, "rb") as f:
+            result = f.read()
+
+        import cv2
+        if args.mode == "jxl":
+            # The original jpeg file is reconstructed bit-exactly from the JPEG XL file
+            reconstructed = os.path.join(tmp, "reconstructed.jpg")
+            if subprocess.run(["djxl", dest, reconstructed], capture_output=True).returncode != 0:
+                return None
+            with open(reconstructed, "rb") as f:
+                if f.read() != data:
+                    return None
+        else:
+            image = cv2.imdecode(np.frombuffer(data, dtype="uint8"), cv2.IMREAD_UNCHANGED)
+            transcoded = cv2.imdecode(np.frombuffer(result, dtype="uint8"), cv2.IMREAD_UNCHANGED)
+            if image is None or transcoded is None or image.shape != transcoded.shape or not np.array_equal(image, transcoded):
+                return None
+    return result
+
+print("Finding tiles...")
+if is_bin:
+    meta = np.load(os.path.join(args.input, "images-meta.npz"))
+    images_bin = np.memmap(os.path.join(args.input, "images.dat"), dtype="uint8", mode="r")
+    tiles = [(int(zoom), int(x), int(y), (int(begin), int(end))) for zoom, x, y, begin, end in zip(meta["zoom"], meta["x"], meta["y"], meta["offset"][:-1], meta["offset"][1:])]
+else:
+    tiles = []
+    for zoom in os.listdir(args.input):
+        zoom_path = os.path.join(args.input, zoom)
+        if not os.path.isdir(zoom_path) or not zoom.isdigit():
+            continue
+        for x in os.listdir(zoom_path):
+            x_path = os.path.join(zoom_path, x)
+            if not os.path.isdir(x_path):
+                continue
+            for y in os.listdir(x_path):
+                file = os.path.join(x_path, y)
+                name, extension = os.path.splitext(y)
+                if os.path.isfile(file) and extension in [".jpg", ".jpeg"]:
+                    tiles.append((int(zoom), int(x), int(name), file))
+tiles = sorted(tiles)
+
+if args.output is not None:
+    os.makedirs(args.output, exist_ok=True)
+    with open(os.path.join(args.input, "layout.yaml"), "r") as f:
+        layout_yaml = f.read()
+    if output_extension is not None and not is_bin:
+        layout_yaml = layout_yaml.replace("{y}.jpg", "{y}" + output_extension).replace("{y}.jpeg", "{y}" + output_extension)
+    with open(os.path.join(args.output, "layout.yaml"), "w") as f:
+        f.write(layout_yaml)
+
+pipe = tiles
+pipe = pl.thread.mutex(pipe)
+
+@pl.unpack
+def process(zoom, x, y, source):
+    if is_bin:
+        data = bytes(images_bin[source[0]:source[1]])
+    else:
+        with open(source, "rb") as f:
+            data = f.read()
+    result = transcode(data)
+    failed = result is None
+    if failed and args.mode == "jxl":
+        # The jpeg bytes must not be written as a JPEG XL tile
+        return zoom, x, y, None, len(data), 0, failed
+    if failed or (output_extension is None and len(result) >= len(data)):
+        # Keep the original tile, which is also decoded correctly by tileloaders when stored with another extension
+        result = data
+
+    if not is_bin:
+        if args.output is None:
+            if result is not data:
+                temp_file = source + ".tmp"
+                with open(temp_file, "wb") as f:
+                    f.write(result)
+                os.replace(temp_file, source)
+        else:
+            path = os.path.join(args.output, str(zoom), str(x))
+            os.makedirs(path, exist_ok=True)
+            extension = output_extension if output_extension is not None else os.path.splitext(source)[1]
+            with open(os.path.join(path, f"{y}{extension}"), "wb") as f:
+                f.write(result)
+        return zoom, x, y, None, len(data), len(result), failed
+    else:
+        return zoom, x, y, np.frombuffer(result, dtype="uint8"), len(data), len(result), failed
+pipe = pl.process.map(pipe, process, workers=args.workers)
+
+bytes_in = 0
+bytes_out = 0
+failures = 0
+written = []
+images_out = open(os.path.join(args.output, "images.dat"), "wb") if is_bin else None
+for zoom, x, y, result, size_in, size_out, failed in tqdm.tqdm(pipe, total=len(tiles), desc="Transcoding tiles"):
+    if failed and args.mode == "jxl":
+        print(f"Tile {x} {y} at zoom {zoom} could not be transcoded losslessly into JPEG XL, aborting. The output at {args.output} is incomplete")
+        sys.exit(-1)
+    if images_out is not None:
+        written.append((zoom, x, y, bytes_out))
+        images_out.write(result.tobytes())
+    bytes_in += size_in
+    bytes_out += size_out
+    failures += failed
+if images_out is not None:
+    images_out.close()
+    np.savez(
+        os.path.join(args.output, "images-meta.npz"),
+        zoom=np.asarray([tile[0] for tile in written]).astype("int64"),
+        x=np.asarray([tile[1] for tile in written]).astype("int64"),
+        y=np.asarray([tile[2] for tile in written]).astype("int64"),
+        offset=np.asarray([tile[3] for tile in written] + [bytes_out]).astype("int64"),
+    )
+
+print(f"Transcoded {len(tiles)} tiles from {bytes_in / 1024 ** 3:.2f} GB to {bytes_out / 1024 ** 3:.2f} GB")
+if failures > 0:
+    print(f"{failures} tiles could not be transcoded losslessly and were kept as they are")
@@ -1,6 +1,7 @@
 import tiledwebmaps as twm
 import numpy as np
 import math
+import pytest
 
 def test_tile_loader():
     tile_loader = twm.Http("https://wms.openstreetmap.fr/tms/1.0.0/bayonne_2016/{zoom}/{tile_x}/{tile_y}", layout=twm.Layout.XYZ((256, 256)), wait_after_error=1.5, retries=1)
@@ -14,3 +15,75 @@ def test_tile_loader():
     tile_loader = twm.Http("https://imagery.tnris.org/server/rest/services/StratMap/StratMap21_NCCIR_CapArea_Brazos_Kerr/ImageServer/exportImage?f=image&bbox={crs_lower_x}%2C{crs_lower_y}%2C{crs_upper_x}%2C{crs_upper_y}&imageSR=102100&bboxSR=102100&size={tile_size_x}%2C{tile_size_y}", layout=twm.Layout.XYZ((256, 256)))
     tile = tile_loader.load((479274, 863078), 21)
     assert tile.shape[0] == 256 and tile.shape[1] == 256
+
+def test_load_out(tmp_path):
+    disk = twm.Disk(str(tmp_path / "{zoom}/{x}/{y}.png"), twm.Layout.XYZ(), 0, 20)
+    image = np.random.randint(0, 256, (256, 256, 3), dtype=np.uint8)
+    disk.save(image, (1, 2), 3)
+
+    tile = disk.load((1, 2), 3)
+    assert tile.dtype == np.uint8 and np.array_equal(tile, image)
+
+    batch = np.zeros((2, 256, 256, 3), dtype=np.uint8)
+    result = disk.load((1, 2), 3, out=batch[1])
+    assert np.shares_memory(result, batch)
+    assert np.array_equal(batch[1], image) and np.all(batch[0] == 0)
+
+    with pytest.raises(ValueError):
+        disk.load((1, 2), 3, out=np.zeros((128, 128, 3), dtype=np.uint8))
+
+def test_deprecated_arguments(tmp_path):
+    with pytest.warns(DeprecationWarning):
+        disk = twm.Disk(str(tmp_path / "{zoom}/{x}/{y}.png"), twm.Layout.XYZ(), 0, 20, 1.0)
+    with pytest.raises(TypeError):
+        twm.Disk(str(tmp_path / "{zoom}/{x}/{y}.png"), twm.Layout.XYZ(), 0, 20, 1.0, True)
+
+    with pytest.warns(DeprecationWarning):
+        cached = twm.DiskCached(disk, str(tmp_path / "cache/{zoom}/{x}/{y}.png"), 1.0)
+    assert cached.negative_cache is None
+
+def test_tile_format(tmp_path):
+    masks = twm.Disk(str(tmp_path / "masks/{zoom}/{x}/{y}.png"), twm.Layout.XYZ(), 0, 20)
+    masks.tile_format = "unchanged"
+    mask = np.random.randint(0, 65536, (256, 256), dtype=np.uint16)
+    masks.save(mask, (1, 2), 3)
+    tile = masks.load((1, 2), 3)
+    assert tile.dtype == np.uint16 and np.array_equal(tile[:, :, 0], mask)
+
+    dem = twm.Disk(str(tmp_path / "dem/{zoom}/{x}/{y}.png"), twm.Layout.XYZ(), 0, 20)
+    dem.tile_format = "terrarium"
+    elevation = (np.round(np.random.uniform(-100.0, 4000.0, (256, 256)) * 256) / 256).astype(np.float32)
+    dem.save(elevation, (1, 2), 3)
+    tile = dem.load((1, 2), 3)
+    assert tile.dtype == np.float32 and np.array_equal(tile[:, :, 0], elevation)
+
+    cached = twm.DiskCached(dem, str(tmp_path / "dem_cache/{zoom}/{x}/{y}.png"))
+    for _ in range(2):
+        tile = cached.load((1, 2), 3)
+        assert tile.dtype == np.float32 and np.array_equal(tile[:, :, 0], elevation)
+    assert cached.cache.tile_format == "terrarium"
+
+    out = np.zeros((64, 64, 1), dtype=np.float32)
+    dem = twm.WithDefault(dem, color=[0.0], dtype="float32")
+    image = dem.load(latlon=(48.0, 11.0), bearing=0.0, meters_per_pixel=1.0, shape=(64, 64), zoom=15, out=out)
+    assert np.shares_memory(image, out)
+    with pytest.raises(ValueError):
+        dem.load(latlon=(48.0, 11.0), bearing=0.0, meters_per_pixel=1.0, shape=(64, 64), zoom=15, out=np.zeros((64, 64, 3), dtype=np.uint8))
+
+def test_multi_layer(tmp_path):
+    imagery = twm.WithDefault(twm.Disk(str(tmp_path / "nonexistent"), twm.Layout.XYZ(), 0, 20), color=[1, 2, 3])
+    dem = twm.WithDefault(twm.Disk(str(tmp_path / "nonexistent"), twm.Layout.XYZ(), 0, 12), color=[500.0], dtype="float32")
+    multi_layer = twm.MultiLayer([(imagery, "linear"), (dem, "nearest")])
+
+    images = multi_layer.load(latlon=(48.0, 11.0), bearing=30.0, meters_per_pixel=1.0, shape=(64, 64), zoom=15)
+    assert len(images) == 2
+    assert np.array_equal(images[0], imagery.load(latlon=(48.0, 11.0), bearing=30.0, meters_per_pixel=1.0, shape=(64, 64), zoom=15))
+    assert images[1].dtype == np.float32 and images[1][32, 32, 0] == 500.0
+
+    out = [np.zeros((64, 64, 3), dtype=np.uint8), np.zeros((64, 64, 1), dtype=np.float32)]
+    result = multi_layer.load(latlon=(48.0, 11.0), bearing=30.0, meters_per_pixel=1.0, shape=(64, 64), out=out)
+    assert all(np.shares_memory(a, b) for a, b in zip(result, out))
+    with pytest.raises(ValueError):
+        multi_layer.load(latlon=(48.0, 11.0), bearing=30.0, meters_per_pixel=1.0, shape=(64, 64), out=out[:1])
+    with pytest.raises(ValueError):
+        twm.MultiLayer([(imagery, "cubic")])
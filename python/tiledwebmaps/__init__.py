@@ -5,7 +5,8 @@ if "PROJ_DATA" in os.environ:
 os.environ["PROJ_DATA"] = new_proj_data
 
 import yaml
-from .backend import Layout, TileLoader, Http, Disk, DiskCached, LRU, LRUCached, WithDefault, Bin, proj
+from .backend import LoadTileException, TileNotFoundException, LoadFileException, FileNotFoundException, WriteFileException
+from .backend import Layout, TileLoader, Cache, Http, Disk, DiskCached, BoundedDisk, Pack, MBTiles, COG, LRU, LRUCached, WithDefault, Bin, NegativeCache, CachedTileLoader, TieredCache, SharedMemoryCache, MultiLayer, Retiler, DownloadPipeline, Metrics, Instrumented, can_encode, encode_params, proj
 from . import geo
 from . import presets
 from .presets import *
@@ -46,7 +47,7 @@ def layout_from_yaml(path_or_dict):
     return _layout_from_yaml(cfg)
 setattr(Layout, "from_yaml", layout_from_yaml)
 
-def from_yaml(path, wait_after_last_modified=1.0):
+def from_yaml(path):
     if not path.endswith(".yaml"):
         path = os.path.join(path, "layout.yaml")
     with open(path, "r") as f:
@@ -68,8 +69,8 @@ def from_yaml(path, wait_after_last_modified=1.0):
 
         if "url" in cfg:
             tileloader = Http(cfg["url"], layout=layout, min_zoom=min_zoom, max_zoom=max_zoom)
-            tileloader = DiskCached(tileloader, path, wait_after_last_modified=wait_after_last_modified)
+            tileloader = DiskCached(tileloader, path)
         else:
-            tileloader = Disk(path=path, layout=layout, min_zoom=min_zoom, max_zoom=max_zoom, wait_after_last_modified=wait_after_last_modified)
+            tileloader = Disk(path=path, layout=layout, min_zoom=min_zoom, max_zoom=max_zoom)
 
         return tileloader
\ No newline at end of file
@@ -108,7 +108,7 @@ class Ratelimit:
     def __exit__(self, exc_type, exc_val, exc_tb):
         pass
 
-def add_zooms(path, min_zoom=None, workers=16, min_tiles=8):
+def add_zooms(path, min_zoom=None, workers=16, min_tiles=8, quality=None, optimize=False):
     print(f"Adding zoom levels to tiles at {path}")
     import cv2
     import tinypl as pl
@@ -201,7 +201,7 @@ def add_zooms(path, min_zoom=None, workers=16, min_tiles=8):
                             if not os.path.exists(output_path):
                                 os.makedirs(output_path)
 
-                    cv2.imwrite(os.path.join(output_path, str(tile_out_y) + "." + filetype), image)
+                    cv2.imwrite(os.path.join(output_path, str(tile_out_y) + "." + filetype), image, twm.encode_params("." + filetype, quality=quality, optimize=optimize))
                     return found
                 else:
                     return None
@@ -1,5 +1,29 @@
 #include <tiledwebmaps/http.h>
+#include <tiledwebmaps/affine.h>
+#include <tiledwebmaps/lru.h>
+#include <tiledwebmaps/disk.h>
+#include <tiledwebmaps/encoding.h>
+#include <tiledwebmaps/bounded_disk.h>
+#include <tiledwebmaps/pack.h>
+#include <tiledwebmaps/mbtiles.h>
+#include <tiledwebmaps/cog.h>
+#include <tiledwebmaps/retiler.h>
+#include <tiledwebmaps/pipeline.h>
+#include <tiledwebmaps/metrics.h>
+#include <tiledwebmaps/tiered.h>
+#include <tiledwebmaps/shared_memory.h>
+#include <tiledwebmaps/multi_layer.h>
+#include "../benchmark/tileserver.h"
 #include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iterator>
+#include <thread>
+#include <fstream>
+#include <iomanip>
+#include <sys/wait.h>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xview.hpp>
 
@@ -37,4 +61,884 @@ TEST_CASE("tiledwebmaps::Layout")
 
   REQUIRE(xt::abs(xt::mean(tile_coord - layout.pixel_to_tile(layout.tile_to_pixel(tile_coord, zoom), zoom)))() < 1e-6);
   REQUIRE(xt::abs(xt::mean(tile_coord - layout.crs_to_tile(layout.tile_to_crs(tile_coord, zoom), zoom)))() < 1e-6);
+
+  xti::vec2d latlon({43.49111200344394, -1.4730902418166352});
+  REQUIRE(xt::amax(xt::abs(layout.epsg4326_to_pixel(latlon, zoom) - layout.tile_to_pixel(layout.epsg4326_to_tile(latlon, zoom), zoom)))() < 1e-6);
+  REQUIRE(xt::amax(xt::abs(layout.epsg4326_to_pixel(latlon, zoom) - layout.epsg4326_to_pixel(latlon, std::pow(2.0, zoom) / layout.get_tile_shape_crs()(0))))() < 1e-6);
+  REQUIRE(xt::amax(xt::abs(latlon - layout.pixel_to_epsg4326(layout.epsg4326_to_pixel(latlon, zoom), zoom)))() < 1e-6);
+}
+
+TEST_CASE("tiledwebmaps::Affine2")
+{
+  tiledwebmaps::ScaledRigid<double, 2> scaled_rigid(0.3, xti::vec2d({1.0, -2.0}), 2.5);
+  tiledwebmaps::Affine2<double> affine(scaled_rigid);
+
+  xti::vec2d point({4.0, 7.0});
+  xti::vec2d expected = scaled_rigid.transform(point);
+  tiledwebmaps::Point2<double> got = affine.transform(tiledwebmaps::Point2<double>(point));
+  REQUIRE(std::abs(got(0) - expected(0)) < 1e-9);
+  REQUIRE(std::abs(got(1) - expected(1)) < 1e-9);
+
+  tiledwebmaps::Point2<double> back = (affine * affine.inverse()).transform(tiledwebmaps::Point2<double>(point));
+  REQUIRE(std::abs(back(0) - point(0)) < 1e-9);
+  REQUIRE(std::abs(back(1) - point(1)) < 1e-9);
+}
+
+TEST_CASE("tiledwebmaps::Metrics")
+{
+  tiledwebmaps::LRU lru(1);
+  cv::Mat image(4, 4, CV_8UC3, cv::Scalar(0, 0, 0));
+  lru.save(image, xti::vec2i({1, 2}), 3);
+  lru.save(image, xti::vec2i({2, 2}), 3);
+  lru.load(xti::vec2i({2, 2}), 3);
+  REQUIRE_THROWS_AS(lru.load(xti::vec2i({1, 2}), 3), tiledwebmaps::CacheFailure);
+
+  tiledwebmaps::Metrics::Snapshot snapshot = lru.get_metrics()->snapshot();
+  REQUIRE(snapshot.counters["saves"] == 2);
+  REQUIRE(snapshot.counters["evictions"] == 1);
+  REQUIRE(snapshot.counters["hits"] == 1);
+  REQUIRE(snapshot.counters["misses"] == 1);
+
+  tiledwebmaps::Metrics metrics("test");
+  metrics.set_tracing(true);
+  metrics.record("decode", 0.002);
+  {
+    auto timer = metrics.time("fetch");
+  }
+  REQUIRE(metrics.snapshot().histograms["decode"].count == 1);
+  REQUIRE(metrics.snapshot().histograms["decode"].quantile(0.5) >= 0.002);
+  REQUIRE(metrics.get_trace_events().size() == 1);
+  REQUIRE(metrics.to_prometheus().find("tiledwebmaps_decode_seconds_count{component=\"test\"} 1") != std::string::npos);
+
+  // Names are escaped in the trace
+  metrics.record("say \"hi\"\\", tiledwebmaps::Metrics::Clock::now(), tiledwebmaps::Metrics::Clock::now());
+  REQUIRE(metrics.to_chrome_trace().find("\"name\":\"say \\\"hi\\\"\\\\\"") != std::string::npos);
+
+  // Disabled metrics are not recorded, handles stay valid
+  std::atomic<uint64_t>& saves = metrics.get_counter("saves");
+  metrics.set_enabled(false);
+  metrics.increment("saves");
+  {
+    auto timer = metrics.time("decode");
+  }
+  REQUIRE(saves == 0);
+  REQUIRE(metrics.snapshot().histograms["decode"].count == 1);
+  metrics.set_enabled(true);
+  metrics.increment("saves");
+  REQUIRE(saves == 1);
+}
+
+TEST_CASE("tiledwebmaps::NegativeCache")
+{
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-negative-cache" / "missing.txt";
+  std::filesystem::remove_all(path.parent_path());
+  auto count_lines = [&](){
+    std::ifstream file(path.string());
+    return std::count(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), '\n');
+  };
+
+  {
+    tiledwebmaps::NegativeCache negative_cache(3600.0, path);
+    for (int i = 0; i < 10; i++)
+    {
+      negative_cache.insert(xti::vec2i({1, 2}), 3);
+    }
+    negative_cache.insert(xti::vec2i({2, 2}), 3);
+  }
+  REQUIRE(count_lines() == 11);
+
+  // Overwritten entries are dropped when the file is opened
+  {
+    tiledwebmaps::NegativeCache negative_cache(3600.0, path);
+    REQUIRE(count_lines() == 2);
+    REQUIRE(negative_cache.contains(xti::vec2i({1, 2}), 3));
+    REQUIRE(negative_cache.contains(xti::vec2i({2, 2}), 3));
+  }
+
+  // Expired entries are dropped while inserting
+  {
+    tiledwebmaps::NegativeCache negative_cache(0.0, path);
+    for (int i = 0; i < 3000; i++)
+    {
+      negative_cache.insert(xti::vec2i({i, 0}), 12);
+    }
+    REQUIRE(negative_cache.size() < 2048);
+    REQUIRE(count_lines() < 2048);
+  }
+  std::filesystem::remove_all(path.parent_path());
+}
+
+TEST_CASE("tiledwebmaps::load_async")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-load-async-nonexistent";
+  auto disk = std::make_shared<tiledwebmaps::Disk>(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  REQUIRE_THROWS_AS(disk->load_async(xti::vec2i({1, 2}), 3).get(), tiledwebmaps::FileNotFoundException);
+
+  tiledwebmaps::WithDefault with_default(disk, xti::vec3i({1, 2, 3}));
+  cv::Mat image = with_default.load_async(xti::vec2i({1, 2}), 3).get();
+  REQUIRE(image.at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+}
+
+TEST_CASE("tiledwebmaps::Http in forked child")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-http-fork-nonexistent";
+  auto disk = std::make_shared<tiledwebmaps::Disk>(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  auto source = std::make_shared<tiledwebmaps::WithDefault>(disk, xti::vec3i({1, 2, 3}));
+  tiledwebmaps::benchmark::TileServer server(source, tiledwebmaps::benchmark::TileServer::Options());
+  tiledwebmaps::Http http(server.get_url("png"), tiledwebmaps::Layout::XYZ(proj_context), 0, 20, 10, 0.01, true, {}, {}, {}, true);
+
+  // Starts the event loop and the default thread pool in the parent
+  REQUIRE(http.load_async(xti::vec2i({1, 2}), 3).get().at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+
+  pid_t pid = ::fork();
+  if (pid == 0)
+  {
+    bool ok = false;
+    try
+    {
+      http.make_forksafe();
+      std::future<cv::Mat> future = http.load_async(xti::vec2i({2, 2}), 3);
+      ok = future.wait_for(std::chrono::seconds(10)) == std::future_status::ready && future.get().at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3);
+    }
+    catch (...)
+    {
+    }
+    ::_exit(ok ? 0 : 1);
+  }
+  REQUIRE(pid > 0);
+  int status;
+  ::waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+}
+
+TEST_CASE("tiledwebmaps::load_metric into destination")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-load-metric-nonexistent";
+  auto disk = std::make_shared<tiledwebmaps::Disk>(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  tiledwebmaps::WithDefault with_default(disk, xti::vec3i({1, 2, 3}));
+
+  // Images are sampled into a slot of a batch without reallocating it
+  cv::Mat batch(2 * 64, 64, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::Mat slot = batch.rowRange(64, 128);
+  uint8_t* data = slot.data;
+  for (int i = 0; i < 2; i++)
+  {
+    tiledwebmaps::load_metric(with_default, xti::vec2d({48.0, 11.0}), 30.0 * i, 1.0, xti::vec2i({64, 64}), 15, slot);
+  }
+  REQUIRE(slot.data == data);
+  REQUIRE(batch.at<cv::Vec3b>(96, 32) == cv::Vec3b(1, 2, 3));
+  REQUIRE(batch.at<cv::Vec3b>(32, 32) == cv::Vec3b(0, 0, 0));
+  REQUIRE(cv::norm(slot, tiledwebmaps::load_metric(with_default, xti::vec2d({48.0, 11.0}), 30.0, 1.0, xti::vec2i({64, 64}), 15), cv::NORM_INF) == 0);
+}
+
+TEST_CASE("tiledwebmaps::ChannelOrder")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-channel-order";
+  std::filesystem::remove_all(path);
+  tiledwebmaps::Disk disk(path / "{zoom}/{x}/{y}.png", tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  REQUIRE(disk.get_native_channel_order() == tiledwebmaps::ChannelOrder::BGR);
+
+  cv::Mat image(256, 256, CV_8UC3, cv::Scalar(1, 2, 3));
+  disk.save(image, xti::vec2i({1, 2}), 3);
+  disk.save_ordered(image, xti::vec2i({2, 2}), 3, tiledwebmaps::ChannelOrder::BGR);
+  REQUIRE(disk.load(xti::vec2i({1, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE(disk.load_ordered(xti::vec2i({1, 2}), 3, tiledwebmaps::ChannelOrder::BGR).at<cv::Vec3b>(0, 0) == cv::Vec3b(3, 2, 1));
+  REQUIRE(disk.load(xti::vec2i({2, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(3, 2, 1));
+
+  // The mosaic is composed in BGR and swizzled once
+  cv::Mat mosaic = tiledwebmaps::load(disk, xti::vec2i({1, 2}), xti::vec2i({3, 3}), 3);
+  REQUIRE(mosaic.at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE(mosaic.at<cv::Vec3b>(mosaic.rows - 1, mosaic.cols - 1) == cv::Vec3b(3, 2, 1));
+  mosaic = tiledwebmaps::load(disk, xti::vec2i({1, 2}), xti::vec2i({3, 3}), 3, tiledwebmaps::ChannelOrder::BGR);
+  REQUIRE(mosaic.at<cv::Vec3b>(0, 0) == cv::Vec3b(3, 2, 1));
+
+  // Tileloaders that do not decode tiles are swizzled by default
+  tiledwebmaps::WithDefault with_default(std::make_shared<tiledwebmaps::Disk>(path / "nonexistent", tiledwebmaps::Layout::XYZ(proj_context), 0, 20), xti::vec3i({1, 2, 3}));
+  REQUIRE(with_default.load_ordered(xti::vec2i({1, 2}), 3, tiledwebmaps::ChannelOrder::BGR).at<cv::Vec3b>(0, 0) == cv::Vec3b(3, 2, 1));
+  cv::Mat rgb = tiledwebmaps::load_metric(with_default, xti::vec2d({48.0, 11.0}), 30.0, 1.0, xti::vec2i({64, 64}), 15);
+  cv::Mat bgr = tiledwebmaps::load_metric(with_default, xti::vec2d({48.0, 11.0}), 30.0, 1.0, xti::vec2i({64, 64}), 15, tiledwebmaps::ChannelOrder::BGR);
+  cv::cvtColor(bgr, bgr, cv::COLOR_BGR2RGB);
+  REQUIRE(cv::norm(rgb, bgr, cv::NORM_INF) == 0);
+
+  // Cached tileloaders load hits in the native order of the cache
+  auto cache = std::make_shared<tiledwebmaps::Disk>(path / "cache" / "{zoom}/{x}/{y}.png", tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  tiledwebmaps::CachedTileLoader cached(std::make_shared<tiledwebmaps::WithDefault>(std::make_shared<tiledwebmaps::Disk>(path / "nonexistent", tiledwebmaps::Layout::XYZ(proj_context), 0, 20), xti::vec3i({1, 2, 3})), cache);
+  REQUIRE(cached.get_native_channel_order() == tiledwebmaps::ChannelOrder::BGR);
+  REQUIRE(cached.load_ordered(xti::vec2i({1, 2}), 3, tiledwebmaps::ChannelOrder::BGR).at<cv::Vec3b>(0, 0) == cv::Vec3b(3, 2, 1));
+  REQUIRE(cached.load_ordered(xti::vec2i({1, 2}), 3, tiledwebmaps::ChannelOrder::BGR).at<cv::Vec3b>(0, 0) == cv::Vec3b(3, 2, 1));
+  REQUIRE(cached.load_async(xti::vec2i({2, 2}), 3).get().at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE(cache->load(xti::vec2i({2, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE(cached.get_metrics()->get_counter("hits") == 1);
+  std::filesystem::remove_all(path);
+}
+
+TEST_CASE("tiledwebmaps::TileFormat")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-tile-format";
+  std::filesystem::remove_all(path);
+
+  // RGBA tiles keep their alpha channel
+  auto rgba = std::make_shared<tiledwebmaps::Disk>(path / "rgba" / "{zoom}/{x}/{y}.png", tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  rgba->set_tile_format(tiledwebmaps::TileFormat::UNCHANGED);
+  rgba->save(cv::Mat(256, 256, CV_8UC4, cv::Scalar(1, 2, 3, 4)), xti::vec2i({1, 2}), 3);
+  REQUIRE(rgba->load(xti::vec2i({1, 2}), 3).at<cv::Vec4b>(0, 0) == cv::Vec4b(1, 2, 3, 4));
+  REQUIRE(rgba->load_ordered(xti::vec2i({1, 2}), 3, tiledwebmaps::ChannelOrder::BGR).at<cv::Vec4b>(0, 0) == cv::Vec4b(3, 2, 1, 4));
+
+  // Terrarium tiles are decoded into float elevation without loss
+  auto dem = std::make_shared<tiledwebmaps::Disk>(path / "dem" / "{zoom}/{x}/{y}.png", tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  dem->set_tile_format(tiledwebmaps::TileFormat::TERRARIUM);
+  cv::Mat elevation(256, 256, CV_32FC1);
+  for (int r = 0; r < 256; r++)
+  {
+    for (int c = 0; c < 256; c++)
+    {
+      elevation.at<float>(r, c) = -100.0f + r * 10.0f + c / 256.0f;
+    }
+  }
+  dem->save(elevation, xti::vec2i({1, 2}), 3);
+  dem->save(elevation, xti::vec2i({2, 2}), 3);
+  REQUIRE(cv::norm(dem->load(xti::vec2i({1, 2}), 3), elevation, cv::NORM_INF) == 0);
+  std::vector<uint8_t> data = dem->load_encoded(xti::vec2i({1, 2}), 3);
+  REQUIRE(cv::imdecode(data, cv::IMREAD_UNCHANGED).type() == CV_8UC3);
+
+  cv::Mat mosaic = tiledwebmaps::load(*dem, xti::vec2i({1, 2}), xti::vec2i({3, 3}), 3);
+  REQUIRE(mosaic.type() == CV_32FC1);
+  REQUIRE(mosaic.at<float>(255, 0) == elevation.at<float>(255, 0));
+
+  // The tile format is passed through cached tileloaders to the loader and the cache
+  auto dem_cache = std::make_shared<tiledwebmaps::Disk>(path / "dem_cache" / "{zoom}/{x}/{y}.png", tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  auto nonexistent = std::make_shared<tiledwebmaps::Disk>(path / "nonexistent", tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  tiledwebmaps::CachedTileLoader cached(std::make_shared<tiledwebmaps::WithDefault>(nonexistent, xti::vec3i({-100, 0, 0})), dem_cache);
+  cached.set_tile_format(tiledwebmaps::TileFormat::TERRARIUM);
+  REQUIRE(nonexistent->get_tile_format() == tiledwebmaps::TileFormat::TERRARIUM);
+  REQUIRE(dem_cache->get_tile_format() == tiledwebmaps::TileFormat::TERRARIUM);
+  for (int i = 0; i < 2; i++)
+  {
+    cv::Mat tile = cached.load(xti::vec2i({1, 2}), 3);
+    REQUIRE(tile.type() == CV_32FC1);
+    REQUIRE(tile.at<float>(0, 0) == -100.0f);
+  }
+  REQUIRE(cached.get_metrics()->get_counter("hits") == 1);
+
+  tiledwebmaps::WithDefault with_default(dem, cv::Scalar(0), CV_32FC1);
+  cv::Mat dest(64, 64, CV_32FC1);
+  uint8_t* dest_data = dest.data;
+  tiledwebmaps::load_metric(with_default, xti::vec2d({48.0, 11.0}), 0.0, 1.0, xti::vec2i({64, 64}), 15, dest);
+  REQUIRE(dest.data == dest_data);
+  REQUIRE(dest.at<float>(32, 32) == 0.0f);
+  std::filesystem::remove_all(path);
+}
+
+TEST_CASE("tiledwebmaps::MultiLayer")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-multi-layer";
+  std::filesystem::remove_all(path);
+  tiledwebmaps::Layout layout = tiledwebmaps::Layout::XYZ(proj_context);
+  xti::vec2d latlon({48.0, 11.0});
+
+  // Checkerboard of classes 0 and 10 that is coarser than the sampled images
+  auto labels = std::make_shared<tiledwebmaps::Disk>(path / "{zoom}/{x}/{y}.png", layout, 0, 12);
+  labels->set_tile_format(tiledwebmaps::TileFormat::UNCHANGED);
+  cv::Mat label_tile(256, 256, CV_8UC1);
+  for (int r = 0; r < 256; r++)
+  {
+    for (int c = 0; c < 256; c++)
+    {
+      label_tile.at<uint8_t>(r, c) = ((r + c) % 2) * 10;
+    }
+  }
+  tiledwebmaps::MetricGeometry geometry;
+  tiledwebmaps::get_metric_geometry(layout, latlon, 30.0, 1.0, xti::vec2i({64, 64}), 12, geometry);
+  for (int t0 = geometry.min_tile(0); t0 < geometry.max_tile(0); t0++)
+  {
+    for (int t1 = geometry.min_tile(1); t1 < geometry.max_tile(1); t1++)
+    {
+      labels->save(label_tile, xti::vec2i({t0, t1}), 12);
+    }
+  }
+  auto imagery = std::make_shared<tiledwebmaps::WithDefault>(std::make_shared<tiledwebmaps::Disk>(path / "nonexistent", layout, 0, 20), xti::vec3i({1, 2, 3}));
+
+  // Layers with the same layout and zoom level share the geometry, labels keep their classes
+  tiledwebmaps::MultiLayer multi_layer({{imagery, tiledwebmaps::Interpolation::LINEAR}, {labels, tiledwebmaps::Interpolation::NEAREST}});
+  std::vector<cv::Mat> images = multi_layer.load(latlon, 30.0, 1.0, xti::vec2i({64, 64}), 12);
+  REQUIRE(images.size() == 2);
+  REQUIRE(multi_layer.get_metrics()->snapshot().counters["geometries"] == 1);
+  REQUIRE(cv::norm(images[0], tiledwebmaps::load_metric(*imagery, latlon, 30.0, 1.0, xti::vec2i({64, 64}), 12), cv::NORM_INF) == 0);
+  REQUIRE(images[1].type() == CV_8UC1);
+  REQUIRE(cv::countNonZero(images[1] == 0) + cv::countNonZero(images[1] == 10) == 64 * 64);
+  REQUIRE(cv::countNonZero(images[1] == 10) > 0);
+  REQUIRE(cv::countNonZero(images[1] == 0) > 0);
+
+  tiledwebmaps::MultiLayer linear({{labels, tiledwebmaps::Interpolation::LINEAR}});
+  cv::Mat interpolated = linear.load(latlon, 30.0, 1.0, xti::vec2i({64, 64}), 12)[0];
+  REQUIRE(cv::countNonZero(interpolated == 0) + cv::countNonZero(interpolated == 10) < 64 * 64);
+
+  // Layers are loaded at the zoom level of the first layer clamped to their zoom range, images are sampled into dests
+  std::vector<cv::Mat> dests = {cv::Mat(64, 64, CV_8UC3), cv::Mat(64, 64, CV_8UC1)};
+  uint8_t* data = dests[1].data;
+  multi_layer.load(latlon, 30.0, 1.0, xti::vec2i({64, 64}), 15, dests);
+  REQUIRE(multi_layer.get_metrics()->snapshot().counters["geometries"] == 3);
+  REQUIRE(dests[1].data == data);
+  REQUIRE(cv::norm(dests[1], images[1], cv::NORM_INF) == 0);
+  std::filesystem::remove_all(path);
+}
+
+class SlowTileLoader : public tiledwebmaps::TileLoader
+{
+public:
+  SlowTileLoader(tiledwebmaps::Layout layout)
+    : tiledwebmaps::TileLoader(layout)
+    , loads(0)
+  {
+  }
+
+  cv::Mat load(xti::vec2i tile, int zoom)
+  {
+    loads++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return cv::Mat(4, 4, CV_8UC3, cv::Scalar(1, 2, 3));
+  }
+
+  int get_min_zoom() const
+  {
+    return 0;
+  }
+
+  int get_max_zoom() const
+  {
+    return 20;
+  }
+
+  std::atomic<int> loads;
+};
+
+TEST_CASE("tiledwebmaps::CachedTileLoader coalesces concurrent loads")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  auto loader = std::make_shared<SlowTileLoader>(tiledwebmaps::Layout::XYZ(proj_context));
+  tiledwebmaps::CachedTileLoader cached(loader, std::make_shared<tiledwebmaps::LRU>(10));
+
+  std::vector<std::thread> threads;
+  std::atomic<int> correct(0);
+  for (int i = 0; i < 8; i++)
+  {
+    threads.emplace_back([&](){
+      cv::Mat image = cached.load(xti::vec2i({1, 2}), 3);
+      if (image.at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3))
+      {
+        correct++;
+      }
+    });
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+  REQUIRE(correct == 8);
+  REQUIRE(loader->loads == 1);
+
+  // Workers of a thread pool do not wait for other threads loading the same tile
+  tiledwebmaps::CachedTileLoader cached2(loader, std::make_shared<tiledwebmaps::LRU>(10));
+  std::thread leader([&](){cached2.load(xti::vec2i({1, 2}), 3);});
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  tiledwebmaps::ThreadPool pool(1);
+  std::promise<cv::Mat> follower;
+  pool.post([&](){follower.set_value(cached2.load(xti::vec2i({1, 2}), 3));});
+  REQUIRE(follower.get_future().get().at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  leader.join();
+  REQUIRE(loader->loads == 3);
+  REQUIRE(cached2.get_metrics()->get_counter("uncoalesced") == 1);
+}
+
+class FailingCache : public tiledwebmaps::LRU
+{
+public:
+  FailingCache()
+    : tiledwebmaps::LRU(10)
+  {
+  }
+
+  bool contains(xti::vec2i tile, int zoom) const
+  {
+    throw tiledwebmaps::LoadFileException("failing-cache", "Lookup failed");
+  }
+};
+
+TEST_CASE("tiledwebmaps::CachedTileLoader treats cache failures as misses")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  auto loader = std::make_shared<SlowTileLoader>(tiledwebmaps::Layout::XYZ(proj_context));
+  tiledwebmaps::CachedTileLoader cached(loader, std::make_shared<FailingCache>());
+  REQUIRE(cached.load(xti::vec2i({1, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  std::future<cv::Mat> future = cached.load_async(xti::vec2i({1, 2}), 3);
+  REQUIRE(future.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  REQUIRE(future.get().at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE(loader->loads == 2);
+  REQUIRE(cached.get_metrics()->get_counter("errors.cache") == 4);
+
+  // Exceptions that escape tasks do not terminate the workers of a thread pool
+  tiledwebmaps::ThreadPool pool(1);
+  std::promise<int> promise;
+  pool.post([](){throw std::runtime_error("Task failed");});
+  pool.post([&](){promise.set_value(1);});
+  REQUIRE(promise.get_future().get() == 1);
+}
+
+TEST_CASE("tiledwebmaps::TieredCache")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-tiered-cache";
+  std::filesystem::remove_all(path);
+  auto lru = std::make_shared<tiledwebmaps::LRU>(1);
+  auto disk = std::make_shared<tiledwebmaps::Disk>(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20);
+  tiledwebmaps::TieredCache tiered({
+    {lru, tiledwebmaps::TieredCache::Policy::WRITE_THROUGH, ""},
+    {disk, tiledwebmaps::TieredCache::Policy::WRITE_BACK, ""},
+  });
+
+  cv::Mat image(256, 256, CV_8UC3, cv::Scalar(0, 0, 0));
+  tiered.save(image, xti::vec2i({1, 2}), 3);
+  REQUIRE(!disk->contains(xti::vec2i({1, 2}), 3));
+  tiered.save(image, xti::vec2i({2, 2}), 3);
+  REQUIRE(disk->contains(xti::vec2i({1, 2}), 3));
+
+  tiered.load(xti::vec2i({1, 2}), 3);
+  REQUIRE(lru->contains(xti::vec2i({1, 2}), 3));
+  REQUIRE(disk->contains(xti::vec2i({2, 2}), 3));
+
+  tiledwebmaps::Metrics::Snapshot snapshot = tiered.get_metrics()->snapshot();
+  REQUIRE(snapshot.counters["hits.1_disk"] == 1);
+  REQUIRE(snapshot.counters["promotions.0_lru"] == 1);
+  REQUIRE(snapshot.counters["write_backs.1_disk"] == 2);
+  std::filesystem::remove_all(path);
+}
+
+TEST_CASE("tiledwebmaps::SharedMemoryCache")
+{
+  tiledwebmaps::SharedMemoryCache cache(16, 4 * 4 * 3);
+  pid_t pid = ::fork();
+  if (pid == 0)
+  {
+    cache.save(cv::Mat(4, 4, CV_8UC3, cv::Scalar(1, 2, 3)), xti::vec2i({1, 2}), 3);
+    ::_exit(0);
+  }
+  REQUIRE(pid > 0);
+  ::waitpid(pid, NULL, 0);
+
+  REQUIRE(cache.contains(xti::vec2i({1, 2}), 3));
+  REQUIRE(cache.load(xti::vec2i({1, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE_THROWS_AS(cache.load(xti::vec2i({2, 2}), 3), tiledwebmaps::CacheFailure);
+
+  // Layers share the memory but not the tiles
+  std::shared_ptr<tiledwebmaps::SharedMemoryCache> layer = cache.with_layer(1);
+  REQUIRE(!layer->contains(xti::vec2i({1, 2}), 3));
+  layer->save(cv::Mat(4, 4, CV_8UC3, cv::Scalar(4, 5, 6)), xti::vec2i({1, 2}), 3);
+  REQUIRE(layer->load(xti::vec2i({1, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(4, 5, 6));
+  REQUIRE(cache.load(xti::vec2i({1, 2}), 3).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+
+  // Existing named memory is not replaced
+  std::string name = "tiledwebmaps-test-" + std::to_string(::getpid());
+  tiledwebmaps::SharedMemoryCache named(16, 4 * 4 * 3, name);
+  REQUIRE_THROWS_AS(tiledwebmaps::SharedMemoryCache(16, 4 * 4 * 3, name), std::runtime_error);
+  tiledwebmaps::SharedMemoryCache opened(0, 0, name, false);
+  named.save(cv::Mat(4, 4, CV_8UC3, cv::Scalar(1, 2, 3)), xti::vec2i({1, 2}), 3);
+  REQUIRE(opened.contains(xti::vec2i({1, 2}), 3));
+}
+
+TEST_CASE("tiledwebmaps::BoundedDisk")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-bounded-disk";
+  std::filesystem::remove_all(path);
+  cv::Mat image(256, 256, CV_8UC3, cv::Scalar(0, 0, 0));
+  std::vector<uint8_t> data;
+  cv::imencode(".jpg", image, data);
+
+  {
+    tiledwebmaps::BoundedDisk disk(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, 3 * data.size(), tiledwebmaps::BoundedDisk::EvictionPolicy::LRU, tiledwebmaps::Disk::Sync::NONE, 10.0, 0.5);
+    for (int x = 0; x < 3; x++)
+    {
+      disk.save_encoded(data, xti::vec2i({x, 0}), 3);
+    }
+    disk.load(xti::vec2i({0, 0}), 3);
+    disk.save_encoded(data, xti::vec2i({3, 0}), 3);
+    disk.compact();
+
+    // Least recently used tiles are evicted until half of the quota is used
+    REQUIRE(disk.get_total_bytes() <= 1.5 * data.size());
+    REQUIRE(disk.contains(xti::vec2i({3, 0}), 3));
+    REQUIRE(!disk.contains(xti::vec2i({1, 0}), 3));
+    REQUIRE(!std::filesystem::exists(disk.get_path(xti::vec2i({1, 0}), 3)));
+  }
+
+  // The index is restored from the journal
+  tiledwebmaps::BoundedDisk disk(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, 3 * data.size());
+  REQUIRE(disk.contains(xti::vec2i({3, 0}), 3));
+  REQUIRE(!disk.contains(xti::vec2i({1, 0}), 3));
+
+  // Tiles that are not tracked are found on disk
+  tiledwebmaps::Disk(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20).save_encoded(data, xti::vec2i({5, 0}), 3);
+  REQUIRE(disk.contains(xti::vec2i({5, 0}), 3));
+  REQUIRE(disk.get_tiles_num() == 1);
+
+  // A forked child writes its journal lines to its own file, which the parent adopts, and can be destroyed without
+  // waiting for the thread of the parent
+  pid_t pid = ::fork();
+  if (pid == 0)
+  {
+    disk.make_forksafe();
+    disk.save_encoded(data, xti::vec2i({4, 0}), 3);
+    disk.compact();
+    disk.~BoundedDisk();
+    ::_exit(0);
+  }
+  REQUIRE(pid > 0);
+  int status;
+  ::waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+  REQUIRE(std::filesystem::exists(path / ("journal-" + std::to_string(pid) + ".txt")));
+  disk.compact();
+  REQUIRE(!std::filesystem::exists(path / ("journal-" + std::to_string(pid) + ".txt")));
+  REQUIRE(disk.get_tiles_num() == 2);
+  REQUIRE(disk.get_total_bytes() == 2 * data.size());
+  std::filesystem::remove_all(path);
+}
+
+TEST_CASE("tiledwebmaps::EncodeOptions")
+{
+  REQUIRE_THROWS_AS(tiledwebmaps::EncodeOptions(101), std::invalid_argument);
+  REQUIRE_THROWS_AS(tiledwebmaps::EncodeOptions(90, "411"), std::invalid_argument);
+  REQUIRE(tiledwebmaps::EncodeOptions().get_params(".jpg").empty());
+  REQUIRE(tiledwebmaps::EncodeOptions(80, "", true).get_params(".jpg") == std::vector<int>{cv::IMWRITE_JPEG_QUALITY, 80, cv::IMWRITE_JPEG_OPTIMIZE, 1});
+  REQUIRE(tiledwebmaps::EncodeOptions(80).get_params(".png").empty());
+  REQUIRE_NOTHROW(tiledwebmaps::EncodeOptions(80, "", true).validate(".jpg"));
+
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-encode";
+  std::filesystem::remove_all(path);
+  cv::Mat image(256, 256, CV_8UC3);
+  cv::randu(image, cv::Scalar(0, 0, 0), cv::Scalar(256, 256, 256));
+
+  // Tiles are saved with the encoding options of the disk
+  tiledwebmaps::Disk low(path / "low" / "{zoom}/{x}/{y}.jpg", tiledwebmaps::Layout::XYZ(proj_context), 0, 20, tiledwebmaps::Disk::Sync::NONE, tiledwebmaps::EncodeOptions(30, "420", true));
+  tiledwebmaps::Disk high(path / "high" / "{zoom}/{x}/{y}.jpg", tiledwebmaps::Layout::XYZ(proj_context), 0, 20, tiledwebmaps::Disk::Sync::NONE, tiledwebmaps::EncodeOptions(95, "444"));
+  low.save(image, xti::vec2i({1, 2}), 3);
+  high.save(image, xti::vec2i({1, 2}), 3);
+  std::vector<uint8_t> data = low.load_encoded(xti::vec2i({1, 2}), 3);
+  REQUIRE(tiledwebmaps::detect_encoding(data.data(), data.size()) == ".jpg");
+  REQUIRE(data.size() < high.load_encoded(xti::vec2i({1, 2}), 3).size());
+  REQUIRE(low.load(xti::vec2i({1, 2}), 3).size() == image.size());
+
+  if (tiledwebmaps::can_encode(".webp"))
+  {
+    tiledwebmaps::Disk webp(path / "webp" / "{zoom}/{x}/{y}.webp", tiledwebmaps::Layout::XYZ(proj_context), 0, 20, tiledwebmaps::Disk::Sync::NONE, tiledwebmaps::EncodeOptions(100));
+    webp.save(image, xti::vec2i({1, 2}), 3);
+    data = webp.load_encoded(xti::vec2i({1, 2}), 3);
+    REQUIRE(tiledwebmaps::detect_encoding(data.data(), data.size()) == ".webp");
+    // Quality 100 is lossless
+    REQUIRE(cv::norm(webp.load(xti::vec2i({1, 2}), 3), image, cv::NORM_INF) == 0);
+  }
+  std::filesystem::remove_all(path);
+}
+
+TEST_CASE("tiledwebmaps::Pack")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-pack";
+  std::filesystem::remove_all(path);
+  tiledwebmaps::Pack pack(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png", 16, tiledwebmaps::Disk::Sync::FSYNC);
+
+  cv::Mat image(256, 256, CV_8UC3, cv::Scalar(1, 2, 3));
+  REQUIRE(!pack.contains(xti::vec2i({17, 18}), 5));
+  pack.save(image, xti::vec2i({17, 18}), 5);
+  pack.save(image, xti::vec2i({30, 31}), 5);
+  REQUIRE(pack.contains(xti::vec2i({17, 18}), 5));
+  REQUIRE(!pack.contains(xti::vec2i({18, 17}), 5));
+  REQUIRE(pack.get_pack_path(xti::vec2i({17, 18}), 5) == pack.get_pack_path(xti::vec2i({30, 31}), 5));
+  REQUIRE(pack.load(xti::vec2i({30, 31}), 5).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE_THROWS_AS(pack.load(xti::vec2i({18, 17}), 5), tiledwebmaps::FileNotFoundException);
+
+  // Packfiles with another metatile size are rejected
+  pack.save(image, xti::vec2i({1, 1}), 5);
+  tiledwebmaps::Pack pack8(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png", 8);
+  REQUIRE(!pack8.contains(xti::vec2i({1, 1}), 5));
+  REQUIRE_THROWS_AS(pack8.load(xti::vec2i({1, 1}), 5), tiledwebmaps::LoadFileException);
+
+  // Index entries that point outside of the packfile are rejected
+  {
+    std::fstream file(pack.get_pack_path(xti::vec2i({18, 17}), 5), std::ios::in | std::ios::out | std::ios::binary);
+    uint64_t entry[2] = {16, 1 << 30};
+    file.seekp(16 + (2 * 16 + 1) * 16);
+    file.write((const char*) entry, sizeof(entry));
+  }
+  tiledwebmaps::Pack corrupt(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png");
+  REQUIRE(corrupt.contains(xti::vec2i({18, 17}), 5));
+  REQUIRE_THROWS_AS(corrupt.load(xti::vec2i({18, 17}), 5), tiledwebmaps::LoadFileException);
+  std::filesystem::remove_all(path);
+}
+
+TEST_CASE("tiledwebmaps::MBTiles")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test.mbtiles";
+  std::filesystem::remove(path);
+  cv::Mat image(256, 256, CV_8UC3, cv::Scalar(1, 2, 3));
+  {
+    tiledwebmaps::MBTiles mbtiles(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png", true, 2);
+    REQUIRE(!mbtiles.contains(xti::vec2i({17, 18}), 5));
+    mbtiles.save(image, xti::vec2i({17, 18}), 5);
+    REQUIRE(mbtiles.contains(xti::vec2i({17, 18}), 5));
+    REQUIRE(mbtiles.load(xti::vec2i({17, 18}), 5).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+    mbtiles.save(image, xti::vec2i({30, 31}), 5);
+    mbtiles.save(image, xti::vec2i({0, 0}), 0);
+    REQUIRE_THROWS_AS(mbtiles.load(xti::vec2i({18, 17}), 5), tiledwebmaps::TileNotFoundException);
+  }
+  tiledwebmaps::MBTiles mbtiles(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png");
+  REQUIRE(mbtiles.contains(xti::vec2i({17, 18}), 5));
+  REQUIRE(mbtiles.contains(xti::vec2i({0, 0}), 0));
+  REQUIRE(mbtiles.load(xti::vec2i({30, 31}), 5).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+
+  // Pending tiles are inserted on the next load after max_delay
+  {
+    tiledwebmaps::MBTiles delayed(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png", true, 100, 0.05);
+    delayed.save(image, xti::vec2i({1, 1}), 5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    delayed.load(xti::vec2i({17, 18}), 5);
+    REQUIRE(mbtiles.contains(xti::vec2i({1, 1}), 5));
+  }
+
+  tiledwebmaps::MBTiles read_only(path, tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png", true, 64, 1.0, true);
+  REQUIRE(read_only.load(xti::vec2i({30, 31}), 5).at<cv::Vec3b>(0, 0) == cv::Vec3b(1, 2, 3));
+  REQUIRE_THROWS_AS(read_only.save(image, xti::vec2i({2, 2}), 5), tiledwebmaps::WriteFileException);
+  REQUIRE_THROWS_AS(tiledwebmaps::MBTiles(path.string() + ".nonexistent", tiledwebmaps::Layout::XYZ(proj_context), 0, 20, ".png", true, 64, 1.0, true), tiledwebmaps::LoadFileException);
+  REQUIRE(!std::filesystem::exists(path.string() + ".nonexistent"));
+  std::filesystem::remove(path);
+}
+
+// Writes a little-endian GeoTIFF in EPSG:3857 whose levels consist of uncompressed 256x256 internal tiles with constant
+// colors, the first level is the full-resolution image with the given shape in tiles
+void write_geotiff(std::filesystem::path path, std::vector<std::vector<cv::Vec3b>> levels, xti::vec2i tiles_num, double lower_x, double upper_y, double meters_per_pixel)
+{
+  std::vector<uint8_t> file = {'I', 'I', 42, 0, 0, 0, 0, 0};
+  auto put = [](std::vector<uint8_t>& data, size_t pos, uint64_t value, int bytes){
+    for (int i = 0; i < bytes; i++)
+    {
+      data[pos + i] = (value >> (8 * i)) & 0xFF;
+    }
+  };
+  auto append = [&](std::vector<uint8_t>& data, uint64_t value, int bytes){
+    data.resize(data.size() + bytes);
+    put(data, data.size() - bytes, value, bytes);
+  };
+  struct Entry
+  {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    std::vector<uint8_t> data;
+  };
+  auto shorts = [&](uint16_t tag, std::vector<uint64_t> values){
+    Entry entry{tag, 3, (uint32_t) values.size(), {}};
+    for (uint64_t value : values) append(entry.data, value, 2);
+    return entry;
+  };
+  auto longs = [&](uint16_t tag, std::vector<uint64_t> values){
+    Entry entry{tag, 4, (uint32_t) values.size(), {}};
+    for (uint64_t value : values) append(entry.data, value, 4);
+    return entry;
+  };
+  auto doubles = [&](uint16_t tag, std::vector<double> values){
+    Entry entry{tag, 12, (uint32_t) values.size(), {}};
+    for (double value : values)
+    {
+      uint64_t bits;
+      std::memcpy(&bits, &value, 8);
+      append(entry.data, bits, 8);
+    }
+    return entry;
+  };
+
+  size_t previous_next_pos = 4;
+  for (size_t l = 0; l < levels.size(); l++)
+  {
+    xti::vec2i level_tiles_num({std::max(tiles_num(0) >> l, 1), std::max(tiles_num(1) >> l, 1)});
+    std::vector<uint64_t> offsets, byte_counts;
+    for (const cv::Vec3b& color : levels[l])
+    {
+      offsets.push_back(file.size());
+      byte_counts.push_back(256 * 256 * 3);
+      for (int i = 0; i < 256 * 256; i++)
+      {
+        file.insert(file.end(), {color[0], color[1], color[2]});
+      }
+    }
+    std::vector<Entry> entries = {
+      longs(254, {l == 0 ? 0u : 1u}),
+      longs(256, {(uint64_t) level_tiles_num(1) * 256}),
+      longs(257, {(uint64_t) level_tiles_num(0) * 256}),
+      shorts(258, {8, 8, 8}),
+      shorts(259, {1}),
+      shorts(262, {2}),
+      shorts(277, {3}),
+      shorts(284, {1}),
+      longs(322, {256}),
+      longs(323, {256}),
+      longs(324, offsets),
+      longs(325, byte_counts),
+    };
+    if (l == 0)
+    {
+      entries.push_back(doubles(33550, {meters_per_pixel, meters_per_pixel, 0}));
+      entries.push_back(doubles(33922, {0, 0, 0, lower_x, upper_y, 0}));
+      entries.push_back(shorts(34735, {1, 1, 0, 2, 1024, 0, 1, 1, 3072, 0, 1, 3857}));
+    }
+
+    size_t ifd_pos = file.size();
+    put(file, previous_next_pos, ifd_pos, 4);
+    append(file, entries.size(), 2);
+    size_t data_pos = ifd_pos + 2 + entries.size() * 12 + 4;
+    std::vector<uint8_t> data;
+    for (const Entry& entry : entries)
+    {
+      append(file, entry.tag, 2);
+      append(file, entry.type, 2);
+      append(file, entry.count, 4);
+      if (entry.data.size() <= 4)
+      {
+        std::vector<uint8_t> value = entry.data;
+        value.resize(4);
+        file.insert(file.end(), value.begin(), value.end());
+      }
+      else
+      {
+        append(file, data_pos + data.size(), 4);
+        data.insert(data.end(), entry.data.begin(), entry.data.end());
+      }
+    }
+    previous_next_pos = file.size();
+    append(file, 0, 4);
+    file.insert(file.end(), data.begin(), data.end());
+  }
+
+  std::ofstream stream(path.string(), std::ios::binary);
+  stream.write((const char*) file.data(), file.size());
+}
+
+TEST_CASE("tiledwebmaps::COG")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test.tif";
+  tiledwebmaps::Layout layout = tiledwebmaps::Layout::XYZ(proj_context);
+
+  // Raster covers the north-western quarter of the world, i.e. tile (0, 0) at zoom level 1
+  double size = layout.get_size_crs().value()(0);
+  cv::Vec3b a(10, 20, 30), b(40, 50, 60), c(70, 80, 90), d(100, 110, 120), overview(200, 200, 200);
+  write_geotiff(path, {{a, b, c, d}, {overview}}, xti::vec2i({2, 2}), -size / 2, size / 2, size / 2 / 512);
+
+  tiledwebmaps::COG cog(std::make_shared<tiledwebmaps::FileRangeReader>(path), layout, 0, 5);
+  REQUIRE(cog.get_shape() == xti::vec2i({512, 512}));
+  REQUIRE(cog.get_levels_num() == 2);
+  REQUIRE(cog.load(xti::vec2i({0, 0}), 2).at<cv::Vec3b>(128, 128) == a);
+  REQUIRE(cog.load(xti::vec2i({1, 0}), 2).at<cv::Vec3b>(128, 128) == b);
+  REQUIRE(cog.load(xti::vec2i({0, 1}), 2).at<cv::Vec3b>(128, 128) == c);
+  REQUIRE(cog.load(xti::vec2i({1, 1}), 2).at<cv::Vec3b>(128, 128) == d);
+  REQUIRE(cog.load(xti::vec2i({0, 0}), 1).at<cv::Vec3b>(128, 128) == overview);
+  REQUIRE(cog.load(xti::vec2i({1, 1}), 3).at<cv::Vec3b>(0, 0) == a);
+  REQUIRE_THROWS_AS(cog.load(xti::vec2i({3, 3}), 2), tiledwebmaps::TileNotFoundException);
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("tiledwebmaps::Retiler")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  tiledwebmaps::Layout layout = tiledwebmaps::Layout::XYZ(proj_context);
+  std::shared_ptr<tiledwebmaps::LRU> sink = std::make_shared<tiledwebmaps::LRU>(16);
+
+  // Raster covers the north-western quarter of the world with one raster pixel per tile pixel at zoom level 2
+  double size = layout.get_size_crs().value()(0);
+  double meters_per_pixel = size / 2 / 512;
+  tiledwebmaps::Georeference georeference = tiledwebmaps::Georeference::from_geotransform(layout.get_crs(), {-size / 2, meters_per_pixel, 0, size / 2, 0, -meters_per_pixel});
+  cv::Vec3b a(10, 20, 30), b(40, 50, 60), c(70, 80, 90), background(255, 255, 255);
+
+  tiledwebmaps::Retiler retiler(sink, layout, 2, 8, background);
+  retiler.add(cv::Mat(256, 512, CV_8UC3, cv::Scalar(a[0], a[1], a[2])), georeference, xti::vec2i({0, 0}));
+  REQUIRE(retiler.get_pending_tiles_num() == 0);
+  REQUIRE(sink->contains(xti::vec2i({0, 0}), 2));
+  REQUIRE(sink->contains(xti::vec2i({1, 0}), 2));
+  REQUIRE(!sink->contains(xti::vec2i({0, 1}), 2));
+  retiler.add(cv::Mat(256, 512, CV_8UC3, cv::Scalar(b[0], b[1], b[2])), georeference, xti::vec2i({256, 0}));
+  REQUIRE(retiler.get_pending_tiles_num() == 0);
+  REQUIRE(sink->load(xti::vec2i({1, 0}), 2).at<cv::Vec3b>(255, 0) == a);
+  REQUIRE(sink->load(xti::vec2i({0, 1}), 2).at<cv::Vec3b>(0, 255) == b);
+
+  // Partially covered tiles are kept until flushed, and are completed from the sink by later blocks
+  tiledwebmaps::Retiler retiler2(sink, layout, 3, 8, background);
+  retiler2.add(cv::Mat(64, 64, CV_8UC3, cv::Scalar(c[0], c[1], c[2])), georeference, xti::vec2i({0, 0}));
+  REQUIRE(retiler2.get_pending_tiles_num() == 1);
+  retiler2.flush();
+  REQUIRE(retiler2.get_pending_tiles_num() == 0);
+  REQUIRE(sink->load(xti::vec2i({0, 0}), 3).at<cv::Vec3b>(0, 0) == c);
+  REQUIRE(sink->load(xti::vec2i({0, 0}), 3).at<cv::Vec3b>(255, 255) == background);
+  retiler2.add(cv::Mat(64, 64, CV_8UC3, cv::Scalar(a[0], a[1], a[2])), georeference, xti::vec2i({64, 64}));
+  retiler2.flush();
+  REQUIRE(sink->load(xti::vec2i({0, 0}), 3).at<cv::Vec3b>(0, 0) == c);
+  REQUIRE(sink->load(xti::vec2i({0, 0}), 3).at<cv::Vec3b>(255, 255) == a);
+}
+
+TEST_CASE("tiledwebmaps::DownloadPipeline")
+{
+  std::shared_ptr<tiledwebmaps::proj::Context> proj_context = std::make_shared<tiledwebmaps::proj::Context>();
+  tiledwebmaps::Layout layout = tiledwebmaps::Layout::XYZ(proj_context);
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "tiledwebmaps-test-pipeline";
+  std::filesystem::remove_all(path);
+  std::filesystem::create_directories(path / "inputs");
+
+  // Two local rasters with world files that cover the upper and lower half of tile (0, 0) at zoom level 1
+  double size = layout.get_size_crs().value()(0);
+  double meters_per_pixel = size / 2 / 256;
+  cv::Vec3b a(50, 50, 50), b(150, 150, 150);
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 2; i++)
+  {
+    std::filesystem::path raster_path = path / "inputs" / ("raster" + std::to_string(i) + ".png");
+    cv::imwrite(raster_path.string(), cv::Mat(128, 256, CV_8UC3, i == 0 ? cv::Scalar(a[0], a[1], a[2]) : cv::Scalar(b[0], b[1], b[2])));
+    std::ofstream world_file((path / "inputs" / ("raster" + std::to_string(i) + ".pgw")).string());
+    world_file << std::setprecision(17) << meters_per_pixel << "\n0\n0\n" << -meters_per_pixel << "\n" << -size / 2 + meters_per_pixel / 2 << "\n" << size / 2 - (i * 128 + 0.5) * meters_per_pixel << "\n";
+    inputs.push_back(raster_path.string());
+  }
+
+  tiledwebmaps::DownloadPipeline::Options options;
+  options.strip_rows = 64;
+  options.journal_path = path / "journal.txt";
+  std::shared_ptr<tiledwebmaps::proj::CRS> crs = layout.get_crs();
+  auto georeference = [crs](const std::filesystem::path& raster_path){return tiledwebmaps::read_world_file(raster_path, crs);};
+
+  std::shared_ptr<tiledwebmaps::LRU> sink = std::make_shared<tiledwebmaps::LRU>(16);
+  {
+    tiledwebmaps::DownloadPipeline pipeline(sink, layout, 1, path / "work", georeference, options);
+    std::atomic<size_t> progress(0);
+    pipeline.run(inputs, [&](size_t done, size_t total){progress = done;});
+    REQUIRE(progress == 2);
+    REQUIRE(pipeline.get_journal()->size() == 2);
+  }
+  REQUIRE(sink->load(xti::vec2i({0, 0}), 1).at<cv::Vec3b>(0, 0) == a);
+  REQUIRE(sink->load(xti::vec2i({0, 0}), 1).at<cv::Vec3b>(255, 255) == b);
+  REQUIRE(!sink->contains(xti::vec2i({1, 0}), 1));
+
+  // Inputs recorded in the journal are skipped
+  std::shared_ptr<tiledwebmaps::LRU> sink2 = std::make_shared<tiledwebmaps::LRU>(16);
+  {
+    tiledwebmaps::DownloadPipeline pipeline(sink2, layout, 1, path / "work", georeference, options);
+    pipeline.run(inputs);
+  }
+  REQUIRE(!sink2->contains(xti::vec2i({0, 0}), 1));
+  std::filesystem::remove_all(path);
 }